@@ -2,6 +2,17 @@
 #include <xmmintrin.h>
 #include "core/geometry.h"
 #include "core/spectrum.h"
+#include "rgb2spec/rgb2spec.h"
+#include "core/accelerator.h"
+#include "core/mesh.h"
+#include "core/rng.h"
+#include "core/integrator.h"
+#include "core/scene.h"
+#include "cameras/perspective.h"
+#include "lights/rect.h"
+#include "samplers/sobol.h"
+#include "samplers/zsobol.h"
+#include "samplers/pmj02.h"
 using namespace narukami;
 
 /*******************************************************************************/
@@ -111,6 +122,75 @@ static void BM_narukami_rsqrt_quake(benchmark::State &state)
 }
 BENCHMARK(BM_narukami_rsqrt_quake)->Arg(1024);
 
+/*******************************************************************************/
+/***************************************rng*************************************/
+static void BM_narukami_RNG_next_float(benchmark::State &state)
+{
+    RNG rng(1);
+    std::vector<float> samples(state.range(0));
+    for (auto _ : state)
+    {
+        for (auto &&u : samples)
+        {
+            u = rng.next_float();
+        }
+        benchmark::DoNotOptimize(samples.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_RNG_next_float)->Arg(1024);
+
+static void BM_narukami_RNG4_next_float(benchmark::State &state)
+{
+    RNG4 rng(1);
+    std::vector<float> samples(state.range(0));
+    for (auto _ : state)
+    {
+        for (auto &&u : samples)
+        {
+            u = rng.next_float();
+        }
+        benchmark::DoNotOptimize(samples.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_RNG4_next_float)->Arg(1024);
+
+static void BM_narukami_RNG4_fill_1D(benchmark::State &state)
+{
+    RNG4 rng(1);
+    std::vector<float> samples(state.range(0));
+    for (auto _ : state)
+    {
+        rng.fill_1D(samples.data(), static_cast<uint32_t>(samples.size()));
+        benchmark::DoNotOptimize(samples.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_RNG4_fill_1D)->Arg(1024);
+
+//range(0):0为RNG,1为RNG4
+static void BM_narukami_shuffle(benchmark::State &state)
+{
+    RNG rng(1);
+    RNG4 rng4(1);
+    std::vector<Point2f> samples(state.range(1));
+    for (auto _ : state)
+    {
+        if (state.range(0))
+        {
+            shuffle(samples.data(), static_cast<int>(samples.size()), 1, rng4);
+        }
+        else
+        {
+            shuffle(samples.data(), static_cast<int>(samples.size()), 1, rng);
+        }
+        benchmark::DoNotOptimize(samples.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_narukami_shuffle)->Args({0, 64})->Args({1, 64})->Args({0, 1024})->Args({1, 1024});
+
 /*******************************************************************************/
 /***************************************spectrum********************************/
 struct BM_Spectrum
@@ -173,6 +253,32 @@ inline float average(const BM_Spectrum &spd)
     return sum/SPD_SAMPLE_COUNT;
 }
 
+//在benchmark期间切换Spectrum使用的SIMD kernel,结束后恢复启动时的选择
+class ScopedSIMDLevel
+{
+public:
+    explicit ScopedSIMDLevel(benchmark::State &state, int arg_index = 1) : _old_level(spectrum_simd_level())
+    {
+        if (!set_spectrum_simd_level(static_cast<SIMDLevel>(state.range(arg_index))))
+        {
+            state.SkipWithError("SIMD level is not supported by this CPU");
+        }
+    }
+    ~ScopedSIMDLevel() { set_spectrum_simd_level(_old_level); }
+
+private:
+    SIMDLevel _old_level;
+};
+
+//range(0)为n,range(1)为SIMDLevel:0为SSE,1为AVX2,2为AVX-512
+static void spectrum_simd_args(benchmark::internal::Benchmark *b)
+{
+    for (int level = 0; level <= static_cast<int>(SIMDLevel::AVX512); ++level)
+    {
+        b->Args({1024, level});
+    }
+}
+
 static void BM_trivial_Spectrum_operator_add(benchmark::State &state)
 {
     for (auto _ : state)
@@ -189,6 +295,7 @@ BENCHMARK(BM_trivial_Spectrum_operator_add)->Arg(1024);
 
 static void BM_narukami_Spectrum_operator_add(benchmark::State &state)
 {
+    ScopedSIMDLevel simd_level(state);
     for (auto _ : state)
     {
         for (auto i = 0; i < state.range(0); i++)
@@ -198,7 +305,7 @@ static void BM_narukami_Spectrum_operator_add(benchmark::State &state)
         }
     }
 }
-BENCHMARK(BM_narukami_Spectrum_operator_add)->Arg(1024);
+BENCHMARK(BM_narukami_Spectrum_operator_add)->Apply(spectrum_simd_args);
 
 static void BM_trivial_Spectrum_is_black(benchmark::State &state)
 {
@@ -215,6 +322,7 @@ BENCHMARK(BM_trivial_Spectrum_is_black)->Arg(1024);
 
 static void BM_narukami_Spectrum_is_black(benchmark::State &state)
 {
+    ScopedSIMDLevel simd_level(state);
     for (auto _ : state)
     {
         for (auto i = 0; i < state.range(0); i++)
@@ -224,7 +332,7 @@ static void BM_narukami_Spectrum_is_black(benchmark::State &state)
         }
     }
 }
-BENCHMARK(BM_narukami_Spectrum_is_black)->Arg(1024);
+BENCHMARK(BM_narukami_Spectrum_is_black)->Apply(spectrum_simd_args);
 
 static void BM_trivial_Spectrum_average(benchmark::State &state)
 {
@@ -241,6 +349,7 @@ BENCHMARK(BM_trivial_Spectrum_average)->Arg(1024);
 
 static void BM_narukami_Spectrum_average(benchmark::State &state)
 {
+    ScopedSIMDLevel simd_level(state);
     for (auto _ : state)
     {
         for (auto i = 0; i < state.range(0); i++)
@@ -250,7 +359,1059 @@ static void BM_narukami_Spectrum_average(benchmark::State &state)
         }
     }
 }
-BENCHMARK(BM_narukami_Spectrum_average)->Arg(1024);
+BENCHMARK(BM_narukami_Spectrum_average)->Apply(spectrum_simd_args);
+
+//路径顶点上的典型运算:L += f * Li / pdf,再转换到xyz
+template <typename SpectrumType>
+static void BM_narukami_Spectrum_path_vertex(benchmark::State &state)
+{
+    ScopedSIMDLevel simd_level(state);
+    SpectrumType f(0.5f), Li = tungsten_lamp_3000k<SpectrumType>(1.0f);
+    float xyz[3];
+    for (auto _ : state)
+    {
+        SpectrumType L(0.0f);
+        for (auto i = 0; i < state.range(0); i++)
+        {
+            L = L + f * Li / float(i + 1);
+        }
+        from_spd_to_xyz(L, xyz);
+        benchmark::DoNotOptimize(xyz);
+    }
+}
+BENCHMARK_TEMPLATE(BM_narukami_Spectrum_path_vertex, Spectrum)->Apply(spectrum_simd_args);
+BENCHMARK_TEMPLATE(BM_narukami_Spectrum_path_vertex, CoarseSpectrum)->Apply(spectrum_simd_args);
+
+static void BM_narukami_Spectrum_to_xyz(benchmark::State &state)
+{
+    ScopedSIMDLevel simd_level(state);
+    Spectrum spd = tungsten_lamp_3000k(1.0f);
+    float xyz[3];
+    for (auto _ : state)
+    {
+        for (auto i = 0; i < state.range(0); i++)
+        {
+            from_spd_to_xyz(spd, xyz);
+            benchmark::DoNotOptimize(xyz);
+        }
+    }
+}
+BENCHMARK(BM_narukami_Spectrum_to_xyz)->Apply(spectrum_simd_args);
+
+//rgb2spec的系数表需要./srgb.coeff,找不到时跳过
+static bool srgb_coeff_available(benchmark::State &state)
+{
+    static const bool loaded = load_srgb_coeff();
+    if (!loaded)
+    {
+        state.SkipWithError("./srgb.coeff is not found");
+    }
+    return loaded;
+}
+
+//256x256的8bit纹理,color_count为0时相邻像素的颜色相近但几乎没有重复,否则从color_count种颜色中随机选取
+static std::vector<float> create_benchmark_texture_colors(int color_count = 0)
+{
+    RNG rng(1);
+    std::vector<float> palette;
+    for (int i = 0; i < color_count * 3; ++i)
+    {
+        palette.push_back(std::round(rng.next_float() * 255.0f) / 255.0f);
+    }
+    std::vector<float> colors;
+    for (int y = 0; y < 256; ++y)
+    {
+        for (int x = 0; x < 256; ++x)
+        {
+            if (color_count > 0)
+            {
+                const int idx = std::min(static_cast<int>(rng.next_float() * color_count), color_count - 1);
+                colors.insert(colors.end(), &palette[idx * 3], &palette[idx * 3 + 3]);
+                continue;
+            }
+            const float rgb[3] = {x / 255.0f, y / 255.0f, (x ^ y) / 255.0f};
+            for (int i = 0; i < 3; ++i)
+            {
+                const int noise = static_cast<int>(rng.next_float() * 4.0f) - 2;
+                colors.push_back(clamp(std::round(rgb[i] * 255.0f) + noise, 0.0f, 255.0f) / 255.0f);
+            }
+        }
+    }
+    return colors;
+}
+
+//之前的实现:每个波长单独调用rgb2spec_eval_precise
+static void BM_trivial_from_srgb_to_spd(benchmark::State &state)
+{
+    if (!srgb_coeff_available(state))
+    {
+        return;
+    }
+    auto colors = create_benchmark_texture_colors();
+    RGB2Spec *model = rgb2spec_load("./srgb.coeff");
+    Spectrum spd;
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < colors.size(); i += 3)
+        {
+            float coeff[RGB2SPEC_N_COEFFS];
+            rgb2spec_fetch(model, &colors[i], coeff);
+            for (int j = 0; j < SPD_SAMPLE_COUNT; ++j)
+            {
+                spd[j] = rgb2spec_eval_precise(coeff, WAVELENGTH_MIN + j * (WAVELENGTH_MAX - WAVELENGTH_MIN) / (SPD_SAMPLE_COUNT - 1));
+            }
+            benchmark::DoNotOptimize(spd);
+        }
+    }
+    rgb2spec_free(model);
+    state.SetItemsProcessed(state.iterations() * colors.size() / 3);
+}
+BENCHMARK(BM_trivial_from_srgb_to_spd)->Unit(benchmark::kMillisecond);
+
+static void BM_narukami_from_srgb_to_spd(benchmark::State &state)
+{
+    if (!srgb_coeff_available(state))
+    {
+        return;
+    }
+    auto colors = create_benchmark_texture_colors();
+    Spectrum spd;
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < colors.size(); i += 3)
+        {
+            from_srgb_to_spd(&colors[i], spd);
+            benchmark::DoNotOptimize(spd);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * colors.size() / 3);
+}
+BENCHMARK(BM_narukami_from_srgb_to_spd)->Unit(benchmark::kMillisecond);
+
+//一次查询一行像素的系数
+static void BM_narukami_from_srgb_to_sigmoid_polynomial_batch(benchmark::State &state)
+{
+    if (!srgb_coeff_available(state))
+    {
+        return;
+    }
+    auto colors = create_benchmark_texture_colors();
+    std::vector<SigmoidPolynomial> polys(256);
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < colors.size(); i += 256 * 3)
+        {
+            from_srgb_to_sigmoid_polynomial(&colors[i], &polys[0], 256);
+            benchmark::DoNotOptimize(polys.data());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * colors.size() / 3);
+}
+BENCHMARK(BM_narukami_from_srgb_to_sigmoid_polynomial_batch)->Unit(benchmark::kMillisecond);
+
+//range(0):0为完整的Spectrum,1为hero wavelength只求4个波长
+//range(1):纹理中颜色的种类,0为几乎每个像素都不同(缓存最差的情况)
+static void BM_narukami_from_srgb_cached(benchmark::State &state)
+{
+    if (!srgb_coeff_available(state))
+    {
+        return;
+    }
+    auto colors = create_benchmark_texture_colors(static_cast<int>(state.range(1)));
+    Spectrum spd;
+    const SampledWavelengths wavelengths = sample_wavelengths(0.5f);
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < colors.size(); i += 3)
+        {
+            const SigmoidPolynomial poly = from_srgb_to_sigmoid_polynomial_cached(&colors[i]);
+            if (state.range(0))
+            {
+                benchmark::DoNotOptimize(sample(poly, wavelengths));
+            }
+            else
+            {
+                from_sigmoid_polynomial_to_spd(poly, spd);
+                benchmark::DoNotOptimize(spd);
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * colors.size() / 3);
+}
+BENCHMARK(BM_narukami_from_srgb_cached)->Args({0, 0})->Args({0, 256})->Args({1, 0})->Args({1, 256})->Unit(benchmark::kMillisecond);
+
+/*******************************************************************************/
+/***************************************accelerator*****************************/
+//随机三角形构成的场景,BVH节点远大于cache,用来模拟不相干射线的访存
+static shared<MeshBLAS> create_random_triangle_blas(uint32_t triangle_num, float triangle_size = 0.01f)
+{
+    RNG rng(0);
+    std::vector<Point3f> positions;
+    std::vector<MeshFace> faces;
+    for (uint32_t i = 0; i < triangle_num; ++i)
+    {
+        Point3f center(rng.next_float(), rng.next_float(), rng.next_float());
+        for (int v = 0; v < 3; ++v)
+        {
+            Vector3f offset(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f);
+            positions.push_back(center + offset * triangle_size);
+        }
+        uint32_t vi[3] = {i * 3, i * 3 + 1, i * 3 + 2};
+        faces.push_back(MeshFace(vi));
+    }
+    std::vector<MeshSegment> segments = {MeshSegment(faces)};
+    auto transform = std::make_shared<Transform>();
+    auto mesh = std::make_shared<Mesh>(transform, transform, positions, std::vector<Normal3f>(), std::vector<Point2f>(), segments);
+    return std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(mesh));
+}
+
+static const MeshBLAS &get_random_triangle_blas()
+{
+    static auto blas = create_random_triangle_blas(1 << 19);
+    return *blas;
+}
+
+static std::vector<Ray> create_incoherent_rays(uint32_t ray_num)
+{
+    RNG rng(1);
+    std::vector<Ray> rays;
+    for (uint32_t i = 0; i < ray_num; ++i)
+    {
+        Point3f o(rng.next_float(), rng.next_float(), rng.next_float());
+        Vector3f d(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f);
+        rays.push_back(Ray(o, normalize(d)));
+    }
+    return rays;
+}
+
+static void BM_narukami_BLAS_incoherent_single(benchmark::State &state)
+{
+    auto &blas = get_random_triangle_blas();
+    auto rays = create_incoherent_rays(static_cast<uint32_t>(state.range(0)));
+    SurfaceInteraction interaction;
+    traversal_stack_traffic = 0;
+    for (auto _ : state)
+    {
+        for (auto &&ray : rays)
+        {
+            ray.t_max = INFINITE;
+            benchmark::DoNotOptimize(blas.intersect(ray, &interaction));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    //每条射线写入遍历栈的字节数
+    state.counters["stack_bytes_per_ray"] = static_cast<double>(traversal_stack_traffic) / (state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_BLAS_incoherent_single)->Arg(4096);
+
+//同样的图元用64 bits的节点引用,节点从128 byte变成144 byte
+static const WideMeshBLAS &get_random_triangle_wide_blas()
+{
+    static auto blas = std::make_shared<WideMeshBLAS>(get_random_triangle_blas().get_primitives());
+    return *blas;
+}
+
+static void BM_narukami_WideBLAS_incoherent_single(benchmark::State &state)
+{
+    auto &blas = get_random_triangle_wide_blas();
+    auto rays = create_incoherent_rays(static_cast<uint32_t>(state.range(0)));
+    SurfaceInteraction interaction;
+    for (auto _ : state)
+    {
+        for (auto &&ray : rays)
+        {
+            ray.t_max = INFINITE;
+            benchmark::DoNotOptimize(blas.intersect(ray, &interaction));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_WideBLAS_incoherent_single)->Arg(4096);
+
+/*******************************************************************************/
+/***************************************integrator******************************/
+static shared<BLASInstance> create_plane_instance(const Transform &plane_to_world)
+{
+    auto transform = std::make_shared<Transform>(plane_to_world);
+    auto inv_transform = std::make_shared<Transform>(inverse(*transform));
+    auto mesh = create_plane(transform, inv_transform, 5, 5);
+    auto blas = std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(mesh));
+    return std::make_shared<BLASInstance>(std::make_shared<AnimatedTransform>(std::make_shared<Transform>()), blas);
+}
+
+//随机三角形加上地面和墙面,一个面光源
+static Scene &get_benchmark_scene()
+{
+    static Scene *scene = nullptr;
+    if (scene == nullptr)
+    {
+        std::vector<shared<BLASInstance>> instance_list;
+        instance_list.push_back(std::make_shared<BLASInstance>(std::make_shared<AnimatedTransform>(std::make_shared<Transform>(translate(-0.5f, -0.5f, 0.5f))), create_random_triangle_blas(1 << 16)));
+        instance_list.push_back(create_plane_instance(translate(0, -1, 0) * rotate(90, 1, 0, 0)));
+        instance_list.push_back(create_plane_instance(translate(0, 0, 2.5f)));
+
+        std::vector<Light *> lights;
+        auto transform = std::make_shared<Transform>(translate(Vector3f(0.0f, 1.0f, 0.5f)) * rotate(-90, 1, 0, 0));
+        auto inv_transform = std::make_shared<Transform>(inverse(*transform));
+        lights.push_back(new RectLight(transform, inv_transform, tungsten_lamp_3000k(5), false, 1, 1));
+
+        auto tlas = std::make_shared<TLAS>(instance_list);
+        scene = new Scene(tlas, lights);
+    }
+    return *scene;
+}
+
+static shared<PerspectiveCamera> create_benchmark_camera(const Point2i &resolution, const FilmMode film_mode = FilmMode::Spectrum)
+{
+    auto film = std::make_shared<Film>(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)), 1.0f, 1.0f, film_mode);
+    auto camera_transform = std::make_shared<Transform>(translate(0, 0, -4));
+    float aspect = static_cast<float>(resolution.x) / resolution.y;
+    return std::make_shared<PerspectiveCamera>(std::make_shared<AnimatedTransform>(camera_transform), 0, 1, Bounds2f{{-1 * aspect, -1}, {1 * aspect, 1}}, 45, film);
+}
+
+static void BM_narukami_Integrator_render(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto camera = create_benchmark_camera(Point2i(256, 256));
+    LowDiscrepancySampler sampler(static_cast<uint32_t>(state.range(0)));
+    Integrator integrator(camera.get(), &sampler);
+    for (auto _ : state)
+    {
+        integrator.render(scene);
+    }
+    state.SetItemsProcessed(state.iterations() * 256 * 256 * sampler.get_spp());
+}
+BENCHMARK(BM_narukami_Integrator_render)->Arg(8)->Unit(benchmark::kMillisecond);
+
+static void BM_narukami_WavefrontIntegrator_render(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto camera = create_benchmark_camera(Point2i(256, 256));
+    LowDiscrepancySampler sampler(static_cast<uint32_t>(state.range(0)));
+    WavefrontIntegrator integrator(camera.get(), &sampler);
+    for (auto _ : state)
+    {
+        integrator.render(scene);
+    }
+    state.SetItemsProcessed(state.iterations() * 256 * 256 * sampler.get_spp());
+}
+BENCHMARK(BM_narukami_WavefrontIntegrator_render)->Arg(8)->Unit(benchmark::kMillisecond);
+
+//range(0):0为Spectrum film,1为XYZ film
+static void BM_narukami_Integrator_render_film_mode(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto camera = create_benchmark_camera(Point2i(256, 256), state.range(0) ? FilmMode::XYZ : FilmMode::Spectrum);
+    LowDiscrepancySampler sampler(8);
+    Integrator integrator(camera.get(), &sampler);
+    for (auto _ : state)
+    {
+        integrator.render(scene);
+    }
+    state.SetItemsProcessed(state.iterations() * 256 * 256 * sampler.get_spp());
+}
+BENCHMARK(BM_narukami_Integrator_render_film_mode)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+//range(0):0为完整的Spectrum,1为hero wavelength
+static void BM_narukami_Integrator_render_spectrum_mode(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto camera = create_benchmark_camera(Point2i(256, 256), FilmMode::XYZ);
+    LowDiscrepancySampler sampler(8);
+    Integrator integrator(camera.get(), &sampler, state.range(0) ? SpectrumMode::HeroWavelength : SpectrumMode::Full);
+    for (auto _ : state)
+    {
+        integrator.render(scene);
+    }
+    state.SetItemsProcessed(state.iterations() * 256 * 256 * sampler.get_spp());
+}
+BENCHMARK(BM_narukami_Integrator_render_spectrum_mode)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+//每遍range(0)个样本渲染到8spp,和BM_narukami_Integrator_render比较分遍的开销
+static void BM_narukami_Integrator_render_progressive(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    LowDiscrepancySampler sampler(8);
+    ProgressiveSettings settings;
+    settings.samples_per_pass = static_cast<uint32_t>(state.range(0));
+    for (auto _ : state)
+    {
+        auto camera = create_benchmark_camera(Point2i(256, 256));
+        Integrator integrator(camera.get(), &sampler);
+        integrator.render_progressive(scene, settings);
+    }
+    state.SetItemsProcessed(state.iterations() * 256 * 256 * sampler.get_spp());
+}
+BENCHMARK(BM_narukami_Integrator_render_progressive)->Arg(1)->Arg(4)->Unit(benchmark::kMillisecond);
+
+//在range(0)毫秒的预算内尽可能多地渲染,counter为实际使用的预算比例、每个像素的样本数和噪声估计
+static void BM_narukami_Integrator_render_time_budget(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    PMJ02Sampler sampler(4096);
+    ProgressiveSettings settings;
+    settings.time_budget = state.range(0) * 1e-3;
+    ProgressiveResult result;
+    for (auto _ : state)
+    {
+        auto camera = create_benchmark_camera(Point2i(256, 256));
+        Integrator integrator(camera.get(), &sampler);
+        result = integrator.render_progressive(scene, settings);
+    }
+    state.counters["budget_used"] = result.elapsed / settings.time_budget;
+    state.counters["spp"] = result.sample_count;
+    state.counters["noise"] = result.noise;
+}
+BENCHMARK(BM_narukami_Integrator_render_time_budget)->Arg(500)->Arg(2000)->Iterations(1)->Unit(benchmark::kMillisecond);
+
+//一个64x64 tile内的splat开销,range(0):0为Spectrum,1为XYZ;range(1)为SIMDLevel
+static void BM_narukami_FilmTile_add_sample(benchmark::State &state)
+{
+    ScopedSIMDLevel simd_level(state);
+    const FilmMode mode = state.range(0) ? FilmMode::XYZ : FilmMode::Spectrum;
+    Film film(Point2i(64, 64), Bounds2f(Point2f(0, 0), Point2f(1, 1)), 1.0f, 1.0f, mode);
+    RNG rng(1);
+    std::vector<Point2f> positions;
+    for (int i = 0; i < 4096; ++i)
+    {
+        positions.push_back(Point2f(rng.next_float() * 64.0f, rng.next_float() * 64.0f));
+    }
+    Spectrum l(0.5f);
+    for (auto _ : state)
+    {
+        auto tile = film.get_film_tile(film.get_sample_bounds());
+        for (auto &&pos : positions)
+        {
+            tile->add_sample(pos, l, 1.0f);
+        }
+        benchmark::DoNotOptimize(tile.get());
+    }
+    state.SetItemsProcessed(state.iterations() * positions.size());
+}
+BENCHMARK(BM_narukami_FilmTile_add_sample)->Args({0, 0})->Args({0, 1})->Args({0, 2})->Args({1, 0})->Args({1, 1})->Args({1, 2});
+
+//多个线程同时merge各自的tile,range(0):0为Spectrum,1为XYZ
+static void BM_narukami_Film_merge_film_tile(benchmark::State &state)
+{
+    const int tile_size = 32;
+    const int tile_count = 8;
+    static Film spectrum_film(Point2i(tile_size * tile_count, tile_size * tile_count), Bounds2f(Point2f(0, 0), Point2f(1, 1)));
+    static Film xyz_film(Point2i(tile_size * tile_count, tile_size * tile_count), Bounds2f(Point2f(0, 0), Point2f(1, 1)), 1.0f, 1.0f, FilmMode::XYZ);
+    Film &film = state.range(0) ? xyz_film : spectrum_film;
+
+    const int tile_index = state.thread_index % (tile_count * tile_count);
+    const Point2i tile_min(tile_index % tile_count * tile_size, tile_index / tile_count * tile_size);
+    const Bounds2i tile_bounds(tile_min, tile_min + Point2i(tile_size, tile_size));
+    for (auto _ : state)
+    {
+        film.merge_film_tile(film.get_film_tile(tile_bounds));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_narukami_Film_merge_film_tile)->Arg(0)->Arg(1)->ThreadRange(1, 16)->UseRealTime();
+
+//range(0):0为LowDiscrepancySampler,1为SobolSampler,2为ZSobolSampler,3为PMJ02Sampler
+static std::unique_ptr<Sampler> create_benchmark_sampler(const int64_t type, const uint32_t spp, const Point2i &resolution = Point2i(64, 64))
+{
+    if (type == 1)
+    {
+        return narukami::make_unique<SobolSampler>(spp);
+    }
+    if (type == 2)
+    {
+        return narukami::make_unique<ZSobolSampler>(spp, resolution);
+    }
+    if (type == 3)
+    {
+        return narukami::make_unique<PMJ02Sampler>(spp);
+    }
+    return narukami::make_unique<LowDiscrepancySampler>(spp);
+}
+
+//每个样本取4个二维和4个一维值,range(0)为采样器,range(1)为spp
+static void BM_narukami_Sampler_generate(benchmark::State &state)
+{
+    auto sampler = create_benchmark_sampler(state.range(0), static_cast<uint32_t>(state.range(1)))->clone(0);
+    const int pixel_count = 64;
+    for (auto _ : state)
+    {
+        for (int i = 0; i < pixel_count; ++i)
+        {
+            sampler->start_pixel(Point2i(i, i));
+            do
+            {
+                for (int d = 0; d < 4; ++d)
+                {
+                    benchmark::DoNotOptimize(sampler->get_2D());
+                    benchmark::DoNotOptimize(sampler->get_1D());
+                }
+            } while (sampler->start_next_sample());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * pixel_count * sampler->get_spp());
+}
+BENCHMARK(BM_narukami_Sampler_generate)->Args({0, 16})->Args({1, 16})->Args({2, 16})->Args({3, 16})->Args({0, 256})->Args({1, 256})->Args({2, 256})->Args({3, 256});
+
+//每遍每个像素只取一个样本,和samples_per_pass为1的分遍渲染相同,range(0)为采样器,range(1)为spp
+static void BM_narukami_Sampler_resume(benchmark::State &state)
+{
+    auto sampler = create_benchmark_sampler(state.range(0), static_cast<uint32_t>(state.range(1)))->clone(0);
+    const int pixel_count = 64;
+    for (auto _ : state)
+    {
+        for (uint32_t sample_idx = 0; sample_idx < sampler->get_spp(); ++sample_idx)
+        {
+            for (int i = 0; i < pixel_count; ++i)
+            {
+                sampler->start_pixel_sample(Point2i(i, i), sample_idx);
+                for (int d = 0; d < 4; ++d)
+                {
+                    benchmark::DoNotOptimize(sampler->get_2D());
+                    benchmark::DoNotOptimize(sampler->get_1D());
+                }
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * pixel_count * sampler->get_spp());
+}
+BENCHMARK(BM_narukami_Sampler_resume)->Args({0, 16})->Args({3, 16})->Args({0, 256})->Args({3, 256});
+
+//每个像素用第0维和第8维的二维样本估计sin(πu)sin(πv)在[0,1)^2上的积分,counter为所有像素的RMSE
+static void BM_narukami_Sampler_convergence(benchmark::State &state)
+{
+    auto sampler = create_benchmark_sampler(state.range(0), static_cast<uint32_t>(state.range(1)))->clone(0);
+    const int pixel_count = 1024;
+    const int dim_count = 9;
+    const double reference = 4.0 / (PI * PI);
+    double sqr_error[2] = {0.0, 0.0};
+    for (auto _ : state)
+    {
+        sqr_error[0] = sqr_error[1] = 0.0;
+        for (int i = 0; i < pixel_count; ++i)
+        {
+            sampler->start_pixel(Point2i(i % 32, i / 32));
+            double sum[2] = {0.0, 0.0};
+            do
+            {
+                for (int d = 0; d < dim_count; ++d)
+                {
+                    const Point2f u = sampler->get_2D();
+                    if (d == 0 || d == dim_count - 1)
+                    {
+                        sum[d == 0 ? 0 : 1] += std::sin(PI * u.x) * std::sin(PI * u.y);
+                    }
+                }
+            } while (sampler->start_next_sample());
+            for (int k = 0; k < 2; ++k)
+            {
+                const double error = sum[k] / sampler->get_spp() - reference;
+                sqr_error[k] += error * error;
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * pixel_count * sampler->get_spp());
+    state.counters["rmse_dim0"] = std::sqrt(sqr_error[0] / pixel_count);
+    state.counters["rmse_dim8"] = std::sqrt(sqr_error[1] / pixel_count);
+}
+BENCHMARK(BM_narukami_Sampler_convergence)->Args({0, 16})->Args({1, 16})->Args({3, 16})->Args({0, 48})->Args({3, 48})->Args({0, 64})->Args({1, 64})->Args({3, 64})->Unit(benchmark::kMillisecond);
+
+//64x64的图像中每个像素用第2维的二维样本估计u^2+v<1的面积(2/3),counter为误差图像的RMSE,
+//以及误差图像经过sigma为1像素的高斯模糊(近似人眼的低通)后的RMSE,误差是蓝噪声时后者明显更小
+static void BM_narukami_Sampler_perceptual_error(benchmark::State &state)
+{
+    const int resolution = 64;
+    auto sampler = create_benchmark_sampler(state.range(0), static_cast<uint32_t>(state.range(1)), Point2i(resolution, resolution))->clone(0);
+    const double reference = 2.0 / 3.0;
+    std::vector<double> error(resolution * resolution);
+    for (auto _ : state)
+    {
+        for (int y = 0; y < resolution; ++y)
+        {
+            for (int x = 0; x < resolution; ++x)
+            {
+                sampler->start_pixel(Point2i(x, y));
+                double sum = 0.0;
+                do
+                {
+                    sampler->get_2D();
+                    sampler->get_2D();
+                    const Point2f u = sampler->get_2D();
+                    sum += (u.x * u.x + u.y < 1.0f) ? 1.0 : 0.0;
+                } while (sampler->start_next_sample());
+                error[y * resolution + x] = sum / sampler->get_spp() - reference;
+            }
+        }
+        benchmark::DoNotOptimize(error.data());
+    }
+    state.SetItemsProcessed(state.iterations() * resolution * resolution * sampler->get_spp());
+
+    const int radius = 3;
+    double kernel[2 * radius + 1];
+    double kernel_sum = 0.0;
+    for (int i = -radius; i <= radius; ++i)
+    {
+        kernel[i + radius] = std::exp(-0.5 * i * i);
+        kernel_sum += kernel[i + radius];
+    }
+    double sqr_error = 0.0;
+    double sqr_perceptual_error = 0.0;
+    for (int y = 0; y < resolution; ++y)
+    {
+        for (int x = 0; x < resolution; ++x)
+        {
+            double blurred = 0.0;
+            for (int j = -radius; j <= radius; ++j)
+            {
+                for (int i = -radius; i <= radius; ++i)
+                {
+                    const int sx = (x + i + resolution) % resolution;
+                    const int sy = (y + j + resolution) % resolution;
+                    blurred += kernel[i + radius] * kernel[j + radius] * error[sy * resolution + sx];
+                }
+            }
+            blurred /= kernel_sum * kernel_sum;
+            sqr_error += error[y * resolution + x] * error[y * resolution + x];
+            sqr_perceptual_error += blurred * blurred;
+        }
+    }
+    state.counters["rmse"] = std::sqrt(sqr_error / (resolution * resolution));
+    state.counters["perceptual_rmse"] = std::sqrt(sqr_perceptual_error / (resolution * resolution));
+}
+BENCHMARK(BM_narukami_Sampler_perceptual_error)->Args({0, 1})->Args({1, 1})->Args({2, 1})->Args({0, 4})->Args({1, 4})->Args({2, 4})->Args({0, 16})->Args({1, 16})->Args({2, 16});
+
+/*******************************************************************************/
+/***************************************ray stream******************************/
+struct BenchmarkRayStream
+{
+    std::vector<float> ox, oy, oz, dx, dy, dz, t_max;
+
+    RayStream stream() const
+    {
+        return RayStream{&ox[0], &oy[0], &oz[0], &dx[0], &dy[0], &dz[0], &t_max[0], ox.size()};
+    }
+
+    void push_back(const Ray &ray)
+    {
+        ox.push_back(ray.o.x);
+        oy.push_back(ray.o.y);
+        oz.push_back(ray.o.z);
+        dx.push_back(ray.d.x);
+        dy.push_back(ray.d.y);
+        dz.push_back(ray.d.z);
+        t_max.push_back(ray.t_max);
+    }
+};
+
+static BenchmarkRayStream create_random_ray_stream(uint32_t ray_num)
+{
+    RNG rng(2);
+    BenchmarkRayStream rays;
+    for (uint32_t i = 0; i < ray_num; ++i)
+    {
+        Point3f o(rng.next_float() * 4.0f - 2.0f, rng.next_float() * 2.0f - 1.0f, rng.next_float() * 4.0f - 1.5f);
+        Vector3f d(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f);
+        rays.push_back(Ray(o, normalize(d)));
+    }
+    return rays;
+}
+
+//从相机位置出发的一束射线
+static BenchmarkRayStream create_coherent_ray_stream(uint32_t ray_num)
+{
+    BenchmarkRayStream rays;
+    uint32_t width = static_cast<uint32_t>(sqrt(static_cast<float>(ray_num)));
+    for (uint32_t i = 0; i < ray_num; ++i)
+    {
+        float x = static_cast<float>(i % width) / width - 0.5f;
+        float y = static_cast<float>(i / width) / width - 0.5f;
+        rays.push_back(Ray(Point3f(0, 0, -4), normalize(Vector3f(x, y, 1.0f))));
+    }
+    return rays;
+}
+
+static void BM_narukami_Scene_intersect_stream_random(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_random_ray_stream(static_cast<uint32_t>(state.range(0)));
+    std::vector<HitRecord> hits(rays.ox.size());
+    for (auto _ : state)
+    {
+        scene.intersect_stream(rays.stream(), &hits[0]);
+        benchmark::DoNotOptimize(&hits[0]);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_Scene_intersect_stream_random)->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+
+static void BM_narukami_Scene_intersect_stream_coherent(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_coherent_ray_stream(static_cast<uint32_t>(state.range(0)));
+    std::vector<HitRecord> hits(rays.ox.size());
+    for (auto _ : state)
+    {
+        scene.intersect_stream(rays.stream(), &hits[0]);
+        benchmark::DoNotOptimize(&hits[0]);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_Scene_intersect_stream_coherent)->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+
+static void BM_narukami_Scene_occluded_stream_random(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_random_ray_stream(static_cast<uint32_t>(state.range(0)));
+    std::unique_ptr<bool[]> occluded(new bool[rays.ox.size()]);
+    for (auto _ : state)
+    {
+        scene.occluded_stream(rays.stream(), occluded.get());
+        benchmark::DoNotOptimize(occluded.get());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_Scene_occluded_stream_random)->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+
+//不排序,逐条调用Scene::intersect作为对比
+static void BM_narukami_Scene_intersect_loop_random(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_random_ray_stream(static_cast<uint32_t>(state.range(0)));
+    auto stream = rays.stream();
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < stream.count; ++i)
+        {
+            SurfaceInteraction interaction;
+            benchmark::DoNotOptimize(scene.intersect(stream[i], &interaction));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_Scene_intersect_loop_random)->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+
+static void BM_narukami_Scene_intersect_loop_coherent(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_coherent_ray_stream(static_cast<uint32_t>(state.range(0)));
+    auto stream = rays.stream();
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < stream.count; ++i)
+        {
+            SurfaceInteraction interaction;
+            benchmark::DoNotOptimize(scene.intersect(stream[i], &interaction));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_Scene_intersect_loop_coherent)->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+
+/*******************************************************************************/
+/***************************************ray packet******************************/
+static std::vector<Ray> create_primary_rays(uint32_t width)
+{
+    //以2x2像素块的顺序排列,相邻四条射线组成一个packet
+    std::vector<Ray> rays;
+    for (uint32_t y = 0; y < width; y += 2)
+    {
+        for (uint32_t x = 0; x < width; x += 2)
+        {
+            for (uint32_t i = 0; i < 4; ++i)
+            {
+                float u = static_cast<float>(x + (i & 1)) / width - 0.5f;
+                float v = static_cast<float>(y + (i >> 1)) / width - 0.5f;
+                rays.push_back(Ray(Point3f(0, 0, -4), normalize(Vector3f(u, v, 1.0f))));
+            }
+        }
+    }
+    return rays;
+}
+
+static void BM_narukami_Scene_intersect_primary_single(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_primary_rays(static_cast<uint32_t>(state.range(0)));
+    for (auto _ : state)
+    {
+        for (auto &&ray : rays)
+        {
+            ray.t_max = INFINITE;
+            SurfaceInteraction interaction;
+            benchmark::DoNotOptimize(scene.intersect(ray, &interaction));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * rays.size());
+}
+BENCHMARK(BM_narukami_Scene_intersect_primary_single)->Arg(512)->Unit(benchmark::kMillisecond);
+
+static void BM_narukami_Scene_intersect_primary_packet(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_primary_rays(static_cast<uint32_t>(state.range(0)));
+    SurfaceInteraction interactions[SSE_WIDTH];
+    bool hits[SSE_WIDTH];
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < rays.size(); i += SSE_WIDTH)
+        {
+            for (size_t lane = 0; lane < SSE_WIDTH; ++lane)
+            {
+                rays[i + lane].t_max = INFINITE;
+            }
+            scene.intersect_packet(&rays[i], 0xF, interactions, hits);
+            benchmark::DoNotOptimize(hits);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * rays.size());
+}
+BENCHMARK(BM_narukami_Scene_intersect_primary_packet)->Arg(512)->Unit(benchmark::kMillisecond);
+
+static void BM_narukami_Scene_occluded_primary_single(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_primary_rays(static_cast<uint32_t>(state.range(0)));
+    for (auto _ : state)
+    {
+        for (auto &&ray : rays)
+        {
+            benchmark::DoNotOptimize(scene.intersect(ray));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * rays.size());
+}
+BENCHMARK(BM_narukami_Scene_occluded_primary_single)->Arg(512)->Unit(benchmark::kMillisecond);
+
+static void BM_narukami_Scene_occluded_primary_packet(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_primary_rays(static_cast<uint32_t>(state.range(0)));
+    bool occluded[SSE_WIDTH];
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < rays.size(); i += SSE_WIDTH)
+        {
+            scene.occluded_packet(&rays[i], 0xF, occluded);
+            benchmark::DoNotOptimize(occluded);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * rays.size());
+}
+BENCHMARK(BM_narukami_Scene_occluded_primary_packet)->Arg(512)->Unit(benchmark::kMillisecond);
+
+/*******************************************************************************/
+/***************************************shadow ray******************************/
+//从主射线的交点连向面光源上的随机点,按像素顺序排列,相邻的shadow ray通常被同一个物体遮挡
+static std::vector<Ray> create_shadow_rays(uint32_t width)
+{
+    auto &scene = get_benchmark_scene();
+    auto primary_rays = create_primary_rays(width);
+    RNG rng(2);
+    std::vector<Ray> rays;
+    for (auto &&ray : primary_rays)
+    {
+        SurfaceInteraction interaction;
+        if (!scene.intersect(ray, &interaction))
+        {
+            continue;
+        }
+        Point3f light_point(rng.next_float() - 0.5f, 1.0f, rng.next_float());
+        auto d = light_point - interaction.p;
+        rays.push_back(Ray(interaction.p + d * 1e-4f, d, 0.99f));
+    }
+    return rays;
+}
+
+static void BM_narukami_Scene_occluded_shadow(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_shadow_rays(static_cast<uint32_t>(state.range(0)));
+    for (auto _ : state)
+    {
+        for (auto &&ray : rays)
+        {
+            benchmark::DoNotOptimize(scene.intersect(ray));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * rays.size());
+}
+BENCHMARK(BM_narukami_Scene_occluded_shadow)->Arg(512)->Unit(benchmark::kMillisecond);
+
+//打乱顺序后相邻射线的遮挡物不同,上一次遮挡物的缓存几乎不会命中
+static void BM_narukami_Scene_occluded_shadow_shuffled(benchmark::State &state)
+{
+    auto &scene = get_benchmark_scene();
+    auto rays = create_shadow_rays(static_cast<uint32_t>(state.range(0)));
+    RNG rng(3);
+    for (size_t i = rays.size(); i > 1; --i)
+    {
+        std::swap(rays[i - 1], rays[rng.next_uint32(static_cast<uint32_t>(i))]);
+    }
+    for (auto _ : state)
+    {
+        for (auto &&ray : rays)
+        {
+            benchmark::DoNotOptimize(scene.intersect(ray));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * rays.size());
+}
+BENCHMARK(BM_narukami_Scene_occluded_shadow_shuffled)->Arg(512)->Unit(benchmark::kMillisecond);
+
+/*******************************************************************************/
+/***************************************rotated instance************************/
+//沿x轴的细长物体
+static shared<MeshBLAS> create_beam_blas()
+{
+    RNG rng(4);
+    std::vector<Point3f> positions;
+    std::vector<MeshFace> faces;
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        Point3f center(rng.next_float() - 0.5f, (rng.next_float() - 0.5f) * 0.02f, (rng.next_float() - 0.5f) * 0.02f);
+        for (int v = 0; v < 3; ++v)
+        {
+            Vector3f offset((rng.next_float() - 0.5f) * 0.05f, (rng.next_float() - 0.5f) * 0.01f, (rng.next_float() - 0.5f) * 0.01f);
+            positions.push_back(center + offset);
+        }
+        uint32_t vi[3] = {i * 3, i * 3 + 1, i * 3 + 2};
+        faces.push_back(MeshFace(vi));
+    }
+    std::vector<MeshSegment> segments = {MeshSegment(faces)};
+    auto transform = std::make_shared<Transform>();
+    auto mesh = std::make_shared<Mesh>(transform, transform, positions, std::vector<Normal3f>(), std::vector<Point2f>(), segments);
+    return std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(mesh));
+}
+
+//随机旋转的细长物体,world空间的AABB远大于物体本身
+static const TLAS &get_rotated_beam_tlas()
+{
+    static shared<TLAS> tlas;
+    if (!tlas)
+    {
+        RNG rng(5);
+        auto blas = create_beam_blas();
+        std::vector<shared<BLASInstance>> instance_list;
+        for (uint32_t i = 0; i < 4096; ++i)
+        {
+            auto t = translate(rng.next_float() * 10.0f, rng.next_float() * 10.0f, rng.next_float() * 10.0f) * rotate(rng.next_float() * 360.0f, normalize(Vector3f(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f)));
+            instance_list.push_back(std::make_shared<BLASInstance>(std::make_shared<AnimatedTransform>(std::make_shared<Transform>(t)), blas));
+        }
+        tlas = std::make_shared<TLAS>(instance_list);
+    }
+    return *tlas;
+}
+
+static void BM_narukami_TLAS_rotated_instances(benchmark::State &state)
+{
+    auto &tlas = get_rotated_beam_tlas();
+    RNG rng(6);
+    std::vector<Ray> rays;
+    for (int64_t i = 0; i < state.range(0); ++i)
+    {
+        Point3f o(rng.next_float() * 10.0f, rng.next_float() * 10.0f, rng.next_float() * 10.0f);
+        Vector3f d(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f);
+        rays.push_back(Ray(o, normalize(d)));
+    }
+    for (auto _ : state)
+    {
+        for (auto &&ray : rays)
+        {
+            ray.t_max = INFINITE;
+            SurfaceInteraction interaction;
+            benchmark::DoNotOptimize(tlas.intersect(ray, &interaction));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_TLAS_rotated_instances)->Arg(1 << 16)->Unit(benchmark::kMillisecond);
+
+/*******************************************************************************/
+/***************************************flattened instance**********************/
+//大量只被引用一次的小物体,flatten为true时合并成一个blas
+static const TLAS &get_small_instance_tlas(bool flatten)
+{
+    static shared<TLAS> tlases[2];
+    auto &tlas = tlases[flatten ? 1 : 0];
+    if (!tlas)
+    {
+        RNG rng(7);
+        std::vector<shared<BLASInstance>> instance_list;
+        for (uint32_t i = 0; i < 4096; ++i)
+        {
+            auto t = translate(rng.next_float() * 10.0f, rng.next_float() * 10.0f, rng.next_float() * 10.0f) * rotate(rng.next_float() * 360.0f, 0, 1, 0) * scale(0.2f, 0.2f, 0.2f);
+            instance_list.push_back(std::make_shared<BLASInstance>(std::make_shared<AnimatedTransform>(std::make_shared<Transform>(t)), create_random_triangle_blas(16, 0.3f)));
+        }
+        tlas = std::make_shared<TLAS>(flatten ? flatten_instances(instance_list) : instance_list);
+    }
+    return *tlas;
+}
+
+static void BM_narukami_TLAS_small_instances(benchmark::State &state)
+{
+    auto &tlas = get_small_instance_tlas(state.range(0) != 0);
+    RNG rng(8);
+    std::vector<Ray> rays;
+    for (int64_t i = 0; i < state.range(1); ++i)
+    {
+        Point3f o(rng.next_float() * 10.0f, rng.next_float() * 10.0f, rng.next_float() * 10.0f);
+        Vector3f d(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f);
+        rays.push_back(Ray(o, normalize(d)));
+    }
+    for (auto _ : state)
+    {
+        for (auto &&ray : rays)
+        {
+            ray.t_max = INFINITE;
+            SurfaceInteraction interaction;
+            benchmark::DoNotOptimize(tlas.intersect(ray, &interaction));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_narukami_TLAS_small_instances)->Args({0, 1 << 16})->Args({1, 1 << 16})->Unit(benchmark::kMillisecond);
+
+//共用一个单三角形blas的instance,求交时间主要花在进入instance的开销上
+static const TLAS &get_single_triangle_instance_tlas()
+{
+    static shared<TLAS> tlas;
+    if (!tlas)
+    {
+        RNG rng(9);
+        auto blas = create_random_triangle_blas(1, 0.5f);
+        std::vector<shared<BLASInstance>> instance_list;
+        for (uint32_t i = 0; i < 16384; ++i)
+        {
+            auto t = translate(rng.next_float() * 10.0f, rng.next_float() * 10.0f, rng.next_float() * 10.0f);
+            instance_list.push_back(std::make_shared<BLASInstance>(std::make_shared<AnimatedTransform>(std::make_shared<Transform>(t)), blas));
+        }
+        tlas = std::make_shared<TLAS>(instance_list);
+    }
+    return *tlas;
+}
+
+static void BM_narukami_TLAS_instance_visit(benchmark::State &state)
+{
+    auto &tlas = get_single_triangle_instance_tlas();
+    RNG rng(10);
+    std::vector<Ray> rays;
+    for (int64_t i = 0; i < state.range(0); ++i)
+    {
+        Point3f o(rng.next_float() * 10.0f, rng.next_float() * 10.0f, rng.next_float() * 10.0f);
+        Vector3f d(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f);
+        rays.push_back(Ray(o, normalize(d)));
+    }
+    for (auto _ : state)
+    {
+        for (auto &&ray : rays)
+        {
+            ray.t_max = INFINITE;
+            SurfaceInteraction interaction;
+            benchmark::DoNotOptimize(tlas.intersect(ray, &interaction));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_narukami_TLAS_instance_visit)->Arg(1 << 16)->Unit(benchmark::kMillisecond);
 
 // static void BM_common_rsqrt(benchmark::State &state)
 // {
@@ -9,7 +9,7 @@
 #include "cameras/orthographic.h"
 using namespace narukami;
 int main(){
-    Sampler sampler(1024);
+    LowDiscrepancySampler sampler(1024);
     auto film = std::make_shared<Film>(Point2i(128,128),Bounds2f(Point2f(0,0),Point2f(1,1)));
     shared<AnimatedTransform> t(new AnimatedTransform(make_shared(Transform()),0,make_shared(Transform()),0));
     OrthographicCamera camera(t,0,0,{{0,0},{1,1}},film);
@@ -18,6 +18,7 @@
 #include "lights/point.h"
 #include "lights/rect.h"
 #include "lights/disk.h"
+#include "samplers/sobol.h"
 using namespace narukami;
 int main()
 {
@@ -25,8 +26,8 @@ int main()
     Spectrum::init();
     auto camera_transform = translate(0, 0, -4);  //* rotate(-1.5f,0,0,1);
     auto camera_transform2 = translate(0, 0, -4); //* rotate( 1.5f,0,0,1);
-    auto sampler = Sampler(32);
-    auto film = std::make_shared<Film>(Point2i(1920, 1080), Bounds2f(Point2f(0, 0), Point2f(1, 1)));
+    auto sampler = SobolSampler(32);
+    auto film = std::make_shared<Film>(Point2i(1920, 1080), Bounds2f(Point2f(0, 0), Point2f(1, 1)), 1.0f, 1.0f, FilmMode::XYZ);
     float aspect = 16.0f / 9.0f;
 
     auto camera = PerspectiveCamera(std::make_shared<AnimatedTransform>(std::make_shared<Transform>(camera_transform), 0, std::make_shared<Transform>(camera_transform2), 1), 0, 1, Bounds2f{{-1 * aspect, -1}, {1 * aspect, 1}}, 45, film);
@@ -164,7 +165,7 @@ int main()
     //     primitives = _union(primitives,create_primitives(disklight_triangles,disk_light.get()));
     // }
 
-    auto acce = shared<TLAS>(new TLAS(instance_list));
+    auto acce = shared<TLAS>(new TLAS(flatten_instances(instance_list)));
 
     Scene scene(acce, lights);
     Integrator integrator(&camera, &sampler);
@@ -9,7 +9,7 @@
 #include "cameras/orthographic.h"
 using namespace narukami;
 int main(){
-    Sampler sampler(128);
+    LowDiscrepancySampler sampler(128);
     auto film_0 =std::make_shared<Film>(Point2i(512,512),Bounds2f(Point2f(0,0),Point2f(1,1)));
     auto film_1 =std::make_shared<Film>(Point2i(512,512),Bounds2f(Point2f(0,0),Point2f(1,1)));
     auto film_2 =std::make_shared<Film>(Point2i(512,512),Bounds2f(Point2f(0,0),Point2f(1,1)));
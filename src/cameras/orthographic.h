@@ -39,6 +39,7 @@ NARUKAMI_BEGIN
                 float shutter_time = shutter_open + sample.time * (shutter_end - shutter_open);
                 Ray ray_cam(point_camera,Vector3f(0.0f,0.0f,1.0f),shutter_time);
                 ray_cam.time = shutter_time;
+                ray_cam.mask = RAY_MASK_CAMERA;
                 Transform c2w;
                 camera_to_world->interpolate(shutter_time,&c2w);
                 (*ray)=c2w(ray_cam);
@@ -54,6 +55,7 @@ NARUKAMI_BEGIN
                 float shutter_time = shutter_open + sample.time * (shutter_end - shutter_open);
                 RayDifferential ray_cam(point_camera,Vector3f(0.0f,0.0f,1.0f),shutter_time);
                 ray_cam.time = shutter_time;
+                ray_cam.mask = RAY_MASK_CAMERA;
                 
                 ray_cam.ox = point_camera_x;
                 ray_cam.dx = Vector3f(0.0f,0.0f,1.0f);
@@ -39,6 +39,7 @@ public:
         float shutter_time = shutter_open + sample.time * (shutter_end - shutter_open);
         Ray ray_cam(Point3f(0, 0, 0), normalize(Vector3f(point_camera)));
         ray_cam.time = shutter_time;
+        ray_cam.mask = RAY_MASK_CAMERA;
         Transform c2w;
         camera_to_world->interpolate(shutter_time, &c2w);
         (*ray) = c2w(ray_cam);
@@ -55,6 +56,7 @@ public:
         
         RayDifferential ray_cam(Point3f(0, 0, 0), normalize(Vector3f(point_camera)));
         ray_cam.time = shutter_time;
+        ray_cam.mask = RAY_MASK_CAMERA;
 
         // x offset eye ray
         {
@@ -23,8 +23,24 @@ SOFTWARE.
 */
 #include "core/accelerator.h"
 #include "core/progressreporter.h"
+#include <atomic>
+#include <map>
 NARUKAMI_BEGIN
 
+/**
+ * 每个线程记录上一次遮挡射线的instance和元素
+ * 相邻着色点的shadow ray通常被同一个物体遮挡,先测试它就可以跳过整个遍历
+*/
+struct LastOccluderCache
+{
+    uint64_t tlas_id;
+    uint32_t instance;
+    uint32_t occluder;
+};
+
+static std::atomic<uint64_t> tlas_id_counter(0);
+static thread_local LastOccluderCache last_occluder_cache = {0, 0, INVALID_OCCLUDER};
+
 QBVHCollapseNode *collapse(MemoryArena &arena, const BVHBuildNode *subtree_root, uint32_t *total)
 {
     auto node = arena.alloc<QBVHCollapseNode>(1);
@@ -88,7 +104,8 @@ QBVHCollapseNode *collapse(MemoryArena &arena, const BVHBuildNode *subtree_root,
     return node;
 }
 
-uint32_t flatten(std::vector<QBVHNode> &nodes, uint32_t depth, const QBVHCollapseNode *c_node, uint32_t *offset, uint32_t *max_depth)
+template <typename NodeReference>
+uint32_t flatten(std::vector<BasicQBVHNode<NodeReference>> &nodes, uint32_t depth, const QBVHCollapseNode *c_node, uint32_t *offset, uint32_t *max_depth)
 {
     auto cur_offset = (*offset);
     (*offset)++;
@@ -121,7 +138,8 @@ uint32_t flatten(std::vector<QBVHNode> &nodes, uint32_t depth, const QBVHCollaps
     return cur_offset;
 }
 
-void get_traversal_orders(const QBVHNode &node, const Vector3f &dir, uint32_t orders[4])
+template <typename NodeReference>
+void get_traversal_orders(const BasicQBVHNode<NodeReference> &node, const Vector3f &dir, uint32_t orders[4])
 {
     orders[0] = 0;
     orders[1] = 1;
@@ -143,6 +161,11 @@ void get_traversal_orders(const QBVHNode &node, const Vector3f &dir, uint32_t or
     }
 }
 
+template uint32_t flatten<NarrowNodeReference>(std::vector<QBVHNode> &, uint32_t, const QBVHCollapseNode *, uint32_t *, uint32_t *);
+template uint32_t flatten<WideNodeReference>(std::vector<WideQBVHNode> &, uint32_t, const QBVHCollapseNode *, uint32_t *, uint32_t *);
+template void get_traversal_orders<NarrowNodeReference>(const QBVHNode &, const Vector3f &, uint32_t[4]);
+template void get_traversal_orders<WideNodeReference>(const WideQBVHNode &, const Vector3f &, uint32_t[4]);
+
 TLAS::TLAS(const std::vector<shared<BLASInstance>> &instance_list) : _instances(instance_list)
 {
     STAT_INCREASE_COUNTER(blas_instance_num, instance_list.size())
@@ -152,6 +175,7 @@ TLAS::TLAS(const std::vector<shared<BLASInstance>> &instance_list) : _instances(
         instance_infos[i] = BLASInstanceInfo(instance_list[i], i);
     }
 
+    _id = ++tlas_id_counter;
     _bounds = get_max_bounds(instance_infos, 0, static_cast<uint32_t>(instance_infos.size()));
 
     MemoryArena arena;
@@ -162,13 +186,31 @@ TLAS::TLAS(const std::vector<shared<BLASInstance>> &instance_list) : _instances(
     auto build_root = build(arena, 0, static_cast<uint32_t>(instance_infos.size()), instance_infos, _ordered_instance_list, &total_build_node_num);
 
     _instances = _ordered_instance_list;
+    _instance_obbs.resize(_instances.size());
+    for (uint32_t i = 0; i < _instances.size(); ++i)
+    {
+        _instance_obbs[i].enabled = _instances[i]->has_oriented_bounds();
+        if (_instance_obbs[i].enabled)
+        {
+            _instance_obbs[i].world_to_blas = _instances[i]->static_world_to_blas().mat;
+            _instance_obbs[i].bounds = _instances[i]->blas_bounds();
+        }
+    }
     auto collapse_root = collapse(arena, build_root, &total_collapse_node_num);
     _nodes.resize(total_collapse_node_num);
 
     build_soa_instance_info(build_root);
-    uint32_t offset = 0;
     _max_depth = 0;
+    //引用放不下时TLAS是空的,而不是flatten出溢出的错误的树
+    if (!check_node_reference("TLAS", _compact_instances.size(), total_collapse_node_num, _nodes))
+    {
+        _node_masks.resize(1);
+        return;
+    }
+    uint32_t offset = 0;
     flatten(_nodes, 0, collapse_root, &offset, &_max_depth);
+    _node_masks.resize(_nodes.size());
+    build_node_masks(0);
 
     STAT_INCREASE_MEMORY_COUNTER(QBVH_node_memory_cost, sizeof(QBVHNode) * total_collapse_node_num)
 }
@@ -278,16 +320,19 @@ std::vector<CompactBLASInstance> pack_instances(const std::vector<shared<BLASIns
     uint32_t soa_count = (uint32_t)(count - 1) / SSE_WIDTH + 1;
 
     std::vector<Bounds3f> bounds_array;
+    std::vector<uint32_t> mask_array;
 
     for (uint32_t i = 0; i < soa_count * SSE_WIDTH; ++i)
     {
         if (i < count)
         {
             bounds_array.push_back(instance_list[start + i]->bounds());
+            mask_array.push_back(instance_list[start + i]->mask());
         }
         else
         {
             bounds_array.push_back(Bounds3f());
+            mask_array.push_back(0);
         }
     }
     std::vector<CompactBLASInstance> soa_instance_info;
@@ -296,6 +341,10 @@ std::vector<CompactBLASInstance> pack_instances(const std::vector<shared<BLASIns
     {
         CompactBLASInstance instance;
         instance.bounds = load(&bounds_array[i * SSE_WIDTH]);
+        for (uint32_t k = 0; k < SSE_WIDTH; ++k)
+        {
+            instance.masks.masks[k] = mask_array[i * SSE_WIDTH + k];
+        }
 
         instance.offset = start + i * SSE_WIDTH;
         soa_instance_info.push_back(instance);
@@ -322,157 +371,582 @@ void TLAS::build_soa_instance_info(BVHBuildNode *node)
     }
 }
 
+uint32_t TLAS::build_node_masks(uint32_t node)
+{
+    uint32_t node_mask = 0;
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+        auto child = _nodes[node].childrens[i];
+        uint32_t mask = 0;
+        if (leaf_is_empty(child))
+        {
+            mask = 0;
+        }
+        else if (is_leaf(child))
+        {
+            for (uint32_t j = leaf_offset(child); j < leaf_offset(child) + leaf_num(child); ++j)
+            {
+                for (uint32_t k = 0; k < SSE_WIDTH; ++k)
+                {
+                    mask |= _compact_instances[j].masks.masks[k];
+                }
+            }
+        }
+        else
+        {
+            mask = build_node_masks(child);
+        }
+        _node_masks[node].masks[i] = mask;
+        node_mask |= mask;
+    }
+    return node_mask;
+}
+
 bool TLAS::intersect(const Ray &ray, SurfaceInteraction *interaction) const
 {
-    LocalStack<std::pair<const QBVHNode*,float>,MAX_LOCAL_STACK_DEEP> node_stack;
+    TraversalRay traversal_ray(ray);
+    bool tlas_has_hit = false;
+    traverse_closest(&_nodes[0], &_node_masks[0], traversal_stack_size(), traversal_ray, ray, [&](uint32_t offset, uint32_t num) {
+        for (uint32_t j = offset; j < offset + num; ++j)
+        {
+            auto leaf_box_hits = movemask(narukami::intersect(traversal_ray, ray.t_max, _compact_instances[j].bounds) & visible(_compact_instances[j].masks, ray.mask));
+            for (uint32_t k = 0; k < 4; k++)
+            {
+                if ((leaf_box_hits >> k) & 1)
+                {
+                    auto instance_offset = _compact_instances[j].offset + k;
+                    //这里不需要更新ray的t_max,因为已经在blas中更新过了
+                    if (intersect_instance_obb(ray, instance_offset) && _instances[instance_offset]->intersect(ray, interaction))
+                    {
+                        tlas_has_hit = true;
+                    }
+                }
+            }
+        }
+    });
+    return tlas_has_hit;
+}
+
+bool TLAS::intersect(const Ray &ray) const
+{
+    auto &cache = last_occluder_cache;
+    if (cache.tlas_id == _id && (_instances[cache.instance]->mask() & ray.mask) != 0)
+    {
+        STAT_INCREASE_COUNTER(occluder_cache_test_num, 1)
+        if (_instances[cache.instance]->occluded_by(ray, cache.occluder))
+        {
+            STAT_INCREASE_COUNTER(occluder_cache_hit_num, 1)
+            return true;
+        }
+    }
 
-    RayPack soa_ray(ray.o, ray.d, ray.t_max);
+    TraversalRay traversal_ray(ray);
+    return traverse_occluded(&_nodes[0], &_node_masks[0], traversal_stack_size(), traversal_ray, ray, [&](uint32_t offset, uint32_t num) {
+        for (uint32_t j = offset; j < offset + num; ++j)
+        {
+            auto leaf_box_hits = static_cast<uint32_t>(movemask(narukami::intersect(traversal_ray, ray.t_max, _compact_instances[j].bounds) & visible(_compact_instances[j].masks, ray.mask)));
+            while (leaf_box_hits != 0)
+            {
+                auto instance_offset = _compact_instances[j].offset + ctz(leaf_box_hits);
+                leaf_box_hits &= leaf_box_hits - 1;
+                const auto &blas_instance = _instances[instance_offset];
+                uint32_t occluder;
+                if (intersect_instance_obb(ray, instance_offset) && blas_instance->occluded(ray, &occluder))
+                {
+                    cache = {_id, instance_offset, occluder};
+                    return true;
+                }
+            }
+        }
+        return false;
+    });
+}
 
-    int is_positive[3] = {ray.d[0] >= 0 ? 1 : 0, ray.d[1] >= 0 ? 1 : 0, ray.d[2] >= 0 ? 1 : 0};
-    node_stack.push({&_nodes[0], 0.0f});
+//排序key的低位是射线在bin中的序号
+static constexpr uint32_t RAY_STREAM_INDEX_BITS = 12;
+static_assert(RAY_STREAM_BIN_SIZE <= (1u << RAY_STREAM_INDEX_BITS), "ray stream index overflow");
+
+inline uint32_t stream_key_index(const uint64_t key)
+{
+    return static_cast<uint32_t>(key & ((1u << RAY_STREAM_INDEX_BITS) - 1));
+}
+
+/**
+ * 按照方向的卦限和起点的morton code对[start,start+count)范围内的射线排序
+ * 卦限和morton code一共33位,用三趟11位的基数排序,temp和keys的大小相同
+*/
+static void sort_ray_stream(const RayStream &rays, size_t start, uint32_t count, const Bounds3f &bounds, uint64_t *keys, uint64_t *temp)
+{
+    auto extent = bounds.max_point - bounds.min_point;
+    //超出场景范围的起点被截断到边界上
+    auto quantize = [](float o, float min_o, float extent) {
+        float x = extent > 0 ? (o - min_o) / extent : 0.0f;
+        return static_cast<uint32_t>(clamp(x, 0.0f, 1.0f) * 1023.0f);
+    };
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        size_t idx = start + i;
+        uint64_t octant = (rays.dx[idx] >= 0 ? 1 : 0) | (rays.dy[idx] >= 0 ? 2 : 0) | (rays.dz[idx] >= 0 ? 4 : 0);
+        uint32_t morton = encode_morton3(quantize(rays.ox[idx], bounds.min_point.x, extent.x),
+                                         quantize(rays.oy[idx], bounds.min_point.y, extent.y),
+                                         quantize(rays.oz[idx], bounds.min_point.z, extent.z));
+        keys[i] = (((octant << 30) | morton) << RAY_STREAM_INDEX_BITS) | i;
+    }
+
+    constexpr uint32_t RADIX_BITS = 11;
+    uint64_t *src = keys;
+    uint64_t *dst = temp;
+    for (uint32_t pass = 0; pass < 3; ++pass)
+    {
+        uint32_t shift = RAY_STREAM_INDEX_BITS + pass * RADIX_BITS;
+        uint32_t offsets[1 << RADIX_BITS] = {};
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            offsets[(src[i] >> shift) & ((1 << RADIX_BITS) - 1)]++;
+        }
+        uint32_t sum = 0;
+        for (auto &&offset : offsets)
+        {
+            auto n = offset;
+            offset = sum;
+            sum += n;
+        }
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            dst[offsets[(src[i] >> shift) & ((1 << RADIX_BITS) - 1)]++] = src[i];
+        }
+        std::swap(src, dst);
+    }
+    std::copy(src, src + count, keys);
+}
+
+//排序后相邻的四条射线组成一个packet,lane_mask为实际装入的射线
+static uint32_t load_stream_packet(const RayStream &rays, size_t start, const uint64_t *keys, uint32_t count, Ray packet_rays[SSE_WIDTH])
+{
+    auto lane_num = min<uint32_t>(SSE_WIDTH, count);
+    for (uint32_t lane = 0; lane < lane_num; ++lane)
+    {
+        packet_rays[lane] = rays[start + stream_key_index(keys[lane])];
+    }
+    return (1u << lane_num) - 1;
+}
+
+//方向和起点都接近的packet用packet遍历共享节点,发散的packet区间剔除无效,逐条射线求交更快
+static bool is_coherent_packet(const Ray packet_rays[SSE_WIDTH], uint32_t lane_mask, float max_origin_distance)
+{
+    const Ray &first = packet_rays[0];
+    for (uint32_t lane = 1; is_active_lane(lane_mask, lane); ++lane)
+    {
+        const Ray &ray = packet_rays[lane];
+        if (dot(ray.d, first.d) < RAY_STREAM_COHERENT_COS * length(ray.d) * length(first.d) || distance(ray.o, first.o) > max_origin_distance)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TLAS::intersect_stream(const RayStream &rays, HitRecord *hits) const
+{
+    STAT_INCREASE_COUNTER(stream_ray_num, rays.count)
+    std::vector<uint64_t> keys(RAY_STREAM_BIN_SIZE);
+    std::vector<uint64_t> temp(RAY_STREAM_BIN_SIZE);
+    auto max_origin_distance = RAY_STREAM_COHERENT_ORIGIN_RATIO * distance(_bounds.min_point, _bounds.max_point);
+    for (size_t start = 0; start < rays.count; start += RAY_STREAM_BIN_SIZE)
+    {
+        auto count = static_cast<uint32_t>(min<size_t>(RAY_STREAM_BIN_SIZE, rays.count - start));
+        sort_ray_stream(rays, start, count, _bounds, &keys[0], &temp[0]);
+        for (uint32_t i = 0; i < count; i += SSE_WIDTH)
+        {
+            Ray packet_rays[SSE_WIDTH];
+            SurfaceInteraction interactions[SSE_WIDTH];
+            bool packet_hits[SSE_WIDTH];
+            auto lane_mask = load_stream_packet(rays, start, &keys[i], count - i, packet_rays);
+            if (is_coherent_packet(packet_rays, lane_mask, max_origin_distance))
+            {
+                intersect_packet(packet_rays, lane_mask, interactions, packet_hits);
+            }
+            else
+            {
+                for (uint32_t lane = 0; is_active_lane(lane_mask, lane); ++lane)
+                {
+                    packet_hits[lane] = intersect(packet_rays[lane], &interactions[lane]);
+                }
+            }
+            for (uint32_t lane = 0; is_active_lane(lane_mask, lane); ++lane)
+            {
+                auto &hit = hits[start + stream_key_index(keys[i + lane])];
+                if (packet_hits[lane])
+                {
+                    hit.t = packet_rays[lane].t_max;
+                    hit.n = interactions[lane].n;
+                    hit.uv = interactions[lane].uv;
+                }
+                else
+                {
+                    hit.t = INFINITE;
+                }
+            }
+        }
+    }
+}
+
+void TLAS::occluded_stream(const RayStream &rays, bool *occluded) const
+{
+    STAT_INCREASE_COUNTER(stream_ray_num, rays.count)
+    std::vector<uint64_t> keys(RAY_STREAM_BIN_SIZE);
+    std::vector<uint64_t> temp(RAY_STREAM_BIN_SIZE);
+    auto max_origin_distance = RAY_STREAM_COHERENT_ORIGIN_RATIO * distance(_bounds.min_point, _bounds.max_point);
+    for (size_t start = 0; start < rays.count; start += RAY_STREAM_BIN_SIZE)
+    {
+        auto count = static_cast<uint32_t>(min<size_t>(RAY_STREAM_BIN_SIZE, rays.count - start));
+        sort_ray_stream(rays, start, count, _bounds, &keys[0], &temp[0]);
+        for (uint32_t i = 0; i < count; i += SSE_WIDTH)
+        {
+            Ray packet_rays[SSE_WIDTH];
+            bool packet_occluded[SSE_WIDTH];
+            auto lane_mask = load_stream_packet(rays, start, &keys[i], count - i, packet_rays);
+            if (is_coherent_packet(packet_rays, lane_mask, max_origin_distance))
+            {
+                occluded_packet(packet_rays, lane_mask, packet_occluded);
+            }
+            else
+            {
+                for (uint32_t lane = 0; is_active_lane(lane_mask, lane); ++lane)
+                {
+                    packet_occluded[lane] = intersect(packet_rays[lane]);
+                }
+            }
+            for (uint32_t lane = 0; is_active_lane(lane_mask, lane); ++lane)
+            {
+                occluded[start + stream_key_index(keys[i + lane])] = packet_occluded[lane];
+            }
+        }
+    }
+}
+
+void TLAS::intersect_packet(const Ray *rays, uint32_t lane_mask, SurfaceInteraction *interactions, bool *hits) const
+{
+    STAT_INCREASE_COUNTER(packet_num, 1)
+    RayPacket packet;
+    if (is_single_lane(lane_mask) || !init_ray_packet(rays, lane_mask, &packet))
+    {
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (is_active_lane(lane_mask, lane))
+            {
+                hits[lane] = intersect(rays[lane], &interactions[lane]);
+            }
+        }
+        return;
+    }
+    STAT_INCREASE_COUNTER(coherent_packet_num, 1)
+
+    for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+    {
+        if (is_active_lane(lane_mask, lane))
+        {
+            hits[lane] = false;
+        }
+    }
+
+    InlineStack<PacketStackElement, MAX_LOCAL_STACK_DEEP> node_stack;
+    node_stack.reserve(traversal_stack_size());
+    STAT_INCREASE_COUNTER_CONDITION(traversal_stack_spill_num, 1, node_stack.spilled())
+    node_stack.push({0, lane_mask, 0.0f});
 
-    bool tlas_has_hit = false;
     while (!node_stack.empty())
     {
+        auto element = node_stack.pop();
+        float packet_t_max = max_t(packet, element.lane_mask);
+        if (element.t > packet_t_max)
+        {
+            continue;
+        }
 
-        if (node_stack.top().second > ray.t_max)
+        auto node = &_nodes[element.node];
+        if (!is_single_lane(element.lane_mask) && none(narukami::intersect(packet.o_min, packet.o_max, packet.inv_d_min, packet.inv_d_max, packet_t_max, packet.is_positive, node->bounds)))
         {
-            node_stack.pop();
             continue;
         }
 
-        auto node = node_stack.pop().first;
-        float4 box_t;
-        auto box_hits = narukami::intersect(soa_ray.o, safe_rcp(soa_ray.d), float4(0), float4(soa_ray.t_max), is_positive, node->bounds, &box_t);
+        uint32_t child_masks[4] = {0, 0, 0, 0};
+        float child_t[4] = {INFINITE, INFINITE, INFINITE, INFINITE};
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (!is_active_lane(element.lane_mask, lane))
+            {
+                continue;
+            }
+            const RayPack &soa_ray = packet.soa_rays[lane];
+            float4 box_t;
+            auto box_hits = narukami::intersect(soa_ray.o, packet.inv_d[lane], float4(0), float4(soa_ray.t_max), packet.is_positive, node->bounds, &box_t) & visible(_node_masks[element.node], rays[lane].mask);
+            for (uint32_t i = 0; i < 4; ++i)
+            {
+                if (box_hits[i] && box_t[i] < rays[lane].t_max)
+                {
+                    child_masks[i] |= (1 << lane);
+                    child_t[i] = min(child_t[i], box_t[i]);
+                }
+            }
+        }
 
-        bool push_child[4] = {false, false, false, false};
         uint32_t orders[4];
-        get_traversal_orders((*node), ray.d, orders);
+        auto hit_num = sort_children(child_t, child_masks, orders);
+        STAT_INCREASE_COUNTER(ordered_traversal_denom, 4)
+        STAT_INCREASE_COUNTER(ordered_traversal_num, hit_num)
 
-        for (uint32_t i = 0; i < 4; ++i)
+        uint32_t push_children[4];
+        uint32_t push_num = 0;
+        for (uint32_t i = 0; i < hit_num; ++i)
         {
             uint32_t index = orders[i];
-            STAT_INCREASE_COUNTER(ordered_traversal_denom, 1)
-            if (box_hits[index] && box_t[index] < ray.t_max)
+            //处理近处的叶子后t_max可能变小
+            if (child_t[index] > max_t(packet, child_masks[index]))
+            {
+                continue;
+            }
+            if (is_leaf(node->childrens[index]))
             {
-                STAT_INCREASE_COUNTER(ordered_traversal_num, 1)
-                if (is_leaf(node->childrens[index]))
+                auto offset = leaf_offset(node->childrens[index]);
+                auto num = leaf_num(node->childrens[index]);
+                for (uint32_t j = offset; j < offset + num; ++j)
                 {
-                    auto offset = leaf_offset(node->childrens[index]);
-                    auto num = leaf_num(node->childrens[index]);
-                    for (uint32_t j = offset; j < offset + num; ++j)
+                    uint32_t instance_masks[4] = {0, 0, 0, 0};
+                    for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
                     {
+                        if (!is_active_lane(child_masks[index], lane))
+                        {
+                            continue;
+                        }
+                        const RayPack &soa_ray = packet.soa_rays[lane];
+                        auto leaf_box_hits = narukami::intersect(soa_ray.o, packet.inv_d[lane], float4(0), float4(soa_ray.t_max), packet.is_positive, _compact_instances[j].bounds) & visible(_compact_instances[j].masks, rays[lane].mask);
+                        for (uint32_t k = 0; k < 4; ++k)
+                        {
+                            if (leaf_box_hits[k] && intersect_instance_obb(rays[lane], _compact_instances[j].offset + k))
+                            {
+                                instance_masks[k] |= (1 << lane);
+                            }
+                        }
+                    }
 
-                        auto leaf_box_hits = narukami::intersect(soa_ray.o, safe_rcp(soa_ray.d), float4(0), float4(soa_ray.t_max), is_positive, _compact_instances[j].bounds);
-
-                        for (uint32_t k = 0; k < 4; k++)
+                    for (uint32_t k = 0; k < 4; ++k)
+                    {
+                        if (instance_masks[k] == 0)
+                        {
+                            continue;
+                        }
+                        const auto &blas_instance = _instances[_compact_instances[j].offset + k];
+                        SurfaceInteraction instance_interactions[SSE_WIDTH];
+                        bool instance_hits[SSE_WIDTH] = {false, false, false, false};
+                        blas_instance->intersect_packet(rays, instance_masks[k], instance_interactions, instance_hits);
+                        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
                         {
-                            if (leaf_box_hits[k])
+                            if (is_active_lane(instance_masks[k], lane) && instance_hits[lane])
                             {
-                                auto instance_offset = _compact_instances[j].offset + k;
-                                auto blas_instance = _instances[instance_offset];
-
-                                bool has_hit = blas_instance->intersect(ray, interaction);
-
-                                if (has_hit)
-                                {
-                                    {
-                                        tlas_has_hit = true;
-                                    }
-                                    {
-                                        //这里不需要更新ray的t_max,因为已经在blas中更新过了
-                                        soa_ray.t_max = float4(ray.t_max);
-                                    }
-                                }
+                                hits[lane] = true;
+                                interactions[lane] = instance_interactions[lane];
+                                //这里不需要更新ray的t_max,因为已经在blas中更新过了
+                                packet.soa_rays[lane].t_max = float4(rays[lane].t_max);
                             }
                         }
                     }
                 }
-                else
-                {
-                    push_child[index] = true;
-                }
+            }
+            else
+            {
+                push_children[push_num++] = index;
             }
         }
 
-        for (uint32_t i = 0; i < 4; i++)
+        //远的先入栈,近的先出栈
+        while (push_num > 0)
         {
-            uint32_t index = orders[i];
-            if (push_child[index])
+            uint32_t index = push_children[--push_num];
+            node_stack.push({node->childrens[index], child_masks[index], child_t[index]});
+            STAT_INCREASE_MEMORY_COUNTER(traversal_stack_traffic, sizeof(PacketStackElement))
+        }
+    }
+}
+
+void TLAS::occluded_packet(const Ray *rays, uint32_t lane_mask, bool *occluded) const
+{
+    STAT_INCREASE_COUNTER(packet_num, 1)
+    RayPacket packet;
+    if (is_single_lane(lane_mask) || !init_ray_packet(rays, lane_mask, &packet))
+    {
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (is_active_lane(lane_mask, lane))
             {
-                node_stack.push({&_nodes[node->childrens[index]], box_t[index]});
+                occluded[lane] = intersect(rays[lane]);
             }
         }
+        return;
     }
+    STAT_INCREASE_COUNTER(coherent_packet_num, 1)
 
-    return tlas_has_hit;
-}
+    for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+    {
+        if (is_active_lane(lane_mask, lane))
+        {
+            occluded[lane] = false;
+        }
+    }
 
-bool TLAS::intersect(const Ray &ray) const
-{
-    LocalStack<const QBVHNode*,MAX_LOCAL_STACK_DEEP> node_stack;
-    RayPack soa_ray(ray);
-    int is_positive[3] = {ray.d[0] >= 0 ? 1 : 0, ray.d[1] >= 0 ? 1 : 0, ray.d[2] >= 0 ? 1 : 0};
-    node_stack.push(&_nodes[0]);
-    Point2f uv;
-    while (!node_stack.empty())
+    InlineStack<PacketStackElement, MAX_LOCAL_STACK_DEEP> node_stack;
+    node_stack.reserve(traversal_stack_size());
+    STAT_INCREASE_COUNTER_CONDITION(traversal_stack_spill_num, 1, node_stack.spilled())
+    node_stack.push({0, lane_mask, 0.0f});
+    uint32_t alive_mask = lane_mask;
+
+    while (!node_stack.empty() && alive_mask != 0)
     {
-        auto node =node_stack.pop();
-        float4 box_t;
-        auto box_hits = narukami::intersect(soa_ray.o, safe_rcp(soa_ray.d), float4(0), float4(soa_ray.t_max), is_positive, node->bounds, &box_t);
+        auto element = node_stack.pop();
+        element.lane_mask &= alive_mask;
+        if (element.lane_mask == 0)
+        {
+            continue;
+        }
 
-        bool push_child[4] = {false, false, false, false};
-        uint32_t orders[4];
-        get_traversal_orders((*node), ray.d, orders);
+        auto node = &_nodes[element.node];
+        if (!is_single_lane(element.lane_mask) && none(narukami::intersect(packet.o_min, packet.o_max, packet.inv_d_min, packet.inv_d_max, max_t(packet, element.lane_mask), packet.is_positive, node->bounds)))
+        {
+            continue;
+        }
+
+        uint32_t child_masks[4] = {0, 0, 0, 0};
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (!is_active_lane(element.lane_mask, lane))
+            {
+                continue;
+            }
+            const RayPack &soa_ray = packet.soa_rays[lane];
+            auto box_hits = narukami::intersect(soa_ray.o, packet.inv_d[lane], float4(0), float4(soa_ray.t_max), packet.is_positive, node->bounds) & visible(_node_masks[element.node], rays[lane].mask);
+            for (uint32_t i = 0; i < 4; ++i)
+            {
+                if (box_hits[i])
+                {
+                    child_masks[i] |= (1 << lane);
+                }
+            }
+        }
 
         for (uint32_t i = 0; i < 4; ++i)
         {
-            uint32_t index = orders[i];
             STAT_INCREASE_COUNTER(ordered_traversal_denom, 1)
-            if (box_hits[index])
+            if (child_masks[i] == 0)
             {
-                STAT_INCREASE_COUNTER(ordered_traversal_num, 1)
-                if (is_leaf(node->childrens[index]))
+                continue;
+            }
+            STAT_INCREASE_COUNTER(ordered_traversal_num, 1)
+            if (is_leaf(node->childrens[i]))
+            {
+                auto offset = leaf_offset(node->childrens[i]);
+                auto num = leaf_num(node->childrens[i]);
+                for (uint32_t j = offset; j < offset + num && alive_mask != 0; ++j)
                 {
-                    auto offset = leaf_offset(node->childrens[index]);
-                    auto num = leaf_num(node->childrens[index]);
-                    for (uint32_t j = offset; j < offset + num; ++j)
+                    uint32_t instance_masks[4] = {0, 0, 0, 0};
+                    for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
                     {
+                        if (!is_active_lane(child_masks[i] & alive_mask, lane))
+                        {
+                            continue;
+                        }
+                        const RayPack &soa_ray = packet.soa_rays[lane];
+                        auto leaf_box_hits = narukami::intersect(soa_ray.o, packet.inv_d[lane], float4(0), float4(soa_ray.t_max), packet.is_positive, _compact_instances[j].bounds) & visible(_compact_instances[j].masks, rays[lane].mask);
+                        for (uint32_t k = 0; k < 4; ++k)
+                        {
+                            if (leaf_box_hits[k] && intersect_instance_obb(rays[lane], _compact_instances[j].offset + k))
+                            {
+                                instance_masks[k] |= (1 << lane);
+                            }
+                        }
+                    }
 
-                        auto leaf_box_hits = narukami::intersect(soa_ray.o, safe_rcp(soa_ray.d), float4(0), float4(soa_ray.t_max), is_positive, _compact_instances[j].bounds);
-
-                        for (uint32_t k = 0; k < 4; k++)
+                    for (uint32_t k = 0; k < 4; ++k)
+                    {
+                        auto instance_mask = instance_masks[k] & alive_mask;
+                        if (instance_mask == 0)
+                        {
+                            continue;
+                        }
+                        const auto &blas_instance = _instances[_compact_instances[j].offset + k];
+                        bool instance_occluded[SSE_WIDTH] = {false, false, false, false};
+                        blas_instance->occluded_packet(rays, instance_mask, instance_occluded);
+                        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
                         {
-                            if (leaf_box_hits[k])
+                            if (is_active_lane(instance_mask, lane) && instance_occluded[lane])
                             {
-                                auto instance_offset = _compact_instances[j].offset + k;
-                                auto blas_instance = _instances[instance_offset];
-                                bool is_hit = blas_instance->intersect(ray);
-                                if (is_hit)
-                                {
-                                    return true;
-                                }
+                                occluded[lane] = true;
+                                alive_mask &= ~(1 << lane);
                             }
                         }
                     }
                 }
-                else
-                {
-                    push_child[index] = true;
-                }
+            }
+            else
+            {
+                node_stack.push({node->childrens[i], child_masks[i], 0.0f});
+                STAT_INCREASE_MEMORY_COUNTER(traversal_stack_traffic, sizeof(PacketStackElement))
             }
         }
+    }
+}
 
-        for (uint32_t i = 0; i < 4; i++)
+std::vector<shared<BLASInstance>> flatten_instances(const std::vector<shared<BLASInstance>> &instances, const InstanceFlattenOptions &options)
+{
+    std::map<const BLAS *, uint32_t> reference_counts;
+    for (auto &&instance : instances)
+    {
+        reference_counts[instance->blas().get()]++;
+    }
+
+    std::vector<shared<BLASInstance>> flattened_instances;
+    //mask相同的instance可以放在同一个blas里
+    std::map<uint32_t, std::vector<shared<MeshTrianglePrimitive>>> merged_primitives;
+    for (auto &&instance : instances)
+    {
+        auto mesh_blas = std::dynamic_pointer_cast<MeshBLAS>(instance->blas());
+        if (instance->has_animation() || !mesh_blas)
         {
-            uint32_t index = orders[i];
-            if (push_child[index])
+            flattened_instances.push_back(instance);
+            continue;
+        }
+
+        auto primitive_num = mesh_blas->get_primitive_num();
+        bool is_small = primitive_num <= options.small_primitive_num;
+        bool is_unique = reference_counts[mesh_blas.get()] == 1 && primitive_num <= options.unique_primitive_num;
+        if (!is_small && !is_unique)
+        {
+            flattened_instances.push_back(instance);
+            continue;
+        }
+
+        auto object2world = std::make_shared<Transform>(instance->static_blas_to_world());
+        auto world2object = std::make_shared<Transform>(inverse(*object2world));
+        //同一个mesh的图元共用变换后的mesh
+        std::map<const Mesh *, shared<Mesh>> transformed_meshes;
+        auto &primitives = merged_primitives[instance->mask()];
+        for (auto &&primitive : mesh_blas->get_primitives())
+        {
+            auto &mesh = transformed_meshes[primitive->mesh().get()];
+            if (!mesh)
             {
-                node_stack.push(&_nodes[node->childrens[index]]);
+                mesh = transform_mesh(primitive->mesh(), object2world, world2object);
             }
+            primitives.push_back(shared<MeshTrianglePrimitive>(new MeshTrianglePrimitive(mesh, primitive->segment(), primitive->face())));
         }
+        STAT_INCREASE_COUNTER(flattened_instance_num, 1)
+    }
+
+    for (auto &&mp : merged_primitives)
+    {
+        auto blas = shared<MeshBLAS>(new MeshBLAS(mp.second));
+        flattened_instances.push_back(std::make_shared<BLASInstance>(std::make_shared<AnimatedTransform>(std::make_shared<Transform>()), blas, mp.first));
     }
-    return false;
+    return flattened_instances;
 }
 
-NARUKAMI_END
\ No newline at end of file
+NARUKAMI_END
@@ -32,6 +32,10 @@ SOFTWARE.
 #include <vector>
 #include <stack>
 #include <algorithm>
+#include <utility>
+#include <functional>
+#include <mutex>
+#include <atomic>
 NARUKAMI_BEGIN
 
 //MeshBLAS ONLY
@@ -39,10 +43,20 @@ STAT_COUNTER("accelerator/primitive num", primitive_count)
 STAT_MEMORY_COUNTER("accelerator/primitive memory", primitive_memory_cost)
 STAT_PERCENT("accelerator/blas SoA utilization ratio", SoA_utilization_ratio_num, SoA_utilization_ratio_denom)
 STAT_COUNTER("accelerator/intersect triangle num", intersect_triangle_num)
+STAT_MEMORY_COUNTER("accelerator/blas build peak memory", blas_build_peak_memory)
 //TLAS ONLY
 STAT_COUNTER("accelerator/blas instance num", blas_instance_num)
 // GENERL
 STAT_MEMORY_COUNTER("accelerator/QBVH node memory", QBVH_node_memory_cost)
+STAT_COUNTER("accelerator/stream ray num", stream_ray_num)
+STAT_COUNTER("accelerator/traversal stack on heap num", traversal_stack_spill_num)
+STAT_MEMORY_COUNTER("accelerator/traversal stack traffic", traversal_stack_traffic)
+STAT_PERCENT("accelerator/coherent ray packet ratio", coherent_packet_num, packet_num)
+STAT_PERCENT("accelerator/last occluder cache hit ratio", occluder_cache_hit_num, occluder_cache_test_num)
+STAT_PERCENT("accelerator/instance visits avoided by OBB test", obb_culled_instance_num, obb_tested_instance_num)
+STAT_COUNTER("accelerator/tlas to blas crossing num", blas_crossing_num)
+STAT_COUNTER("accelerator/flattened instance num", flattened_instance_num)
+STAT_PERCENT("accelerator/lazy blas built ratio", lazy_blas_built_num, lazy_blas_num)
 STAT_PERCENT("accelerator/ratio of travel QBVH's four subnode(25%:just one subnode is visited. 50%:two subnodes are  visited and so on.) ", ordered_traversal_num, ordered_traversal_denom)
 
 constexpr uint32_t BLAS_ELEMENT_NUM_PER_LEAF = 64;
@@ -51,7 +65,15 @@ constexpr int BLAS_SAH_BUCKET_NUM = 12;
 constexpr uint32_t ACCELERATOR_ELEMENT_NUM_PER_LEAF = 64;
 constexpr int ACCELERATOR_SAH_BUCKET_NUM = 12;
 
+//occluded没有给出遮挡元素时的值
+constexpr uint32_t INVALID_OCCLUDER = 0xFFFFFFFF;
+//遍历栈存放在栈上的元素数量,更深的树会把遍历栈放到堆上
 constexpr uint32_t MAX_LOCAL_STACK_DEEP = 64;
+//射线流按块排序,每块的射线数量,保证一块射线的数据可以放在cache中
+constexpr uint32_t RAY_STREAM_BIN_SIZE = 4096;
+//射线流中方向夹角的余弦和起点距离(相对于场景对角线)都满足条件的四条射线才组成packet
+constexpr float RAY_STREAM_COHERENT_COS = 0.95f;
+constexpr float RAY_STREAM_COHERENT_ORIGIN_RATIO = 0.05f;
 
 /**
  * 描述每个MeshPrimitive的额外信息
@@ -76,6 +98,21 @@ struct BVHBuildNode
     uint32_t offset, num;
 };
 
+/**
+ * 记录构建BVH时持有的内存,用来统计构建的峰值内存
+*/
+struct BuildMemoryTracker
+{
+    size_t current = 0;
+    size_t peak = 0;
+    void alloc(const size_t size)
+    {
+        current += size;
+        peak = max(peak, current);
+    }
+    void release(const size_t size) { current -= size; }
+};
+
 inline void init_leaf(BVHBuildNode *node, const uint32_t offset, const uint32_t num, const Bounds3f &bounds)
 {
     node->bounds = bounds;
@@ -112,19 +149,6 @@ struct QBVHCollapseNode
     uint32_t axis0, axis1, axis2;
 };
 
-/**
- * QBVH节点
- * 128 byte
-*/
-
-struct SSE_ALIGNAS QBVHNode
-{
-    Bounds3fPack bounds;
-    uint32_t childrens[4];
-    uint32_t axis0, axis1, axis2;
-    uint32_t depth;
-};
-
 inline uint32_t leaf(const uint32_t offset, const uint32_t num)
 {
     auto bits = 0x80000000;                      //set flag for leaf 1 bits
@@ -160,7 +184,115 @@ inline uint32_t leaf_num(const uint32_t bits)
     return ((bits)&0xF) + 1;
 }
 
-inline void init_QBVH_node(QBVHNode *node, uint32_t depth, const QBVHCollapseNode *cn)
+//64 bits的引用:1 bit标记,32 bits的offset,4 bits的(num-1);内部节点只存节点索引
+inline uint64_t wide_leaf(const uint32_t offset, const uint32_t num)
+{
+    auto bits = 0x8000000000000000ull;
+    bits = ((static_cast<uint64_t>(offset) << 4) | bits);
+    bits = (((num - 1) & 0XF) | bits);
+    return bits;
+}
+
+inline uint64_t wide_empty_leaf()
+{
+    return 0XFFFFFFFFFFFFFFFFull;
+}
+inline bool leaf_is_empty(const uint64_t bits)
+{
+    return bits == 0XFFFFFFFFFFFFFFFFull;
+}
+
+inline uint32_t interior(const uint64_t bits)
+{
+    return static_cast<uint32_t>(bits);
+}
+
+inline bool is_leaf(const uint64_t bits)
+{
+    return (bits >> 63) != 0;
+}
+inline uint32_t leaf_offset(const uint64_t bits)
+{
+    return static_cast<uint32_t>(bits >> 4);
+}
+inline uint32_t leaf_num(const uint64_t bits)
+{
+    return static_cast<uint32_t>(bits & 0xF) + 1;
+}
+
+/**
+ * QBVH节点中子节点引用的格式
+ * NarrowNodeReference:32 bits,叶子的offset只有27 bits,单个BLAS最多约1.3亿个图元包
+ * WideNodeReference:64 bits,offset和构建时的计数一样是32 bits,节点变大到144 byte
+ * 遍历栈中的节点索引是32 bits,所以两种格式的节点数都不能超过MAX_NODE_NUM
+*/
+struct NarrowNodeReference
+{
+    using Type = uint32_t;
+    static constexpr uint64_t MAX_LEAF_OFFSET = 1ull << 27;
+    static constexpr uint64_t MAX_NODE_NUM = 1ull << 31;
+    static Type leaf(const uint32_t offset, const uint32_t num) { return narukami::leaf(offset, num); }
+    static Type empty_leaf() { return narukami::empty_leaf(); }
+};
+
+struct WideNodeReference
+{
+    using Type = uint64_t;
+    static constexpr uint64_t MAX_LEAF_OFFSET = 1ull << 32;
+    static constexpr uint64_t MAX_NODE_NUM = 1ull << 32;
+    static Type leaf(const uint32_t offset, const uint32_t num) { return wide_leaf(offset, num); }
+    static Type empty_leaf() { return wide_empty_leaf(); }
+};
+
+//offset_num个图元包和node_num个节点能否用这种引用表示
+template <typename NodeReference>
+inline bool fits_node_reference(const uint64_t offset_num, const uint64_t node_num)
+{
+    return offset_num <= NodeReference::MAX_LEAF_OFFSET && node_num <= NodeReference::MAX_NODE_NUM;
+}
+
+/**
+ * QBVH节点
+ * NarrowNodeReference时128 byte
+*/
+template <typename NodeReference>
+struct SSE_ALIGNAS BasicQBVHNode
+{
+    using Reference = NodeReference;
+    Bounds3fPack bounds;
+    typename NodeReference::Type childrens[4];
+    uint32_t axis0, axis1, axis2;
+    uint32_t depth;
+};
+
+using QBVHNode = BasicQBVHNode<NarrowNodeReference>;
+using WideQBVHNode = BasicQBVHNode<WideNodeReference>;
+
+/**
+ * 引用放不下offset_num个元素包和node_num个节点时报错,nodes只留下一个空的根节点
+ * 返回false时调用者不能再flatten,否则会生成溢出的错误的树
+*/
+template <typename NodeReference>
+bool check_node_reference(const char *name, const uint64_t offset_num, const uint64_t node_num, std::vector<BasicQBVHNode<NodeReference>> &nodes)
+{
+    if (fits_node_reference<NodeReference>(offset_num, node_num))
+    {
+        return true;
+    }
+    NARUKAMI_ERROR("%s has %llu leaf offsets and %llu nodes, which overflow the node reference", name, static_cast<unsigned long long>(offset_num), static_cast<unsigned long long>(node_num))
+    Bounds3f empty_bounds[4];
+    nodes.resize(1);
+    nodes[0].bounds = Bounds3fPack(empty_bounds);
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+        nodes[0].childrens[i] = NodeReference::empty_leaf();
+    }
+    nodes[0].depth = 0;
+    return false;
+}
+
+template <typename NodeReference>
+inline void init_QBVH_node(BasicQBVHNode<NodeReference> *node, uint32_t depth, const QBVHCollapseNode *cn)
 {
     Bounds3f bounds[4];
 
@@ -196,31 +328,31 @@ inline void init_QBVH_node(QBVHNode *node, uint32_t depth, const QBVHCollapseNod
 
     if (is_leaf(cn->data[0]))
     {
-        node->childrens[0] = leaf(cn->data[0]->offset, cn->data[0]->num);
+        node->childrens[0] = NodeReference::leaf(cn->data[0]->offset, cn->data[0]->num);
     }
     if (cn->data[1] == nullptr)
     {
-        node->childrens[1] = empty_leaf();
+        node->childrens[1] = NodeReference::empty_leaf();
     }
     else if (is_leaf(cn->data[1]))
     {
-        node->childrens[1] = leaf(cn->data[1]->offset, cn->data[1]->num);
+        node->childrens[1] = NodeReference::leaf(cn->data[1]->offset, cn->data[1]->num);
     }
     if (cn->data[2] == nullptr)
     {
-        node->childrens[2] = empty_leaf();
+        node->childrens[2] = NodeReference::empty_leaf();
     }
     else if (is_leaf(cn->data[2]))
     {
-        node->childrens[2] = leaf(cn->data[2]->offset, cn->data[2]->num);
+        node->childrens[2] = NodeReference::leaf(cn->data[2]->offset, cn->data[2]->num);
     }
     if (cn->data[3] == nullptr)
     {
-        node->childrens[3] = empty_leaf();
+        node->childrens[3] = NodeReference::empty_leaf();
     }
     else if (is_leaf(cn->data[3]))
     {
-        node->childrens[3] = leaf(cn->data[3]->offset, cn->data[3]->num);
+        node->childrens[3] = NodeReference::leaf(cn->data[3]->offset, cn->data[3]->num);
     }
 
     node->depth = depth;
@@ -244,9 +376,331 @@ Bounds3f get_max_bounds(std::vector<T> &infos, uint32_t start, uint32_t end)
     return max_bounds;
 }
 
+/**
+ * 遍历栈的元素,8 byte
+ * 节点在_nodes中的索引以及进入节点时的距离
+*/
+struct NodeStackElement
+{
+    uint32_t node;
+    float t;
+};
+
+/**
+ * 四个子节点或者四个instance的mask
+ * 子节点的mask是子树中所有instance的mask的或
+*/
+struct SSE_ALIGNAS MaskPack
+{
+    uint32_t masks[4];
+};
+
+//和射线的mask相与不为0的通道为true
+inline bool4 visible(const MaskPack &mask, const uint32_t ray_mask)
+{
+    auto x = _mm_and_si128(_mm_load_si128(reinterpret_cast<const __m128i *>(mask.masks)), _mm_set1_epi32(static_cast<int>(ray_mask)));
+    return bool4(_mm_castsi128_ps(_mm_xor_si128(_mm_cmpeq_epi32(x, _mm_setzero_si128()), _mm_set1_epi32(-1))));
+}
+
+/**
+ * 单条射线的遍历上下文,进入BVH时只计算一次
+ * 预先算好inv_d和o*inv_d,box测试就只剩一次乘减
+ * near_plane/far_plane是每个轴上近平面和远平面在Bounds3fPack中的column
+*/
+struct TraversalRay
+{
+    Vector3fPack inv_d;
+    Vector3fPack o_inv_d;
+    int near_plane[3];
+    int far_plane[3];
+
+    TraversalRay() = default;
+    explicit TraversalRay(const Ray &ray)
+    {
+        Vector3f rcp_d = safe_rcp(ray.d);
+        inv_d = Vector3fPack(rcp_d);
+        o_inv_d = Vector3fPack(Vector3f(ray.o.x * rcp_d.x, ray.o.y * rcp_d.y, ray.o.z * rcp_d.z));
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            far_plane[axis] = ray.d[axis] >= 0 ? 1 : 0;
+            near_plane[axis] = 1 - far_plane[axis];
+        }
+    }
+};
+
+inline bool4 intersect(const TraversalRay &ray, const float t_max, const Bounds3fPack &box, float4 *t)
+{
+    float4 t_near = float4(0.0f);
+    float4 t_far = float4(t_max);
+    //x
+    t_near = max(msub(box.column(ray.near_plane[0]).xxxx, ray.inv_d.xxxx, ray.o_inv_d.xxxx), t_near);
+    t_far = min(msub(box.column(ray.far_plane[0]).xxxx, ray.inv_d.xxxx, ray.o_inv_d.xxxx), t_far);
+    //y
+    t_near = max(msub(box.column(ray.near_plane[1]).yyyy, ray.inv_d.yyyy, ray.o_inv_d.yyyy), t_near);
+    t_far = min(msub(box.column(ray.far_plane[1]).yyyy, ray.inv_d.yyyy, ray.o_inv_d.yyyy), t_far);
+    //z
+    t_near = max(msub(box.column(ray.near_plane[2]).zzzz, ray.inv_d.zzzz, ray.o_inv_d.zzzz), t_near);
+    t_far = min(msub(box.column(ray.far_plane[2]).zzzz, ray.inv_d.zzzz, ray.o_inv_d.zzzz), t_far);
+
+    (*t) = t_near;
+    return t_near <= t_far;
+}
+
+inline bool4 intersect(const TraversalRay &ray, const float t_max, const Bounds3fPack &box)
+{
+    float4 t;
+    return intersect(ray, t_max, box, &t);
+}
+
+/**
+ * 用SSE排序网络把命中的子节点按box_t从近到远排序,返回命中的子节点数
+ * box_t>=0,按整数比较和按浮点比较的结果相同,低两位换成子节点的序号
+ * 没有命中的子节点的key全为1,排在最后
+*/
+inline uint32_t sort_children(const float4 &box_t, const bool4 &box_hits, uint32_t orders[4])
+{
+    __m128i keys = _mm_or_si128(_mm_andnot_si128(_mm_set1_epi32(3), _mm_castps_si128(box_t)), _mm_set_epi32(3, 2, 1, 0));
+    keys = _mm_or_si128(keys, _mm_castps_si128(_mm_xor_ps(box_hits, SSE_MASK_TRUE)));
+
+    //(0,1) (2,3)
+    __m128i b = _mm_shuffle_epi32(keys, _MM_SHUFFLE(2, 3, 0, 1));
+    keys = _mm_blend_epi16(_mm_min_epu32(keys, b), _mm_max_epu32(keys, b), 0xCC);
+    //(0,2) (1,3)
+    b = _mm_shuffle_epi32(keys, _MM_SHUFFLE(1, 0, 3, 2));
+    keys = _mm_blend_epi16(_mm_min_epu32(keys, b), _mm_max_epu32(keys, b), 0xF0);
+    //(1,2)
+    b = _mm_shuffle_epi32(keys, _MM_SHUFFLE(3, 1, 2, 0));
+    keys = _mm_blend_epi16(_mm_min_epu32(keys, b), _mm_max_epu32(keys, b), 0x30);
+
+    SSE_ALIGNAS uint32_t sorted[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(sorted), keys);
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+        orders[i] = sorted[i] & 3;
+    }
+    return static_cast<uint32_t>(popcount(movemask(box_hits)));
+}
+
+//packet遍历中子节点的box_t取活跃射线里最近的一个,没有射线命中的子节点排在最后
+inline uint32_t sort_children(const float child_t[4], const uint32_t child_masks[4], uint32_t orders[4])
+{
+    return sort_children(float4(_mm_loadu_ps(child_t)), bool4(child_masks[0] != 0, child_masks[1] != 0, child_masks[2] != 0, child_masks[3] != 0), orders);
+}
+
+/**
+ * TLAS和CompactBLAS共用的最近交点遍历内核
+ * 子节点按box_t从近到远访问,剔除比当前最近交点更远的节点
+ * leaf(offset,num)处理叶子中的元素,并负责更新ray.t_max
+ * node_masks不为空时剔除mask和射线的mask不相交的子树
+*/
+template <typename Node, typename LeafFunction>
+void traverse_closest(const Node *nodes, const MaskPack *node_masks, const uint32_t stack_size, const TraversalRay &traversal_ray, const Ray &ray, LeafFunction &&leaf)
+{
+    InlineStack<NodeStackElement, MAX_LOCAL_STACK_DEEP> node_stack;
+    node_stack.reserve(stack_size);
+    STAT_INCREASE_COUNTER_CONDITION(traversal_stack_spill_num, 1, node_stack.spilled())
+    node_stack.push({0, 0.0f});
+
+    while (!node_stack.empty())
+    {
+        auto element = node_stack.pop();
+        if (element.t > ray.t_max)
+        {
+            continue;
+        }
+
+        auto node = &nodes[element.node];
+        float4 box_t;
+        auto box_hits = intersect(traversal_ray, ray.t_max, node->bounds, &box_t);
+        if (node_masks != nullptr)
+        {
+            box_hits = box_hits & visible(node_masks[element.node], ray.mask);
+        }
+        uint32_t orders[4];
+        auto hit_num = sort_children(box_t, box_hits, orders);
+        STAT_INCREASE_COUNTER(ordered_traversal_denom, 4)
+        STAT_INCREASE_COUNTER(ordered_traversal_num, hit_num)
+
+        uint32_t push_children[4];
+        uint32_t push_num = 0;
+        for (uint32_t i = 0; i < hit_num; ++i)
+        {
+            uint32_t index = orders[i];
+            //处理近处的叶子后t_max可能变小
+            if (box_t[index] > ray.t_max)
+            {
+                continue;
+            }
+            auto child = node->childrens[index];
+            if (is_leaf(child))
+            {
+                leaf(leaf_offset(child), leaf_num(child));
+            }
+            else
+            {
+                push_children[push_num++] = index;
+            }
+        }
+
+        //远的先入栈,近的先出栈
+        while (push_num > 0)
+        {
+            uint32_t index = push_children[--push_num];
+            node_stack.push({interior(node->childrens[index]), box_t[index]});
+            STAT_INCREASE_MEMORY_COUNTER(traversal_stack_traffic, sizeof(NodeStackElement))
+        }
+    }
+}
+
+/**
+ * 遮挡查询的遍历内核,找到任意一个交点就结束
+ * 不排序子节点,栈里只存节点索引
+ * leaf(offset,num)返回true表示射线被遮挡
+*/
+template <typename Node, typename LeafFunction>
+bool traverse_occluded(const Node *nodes, const MaskPack *node_masks, const uint32_t stack_size, const TraversalRay &traversal_ray, const Ray &ray, LeafFunction &&leaf)
+{
+    InlineStack<uint32_t, MAX_LOCAL_STACK_DEEP> node_stack;
+    node_stack.reserve(stack_size);
+    STAT_INCREASE_COUNTER_CONDITION(traversal_stack_spill_num, 1, node_stack.spilled())
+    node_stack.push(0);
+
+    while (!node_stack.empty())
+    {
+        auto node_index = node_stack.pop();
+        auto node = &nodes[node_index];
+        auto box_hits = intersect(traversal_ray, ray.t_max, node->bounds);
+        if (node_masks != nullptr)
+        {
+            box_hits = box_hits & visible(node_masks[node_index], ray.mask);
+        }
+        auto hit_bits = static_cast<uint32_t>(movemask(box_hits));
+        STAT_INCREASE_COUNTER(ordered_traversal_denom, 4)
+        STAT_INCREASE_COUNTER(ordered_traversal_num, popcount(hit_bits))
+
+        while (hit_bits != 0)
+        {
+            auto child = node->childrens[ctz(hit_bits)];
+            hit_bits &= hit_bits - 1;
+            if (is_leaf(child))
+            {
+                if (leaf(leaf_offset(child), leaf_num(child)))
+                {
+                    return true;
+                }
+            }
+            else
+            {
+                node_stack.push(interior(child));
+                STAT_INCREASE_MEMORY_COUNTER(traversal_stack_traffic, sizeof(uint32_t))
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * 由SSE_WIDTH条射线组成的packet
+ * 所有活跃射线的方向在同一个卦限时,可以用区间射线一次剔除整个packet
+*/
+struct RayPacket
+{
+    //每条射线广播到四个通道,用于和节点的四个box以及图元求交
+    RayPack soa_rays[SSE_WIDTH];
+    Vector3fPack inv_d[SSE_WIDTH];
+    int is_positive[3];
+    //区间射线
+    Point3f o_min, o_max;
+    Vector3f inv_d_min, inv_d_max;
+};
+
+struct PacketStackElement
+{
+    uint32_t node;
+    uint32_t lane_mask;
+    float t;
+};
+
+inline bool is_active_lane(const uint32_t lane_mask, const uint32_t lane)
+{
+    return (lane_mask >> lane) & 1;
+}
+
+inline uint32_t first_active_lane(const uint32_t lane_mask)
+{
+    return static_cast<uint32_t>(ctz(lane_mask));
+}
+
+inline bool is_single_lane(const uint32_t lane_mask)
+{
+    return (lane_mask & (lane_mask - 1)) == 0;
+}
+
+//活跃射线中最大的t_max
+inline float max_t(const RayPacket &packet, const uint32_t lane_mask)
+{
+    float t = 0.0f;
+    for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+    {
+        if (is_active_lane(lane_mask, lane))
+        {
+            t = max(t, packet.soa_rays[lane].t_max[0]);
+        }
+    }
+    return t;
+}
+
+//活跃射线的方向不在同一个卦限时返回false
+inline bool init_ray_packet(const Ray *rays, const uint32_t lane_mask, RayPacket *packet)
+{
+    auto first = first_active_lane(lane_mask);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        packet->is_positive[axis] = rays[first].d[axis] >= 0 ? 1 : 0;
+    }
+    packet->o_min = packet->o_max = rays[first].o;
+    packet->inv_d_min = packet->inv_d_max = safe_rcp(rays[first].d);
+
+    for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+    {
+        if (!is_active_lane(lane_mask, lane))
+        {
+            continue;
+        }
+        const Ray &ray = rays[lane];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if ((ray.d[axis] >= 0 ? 1 : 0) != packet->is_positive[axis])
+            {
+                return false;
+            }
+        }
+        packet->soa_rays[lane] = RayPack(ray);
+        packet->inv_d[lane] = safe_rcp(packet->soa_rays[lane].d);
+        Vector3f inv_d = safe_rcp(ray.d);
+        packet->o_min = min(packet->o_min, ray.o);
+        packet->o_max = max(packet->o_max, ray.o);
+        packet->inv_d_min = min(packet->inv_d_min, inv_d);
+        packet->inv_d_max = max(packet->inv_d_max, inv_d);
+    }
+    return true;
+}
+
+template <typename Node>
+inline void prefetch_node(const Node *node)
+{
+    //QBVHNode占两个cache line,WideQBVHNode占三个
+    for (size_t i = 0; i < sizeof(Node); i += 64)
+    {
+        _mm_prefetch(reinterpret_cast<const char *>(node) + i, _MM_HINT_T0);
+    }
+}
+
 QBVHCollapseNode *collapse(MemoryArena &arena, const BVHBuildNode *subtree_root, uint32_t *total);
-uint32_t flatten(std::vector<QBVHNode> &nodes, uint32_t depth, const QBVHCollapseNode *c_node, uint32_t *offset,uint32_t* max_depth);
-void get_traversal_orders(const QBVHNode &node, const Vector3f &dir, uint32_t orders[4]);
+template <typename NodeReference>
+uint32_t flatten(std::vector<BasicQBVHNode<NodeReference>> &nodes, uint32_t depth, const QBVHCollapseNode *c_node, uint32_t *offset,uint32_t* max_depth);
+template <typename NodeReference>
+void get_traversal_orders(const BasicQBVHNode<NodeReference> &node, const Vector3f &dir, uint32_t orders[4]);
 
 class ProgressReporter;
 
@@ -256,6 +710,35 @@ public:
     BLAS() {}
     virtual bool intersect(const Ray &ray, SurfaceInteraction *interaction) const = 0;
     virtual bool intersect(const Ray &ray) const = 0;
+    //packet求交,只处理lane_mask中的射线,rays的长度是SSE_WIDTH
+    virtual void intersect_packet(const Ray *rays, uint32_t lane_mask, SurfaceInteraction *interactions, bool *hits) const
+    {
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (is_active_lane(lane_mask, lane))
+            {
+                hits[lane] = intersect(rays[lane], &interactions[lane]);
+            }
+        }
+    }
+    //遮挡查询,occluder返回遮挡射线的元素,供occluded_by再次测试
+    virtual bool occluded(const Ray &ray, uint32_t *occluder) const
+    {
+        (*occluder) = INVALID_OCCLUDER;
+        return intersect(ray);
+    }
+    //只测试上一次遮挡射线的元素
+    virtual bool occluded_by(const Ray &ray, uint32_t occluder) const { return false; }
+    virtual void occluded_packet(const Ray *rays, uint32_t lane_mask, bool *occluded) const
+    {
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (is_active_lane(lane_mask, lane))
+            {
+                occluded[lane] = intersect(rays[lane]);
+            }
+        }
+    }
     virtual Bounds3f bounds() const = 0;
 };
 
@@ -268,18 +751,55 @@ struct BVHPrimitiveState
     BVHPrimitiveState() = default;
     BVHPrimitiveState(const shared<PrimitiveType> &p, uint32_t index) : prim_index(index), bounds(p->bounds()), centroid((p->bounds().min_point + p->bounds().max_point) * 0.5f) {}
 };
-template <class PrimitiveType, class CompactPrimitiveType>
-class CompactBLAS : public BLAS
+
+/**
+ * 原地把values重排成values[i] = 原来的values[states[i].prim_index],结果和复制一份有序数组相同
+ * 沿着置换的环移动元素,处理过的state的prim_index会被改写
+*/
+template <class T, class State>
+void permute_in_place(std::vector<T> &values, std::vector<State> &states)
+{
+    assert(values.size() == states.size());
+    constexpr uint32_t placed = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < states.size(); ++i)
+    {
+        if (states[i].prim_index == placed)
+        {
+            continue;
+        }
+        auto value = std::move(values[i]);
+        uint32_t j = i;
+        while (states[j].prim_index != i)
+        {
+            auto k = states[j].prim_index;
+            values[j] = std::move(values[k]);
+            states[j].prim_index = placed;
+            j = k;
+        }
+        values[j] = std::move(value);
+        states[j].prim_index = placed;
+    }
+}
+/**
+ * NodeReference决定节点中子节点引用的位数,超大的BLAS用WideNodeReference
+*/
+template <class PrimitiveType, class CompactPrimitiveType, class NodeReference = NarrowNodeReference>
+class CompactBLAS final : public BLAS
 {
 private:
+    using Node = BasicQBVHNode<NodeReference>;
     std::vector<shared<PrimitiveType>> _primitives;
     std::vector<CompactPrimitiveType> _compact_primitives;
     std::vector<uint32_t> _compact_primitive_offsets;
-    std::vector<QBVHNode> _nodes;
+    std::vector<Node> _nodes;
     uint32_t _max_depth;
     Bounds3f _bounds;
-    BVHBuildNode *build(MemoryArena &arena, uint32_t start, uint32_t end, std::vector<BVHPrimitiveState<PrimitiveType>> &primitive_states, std::vector<shared<PrimitiveType>> &ordered, uint32_t *total);
+    size_t _build_peak_memory;
+    //原地划分primitive_states,叶子是其中连续的一段,compact_total累计叶子打包后的图元包数量
+    BVHBuildNode *build(MemoryArena &arena, uint32_t start, uint32_t end, std::vector<BVHPrimitiveState<PrimitiveType>> &primitive_states, uint32_t *total, uint32_t *compact_total);
     void build_compact_primitives(BVHBuildNode *node);
+    //有序遍历每访问一层最多增加3个元素
+    uint32_t traversal_stack_size() const { return 3 * _max_depth + 1; }
     shared<PrimitiveType> get_primitive(int compact_primitive_id, int compact_primitive_offset) const
     {
         uint32_t offset = _compact_primitive_offsets[compact_primitive_id];
@@ -291,12 +811,20 @@ public:
     CompactBLAS(const std::vector<shared<PrimitiveType>> &primitives);
     bool intersect(const Ray &ray, SurfaceInteraction *interaction) const override;
     bool intersect(const Ray &ray) const override;
+    bool occluded(const Ray &ray, uint32_t *occluder) const override;
+    bool occluded_by(const Ray &ray, uint32_t occluder) const override;
+    //相干射线的packet遍历,方向不在同一个卦限时退化成单射线遍历
+    void intersect_packet(const Ray *rays, uint32_t lane_mask, SurfaceInteraction *interactions, bool *hits) const override;
+    void occluded_packet(const Ray *rays, uint32_t lane_mask, bool *occluded) const override;
     Bounds3f bounds() const override { return _bounds; }
 public:
     std::vector<shared<PrimitiveType>> get_primitives() const {return _primitives;}
-    std::vector<QBVHNode> get_nodes(uint32_t depth) const
+    size_t get_primitive_num() const { return _primitives.size(); }
+    //构建过程中BuildMemoryTracker记录的峰值
+    size_t get_build_peak_memory() const { return _build_peak_memory; }
+    std::vector<Node> get_nodes(uint32_t depth) const
     {
-        std::vector<QBVHNode> nodes;
+        std::vector<Node> nodes;
         for(auto&& n:_nodes)
         {
             if(n.depth == depth)
@@ -306,39 +834,61 @@ public:
     }
 };
 
-template <class PrimitiveType, class CompactPrimitiveType>
-CompactBLAS<PrimitiveType, CompactPrimitiveType>::CompactBLAS(const std::vector<shared<PrimitiveType>> &primitives) : _primitives(primitives)
+template <class PrimitiveType, class CompactPrimitiveType, class NodeReference>
+CompactBLAS<PrimitiveType, CompactPrimitiveType, NodeReference>::CompactBLAS(const std::vector<shared<PrimitiveType>> &primitives) : _primitives(primitives)
 {
     STAT_INCREASE_COUNTER(primitive_count, _primitives.size())
+    BuildMemoryTracker build_memory;
+    build_memory.alloc(sizeof(shared<PrimitiveType>) * _primitives.size());
     std::vector<BVHPrimitiveState<PrimitiveType>> primitive_states(_primitives.size());
+    build_memory.alloc(sizeof(BVHPrimitiveState<PrimitiveType>) * primitive_states.size());
     for (uint32_t i = 0; i < _primitives.size(); ++i)
     {
         primitive_states[i] = BVHPrimitiveState<PrimitiveType>(_primitives[i], i);
     }
     //获取所有Primitive的Bounds
     _bounds = get_max_bounds(primitive_states, 0, static_cast<uint32_t>(primitive_states.size()));
-    MemoryArena arena;
-    std::vector<shared<PrimitiveType>> _ordered_primitives;
+    MemoryArena build_arena;
     uint32_t total_build_node_num = 0;
+    uint32_t total_compact_num = 0;
     uint32_t total_collapse_node_num = 0;
     //1.build
-    auto build_root = build(arena, 0, static_cast<uint32_t>(primitive_states.size()), primitive_states, _ordered_primitives, &total_build_node_num);
-    _primitives = _ordered_primitives;
-    //2.collapse
-    auto collapse_root = collapse(arena, build_root, &total_collapse_node_num);
-    _nodes.resize(total_collapse_node_num);
-    //3.compact
+    auto build_root = build(build_arena, 0, static_cast<uint32_t>(primitive_states.size()), primitive_states, &total_build_node_num, &total_compact_num);
+    build_memory.alloc(build_arena.allocated_size());
+    //2.按照primitive_states的顺序原地重排_primitives,不再复制一份有序的shared_ptr
+    permute_in_place(_primitives, primitive_states);
+    build_memory.release(sizeof(BVHPrimitiveState<PrimitiveType>) * primitive_states.size());
+    std::vector<BVHPrimitiveState<PrimitiveType>>().swap(primitive_states);
+    //3.compact,容量一次分配好,叶子直接写进_compact_primitives
+    _compact_primitives.reserve(total_compact_num);
+    _compact_primitive_offsets.reserve(total_compact_num);
+    build_memory.alloc((sizeof(CompactPrimitiveType) + sizeof(uint32_t)) * total_compact_num);
     build_compact_primitives(build_root);
-    //4.flatten
+    //4.collapse
+    MemoryArena collapse_arena;
+    auto collapse_root = collapse(collapse_arena, build_root, &total_collapse_node_num);
+    build_memory.alloc(collapse_arena.allocated_size());
+    //引用放不下时只留下一个空的根节点,这时应该换成WideNodeReference
+    if (!check_node_reference("BLAS", _compact_primitives.size(), total_collapse_node_num, _nodes))
+    {
+        _max_depth = 0;
+        _build_peak_memory = build_memory.peak;
+        return;
+    }
+    //5.flatten
+    _nodes.resize(total_collapse_node_num);
+    build_memory.alloc(sizeof(Node) * total_collapse_node_num);
     uint32_t offset = 0;
     _max_depth = 0;
     flatten(_nodes, 0, collapse_root, &offset,&_max_depth);
     STAT_INCREASE_MEMORY_COUNTER(primitive_memory_cost, sizeof(Primitive) * _primitives.size())
-    STAT_INCREASE_MEMORY_COUNTER(QBVH_node_memory_cost, sizeof(QBVHNode) * total_collapse_node_num)
+    STAT_INCREASE_MEMORY_COUNTER(QBVH_node_memory_cost, sizeof(Node) * total_collapse_node_num)
+    _build_peak_memory = build_memory.peak;
+    STAT_MAX_MEMORY_COUNTER(blas_build_peak_memory, build_memory.peak)
 }
 
-template <class PrimitiveType, class CompactPrimitiveType>
-BVHBuildNode *CompactBLAS<PrimitiveType, CompactPrimitiveType>::build(MemoryArena &arena, uint32_t start, uint32_t end, std::vector<BVHPrimitiveState<PrimitiveType>> &primitive_states, std::vector<shared<PrimitiveType>> &ordered, uint32_t *total)
+template <class PrimitiveType, class CompactPrimitiveType, class NodeReference>
+BVHBuildNode *CompactBLAS<PrimitiveType, CompactPrimitiveType, NodeReference>::build(MemoryArena &arena, uint32_t start, uint32_t end, std::vector<BVHPrimitiveState<PrimitiveType>> &primitive_states, uint32_t *total, uint32_t *compact_total)
 {
     auto node = arena.alloc<BVHBuildNode>(1);
     (*total)++;
@@ -347,12 +897,8 @@ BVHBuildNode *CompactBLAS<PrimitiveType, CompactPrimitiveType>::build(MemoryAren
     uint32_t num = end - start;
     if (num <= BLAS_ELEMENT_NUM_PER_LEAF)
     {
-        uint32_t offset = static_cast<uint32_t>(ordered.size());
-        for (uint32_t i = start; i < end; i++)
-        {
-            ordered.push_back(_primitives[primitive_states[i].prim_index]);
-        }
-        init_leaf(node, offset, num, max_bounds);
+        (*compact_total) += (num - 1) / SSE_WIDTH + 1;
+        init_leaf(node, start, num, max_bounds);
     }
     else
     {
@@ -369,7 +915,7 @@ BVHBuildNode *CompactBLAS<PrimitiveType, CompactPrimitiveType>::build(MemoryAren
             //degenerate
             auto mid = (start + end) / 2;
             std::nth_element(&primitive_states[start], &primitive_states[mid], &primitive_states[end - 1] + 1, [dim](const BVHPrimitiveState<PrimitiveType> &p0, const BVHPrimitiveState<PrimitiveType> &p1) { return p0.centroid[dim] < p1.centroid[dim]; });
-            init_interior(node, build(arena, start, mid, primitive_states, ordered, total), build(arena, mid, end, primitive_states, ordered, total), dim);
+            init_interior(node, build(arena, start, mid, primitive_states, total, compact_total), build(arena, mid, end, primitive_states, total, compact_total), dim);
         }
         else
         {
@@ -421,13 +967,13 @@ BVHBuildNode *CompactBLAS<PrimitiveType, CompactPrimitiveType>::build(MemoryAren
                 return bucket_index <= min_cost_bucket_index;
             });
             auto mid = static_cast<uint32_t>(mid_ptr - &primitive_states[0]);
-            init_interior(node, build(arena, start, mid, primitive_states, ordered, total), build(arena, mid, end, primitive_states, ordered, total), dim);
+            init_interior(node, build(arena, start, mid, primitive_states, total, compact_total), build(arena, mid, end, primitive_states, total, compact_total), dim);
         }
     }
     return node;
 }
-template <class PrimitiveType, class CompactPrimitiveType>
-void CompactBLAS<PrimitiveType, CompactPrimitiveType>::build_compact_primitives(BVHBuildNode *node)
+template <class PrimitiveType, class CompactPrimitiveType, class NodeReference>
+void CompactBLAS<PrimitiveType, CompactPrimitiveType, NodeReference>::build_compact_primitives(BVHBuildNode *node)
 {
 
     if (is_leaf(node))
@@ -454,190 +1000,570 @@ void CompactBLAS<PrimitiveType, CompactPrimitiveType>::build_compact_primitives(
     }
 }
 
-template <class PrimitiveType, class CompactPrimitiveType>
-bool CompactBLAS<PrimitiveType, CompactPrimitiveType>::intersect(const Ray &ray, SurfaceInteraction *interaction) const
-{   
-   
-    LocalStack<std::pair<const QBVHNode*,float>,MAX_LOCAL_STACK_DEEP> node_stack;
-    //NodeStackElement arena.
+template <class PrimitiveType, class CompactPrimitiveType, class NodeReference>
+bool CompactBLAS<PrimitiveType, CompactPrimitiveType, NodeReference>::intersect(const Ray &ray, SurfaceInteraction *interaction) const
+{
     RayPack soa_ray(ray.o, ray.d, ray.t_max);
-    int is_positive[3] = {ray.d[0] >= 0 ? 1 : 0, ray.d[1] >= 0 ? 1 : 0, ray.d[2] >= 0 ? 1 : 0};
-    node_stack.push({&_nodes[0], 0.0f});
-    
+    TraversalRay traversal_ray(ray);
 
     bool has_hit = false;
-
-    uint32_t compact_offset;
     uint32_t compact_idx;
-    Point2f param_uv;
     PrimitiveHitPoint hit_point;
 
+    traverse_closest(&_nodes[0], nullptr, traversal_stack_size(), traversal_ray, ray, [&](uint32_t offset, uint32_t num) {
+        for (uint32_t j = offset; j < offset + num; ++j)
+        {
+            PrimitiveHitPoint temp_hit_point;
+            auto is_hit = narukami::intersect(soa_ray, _compact_primitives[j], &temp_hit_point);
+            STAT_INCREASE_COUNTER(intersect_triangle_num, 1)
+
+            if (is_hit && temp_hit_point.hit_t < ray.t_max)
+            {
+                has_hit = true;
+                //更新射线的t_max
+                soa_ray.t_max = float4(temp_hit_point.hit_t);
+                ray.t_max = temp_hit_point.hit_t;
+                compact_idx = j;
+                hit_point = temp_hit_point;
+            }
+        }
+    });
+
+    if (has_hit)
+    {
+        setup_interaction(_compact_primitives[compact_idx], get_primitive(compact_idx, hit_point.compact_offset), ray, hit_point, interaction);
+    }
+    return has_hit;
+}
+template <class PrimitiveType, class CompactPrimitiveType, class NodeReference>
+bool CompactBLAS<PrimitiveType, CompactPrimitiveType, NodeReference>::intersect(const Ray &ray) const
+{
+    uint32_t occluder;
+    return occluded(ray, &occluder);
+}
+
+template <class PrimitiveType, class CompactPrimitiveType, class NodeReference>
+bool CompactBLAS<PrimitiveType, CompactPrimitiveType, NodeReference>::occluded(const Ray &ray, uint32_t *occluder) const
+{
+    RayPack soa_ray(ray);
+    TraversalRay traversal_ray(ray);
+    return traverse_occluded(&_nodes[0], nullptr, traversal_stack_size(), traversal_ray, ray, [&](uint32_t offset, uint32_t num) {
+        for (uint32_t j = offset; j < offset + num; ++j)
+        {
+            if (narukami::intersect(soa_ray, _compact_primitives[j]))
+            {
+                (*occluder) = j;
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+template <class PrimitiveType, class CompactPrimitiveType, class NodeReference>
+bool CompactBLAS<PrimitiveType, CompactPrimitiveType, NodeReference>::occluded_by(const Ray &ray, uint32_t occluder) const
+{
+    if (occluder >= _compact_primitives.size())
+    {
+        return false;
+    }
+    RayPack soa_ray(ray);
+    return narukami::intersect(soa_ray, _compact_primitives[occluder]);
+}
+
+template <class PrimitiveType, class CompactPrimitiveType, class NodeReference>
+void CompactBLAS<PrimitiveType, CompactPrimitiveType, NodeReference>::intersect_packet(const Ray *rays, uint32_t lane_mask, SurfaceInteraction *interactions, bool *hits) const
+{
+    STAT_INCREASE_COUNTER(packet_num, 1)
+    RayPacket packet;
+    if (is_single_lane(lane_mask) || !init_ray_packet(rays, lane_mask, &packet))
+    {
+        BLAS::intersect_packet(rays, lane_mask, interactions, hits);
+        return;
+    }
+    STAT_INCREASE_COUNTER(coherent_packet_num, 1)
+
+    InlineStack<PacketStackElement, MAX_LOCAL_STACK_DEEP> node_stack;
+    node_stack.reserve(traversal_stack_size());
+    STAT_INCREASE_COUNTER_CONDITION(traversal_stack_spill_num, 1, node_stack.spilled())
+    node_stack.push({0, lane_mask, 0.0f});
+
+    bool has_hit[SSE_WIDTH] = {false, false, false, false};
+    uint32_t compact_idx[SSE_WIDTH];
+    PrimitiveHitPoint hit_points[SSE_WIDTH];
+
     while (!node_stack.empty())
     {
-        if (node_stack.top().second > ray.t_max)
+        auto element = node_stack.pop();
+        float packet_t_max = max_t(packet, element.lane_mask);
+        if (element.t > packet_t_max)
         {
-            node_stack.pop();
             continue;
         }
 
-        auto node = node_stack.pop().first;
-        float4 box_t;
-        auto box_hits = narukami::intersect(soa_ray.o, safe_rcp(soa_ray.d), float4(0), float4(soa_ray.t_max), is_positive, node->bounds, &box_t);
+        auto node = &_nodes[element.node];
+        //只剩一条射线时区间剔除没有意义
+        if (!is_single_lane(element.lane_mask) && none(narukami::intersect(packet.o_min, packet.o_max, packet.inv_d_min, packet.inv_d_max, packet_t_max, packet.is_positive, node->bounds)))
+        {
+            continue;
+        }
+
+        uint32_t child_masks[4] = {0, 0, 0, 0};
+        float child_t[4] = {INFINITE, INFINITE, INFINITE, INFINITE};
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (!is_active_lane(element.lane_mask, lane))
+            {
+                continue;
+            }
+            const RayPack &soa_ray = packet.soa_rays[lane];
+            float4 box_t;
+            auto box_hits = narukami::intersect(soa_ray.o, packet.inv_d[lane], float4(0), float4(soa_ray.t_max), packet.is_positive, node->bounds, &box_t);
+            for (uint32_t i = 0; i < 4; ++i)
+            {
+                if (box_hits[i] && box_t[i] < rays[lane].t_max)
+                {
+                    child_masks[i] |= (1 << lane);
+                    child_t[i] = min(child_t[i], box_t[i]);
+                }
+            }
+        }
 
-        bool push_child[4] = {false, false, false, false};
         uint32_t orders[4];
-        get_traversal_orders((*node), ray.d, orders);
+        auto hit_num = sort_children(child_t, child_masks, orders);
+        STAT_INCREASE_COUNTER(ordered_traversal_denom, 4)
+        STAT_INCREASE_COUNTER(ordered_traversal_num, hit_num)
 
-        for (uint32_t i = 0; i < 4; ++i)
+        uint32_t push_children[4];
+        uint32_t push_num = 0;
+        for (uint32_t i = 0; i < hit_num; ++i)
         {
             uint32_t index = orders[i];
-            STAT_INCREASE_COUNTER(ordered_traversal_denom, 1)
-            if (box_hits[index] && box_t[index] < ray.t_max)
+            //处理近处的叶子后t_max可能变小
+            if (child_t[index] > max_t(packet, child_masks[index]))
+            {
+                continue;
+            }
+            if (is_leaf(node->childrens[index]))
             {
-                STAT_INCREASE_COUNTER(ordered_traversal_num, 1)
-                if (is_leaf(node->childrens[index]))
+                auto offset = leaf_offset(node->childrens[index]);
+                auto num = leaf_num(node->childrens[index]);
+                for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
                 {
-                    auto offset = leaf_offset(node->childrens[index]);
-                    auto num = leaf_num(node->childrens[index]);
+                    if (!is_active_lane(child_masks[index], lane))
+                    {
+                        continue;
+                    }
+                    RayPack &soa_ray = packet.soa_rays[lane];
                     for (uint32_t j = offset; j < offset + num; ++j)
                     {
-                        auto is_hit = narukami::intersect(soa_ray,_compact_primitives[j],&hit_point);//narukami::intersect(soa_ray, _compact_primitives[j].triangle, &hit_t, &temp_param_uv, &temp_compact_offset);
+                        PrimitiveHitPoint hit_point;
+                        auto is_hit = narukami::intersect(soa_ray, _compact_primitives[j], &hit_point);
                         STAT_INCREASE_COUNTER(intersect_triangle_num, 1)
-
-                        if (is_hit && hit_point.hit_t < ray.t_max)
+                        if (is_hit && hit_point.hit_t < rays[lane].t_max)
                         {
-                            {
-                                has_hit = true;
-                            }
-                            //更新射线的t_max
-                            {
-                                soa_ray.t_max = float4(hit_point.hit_t);
-                                ray.t_max = hit_point.hit_t;
-                            }
-                            {
-                                compact_offset = hit_point.compact_offset;
-                                compact_idx = j;
-                                param_uv = hit_point.param_uv;
-                            }
+                            has_hit[lane] = true;
+                            soa_ray.t_max = float4(hit_point.hit_t);
+                            rays[lane].t_max = hit_point.hit_t;
+                            compact_idx[lane] = j;
+                            hit_points[lane] = hit_point;
                         }
                     }
                 }
-                else
-                {
-                    push_child[index] = true;
-                }
+            }
+            else
+            {
+                push_children[push_num++] = index;
             }
         }
 
-        for (uint32_t i = 0; i < 4; i++)
+        //远的先入栈,近的先出栈
+        while (push_num > 0)
         {
-            uint32_t index = orders[i];
-            if (push_child[index])
-            {
-               node_stack.push({&_nodes[node->childrens[index]], box_t[index]});
-            }
+            uint32_t index = push_children[--push_num];
+            node_stack.push({interior(node->childrens[index]), child_masks[index], child_t[index]});
+            STAT_INCREASE_MEMORY_COUNTER(traversal_stack_traffic, sizeof(PacketStackElement))
         }
     }
 
-    if (has_hit)
+    for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
     {
-        setup_interaction(_compact_primitives[compact_idx],get_primitive(compact_idx, compact_offset),ray,hit_point,interaction);
+        if (!is_active_lane(lane_mask, lane))
+        {
+            continue;
+        }
+        hits[lane] = has_hit[lane];
+        if (has_hit[lane])
+        {
+            setup_interaction(_compact_primitives[compact_idx[lane]], get_primitive(compact_idx[lane], hit_points[lane].compact_offset), rays[lane], hit_points[lane], &interactions[lane]);
+        }
     }
-    return has_hit;
 }
-template <class PrimitiveType, class CompactPrimitiveType>
-bool CompactBLAS<PrimitiveType, CompactPrimitiveType>::intersect(const Ray &ray) const
+
+template <class PrimitiveType, class CompactPrimitiveType, class NodeReference>
+void CompactBLAS<PrimitiveType, CompactPrimitiveType, NodeReference>::occluded_packet(const Ray *rays, uint32_t lane_mask, bool *occluded) const
 {
-    LocalStack<const QBVHNode*,MAX_LOCAL_STACK_DEEP> node_stack;
-    RayPack soa_ray(ray);
-    int is_positive[3] = {ray.d[0] >= 0 ? 1 : 0, ray.d[1] >= 0 ? 1 : 0, ray.d[2] >= 0 ? 1 : 0};
-    node_stack.push(&_nodes[0]);
-    while (!node_stack.empty())
+    STAT_INCREASE_COUNTER(packet_num, 1)
+    RayPacket packet;
+    if (is_single_lane(lane_mask) || !init_ray_packet(rays, lane_mask, &packet))
     {
-        auto node = node_stack.pop();
-        float4 box_t;
-        auto box_hits = narukami::intersect(soa_ray.o, safe_rcp(soa_ray.d), float4(0), float4(soa_ray.t_max), is_positive, node->bounds, &box_t);
+        BLAS::occluded_packet(rays, lane_mask, occluded);
+        return;
+    }
+    STAT_INCREASE_COUNTER(coherent_packet_num, 1)
 
-        bool push_child[4] = {false, false, false, false};
-        uint32_t orders[4];
-        get_traversal_orders((*node), ray.d, orders);
+    for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+    {
+        if (is_active_lane(lane_mask, lane))
+        {
+            occluded[lane] = false;
+        }
+    }
+
+    InlineStack<PacketStackElement, MAX_LOCAL_STACK_DEEP> node_stack;
+    node_stack.reserve(traversal_stack_size());
+    STAT_INCREASE_COUNTER_CONDITION(traversal_stack_spill_num, 1, node_stack.spilled())
+    node_stack.push({0, lane_mask, 0.0f});
+    //还没有被遮挡的射线
+    uint32_t alive_mask = lane_mask;
+
+    while (!node_stack.empty() && alive_mask != 0)
+    {
+        auto element = node_stack.pop();
+        element.lane_mask &= alive_mask;
+        if (element.lane_mask == 0)
+        {
+            continue;
+        }
+
+        auto node = &_nodes[element.node];
+        if (!is_single_lane(element.lane_mask) && none(narukami::intersect(packet.o_min, packet.o_max, packet.inv_d_min, packet.inv_d_max, max_t(packet, element.lane_mask), packet.is_positive, node->bounds)))
+        {
+            continue;
+        }
+
+        uint32_t child_masks[4] = {0, 0, 0, 0};
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (!is_active_lane(element.lane_mask, lane))
+            {
+                continue;
+            }
+            const RayPack &soa_ray = packet.soa_rays[lane];
+            auto box_hits = narukami::intersect(soa_ray.o, packet.inv_d[lane], float4(0), float4(soa_ray.t_max), packet.is_positive, node->bounds);
+            for (uint32_t i = 0; i < 4; ++i)
+            {
+                if (box_hits[i])
+                {
+                    child_masks[i] |= (1 << lane);
+                }
+            }
+        }
 
         for (uint32_t i = 0; i < 4; ++i)
         {
-            uint32_t index = orders[i];
             STAT_INCREASE_COUNTER(ordered_traversal_denom, 1)
-            if (box_hits[index])
+            if (child_masks[i] == 0)
+            {
+                continue;
+            }
+            STAT_INCREASE_COUNTER(ordered_traversal_num, 1)
+            if (is_leaf(node->childrens[i]))
             {
-                STAT_INCREASE_COUNTER(ordered_traversal_num, 1)
-                if (is_leaf(node->childrens[index]))
+                auto offset = leaf_offset(node->childrens[i]);
+                auto num = leaf_num(node->childrens[i]);
+                for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
                 {
-                    auto offset = leaf_offset(node->childrens[index]);
-                    auto num = leaf_num(node->childrens[index]);
+                    if (!is_active_lane(child_masks[i] & alive_mask, lane))
+                    {
+                        continue;
+                    }
                     for (uint32_t j = offset; j < offset + num; ++j)
                     {
-                        auto is_hit = narukami::intersect(soa_ray, _compact_primitives[j]);
-                        if (is_hit)
+                        if (narukami::intersect(packet.soa_rays[lane], _compact_primitives[j]))
                         {
-                            return true;
+                            occluded[lane] = true;
+                            alive_mask &= ~(1 << lane);
+                            break;
                         }
                     }
                 }
-                else
-                {
-                    push_child[index] = true;
-                }
+            }
+            else
+            {
+                node_stack.push({interior(node->childrens[i]), child_masks[i], 0.0f});
+                STAT_INCREASE_MEMORY_COUNTER(traversal_stack_traffic, sizeof(PacketStackElement))
             }
         }
+    }
+}
+
+using MeshBLAS = CompactBLAS<MeshTrianglePrimitive, CompactMeshTrianglePrimitive>;
+using HairBLAS = CompactBLAS<HairSegmentPrimitive, CompactHairSegmentPrimitive>;
+using WideMeshBLAS = CompactBLAS<MeshTrianglePrimitive, CompactMeshTrianglePrimitive, WideNodeReference>;
+
+template <typename... BLASTypes>
+struct BLASTypeList
+{
+};
+
+//instance直接调用这些类型的blas,不用经过虚函数;不在列表中的blas仍然走虚函数
+using RegisteredBLASTypes = BLASTypeList<MeshBLAS, HairBLAS, WideMeshBLAS>;
+
+/**
+ * type是blas在类型列表中的序号,等于列表长度时表示未注册的类型
+ * dispatch把blas转换成对应的具体类型再调用f,CompactBLAS是final的,所以f里的调用都是直接调用
+*/
+template <typename TypeList>
+struct BLASDispatcher;
+
+template <>
+struct BLASDispatcher<BLASTypeList<>>
+{
+    static uint32_t type_of(const BLAS *blas) { return 0; }
+
+    template <typename Function>
+    static auto dispatch(uint32_t type, const BLAS *blas, Function &&f) -> decltype(f(*blas))
+    {
+        return f(*blas);
+    }
+};
 
-        for (uint32_t i = 0; i < 4; i++)
+template <typename BLASType, typename... Rest>
+struct BLASDispatcher<BLASTypeList<BLASType, Rest...>>
+{
+    using Next = BLASDispatcher<BLASTypeList<Rest...>>;
+
+    static uint32_t type_of(const BLAS *blas) { return dynamic_cast<const BLASType *>(blas) != nullptr ? 0 : 1 + Next::type_of(blas); }
+
+    template <typename Function>
+    static auto dispatch(uint32_t type, const BLAS *blas, Function &&f) -> decltype(f(*blas))
+    {
+        if (type == 0)
         {
-            uint32_t index = orders[i];
-            if (push_child[index])
+            return f(static_cast<const BLASType &>(*blas));
+        }
+        return Next::dispatch(type - 1, blas, std::forward<Function>(f));
+    }
+};
+
+/**
+ * 第一次有射线到达时才构建的blas,TLAS用声明的bounds构建
+ * create只会被调用一次,其他同时到达的线程等待构建完成
+ * 声明的bounds必须包含create生成的blas的bounds
+*/
+class LazyBLAS final : public BLAS
+{
+private:
+    Bounds3f _bounds;
+    mutable std::function<shared<BLAS>()> _create;
+    mutable std::once_flag _build_flag;
+    mutable std::atomic<bool> _is_built;
+    mutable shared<BLAS> _blas;
+    mutable uint32_t _blas_type;
+
+    template <typename Function>
+    auto dispatch_blas(Function &&f) const -> decltype(f(std::declval<const BLAS &>()))
+    {
+        std::call_once(_build_flag, [this]() {
+            _blas = _create();
+            //声明的包围盒用于TLAS构建和剔除,比实际的小会漏掉交点
+            if (!inside(_blas->bounds(), _bounds))
             {
-               node_stack.push(&_nodes[node->childrens[index]]);
+                NARUKAMI_ERROR("the built BLAS is not inside the bounds declared to LazyBLAS")
             }
-        }
+            //释放create持有的数据
+            _create = nullptr;
+            _blas_type = BLASDispatcher<RegisteredBLASTypes>::type_of(_blas.get());
+            _is_built = true;
+            STAT_INCREASE_COUNTER(lazy_blas_built_num, 1)
+        });
+        return BLASDispatcher<RegisteredBLASTypes>::dispatch(_blas_type, _blas.get(), std::forward<Function>(f));
     }
-    return false;
-}
-class BLASInstance : public BLAS
+
+public:
+    LazyBLAS(const Bounds3f &bounds, const std::function<shared<BLAS>()> &create) : _bounds(bounds), _create(create), _is_built(false)
+    {
+        STAT_INCREASE_COUNTER(lazy_blas_num, 1)
+    }
+
+    bool is_built() const { return _is_built; }
+
+    bool intersect(const Ray &ray, SurfaceInteraction *interaction) const override
+    {
+        return dispatch_blas([&](const auto &blas) { return blas.intersect(ray, interaction); });
+    }
+
+    bool intersect(const Ray &ray) const override
+    {
+        return dispatch_blas([&](const auto &blas) { return blas.intersect(ray); });
+    }
+
+    void intersect_packet(const Ray *rays, uint32_t lane_mask, SurfaceInteraction *interactions, bool *hits) const override
+    {
+        dispatch_blas([&](const auto &blas) { blas.intersect_packet(rays, lane_mask, interactions, hits); });
+    }
+
+    bool occluded(const Ray &ray, uint32_t *occluder) const override
+    {
+        return dispatch_blas([&](const auto &blas) { return blas.occluded(ray, occluder); });
+    }
+
+    bool occluded_by(const Ray &ray, uint32_t occluder) const override
+    {
+        return dispatch_blas([&](const auto &blas) { return blas.occluded_by(ray, occluder); });
+    }
+
+    void occluded_packet(const Ray *rays, uint32_t lane_mask, bool *occluded) const override
+    {
+        dispatch_blas([&](const auto &blas) { blas.occluded_packet(rays, lane_mask, occluded); });
+    }
+
+    Bounds3f bounds() const override { return _bounds; }
+};
+
+class BLASInstance final : public BLAS
 {
 private:
     shared<BLAS> _blas;
+    uint32_t _blas_type;
     const shared<AnimatedTransform> _blas_to_world;
     Bounds3f _bounds;
+    uint32_t _mask;
+    //静态instance的变换在构造时算好,求交时不需要再插值和求逆
+    Transform _static_blas_to_world;
+    Transform _static_world_to_blas;
+    bool _has_oriented_bounds;
+
+    const Transform &blas_to_world(float time, Transform *b2w) const
+    {
+        if (!_blas_to_world->has_animation())
+        {
+            return _static_blas_to_world;
+        }
+        _blas_to_world->interpolate(time, b2w);
+        return *b2w;
+    }
+
+    const Transform &world_to_blas(float time, Transform *w2b) const
+    {
+        if (!_blas_to_world->has_animation())
+        {
+            return _static_world_to_blas;
+        }
+        Transform b2w;
+        _blas_to_world->interpolate(time, &b2w);
+        (*w2b) = inverse(b2w);
+        return *w2b;
+    }
+
+    template <typename Function>
+    auto dispatch_blas(Function &&f) const -> decltype(f(std::declval<const BLAS &>()))
+    {
+        return BLASDispatcher<RegisteredBLASTypes>::dispatch(_blas_type, _blas.get(), std::forward<Function>(f));
+    }
 
 public:
-    BLASInstance(const shared<AnimatedTransform> &blas_to_world, const shared<BLAS> &blas) : _blas_to_world(blas_to_world), _blas(blas) { _bounds = (*_blas_to_world)(_blas->bounds()); };
+    BLASInstance(const shared<AnimatedTransform> &blas_to_world, const shared<BLAS> &blas, uint32_t mask = RAY_MASK_ALL) : _blas_to_world(blas_to_world), _blas(blas), _mask(mask)
+    {
+        _blas_type = BLASDispatcher<RegisteredBLASTypes>::type_of(_blas.get());
+        _bounds = (*_blas_to_world)(_blas->bounds());
+        _blas_to_world->interpolate(0.0f, &_static_blas_to_world);
+        _static_world_to_blas = inverse(_static_blas_to_world);
+        _has_oriented_bounds = !_blas_to_world->has_animation() && has_rotation(_static_blas_to_world.mat);
+    };
+
+    //静态并且带旋转的instance,blas空间的box经过变换后比world空间的AABB紧
+    bool has_oriented_bounds() const { return _has_oriented_bounds; }
+    const Transform &static_world_to_blas() const { return _static_world_to_blas; }
+    Bounds3f blas_bounds() const { return _blas->bounds(); }
+
+    //和射线的mask相与为0时射线看不到这个instance,例如去掉RAY_MASK_SHADOW就不投射阴影
+    uint32_t mask() const { return _mask; }
+    const shared<BLAS> &blas() const { return _blas; }
+    bool has_animation() const { return _blas_to_world->has_animation(); }
+    const Transform &static_blas_to_world() const { return _static_blas_to_world; }
 
     bool intersect(const Ray &ray, SurfaceInteraction *interaction) const override
     {
-        Transform w2b;
-        Transform b2w;
+        Transform w2b_storage;
+        auto blas_ray = world_to_blas(ray.time, &w2b_storage)(ray);
+        bool has_hit = dispatch_blas([&](const auto &blas) { return blas.intersect(blas_ray, interaction); });
+        //没有交点时interaction保存的是之前instance的结果,不能再变换
+        if (has_hit)
         {
-            _blas_to_world->interpolate(ray.time, &b2w);
-            w2b = inverse(b2w);
+            Transform b2w_storage;
+            (*interaction) = blas_to_world(ray.time, &b2w_storage)(*interaction);
+            ray.t_max = blas_ray.t_max;
         }
-
-        auto blas_ray = w2b(ray);
-        bool has_hit = _blas->intersect(blas_ray, interaction);
-        (*interaction) = b2w(*interaction);
-        ray.t_max = blas_ray.t_max;
         return has_hit;
     }
 
     bool intersect(const Ray &ray) const override
     {
-        Transform w2b;
-        Transform b2w;
+        uint32_t occluder;
+        return occluded(ray, &occluder);
+    }
+
+    bool occluded(const Ray &ray, uint32_t *occluder) const override
+    {
+        Transform w2b_storage;
+        auto blas_ray = world_to_blas(ray.time, &w2b_storage)(ray);
+        return dispatch_blas([&](const auto &blas) { return blas.occluded(blas_ray, occluder); });
+    }
+
+    bool occluded_by(const Ray &ray, uint32_t occluder) const override
+    {
+        Transform w2b_storage;
+        auto blas_ray = world_to_blas(ray.time, &w2b_storage)(ray);
+        return dispatch_blas([&](const auto &blas) { return blas.occluded_by(blas_ray, occluder); });
+    }
+
+    void intersect_packet(const Ray *rays, uint32_t lane_mask, SurfaceInteraction *interactions, bool *hits) const override
+    {
+        //运动的instance每条射线的时间不同,变换也不同
+        if (_blas_to_world->has_animation())
         {
-            _blas_to_world->interpolate(ray.time, &b2w);
-            w2b = inverse(b2w);
+            BLAS::intersect_packet(rays, lane_mask, interactions, hits);
+            return;
         }
-        auto blas_ray = w2b(ray);
-        bool has_hit = _blas->intersect(blas_ray);
-        ray.t_max = blas_ray.t_max;
-        return has_hit;
+
+        Ray blas_rays[SSE_WIDTH];
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (is_active_lane(lane_mask, lane))
+            {
+                blas_rays[lane] = _static_world_to_blas(rays[lane]);
+            }
+        }
+        dispatch_blas([&](const auto &blas) { blas.intersect_packet(blas_rays, lane_mask, interactions, hits); });
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (is_active_lane(lane_mask, lane) && hits[lane])
+            {
+                interactions[lane] = _static_blas_to_world(interactions[lane]);
+                rays[lane].t_max = blas_rays[lane].t_max;
+            }
+        }
+    }
+
+    void occluded_packet(const Ray *rays, uint32_t lane_mask, bool *occluded) const override
+    {
+        if (_blas_to_world->has_animation())
+        {
+            BLAS::occluded_packet(rays, lane_mask, occluded);
+            return;
+        }
+
+        Ray blas_rays[SSE_WIDTH];
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (is_active_lane(lane_mask, lane))
+            {
+                blas_rays[lane] = _static_world_to_blas(rays[lane]);
+            }
+        }
+        dispatch_blas([&](const auto &blas) { blas.occluded_packet(blas_rays, lane_mask, occluded); });
     }
     Bounds3f bounds() const override { return _bounds; }
 };
@@ -651,12 +1577,44 @@ struct BLASInstanceInfo
     BLASInstanceInfo(const shared<BLASInstance> &instance, uint32_t index) : instance_index(index), bounds(instance->bounds()), centroid((instance->bounds().min_point + instance->bounds().max_point) * 0.5f) {}
 };
 
+/**
+ * instance在blas空间的box以及world到blas的仿射变换
+ * enabled为false时只用world空间的AABB
+*/
+struct SSE_ALIGNAS InstanceOBB
+{
+    Matrix4x4 world_to_blas;
+    Bounds3f bounds;
+    bool enabled;
+};
+
+inline bool intersect(const Ray &ray, const InstanceOBB &obb)
+{
+    auto o = obb.world_to_blas * ray.o;
+    auto d = obb.world_to_blas * ray.d;
+    Vector3f inv_d = safe_rcp(d);
+    int is_positive[3] = {d.x >= 0 ? 1 : 0, d.y >= 0 ? 1 : 0, d.z >= 0 ? 1 : 0};
+    return intersect(o, inv_d, 0.0f, ray.t_max, is_positive, obb.bounds);
+}
+
 struct CompactBLASInstance
 {
     Bounds3fPack bounds;
+    MaskPack masks;
     uint32_t offset;
 };
 
+/**
+ * 射线流求交的结果
+ * 没有交点时t为INFINITE
+*/
+struct HitRecord
+{
+    float t;
+    Normal3f n;
+    Point2f uv;
+};
+
 class TLAS
 {
 private:
@@ -665,15 +1623,61 @@ private:
     std::vector<QBVHNode> _nodes;
     uint32_t _max_depth;
     Bounds3f _bounds;
+    //每个TLAS唯一的id,用来判断线程的遮挡缓存是否属于这个TLAS
+    uint64_t _id;
+    //_nodes中每个节点的四个子树的mask
+    std::vector<MaskPack> _node_masks;
+    //和_instances一一对应
+    std::vector<InstanceOBB> _instance_obbs;
 
     BVHBuildNode *build(MemoryArena &arena, uint32_t start, uint32_t end, std::vector<BLASInstanceInfo> &instance_infos, std::vector<shared<BLASInstance>> &ordered, uint32_t *total);
     void build_soa_instance_info(BVHBuildNode *node);
+    uint32_t build_node_masks(uint32_t node);
+    //AABB命中以后再用OBB测试一次,可以跳过很多旋转后的细长物体
+    //返回true时射线会进入instance的blas,顺便统计TLAS到BLAS的切换次数
+    bool intersect_instance_obb(const Ray &ray, uint32_t instance) const
+    {
+        const auto &obb = _instance_obbs[instance];
+        bool hit = true;
+        if (obb.enabled)
+        {
+            STAT_INCREASE_COUNTER(obb_tested_instance_num, 1)
+            hit = narukami::intersect(ray, obb);
+            STAT_INCREASE_COUNTER_CONDITION(obb_culled_instance_num, 1, !hit)
+        }
+        STAT_INCREASE_COUNTER_CONDITION(blas_crossing_num, 1, hit)
+        return hit;
+    }
+    uint32_t traversal_stack_size() const { return 3 * _max_depth + 1; }
 
 public:
     TLAS(const std::vector<shared<BLASInstance>> &instance);
     bool intersect(const Ray &ray, SurfaceInteraction *interaction) const;
     bool intersect(const Ray &ray) const;
+    //每RAY_STREAM_BIN_SIZE条射线按照方向的卦限和起点的morton code排序,相邻的四条射线组成packet求交,共享节点的访问
+    void intersect_stream(const RayStream &rays, HitRecord *hits) const;
+    void occluded_stream(const RayStream &rays, bool *occluded) const;
+    //SSE_WIDTH条相干射线的packet求交,只处理lane_mask中的射线
+    void intersect_packet(const Ray *rays, uint32_t lane_mask, SurfaceInteraction *interactions, bool *hits) const;
+    void occluded_packet(const Ray *rays, uint32_t lane_mask, bool *occluded) const;
     Bounds3f bounds() const { return _bounds; }
 };
 
+/**
+ * 展开instance的阈值
+ * small_primitive_num:图元数不超过它的静态instance总是展开,即使blas被多个instance共用
+ * unique_primitive_num:blas只被一个instance引用时,图元数不超过它就展开
+*/
+struct InstanceFlattenOptions
+{
+    uint32_t small_primitive_num = 64;
+    uint32_t unique_primitive_num = 1 << 20;
+};
+
+/**
+ * 把适合展开的静态三角形instance的顶点变换到world空间,合并成一个单位变换的blas
+ * 同mask的instance合并在一起;运动的instance、非三角形的blas和被大量复用的blas保持不变
+*/
+std::vector<shared<BLASInstance>> flatten_instances(const std::vector<shared<BLASInstance>> &instances, const InstanceFlattenOptions &options = InstanceFlattenOptions());
+
 NARUKAMI_END
@@ -3,10 +3,11 @@
 NARUKAMI_BEGIN
 #pragma warning(disable:4305) //double 到 const float的截断警告
 #pragma warning(disable:4244) //double 到  float的截断警告
+//CIE 1931匹配函数和标准光源,360nm到830nm每5nm一个样本
 #define CIE_LAMBDA_MIN 360.0
 #define CIE_LAMBDA_MAX 830.0
 #define CIE_SAMPLES    95
-const float cie_lambda[CIE_SAMPLES] = 
+constexpr float cie_lambda[CIE_SAMPLES] = 
 {
   360.0,365.0,370.0,375.0,
   380.0,385.0,390.0,395.0,
@@ -33,7 +34,7 @@ const float cie_lambda[CIE_SAMPLES] =
   800.0,805.0,810.0,815.0,
   820.0,825.0,830.0
 };
-const float cie_x[CIE_SAMPLES] = {
+constexpr float cie_x[CIE_SAMPLES] = {
     0.000129900000, 0.000232100000, 0.000414900000, 0.000741600000,
     0.001368000000, 0.002236000000, 0.004243000000, 0.007650000000,
     0.014310000000, 0.023190000000, 0.043510000000, 0.077630000000,
@@ -59,7 +60,7 @@ const float cie_x[CIE_SAMPLES] = {
     0.000010253980, 0.000007221456, 0.000005085868, 0.000003581652,
     0.000002522525, 0.000001776509, 0.000001251141 };
 
-const float cie_y[CIE_SAMPLES] = {
+constexpr float cie_y[CIE_SAMPLES] = {
     0.000003917000, 0.000006965000, 0.000012390000, 0.000022020000,
     0.000039000000, 0.000064000000, 0.000120000000, 0.000217000000,
     0.000396000000, 0.000640000000, 0.001210000000, 0.002180000000,
@@ -86,7 +87,7 @@ const float cie_y[CIE_SAMPLES] = {
     0.000000910930, 0.000000641530, 0.000000451810
 };
 
-const float cie_z[CIE_SAMPLES] = {
+constexpr float cie_z[CIE_SAMPLES] = {
     0.000606100000, 0.001086000000, 0.001946000000, 0.003486000000,
     0.006450001000, 0.010549990000, 0.020050010000, 0.036210000000,
     0.067850010000, 0.110200000000, 0.207400000000, 0.371300000000,
@@ -113,6 +114,74 @@ const float cie_z[CIE_SAMPLES] = {
     0.000000000000, 0.000000000000, 0.000000000000
 };
 
+/**
+ * 把5nm间隔的CIE匹配函数(分段线性)平均到[LambdaMin,LambdaMax)内SampleCount个等宽的区间中
+ * 区间和cie_lambda一致时直接使用表中的值,保证默认95个样本的结果不变
+ * 所有的表都在编译期计算
+*/
+template <int SampleCount, int LambdaMin, int LambdaMax>
+struct CIEMatchingFunctions
+{
+    float x[SampleCount];
+    float y[SampleCount];
+    float z[SampleCount];
+};
+
+//表在[lambda0,lambda1]上的平均值,超出表范围的部分使用端点值
+constexpr float cie_table_average(const float *table, float lambda0, float lambda1)
+{
+    float sum = 0.0f;
+    if (lambda0 < CIE_LAMBDA_MIN)
+    {
+        sum += table[0] * (static_cast<float>(CIE_LAMBDA_MIN) - lambda0);
+    }
+    if (lambda1 > CIE_LAMBDA_MAX)
+    {
+        sum += table[CIE_SAMPLES - 1] * (lambda1 - static_cast<float>(CIE_LAMBDA_MAX));
+    }
+    for (int i = 0; i + 1 < CIE_SAMPLES; ++i)
+    {
+        float a = lambda0 > cie_lambda[i] ? lambda0 : cie_lambda[i];
+        float b = lambda1 < cie_lambda[i + 1] ? lambda1 : cie_lambda[i + 1];
+        if (a < b)
+        {
+            float width = cie_lambda[i + 1] - cie_lambda[i];
+            float va = table[i] + (table[i + 1] - table[i]) * (a - cie_lambda[i]) / width;
+            float vb = table[i] + (table[i + 1] - table[i]) * (b - cie_lambda[i]) / width;
+            sum += (va + vb) * 0.5f * (b - a);
+        }
+    }
+    return sum / (lambda1 - lambda0);
+}
+
+template <int SampleCount, int LambdaMin, int LambdaMax>
+constexpr CIEMatchingFunctions<SampleCount, LambdaMin, LambdaMax> make_cie_matching_functions()
+{
+    CIEMatchingFunctions<SampleCount, LambdaMin, LambdaMax> functions{};
+    constexpr bool same_as_table = SampleCount == CIE_SAMPLES && LambdaMin == CIE_LAMBDA_MIN && LambdaMax == CIE_LAMBDA_MAX;
+    for (int i = 0; i < SampleCount; ++i)
+    {
+        if (same_as_table)
+        {
+            functions.x[i] = cie_x[i];
+            functions.y[i] = cie_y[i];
+            functions.z[i] = cie_z[i];
+        }
+        else
+        {
+            float lambda0 = LambdaMin + (LambdaMax - LambdaMin) * static_cast<float>(i) / SampleCount;
+            float lambda1 = LambdaMin + (LambdaMax - LambdaMin) * static_cast<float>(i + 1) / SampleCount;
+            functions.x[i] = cie_table_average(cie_x, lambda0, lambda1);
+            functions.y[i] = cie_table_average(cie_y, lambda0, lambda1);
+            functions.z[i] = cie_table_average(cie_z, lambda0, lambda1);
+        }
+    }
+    return functions;
+}
+
+template <int SampleCount, int LambdaMin, int LambdaMax>
+constexpr CIEMatchingFunctions<SampleCount, LambdaMin, LambdaMax> cie_matching_functions = make_cie_matching_functions<SampleCount, LambdaMin, LambdaMax>();
+
 #define N(x) (x / 10566.864005283874576)
 
 const float cie_d65[CIE_SAMPLES] = {
@@ -25,38 +25,87 @@ SOFTWARE.
 #include "core/memory.h"
 NARUKAMI_BEGIN
 
-FilmTile::FilmTile(const Bounds2i &pixel_bounds, const float *filter_lut, const float filter_radius) : _pixel_bounds(pixel_bounds), _filter_lut(filter_lut), _filter_radius(filter_radius), _inv_filter_radius(1.0f / filter_radius)
+//对pos的filter范围内(裁剪到bounds)的每个像素调用f(pixel, filter_weight)
+template <typename F>
+static inline void for_each_filter_pixel(const Point2f &pos, const Bounds2i &bounds, const float *filter_lut, const float filter_radius, const float inv_filter_radius, F &&f)
 {
-    _tile_pixels = std::unique_ptr<TilePixel[]>(new TilePixel[area(_pixel_bounds)]);
-}
-
-void FilmTile::add_sample(const Point2f &pos, const Spectrum &l, const float weight) const
-{
-
     //calculate bounds
     auto dp = pos - Vector2f(0.5f, 0.5f);
-    Point2i p0 = static_cast<Point2i>(ceil(dp - _filter_radius));
-    Point2i p1 = static_cast<Point2i>(floor(dp + _filter_radius)) + Point2i(1, 1);
+    Point2i p0 = static_cast<Point2i>(ceil(dp - filter_radius));
+    Point2i p1 = static_cast<Point2i>(floor(dp + filter_radius)) + Point2i(1, 1);
 
-    p0 = max(p0, _pixel_bounds.min_point);
-    p1 = min(p1, _pixel_bounds.max_point);
+    p0 = max(p0, bounds.min_point);
+    p1 = min(p1, bounds.max_point);
     for (int x = p0.x; x < p1.x; ++x)
     {
-        int idx_x = min(static_cast<int>(abs(x - dp.x) * _inv_filter_radius * NARUKAMI_FILM_FILTER_LUT_WIDTH), NARUKAMI_FILM_FILTER_LUT_WIDTH - 1);
-        float filter_weight_x = _filter_lut[idx_x];
+        int idx_x = min(static_cast<int>(abs(x - dp.x) * inv_filter_radius * NARUKAMI_FILM_FILTER_LUT_WIDTH), NARUKAMI_FILM_FILTER_LUT_WIDTH - 1);
+        float filter_weight_x = filter_lut[idx_x];
         for (int y = p0.y; y < p1.y; ++y)
         {
-            int idx_y = min(static_cast<int>(abs(y - dp.y) * _inv_filter_radius * NARUKAMI_FILM_FILTER_LUT_WIDTH), NARUKAMI_FILM_FILTER_LUT_WIDTH - 1);
-            float filter_weight = _filter_lut[idx_y] * filter_weight_x;
-            TilePixel &pixel = get_tile_pixel(Point2i(x, y));
-            {
-                pixel.intensity += l * weight * filter_weight;
-            }
-            pixel.weight += filter_weight;
+            int idx_y = min(static_cast<int>(abs(y - dp.y) * inv_filter_radius * NARUKAMI_FILM_FILTER_LUT_WIDTH), NARUKAMI_FILM_FILTER_LUT_WIDTH - 1);
+            f(Point2i(x, y), filter_lut[idx_y] * filter_weight_x);
         }
     }
 }
 
+FilmTile::FilmTile(const Bounds2i &pixel_bounds, const float *filter_lut, const float filter_radius, const FilmMode mode) : _pixel_bounds(pixel_bounds), _filter_lut(filter_lut), _filter_radius(filter_radius), _inv_filter_radius(1.0f / filter_radius), _mode(mode)
+{
+    if (_mode == FilmMode::XYZ)
+    {
+        _tile_xyz_pixels = std::unique_ptr<XYZPixel[]>(new XYZPixel[area(_pixel_bounds)]);
+    }
+    else
+    {
+        _tile_pixels = std::unique_ptr<TilePixel[]>(new TilePixel[area(_pixel_bounds)]);
+    }
+}
+
+void FilmTile::add_xyz_sample(const Point2f &pos, const float xyz[3]) const
+{
+    for_each_filter_pixel(pos, _pixel_bounds, _filter_lut, _filter_radius, _inv_filter_radius, [&](const Point2i &p, const float filter_weight) {
+        XYZPixel &pixel = get_tile_xyz_pixel(p);
+        pixel.xyz[0] += xyz[0] * filter_weight;
+        pixel.xyz[1] += xyz[1] * filter_weight;
+        pixel.xyz[2] += xyz[2] * filter_weight;
+        pixel.weight += filter_weight;
+    });
+}
+
+void FilmTile::add_sample(const Point2f &pos, const Spectrum &l, const float weight) const
+{
+    if (_mode == FilmMode::XYZ)
+    {
+        //每个样本只投影一次,之后每个像素只需要累加3个float
+        float xyz[3];
+        from_spd_to_xyz(l * weight, xyz);
+        add_xyz_sample(pos, xyz);
+    }
+    else
+    {
+        for_each_filter_pixel(pos, _pixel_bounds, _filter_lut, _filter_radius, _inv_filter_radius, [&](const Point2i &p, const float filter_weight) {
+            TilePixel &pixel = get_tile_pixel(p);
+            madd(pixel.intensity, l, weight * filter_weight);
+            pixel.weight += filter_weight;
+        });
+    }
+}
+
+void FilmTile::add_sample(const Point2f &pos, const SampledSpectrum &l, const SampledWavelengths &wavelengths, const float weight) const
+{
+    if (_mode == FilmMode::XYZ)
+    {
+        float xyz[3];
+        from_sampled_spectrum_to_xyz(l * weight, wavelengths, xyz);
+        add_xyz_sample(pos, xyz);
+    }
+    else
+    {
+        Spectrum spd;
+        from_sampled_spectrum_to_spd(l, wavelengths, spd);
+        add_sample(pos, spd, weight);
+    }
+}
+
 TilePixel &FilmTile::get_tile_pixel(const Point2i &p) const
 {
     assert(inside_exclusive(p, _pixel_bounds));
@@ -66,12 +115,28 @@ TilePixel &FilmTile::get_tile_pixel(const Point2i &p) const
     return _tile_pixels[y * width + x];
 }
 
-Film::Film(const Point2i &resolution, const Bounds2f &cropped_rect, float const filter_radius, const float gaussian_alpha) : resolution(resolution), _filter_radius(filter_radius), _inv_filter_radius(1.0f / filter_radius), _gaussian_alpha(gaussian_alpha), _gaussian_exp(exp(-gaussian_alpha * filter_radius * filter_radius))
+XYZPixel &FilmTile::get_tile_xyz_pixel(const Point2i &p) const
+{
+    assert(inside_exclusive(p, _pixel_bounds));
+    auto width = _pixel_bounds[1].x - _pixel_bounds[0].x;
+    auto x = p.x - _pixel_bounds[0].x;
+    auto y = p.y - _pixel_bounds[0].y;
+    return _tile_xyz_pixels[y * width + x];
+}
+
+Film::Film(const Point2i &resolution, const Bounds2f &cropped_rect, float const filter_radius, const float gaussian_alpha, const FilmMode mode) : resolution(resolution), _filter_radius(filter_radius), _inv_filter_radius(1.0f / filter_radius), _gaussian_alpha(gaussian_alpha), _gaussian_exp(exp(-gaussian_alpha * filter_radius * filter_radius)), _mode(mode)
 {
     Point2i bounds_min_p = Point2i((int)ceil(resolution.x * cropped_rect.min_point.x), (int)ceil(resolution.y * cropped_rect.min_point.y));
     Point2i bounds_max_p = Point2i((int)ceil(resolution.x * cropped_rect.max_point.x), (int)ceil(resolution.y * cropped_rect.max_point.y));
     this->_cropped_pixel_bounds = Bounds2i(bounds_min_p, bounds_max_p);
-    _pixels = std::unique_ptr<Pixel[]>(new Pixel[area(_cropped_pixel_bounds)]);
+    if (_mode == FilmMode::XYZ)
+    {
+        _xyz_pixels = std::unique_ptr<XYZPixel[]>(new XYZPixel[area(_cropped_pixel_bounds)]);
+    }
+    else
+    {
+        _pixels = std::unique_ptr<Pixel[]>(new Pixel[area(_cropped_pixel_bounds)]);
+    }
 
     //init filter LUT
     for (int i = 0; i < NARUKAMI_FILM_FILTER_LUT_WIDTH; ++i)
@@ -90,6 +155,15 @@ Pixel &Film::get_pixel(const Point2i &p) const
     return _pixels[y * width + x];
 }
 
+XYZPixel &Film::get_xyz_pixel(const Point2i &p) const
+{
+    assert(inside_exclusive(p, _cropped_pixel_bounds));
+    auto width = _cropped_pixel_bounds[1].x - _cropped_pixel_bounds[0].x;
+    auto x = p.x - _cropped_pixel_bounds[0].x;
+    auto y = p.y - _cropped_pixel_bounds[0].y;
+    return _xyz_pixels[y * width + x];
+}
+
 float Film::gaussian_1D(float x) const
 {
     return max(0.0f, exp(-_gaussian_alpha * x * x) - _gaussian_exp);
@@ -102,15 +176,30 @@ shared<narukami::Image> Film::get_image() const
     {
         for (int x = _cropped_pixel_bounds[0].x; x < _cropped_pixel_bounds[1].x; ++x)
         {
-            const Pixel &pixel = get_pixel(Point2i(x, y));
-            float inv_w = rcp(pixel.weight);
-            if (EXPECT_NOT_TAKEN(pixel.weight == 0.0f))
+            float xyz[3];
+            if (_mode == FilmMode::XYZ)
+            {
+                const XYZPixel &pixel = get_xyz_pixel(Point2i(x, y));
+                float inv_w = rcp(pixel.weight);
+                if (EXPECT_NOT_TAKEN(pixel.weight == 0.0f))
+                {
+                    inv_w = 1.0f;
+                }
+                xyz[0] = pixel.xyz[0] * inv_w;
+                xyz[1] = pixel.xyz[1] * inv_w;
+                xyz[2] = pixel.xyz[2] * inv_w;
+            }
+            else
             {
-                inv_w = 1.0f;
+                const Pixel &pixel = get_pixel(Point2i(x, y));
+                float inv_w = rcp(pixel.weight);
+                if (EXPECT_NOT_TAKEN(pixel.weight == 0.0f))
+                {
+                    inv_w = 1.0f;
+                }
+                from_spd_to_xyz(pixel.intensity * inv_w, xyz);
             }
 
-            float xyz[3];
-            from_spd_to_xyz(pixel.intensity * inv_w,xyz);
             float srgb[3];
             from_xyz_to_srgb(xyz,srgb);
             
@@ -126,28 +215,25 @@ shared<narukami::Image> Film::get_image() const
 
 void Film::add_sample(const Point2f &pos, const Spectrum &l, const float weight) const
 {
-
-    //calculate bounds
-    auto dp = pos - Vector2f(0.5f, 0.5f);
-    Point2i p0 = (Point2i)ceil(dp - _filter_radius);
-    Point2i p1 = (Point2i)floor(dp + _filter_radius) + Point2i(1, 1);
-
-    p0 = max(p0, _cropped_pixel_bounds.min_point);
-    p1 = min(p1, _cropped_pixel_bounds.max_point);
-    for (int x = p0.x; x < p1.x; ++x)
+    if (_mode == FilmMode::XYZ)
     {
-        int idx_x = min(static_cast<int>(abs(x - dp.x) * _inv_filter_radius * NARUKAMI_FILM_FILTER_LUT_WIDTH), NARUKAMI_FILM_FILTER_LUT_WIDTH - 1);
-        float filter_weight_x = _filter_lut[idx_x];
-        for (int y = p0.y; y < p1.y; ++y)
-        {
-            int idx_y = min(static_cast<int>(abs(y - dp.y) * _inv_filter_radius * NARUKAMI_FILM_FILTER_LUT_WIDTH), NARUKAMI_FILM_FILTER_LUT_WIDTH - 1);
-            float filter_weight = _filter_lut[idx_y] * filter_weight_x;
-            Pixel &pixel = get_pixel(Point2i(x, y));
-            {
-                pixel.intensity += l * weight * filter_weight;
-            }
+        float xyz[3];
+        from_spd_to_xyz(l * weight, xyz);
+        for_each_filter_pixel(pos, _cropped_pixel_bounds, _filter_lut, _filter_radius, _inv_filter_radius, [&](const Point2i &p, const float filter_weight) {
+            XYZPixel &pixel = get_xyz_pixel(p);
+            pixel.xyz[0] += xyz[0] * filter_weight;
+            pixel.xyz[1] += xyz[1] * filter_weight;
+            pixel.xyz[2] += xyz[2] * filter_weight;
             pixel.weight += filter_weight;
-        }
+        });
+    }
+    else
+    {
+        for_each_filter_pixel(pos, _cropped_pixel_bounds, _filter_lut, _filter_radius, _inv_filter_radius, [&](const Point2i &p, const float filter_weight) {
+            Pixel &pixel = get_pixel(p);
+            madd(pixel.intensity, l, weight * filter_weight);
+            pixel.weight += filter_weight;
+        });
     }
 }
 
@@ -158,20 +244,71 @@ std::unique_ptr<FilmTile> Film::get_film_tile(const Bounds2i &sample_bounds) con
     Point2i p0 = static_cast<Point2i>(ceil(float_bounds.min_point - half_bounds - _filter_radius));
     Point2i p1 = static_cast<Point2i>(floor(float_bounds.max_point - half_bounds + _filter_radius)) + Point2i(1, 1);
     auto pixel_bound = intersect(Bounds2i(p0, p1), _cropped_pixel_bounds);
-    return make_unique<FilmTile>(pixel_bound, _filter_lut, _filter_radius);
+    auto tile = make_unique<FilmTile>(pixel_bound, _filter_lut, _filter_radius, _mode);
+
+    //相邻tile的pixel bounds和上面的p0,p1用同样的方式计算,内部像素正好是去掉相邻tile的pixel bounds后剩下的部分
+    Point2i interior_p0 = static_cast<Point2i>(floor(float_bounds.min_point - half_bounds + _filter_radius)) + Point2i(1, 1);
+    Point2i interior_p1 = static_cast<Point2i>(ceil(float_bounds.max_point - half_bounds - _filter_radius));
+    interior_p0 = min(max(interior_p0, pixel_bound.min_point), pixel_bound.max_point);
+    interior_p1 = max(min(interior_p1, pixel_bound.max_point), interior_p0);
+    //Bounds2的构造函数会交换min/max,这里直接赋值
+    tile->_interior_bounds.min_point = interior_p0;
+    tile->_interior_bounds.max_point = interior_p1;
+    return tile;
 }
 
-void Film::merge_film_tile(std::unique_ptr<FilmTile> tile)
+void Film::merge_tile_row(const FilmTile &tile, const int y, const int x0, const int x1)
 {
-    //lock for thread
-    std::lock_guard<std::mutex> lock(_mutex);
+    if (x0 >= x1)
+    {
+        return;
+    }
+    if (_mode == FilmMode::XYZ)
+    {
+        const XYZPixel *tile_pixels = &tile.get_tile_xyz_pixel(Point2i(x0, y));
+        XYZPixel *merge_pixels = &get_xyz_pixel(Point2i(x0, y));
+        for (int i = 0; i < x1 - x0; ++i)
+        {
+            merge_pixels[i].xyz[0] += tile_pixels[i].xyz[0];
+            merge_pixels[i].xyz[1] += tile_pixels[i].xyz[1];
+            merge_pixels[i].xyz[2] += tile_pixels[i].xyz[2];
+            merge_pixels[i].weight += tile_pixels[i].weight;
+        }
+    }
+    else
+    {
+        const TilePixel *tile_pixels = &tile.get_tile_pixel(Point2i(x0, y));
+        Pixel *merge_pixels = &get_pixel(Point2i(x0, y));
+        for (int i = 0; i < x1 - x0; ++i)
+        {
+            merge_pixels[i].intensity += tile_pixels[i].intensity;
+            merge_pixels[i].weight += tile_pixels[i].weight;
+        }
+    }
+}
 
-    for (auto p : tile->_pixel_bounds)
+void Film::merge_film_tile(std::unique_ptr<FilmTile> tile)
+{
+    const Bounds2i &pixel_bounds = tile->_pixel_bounds;
+    const Bounds2i &interior_bounds = tile->_interior_bounds;
+    for (int y = pixel_bounds.min_point.y; y < pixel_bounds.max_point.y; ++y)
     {
-        const auto tile_pixel = tile->get_tile_pixel(p);
-        Pixel &merge_pixel = get_pixel(p);
-        merge_pixel.intensity = merge_pixel.intensity + tile_pixel.intensity;
-        merge_pixel.weight = merge_pixel.weight + tile_pixel.weight;
+        const bool interior_row = y >= interior_bounds.min_point.y && y < interior_bounds.max_point.y;
+        if (interior_row)
+        {
+            {
+                //边界像素可能同时被相邻的tile写入,按行加锁
+                std::lock_guard<std::mutex> lock(_merge_mutexes[static_cast<uint32_t>(y) % NARUKAMI_FILM_MERGE_LOCK_NUM]);
+                merge_tile_row(*tile, y, pixel_bounds.min_point.x, interior_bounds.min_point.x);
+                merge_tile_row(*tile, y, interior_bounds.max_point.x, pixel_bounds.max_point.x);
+            }
+            merge_tile_row(*tile, y, interior_bounds.min_point.x, interior_bounds.max_point.x);
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(_merge_mutexes[static_cast<uint32_t>(y) % NARUKAMI_FILM_MERGE_LOCK_NUM]);
+            merge_tile_row(*tile, y, pixel_bounds.min_point.x, pixel_bounds.max_point.x);
+        }
     }
 }
 
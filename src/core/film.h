@@ -34,6 +34,34 @@ NARUKAMI_BEGIN
 #define NARUKAMI_FILM_FILTER_LUT_WIDTH 32
 #endif
 
+//merge tile时保护边界像素的锁的数量,按照像素行分配
+#ifndef NARUKAMI_FILM_MERGE_LOCK_NUM
+#define NARUKAMI_FILM_MERGE_LOCK_NUM 64
+#endif
+
+/**
+ * Film的累加方式
+ * Spectrum:每个像素累加完整的光谱(约400字节),get_image时再投影到XYZ
+ * XYZ:add_sample时直接把样本投影到XYZ,每个像素只累加4个float
+ * 两种方式只差在浮点累加顺序上
+*/
+enum class FilmMode
+{
+    Spectrum,
+    XYZ
+};
+
+struct XYZPixel
+{
+   float xyz[3];
+   float weight;
+
+   XYZPixel(){
+       xyz[0]=xyz[1]=xyz[2]=0.0f;
+       weight=0.0f;
+   }
+};
+
 struct TilePixel
 {
    Spectrum intensity;
@@ -54,12 +82,21 @@ class FilmTile
         const float *_filter_lut;
         const float _filter_radius;
         const float _inv_filter_radius;
+        const FilmMode _mode;
+        //其他tile的样本无法影响到的像素范围,merge时不需要加锁
+        Bounds2i _interior_bounds;
+        //根据mode只分配其中一个
         std::unique_ptr<TilePixel[]> _tile_pixels;
+        std::unique_ptr<XYZPixel[]> _tile_xyz_pixels;
+        void add_xyz_sample(const Point2f& pos,const float xyz[3]) const;
     public:
-        FilmTile( const Bounds2i& pixel_bounds,const float* filter_lut,const float filter_radius);
+        FilmTile( const Bounds2i& pixel_bounds,const float* filter_lut,const float filter_radius,const FilmMode mode=FilmMode::Spectrum);
         friend class Film;
         void add_sample(const Point2f& pos,const Spectrum& l,const float weight) const;
+        //hero wavelength样本,l只包含wavelengths上的值
+        void add_sample(const Point2f& pos,const SampledSpectrum& l,const SampledWavelengths& wavelengths,const float weight) const;
         TilePixel& get_tile_pixel(const Point2i& p) const;
+        XYZPixel& get_tile_xyz_pixel(const Point2i& p) const;
         inline  Bounds2i get_pixel_bounds() const{
             return _pixel_bounds;
         }
@@ -81,10 +118,13 @@ class Film{
         const Point2i resolution;
        
     private:
+        //根据mode只分配其中一个
         std::unique_ptr<Pixel[]> _pixels;
+        std::unique_ptr<XYZPixel[]> _xyz_pixels;
         Bounds2i _cropped_pixel_bounds;
         
         Pixel& get_pixel(const Point2i& p) const;
+        XYZPixel& get_xyz_pixel(const Point2i& p) const;
         //from PBRT
         float gaussian_1D(float x) const;
         float _filter_lut[NARUKAMI_FILM_FILTER_LUT_WIDTH]; 
@@ -92,10 +132,16 @@ class Film{
         const float _gaussian_alpha;
         const float _filter_radius;
         const float _inv_filter_radius;
+        const FilmMode _mode;
 
-        std::mutex _mutex;
+        std::mutex _merge_mutexes[NARUKAMI_FILM_MERGE_LOCK_NUM];
+        //把tile中第y行[x0,x1)的像素累加到film
+        void merge_tile_row(const FilmTile &tile, const int y, const int x0, const int x1);
     public:
-        Film(const Point2i& resolution,const Bounds2f& cropped_rect,float const filter_radius=1.0f, float gaussian_alpha=1.0f);
+        Film(const Point2i& resolution,const Bounds2f& cropped_rect,float const filter_radius=1.0f, float gaussian_alpha=1.0f,const FilmMode mode=FilmMode::Spectrum);
+        inline FilmMode get_mode() const{
+            return _mode;
+        }
         inline  Bounds2i get_cropped_pixel_bounds() const{
             return _cropped_pixel_bounds;
         }
@@ -108,6 +154,10 @@ class Film{
         shared<narukami::Image> get_image() const;
         void add_sample(const Point2f& pos,const Spectrum& l,const float weight) const;
 
+        /**
+         * 不同线程获取的tile的sample bounds不能重叠
+         * 这样tile内部的像素只会被一个tile写入,merge时只需要锁住边界上的像素行
+        */
         std::unique_ptr<FilmTile> get_film_tile(const Bounds2i& sample_bounds) const;
         void merge_film_tile(std::unique_ptr<FilmTile> tile);
 
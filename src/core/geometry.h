@@ -257,6 +257,8 @@ inline bool operator!=(const Vector3<T> &v1, const Vector3<T> &v2)
 template <typename T>
 inline Vector3f rcp(const Vector3<T> &v1) { return Vector3f(rcp(v1.x), rcp(v1.y), rcp(v1.z)); }
 template <typename T>
+inline Vector3f safe_rcp(const Vector3<T> &v1) { return Vector3f(safe_rcp(v1.x), safe_rcp(v1.y), safe_rcp(v1.z)); }
+template <typename T>
 inline Vector3<T> abs(const Vector3<T> &v1) { return Vector3f(abs(v1.x), abs(v1.y), abs(v1.z)); }
 template <typename T>
 inline Vector3<T> sign(const Vector3<T> &v1) { return Vector3f(sign(v1.x), sign(v1.y), sign(v1.z)); }
@@ -1582,15 +1584,22 @@ void coordinate_system(const Normal3<T> &v0, Vector3<T> *v1, Vector3<T> *v2)
     *v2 = cross(v0, *v1);
 }
 
+//射线的类型位,射线的mask和instance的mask相与为0时射线看不到这个instance
+constexpr uint32_t RAY_MASK_CAMERA = 1 << 0;
+constexpr uint32_t RAY_MASK_SHADOW = 1 << 1;
+constexpr uint32_t RAY_MASK_INDIRECT = 1 << 2;
+constexpr uint32_t RAY_MASK_ALL = 0xFFFFFFFF;
+
 struct Ray
 {
     Point3f o;
     Vector3f d;
     mutable float t_max;
     float time;
+    uint32_t mask;
 
-    inline Ray() : o(Point3f(0, 0, 0)), d(Vector3f(0, 0, 1)), t_max(INFINITE), time(0.0f) {}
-    inline Ray(const Point3f &o, const Vector3f &d, const float t_max = INFINITE) : o(o), d(d), t_max(t_max), time(0.0f) {}
+    inline Ray() : o(Point3f(0, 0, 0)), d(Vector3f(0, 0, 1)), t_max(INFINITE), time(0.0f), mask(RAY_MASK_ALL) {}
+    inline Ray(const Point3f &o, const Vector3f &d, const float t_max = INFINITE) : o(o), d(d), t_max(t_max), time(0.0f), mask(RAY_MASK_ALL) {}
 };
 inline std::ostream &operator<<(std::ostream &out, const Ray &ray)
 {
@@ -1613,7 +1622,10 @@ inline Ray offset_ray(const Ray &ray, const Normal3f &n)
                        fabsf(ray.o.y) < origin ? ray.o.y + float_scale * n.y : p_i.y,
                        fabsf(ray.o.z) < origin ? ray.o.z + float_scale * n.z : p_i.z);
     float epsion = length(o_offseted - ray.o);
-    return Ray(o_offseted, ray.d, max(0.0f, ray.t_max - epsion));
+    Ray offseted_ray(o_offseted, ray.d, max(0.0f, ray.t_max - epsion));
+    offseted_ray.time = ray.time;
+    offseted_ray.mask = ray.mask;
+    return offseted_ray;
 }
 
 struct SSE_ALIGNAS RayPack
@@ -1622,9 +1634,27 @@ struct SSE_ALIGNAS RayPack
     Vector3fPack d;
     mutable float4 t_max;
 
+    inline RayPack() : t_max(INFINITE) {}
     inline RayPack(const Point3f &o, const Vector3f &d, const float t_max = INFINITE) : o(Point3fPack(o)), d(Vector3fPack(d)), t_max(t_max) {}
     inline explicit RayPack(const Ray &ray) : o(ray.o), d(ray.d), t_max(ray.t_max) {}
 };
+/**
+ * SoA布局的射线流,每个数组都有count个元素
+*/
+struct RayStream
+{
+    const float *ox, *oy, *oz;
+    const float *dx, *dy, *dz;
+    const float *t_max;
+    size_t count;
+
+    inline Ray operator[](const size_t idx) const
+    {
+        assert(idx < count);
+        return Ray(Point3f(ox[idx], oy[idx], oz[idx]), Vector3f(dx[idx], dy[idx], dz[idx]), t_max[idx]);
+    }
+};
+
 inline std::ostream &operator<<(std::ostream &out, const RayPack &ray)
 {
     out << "[o:" << ray.o << " d:" << ray.d << " t:" << float4(ray.t_max) << "]";
@@ -2212,6 +2242,12 @@ inline Bounds3<T> intersect(const Bounds3<T> &b0, const Bounds3<T> &b1)
 {
     return Bounds3<T>(max(b0.min_point, b1.min_point), min(b0.max_point, b1.max_point));
 }
+//b完全在bounds中,包括边界
+template <typename T>
+inline bool inside(const Bounds3<T> &b, const Bounds3<T> &bounds)
+{
+    return _union(b, bounds) == bounds;
+}
 template <typename T>
 inline Bounds3<T> expand(const Bounds3<T> &b, float w)
 {
@@ -2391,6 +2427,45 @@ inline bool4 intersect(const Point3fPack &o, const Vector3fPack &inv_d, float4 t
     return t_min <= t_max;
 }
 
+//区间算术:[p - o_max, p - o_min] * [inv_d_min, inv_d_max]的下界和上界
+inline void interval_slab(const float4 &plane, const float o_min, const float o_max, const float inv_d_min, const float inv_d_max, float4 *lower, float4 *upper)
+{
+    float4 a0 = plane - float4(o_max);
+    float4 a1 = plane - float4(o_min);
+    float4 p0 = a0 * float4(inv_d_min);
+    float4 p1 = a0 * float4(inv_d_max);
+    float4 p2 = a1 * float4(inv_d_min);
+    float4 p3 = a1 * float4(inv_d_max);
+    (*lower) = min(min(p0, p1), min(p2, p3));
+    (*upper) = max(max(p0, p1), max(p2, p3));
+}
+
+//ray packet的区间射线和四个box求交
+//所有射线的方向必须在同一个卦限,返回false的box一定不会和packet中任何一条射线相交
+inline bool4 intersect(const Point3f &o_min, const Point3f &o_max, const Vector3f &inv_d_min, const Vector3f &inv_d_max, float t_max, const int isPositive[3], const Bounds3fPack &box)
+{
+    float4 t_near = float4(0.0f);
+    float4 t_far = float4(t_max);
+    float4 lower, upper;
+    //x
+    interval_slab(box.column(1 - isPositive[0]).xxxx, o_min.x, o_max.x, inv_d_min.x, inv_d_max.x, &lower, &upper);
+    t_near = max(t_near, lower);
+    interval_slab(box.column(isPositive[0]).xxxx, o_min.x, o_max.x, inv_d_min.x, inv_d_max.x, &lower, &upper);
+    t_far = min(t_far, upper);
+    //y
+    interval_slab(box.column(1 - isPositive[1]).yyyy, o_min.y, o_max.y, inv_d_min.y, inv_d_max.y, &lower, &upper);
+    t_near = max(t_near, lower);
+    interval_slab(box.column(isPositive[1]).yyyy, o_min.y, o_max.y, inv_d_min.y, inv_d_max.y, &lower, &upper);
+    t_far = min(t_far, upper);
+    //z
+    interval_slab(box.column(1 - isPositive[2]).zzzz, o_min.z, o_max.z, inv_d_min.z, inv_d_max.z, &lower, &upper);
+    t_near = max(t_near, lower);
+    interval_slab(box.column(isPositive[2]).zzzz, o_min.z, o_max.z, inv_d_min.z, inv_d_max.z, &lower, &upper);
+    t_far = min(t_far, upper);
+
+    return t_near <= t_far;
+}
+
 //TODO need to test
 inline bool intersect(const Point3fPack &o, const Vector3fPack &inv_d, float4 t_min, float4 t_max, const int isPositive[3], const Bounds3fPack &box, float *t_result, int *index)
 {
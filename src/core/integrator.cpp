@@ -29,11 +29,64 @@ SOFTWARE.
 #include "core/parallel.h"
 #include "core/interaction.h"
 #include "core/progressreporter.h"
+#include <chrono>
 NARUKAMI_BEGIN
 
-void Integrator::render(const Scene &scene)
+template <typename SpectrumType, typename... Wavelengths>
+SpectrumType Integrator::Li(const Scene &scene, Sampler *sampler, const RayDifferential &ray, const Wavelengths &... wavelengths) const
 {
+    SurfaceInteraction interaction;
+    constexpr int bounce_count = 0;
+    SpectrumType L(0.0f);
+    float throughout = 1.0f;
+    int bounce = 0;
+    for (; bounce <= bounce_count; ++bounce)
+    {
+
+        if (scene.intersect( ray, &interaction))
+        {
+            if (is_surface_interaction(interaction))
+            {
+                SurfaceInteraction &surface_interaction = static_cast<SurfaceInteraction &>(interaction);
+
+                L = L + Le(surface_interaction, ray.d, wavelengths...);
 
+                for (auto light : scene.lights)
+                {
+                    Vector3f wi;
+                    float pdf;
+                    VisibilityTester tester;
+                    auto Li = light->sample_Li(surface_interaction, sampler->get_2D(), wavelengths..., &wi, &pdf, &tester);
+                    if (pdf > 0 && !is_black(Li) && tester.unoccluded(scene))
+                    {
+                        L = L + INV_PI * saturate(dot(surface_interaction.n, wi)) * throughout * Li * rcp(pdf);
+                    }
+                }
+
+                // if (bounce < bounce_count)
+                // {
+                //     auto direction_object = cosine_sample_hemisphere(sampler->get_2D());
+                //     auto object_to_world = get_object_to_world(surface_interaction);
+                //     auto direction_world =  hemisphere_flip(normalize(object_to_world(direction_object)),interaction.n);
+                //     ray = Ray(interaction.p, direction_world);
+                //     ray = offset_ray(ray, interaction.n);
+                //     STAT_INCREASE_MEMORY_COUNTER(ray_count, 1)
+
+                //     throughout *= INV_PI * abs(direction_object.z);
+                // }
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+    STAT_INCREASE_COUNTER_CONDITION(miss_intersection_num, 1, bounce == 0)
+    return L;
+}
+
+void Integrator::render_samples(const Scene &scene, const uint32_t sample_begin, const uint32_t sample_end, float *pass_luminance, ProgressReporter *reporter)
+{
     auto film = _camera->get_film();
     auto sample_bounds = film->get_sample_bounds();
     auto sample_extent = diagonal(sample_bounds);
@@ -41,7 +94,6 @@ void Integrator::render(const Scene &scene)
     const auto tile_count_x = (sample_extent.x + (tile_size - 1)) / tile_size;
     const auto tile_count_y = (sample_extent.y + (tile_size - 1)) / tile_size;
     const Point2i tile_count(tile_count_x, tile_count_y);
-    ProgressReporter rendering_reporter(tile_count_x * tile_count_y, "rendering");
     parallel_for_2D(
         [&](Point2i tile_index) {
             MemoryArena arena;
@@ -58,20 +110,23 @@ void Integrator::render(const Scene &scene)
 
             for (auto &&pixel : tile_bounds)
             {
-                clone_sampler->start_pixel(pixel);
-                do
+                float luminance = 0.0f;
+                clone_sampler->start_pixel_sample(pixel, sample_begin);
+                for (uint32_t sample_idx = sample_begin; sample_idx < sample_end; ++sample_idx)
                 {
+                    if (sample_idx != sample_begin)
+                    {
+                        clone_sampler->start_next_sample();
+                    }
                     STAT_INCREASE_COUNTER(miss_intersection_denom, 1)
                     // film->add_sample(pixel,{clone_sampler->get_1D(),clone_sampler->get_1D(),clone_sampler->get_1D()}, 1);
                     auto camera_sample = clone_sampler->get_camera_sample(pixel);
                     RayDifferential ray;
                     float w = _camera->generate_normalized_ray_differential(camera_sample, &ray);
                     STAT_INCREASE_MEMORY_COUNTER(ray_count, 1)
+#if 0 //Debug
                     SurfaceInteraction interaction;
-                    constexpr int bounce_count = 0;
                     Spectrum L(0.0f);
-                    float throughout = 1.0f;
-#if 0 //Debug
                      if (scene.intersect(arena, ray, &interaction))
                      {
                          compute_differential(ray,interaction);
@@ -102,54 +157,177 @@ void Integrator::render(const Scene &scene)
                        
                          
                      }
+                    film_tile->add_sample(camera_sample.pFilm, L, w);
 #else
-                    int bounce = 0;
-                    for (; bounce <= bounce_count; ++bounce)
+                    if (_spectrum_mode == SpectrumMode::HeroWavelength)
                     {
-
-                        if (scene.intersect( ray, &interaction))
+                        //波长样本在相机样本之后,光源样本之前
+                        auto wavelengths = sample_wavelengths(clone_sampler->get_1D());
+                        auto L = Li<SampledSpectrum>(scene, clone_sampler.get(), ray, wavelengths);
+                        film_tile->add_sample(camera_sample.pFilm, L, wavelengths, w);
+                        if (pass_luminance)
                         {
-                            if (is_surface_interaction(interaction))
-                            {
-                                SurfaceInteraction &surface_interaction = static_cast<SurfaceInteraction &>(interaction);
-
-                                L = L + Le(surface_interaction, ray.d);
-
-                                for (auto light : scene.lights)
-                                {
-                                    Vector3f wi;
-                                    float pdf;
-                                    VisibilityTester tester;
-                                    auto Li = light->sample_Li(surface_interaction, clone_sampler->get_2D(), &wi, &pdf, &tester);
-                                    if (pdf > 0 && !is_black(Li) && tester.unoccluded(scene))
-                                    {
-                                        L = L + INV_PI * saturate(dot(surface_interaction.n, wi)) * throughout * Li * rcp(pdf);
-                                    }
-                                }
-
-                                // if (bounce < bounce_count)
-                                // {
-                                //     auto direction_object = cosine_sample_hemisphere(clone_sampler->get_2D());
-                                //     auto object_to_world = get_object_to_world(surface_interaction);
-                                //     auto direction_world =  hemisphere_flip(normalize(object_to_world(direction_object)),interaction.n);
-                                //     ray = Ray(interaction.p, direction_world);
-                                //     ray = offset_ray(ray, interaction.n);
-                                //     STAT_INCREASE_MEMORY_COUNTER(ray_count, 1)
-
-                                //     throughout *= INV_PI * abs(direction_object.z);
-                                // }
-                            }
+                            float xyz[3];
+                            from_sampled_spectrum_to_xyz(L, wavelengths, xyz);
+                            luminance += xyz[1] * w;
                         }
-                        else
+                    }
+                    else
+                    {
+                        auto L = Li<Spectrum>(scene, clone_sampler.get(), ray);
+                        film_tile->add_sample(camera_sample.pFilm, L, w);
+                        if (pass_luminance)
                         {
-                            break;
+                            float xyz[3];
+                            from_spd_to_xyz(L, xyz);
+                            luminance += xyz[1] * w;
                         }
                     }
-                    STAT_INCREASE_COUNTER_CONDITION(miss_intersection_num, 1, bounce == 0)
 #endif
-                    film_tile->add_sample(camera_sample.pFilm, L, w);
                     arena.reset();
-                } while (clone_sampler->start_next_sample());
+                }
+                if (pass_luminance)
+                {
+                    const auto offset = pixel - sample_bounds.min_point;
+                    pass_luminance[offset.y * sample_extent.x + offset.x] = luminance / (sample_end - sample_begin);
+                }
+            }
+            film->merge_film_tile(std::move(film_tile));
+            if (reporter)
+            {
+                reporter->update(1);
+            }
+        },
+        tile_count);
+}
+
+void Integrator::render(const Scene &scene)
+{
+    auto sample_extent = diagonal(_camera->get_film()->get_sample_bounds());
+    const int tile_size = 64;
+    ProgressReporter rendering_reporter(((sample_extent.x + (tile_size - 1)) / tile_size) * ((sample_extent.y + (tile_size - 1)) / tile_size), "rendering");
+    render_samples(scene, 0, _sampler->get_spp(), nullptr, &rendering_reporter);
+    rendering_reporter.done();
+}
+
+void Integrator::accumulate_pass_luminance(const float *pass_luminance, const uint32_t pass_sample_count)
+{
+    //按样本数加权的Welford算法,_progressive_sample_count已经包含这一遍的样本
+    const float w = static_cast<float>(pass_sample_count);
+    const float inv_total = 1.0f / static_cast<float>(_progressive_sample_count);
+    for (size_t i = 0; i < _luminance_mean.size(); ++i)
+    {
+        const float delta = pass_luminance[i] - _luminance_mean[i];
+        _luminance_mean[i] += w * inv_total * delta;
+        _luminance_m2[i] += w * delta * (pass_luminance[i] - _luminance_mean[i]);
+    }
+}
+
+float Integrator::estimate_noise() const
+{
+    if (_progressive_pass_count < 2 || _luminance_mean.empty())
+    {
+        return INFINITE;
+    }
+    //均值的方差为m2/(W*(遍数-1)),分母加上下限避免接近黑色的像素主导结果
+    const double inv_denom = 1.0 / (static_cast<double>(_progressive_sample_count) * (_progressive_pass_count - 1));
+    double noise = 0.0;
+    for (size_t i = 0; i < _luminance_mean.size(); ++i)
+    {
+        noise += std::sqrt(max(_luminance_m2[i], 0.0f) * inv_denom) / max(_luminance_mean[i], 0.01f);
+    }
+    return static_cast<float>(noise / _luminance_mean.size());
+}
+
+ProgressiveResult Integrator::render_progressive(const Scene &scene, const ProgressiveSettings &settings)
+{
+    assert(settings.samples_per_pass > 0);
+    auto sample_extent = diagonal(_camera->get_film()->get_sample_bounds());
+    const size_t pixel_num = static_cast<size_t>(sample_extent.x) * sample_extent.y;
+    if (_luminance_mean.size() != pixel_num)
+    {
+        _luminance_mean.assign(pixel_num, 0.0f);
+        _luminance_m2.assign(pixel_num, 0.0f);
+    }
+    std::vector<float> pass_luminance(pixel_num);
+
+    const uint32_t spp = _sampler->get_spp();
+    const auto start = std::chrono::steady_clock::now();
+    auto seconds_since = [](const std::chrono::steady_clock::time_point &t) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+    };
+    float noise = estimate_noise();
+    double last_pass_time = 0.0;
+    for (uint32_t pass = 0;; ++pass)
+    {
+        if (_progressive_sample_count >= spp || (settings.max_passes > 0 && pass >= settings.max_passes) || (settings.noise_target > 0.0f && noise <= settings.noise_target))
+        {
+            break;
+        }
+        if (settings.time_budget > 0.0 && pass > 0 && seconds_since(start) + last_pass_time > settings.time_budget)
+        {
+            break;
+        }
+        const auto pass_start = std::chrono::steady_clock::now();
+        const uint32_t sample_begin = _progressive_sample_count;
+        const uint32_t sample_end = min(sample_begin + settings.samples_per_pass, spp);
+        render_samples(scene, sample_begin, sample_end, &pass_luminance[0], nullptr);
+        _progressive_sample_count = sample_end;
+        _progressive_pass_count++;
+        accumulate_pass_luminance(&pass_luminance[0], sample_end - sample_begin);
+        noise = estimate_noise();
+        last_pass_time = seconds_since(pass_start);
+    }
+    return ProgressiveResult{_progressive_pass_count, _progressive_sample_count, seconds_since(start), noise};
+}
+
+
+void WavefrontIntegrator::render(const Scene &scene)
+{
+    auto film = _camera->get_film();
+    auto sample_bounds = film->get_sample_bounds();
+    auto sample_extent = diagonal(sample_bounds);
+    const int tile_size = 64;
+    const auto tile_count_x = (sample_extent.x + (tile_size - 1)) / tile_size;
+    const auto tile_count_y = (sample_extent.y + (tile_size - 1)) / tile_size;
+    const Point2i tile_count(tile_count_x, tile_count_y);
+    const uint32_t light_num = static_cast<uint32_t>(scene.lights.size());
+    //每一波处理整数个像素,保证像素内样本的累加顺序和Integrator一致
+    const uint32_t wave_pixel_num = max(WAVEFRONT_MAX_PATH_NUM / _sampler->get_spp(), 1u);
+    ProgressReporter rendering_reporter(tile_count_x * tile_count_y, "rendering");
+    parallel_for_2D(
+        [&](Point2i tile_index) {
+            int seed = tile_index.y * tile_count.x + tile_index.x;
+            auto clone_sampler = _sampler->clone(seed);
+
+            auto tile_bounds_min_x = sample_bounds.min_point.x + tile_index.x * tile_size;
+            auto tile_bounds_min_y = sample_bounds.min_point.y + tile_index.y * tile_size;
+            auto tile_bounds_max_x = min(tile_bounds_min_x + tile_size, sample_bounds.max_point.x);
+            auto tile_bounds_max_y = min(tile_bounds_min_y + tile_size, sample_bounds.max_point.y);
+            Bounds2i tile_bounds(Point2i(tile_bounds_min_x, tile_bounds_min_y), Point2i(tile_bounds_max_x, tile_bounds_max_y));
+
+            auto film_tile = film->get_film_tile(tile_bounds);
+
+            std::vector<Point2i> pixels;
+            for (auto &&pixel : tile_bounds)
+            {
+                pixels.push_back(pixel);
+            }
+
+            WavefrontPathQueue queue;
+            for (uint32_t start = 0; start < pixels.size(); start += wave_pixel_num)
+            {
+                uint32_t pixel_num = min(wave_pixel_num, static_cast<uint32_t>(pixels.size()) - start);
+                queue.clear();
+                generate_camera_rays(clone_sampler.get(), &pixels[start], pixel_num, light_num, &queue);
+                intersect_closest(scene, &queue);
+                shade(scene, &queue);
+                trace_shadow_rays(scene, &queue);
+
+                for (uint32_t i = 0; i < queue.size(); ++i)
+                {
+                    film_tile->add_sample(queue.p_film[i], queue.L[i], queue.weights[i]);
+                }
             }
             film->merge_film_tile(std::move(film_tile));
             rendering_reporter.update(1);
@@ -158,4 +336,120 @@ void Integrator::render(const Scene &scene)
     rendering_reporter.done();
 }
 
+void WavefrontIntegrator::generate_camera_rays(Sampler *sampler, const Point2i *pixels, uint32_t pixel_num, uint32_t light_num, WavefrontPathQueue *queue) const
+{
+    for (uint32_t p = 0; p < pixel_num; ++p)
+    {
+        sampler->start_pixel(pixels[p]);
+        do
+        {
+            STAT_INCREASE_COUNTER(miss_intersection_denom, 1)
+            //维度的消耗顺序和Integrator保持一致:相机样本,然后是每个光源的样本
+            auto camera_sample = sampler->get_camera_sample(pixels[p]);
+            RayDifferential ray;
+            float w = _camera->generate_normalized_ray_differential(camera_sample, &ray);
+            STAT_INCREASE_MEMORY_COUNTER(ray_count, 1)
+            queue->p_film.push_back(camera_sample.pFilm);
+            queue->weights.push_back(w);
+            //ray differential在这个积分器中没有用到,只保存射线本身
+            queue->rays.push_back(ray);
+            const size_t light_sample_offset = queue->light_samples.size();
+            queue->light_samples.resize(light_sample_offset + light_num);
+            sampler->fill_2D(queue->light_samples.data() + light_sample_offset, light_num);
+        } while (sampler->start_next_sample());
+    }
+}
+
+void WavefrontIntegrator::intersect_closest(const Scene &scene, WavefrontPathQueue *queue) const
+{
+    auto path_num = queue->size();
+    queue->hit_p.resize(path_num);
+    queue->hit_n.resize(path_num);
+    queue->L.assign(path_num, Spectrum(0.0f));
+    //相邻的相机射线来自同一个像素或者相邻像素,按packet求交
+    for (uint32_t start = 0; start < path_num; start += SSE_WIDTH)
+    {
+        uint32_t lane_num = min<uint32_t>(SSE_WIDTH, path_num - start);
+        Ray rays[SSE_WIDTH];
+        SurfaceInteraction interactions[SSE_WIDTH];
+        bool hits[SSE_WIDTH];
+        for (uint32_t lane = 0; lane < lane_num; ++lane)
+        {
+            rays[lane] = queue->rays.get(start + lane);
+        }
+        scene.intersect_packet(rays, (1 << lane_num) - 1, interactions, hits);
+        for (uint32_t lane = 0; lane < lane_num; ++lane)
+        {
+            if (hits[lane])
+            {
+                queue->hit_p.set(start + lane, interactions[lane].p);
+                queue->hit_n.set(start + lane, interactions[lane].n);
+                queue->hit_paths.push_back(start + lane);
+            }
+            else
+            {
+                STAT_INCREASE_COUNTER(miss_intersection_num, 1)
+            }
+        }
+    }
+}
+
+void WavefrontIntegrator::shade(const Scene &scene, WavefrontPathQueue *queue) const
+{
+    const uint32_t light_num = static_cast<uint32_t>(scene.lights.size());
+    const float throughout = 1.0f;
+    for (auto &&path : queue->hit_paths)
+    {
+        //Le和光源采样只会用到交点的p和n
+        SurfaceInteraction interaction;
+        interaction.p = queue->hit_p.get<Point3f>(path);
+        interaction.n = queue->hit_n.get<Normal3f>(path);
+        if (!is_surface_interaction(interaction))
+        {
+            continue;
+        }
+
+        queue->L[path] = queue->L[path] + Le(interaction, queue->rays.d.get<Vector3f>(path));
+
+        for (uint32_t l = 0; l < light_num; ++l)
+        {
+            Vector3f wi;
+            float pdf;
+            VisibilityTester tester;
+            auto Li = scene.lights[l]->sample_Li(interaction, queue->light_samples[path * light_num + l], &wi, &pdf, &tester);
+            if (pdf > 0 && !is_black(Li))
+            {
+                queue->shadow_paths.push_back(path);
+                queue->shadow_rays.push_back(tester.shadow_ray());
+                queue->shadow_contributions.push_back(INV_PI * saturate(dot(interaction.n, wi)) * throughout * Li * rcp(pdf));
+            }
+        }
+    }
+}
+
+void WavefrontIntegrator::trace_shadow_rays(const Scene &scene, WavefrontPathQueue *queue) const
+{
+    //阴影射线按照路径和光源的顺序入队,所以每条路径的累加顺序和Integrator相同
+    auto shadow_num = static_cast<uint32_t>(queue->shadow_paths.size());
+    for (uint32_t start = 0; start < shadow_num; start += SSE_WIDTH)
+    {
+        uint32_t lane_num = min<uint32_t>(SSE_WIDTH, shadow_num - start);
+        Ray rays[SSE_WIDTH];
+        bool occluded[SSE_WIDTH];
+        for (uint32_t lane = 0; lane < lane_num; ++lane)
+        {
+            rays[lane] = queue->shadow_rays.get(start + lane);
+        }
+        scene.occluded_packet(rays, (1 << lane_num) - 1, occluded);
+        for (uint32_t lane = 0; lane < lane_num; ++lane)
+        {
+            if (!occluded[lane])
+            {
+                auto path = queue->shadow_paths[start + lane];
+                queue->L[path] = queue->L[path] + queue->shadow_contributions[start + lane];
+            }
+        }
+    }
+}
+
 NARUKAMI_END
\ No newline at end of file
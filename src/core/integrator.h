@@ -33,12 +33,194 @@ NARUKAMI_BEGIN
 
 STAT_PERCENT("integrator/miss intersection's ratio",miss_intersection_num,miss_intersection_denom)
 STAT_COUNTER("integrator/dispatch ray count",ray_count)
+enum class SpectrumMode
+{
+    //每条路径都使用完整的Spectrum
+    Full,
+    //每条路径只追踪SAMPLED_WAVELENGTH_COUNT个hero wavelength,在FilmTile中转换到XYZ
+    HeroWavelength
+};
+
+/**
+ * 分多遍渲染的设置,每一遍为每个像素增加samples_per_pass个样本并累加到Film
+ * 满足任意一个条件就停止:本次调用达到max_passes遍,再渲染一遍会超出time_budget,噪声低于noise_target,或者样本数达到sampler的spp
+ * 值为0的条件不生效,所以sampler的spp是样本数的上限,使用PMJ02Sampler时任意一遍结束时的样本都是分层的
+*/
+struct ProgressiveSettings
+{
+    uint32_t samples_per_pass = 1;
+    uint32_t max_passes = 0;
+    //秒,按照上一遍的时间预测下一遍是否还来得及
+    double time_budget = 0.0;
+    //所有像素亮度的平均相对标准误差,由每一遍的亮度均值之间的方差估计
+    float noise_target = 0.0f;
+};
+
+struct ProgressiveResult
+{
+    //Film中累计的遍数和每个像素的样本数
+    uint32_t pass_count;
+    uint32_t sample_count;
+    //本次调用的时间(秒)
+    double elapsed;
+    //少于两遍时为INFINITE
+    float noise;
+};
+
+class ProgressReporter;
+
 class Integrator{
     private:
         Camera* _camera;
         Sampler* _sampler;
+        SpectrumMode _spectrum_mode;
+
+        //分多遍渲染的状态,再次调用render_progressive时从这里继续
+        uint32_t _progressive_pass_count;
+        uint32_t _progressive_sample_count;
+        //每个像素各遍亮度的(按样本数加权的)均值和平方差之和
+        std::vector<float> _luminance_mean;
+        std::vector<float> _luminance_m2;
+
+        //wavelengths为空时使用完整的Spectrum,否则只在采样的波长上求值
+        template <typename SpectrumType, typename... Wavelengths>
+        SpectrumType Li(const Scene &scene, Sampler *sampler, const RayDifferential &ray, const Wavelengths &... wavelengths) const;
+        //渲染每个像素的第[sample_begin,sample_end)个样本并累加到Film,pass_luminance不为空时写入每个像素这些样本的平均亮度
+        void render_samples(const Scene &scene, const uint32_t sample_begin, const uint32_t sample_end, float *pass_luminance, ProgressReporter *reporter);
+        void accumulate_pass_luminance(const float *pass_luminance, const uint32_t pass_sample_count);
+        float estimate_noise() const;
+    public:
+        Integrator(Camera* camera,Sampler* sampler,SpectrumMode spectrum_mode = SpectrumMode::Full):_camera(camera),_sampler(sampler),_spectrum_mode(spectrum_mode),_progressive_pass_count(0),_progressive_sample_count(0){}
+        void render(const Scene& scene);
+        //分多遍渲染,多次调用时继续在同一个Film上累加
+        ProgressiveResult render_progressive(const Scene& scene, const ProgressiveSettings& settings);
+};
+
+//wavefront积分器每一波处理的最大路径数量
+constexpr uint32_t WAVEFRONT_MAX_PATH_NUM = 4096;
+
+//按分量分开存放的三维向量
+struct Float3SoA
+{
+    std::vector<float> x, y, z;
+
+    template <typename T>
+    void push_back(const T &v)
+    {
+        x.push_back(v.x);
+        y.push_back(v.y);
+        z.push_back(v.z);
+    }
+    template <typename T>
+    void set(uint32_t i, const T &v)
+    {
+        x[i] = v.x;
+        y[i] = v.y;
+        z[i] = v.z;
+    }
+    template <typename T>
+    T get(uint32_t i) const { return T(x[i], y[i], z[i]); }
+    void resize(size_t n)
+    {
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+    }
+    void clear()
+    {
+        x.clear();
+        y.clear();
+        z.clear();
+    }
+};
+
+//按分量分开存放的射线,不保存ray differential
+struct RaySoA
+{
+    Float3SoA o, d;
+    std::vector<float> t_max;
+    std::vector<float> time;
+    std::vector<uint32_t> mask;
+
+    void push_back(const Ray &ray)
+    {
+        o.push_back(ray.o);
+        d.push_back(ray.d);
+        t_max.push_back(ray.t_max);
+        time.push_back(ray.time);
+        mask.push_back(ray.mask);
+    }
+    Ray get(uint32_t i) const
+    {
+        Ray ray(o.get<Point3f>(i), d.get<Vector3f>(i), t_max[i]);
+        ray.time = time[i];
+        ray.mask = mask[i];
+        return ray;
+    }
+    void clear()
+    {
+        o.clear();
+        d.clear();
+        t_max.clear();
+        time.clear();
+        mask.clear();
+    }
+    uint32_t size() const { return static_cast<uint32_t>(t_max.size()); }
+};
+
+/**
+ * wavefront积分器中一个tile的路径状态队列(SoA)
+ * 每个阶段(生成射线,最近交点,着色,阴影)都会处理整个队列后再进入下一个阶段
+ * 射线和交点按分量存放,只保留后面的阶段会读到的分量:交点只有p和n,阴影射线不保存VisibilityTester
+ * L和shadow_contributions仍然是每条路径一个完整的Spectrum,它们只会整体累加,按波长拆开会让每次累加变成跨步的写入
+*/
+struct WavefrontPathQueue
+{
+    //ray generation
+    std::vector<Point2f> p_film;
+    std::vector<float> weights;
+    RaySoA rays;
+    //每条路径每个光源的2D样本,按照path_index * light_num + light_index存放
+    std::vector<Point2f> light_samples;
+    //closest hit,没有击中的路径不写入
+    Float3SoA hit_p, hit_n;
+    std::vector<uint32_t> hit_paths;
+    //shading
+    std::vector<Spectrum> L;
+    //shadow
+    std::vector<uint32_t> shadow_paths;
+    RaySoA shadow_rays;
+    std::vector<Spectrum> shadow_contributions;
+
+    void clear()
+    {
+        p_film.clear();
+        weights.clear();
+        rays.clear();
+        light_samples.clear();
+        hit_paths.clear();
+        shadow_paths.clear();
+        shadow_rays.clear();
+        shadow_contributions.clear();
+    }
+
+    uint32_t size() const { return rays.size(); }
+};
+
+/**
+ * 和Integrator得到相同的图像,但是每个阶段都是对一批射线进行处理
+*/
+class WavefrontIntegrator{
+    private:
+        Camera* _camera;
+        Sampler* _sampler;
+
+        void generate_camera_rays(Sampler *sampler, const Point2i *pixels, uint32_t pixel_num, uint32_t light_num, WavefrontPathQueue *queue) const;
+        void intersect_closest(const Scene &scene, WavefrontPathQueue *queue) const;
+        void shade(const Scene &scene, WavefrontPathQueue *queue) const;
+        void trace_shadow_rays(const Scene &scene, WavefrontPathQueue *queue) const;
     public:
-        Integrator(Camera* camera,Sampler* sampler):_camera(camera),_sampler(sampler){}
+        WavefrontIntegrator(Camera* camera,Sampler* sampler):_camera(camera),_sampler(sampler){}
         void render(const Scene& scene);
 };
 NARUKAMI_END
\ No newline at end of file
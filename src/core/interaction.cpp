@@ -39,12 +39,22 @@ Spectrum Le(const SurfaceInteraction& interaction,const Vector3f& wi)
     }
 }
 
+SampledSpectrum Le(const SurfaceInteraction& interaction,const Vector3f& wi,const SampledWavelengths& wavelengths)
+{
+    return SampledSpectrum(0.0f);
+}
+
 bool VisibilityTester::unoccluded(const Scene &scene) const
+{
+    return !scene.intersect(shadow_ray());
+}
+
+Ray VisibilityTester::shadow_ray() const
 {
     //TODO float percise
     Ray ray(_p0.p, _p1.p - _p0.p, 0.99f);
-    ray = offset_ray(ray, _p0.n);
-    return !scene.intersect(ray);
+    ray.mask = RAY_MASK_SHADOW;
+    return offset_ray(ray, _p0.n);
 }
 
 NARUKAMI_END
\ No newline at end of file
@@ -74,6 +74,7 @@ inline void compute_differential(const RayDifferential &ray,SurfaceInteraction&
 }
 
 Spectrum Le(const SurfaceInteraction& interaction,const Vector3f& wi);
+SampledSpectrum Le(const SurfaceInteraction& interaction,const Vector3f& wi,const SampledWavelengths& wavelengths);
 
 
 // _p0 is the start point
@@ -87,6 +88,7 @@ public:
     VisibilityTester() = default;
     VisibilityTester(const Interaction &p0, const Interaction &p1) : _p0(p0), _p1(p1) {}
     bool unoccluded(const Scene &scene) const;
+    Ray shadow_ray() const;
 };
 
 
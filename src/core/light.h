@@ -37,6 +37,11 @@ protected:
 public:
     Light(const shared<Transform> &light_to_world, const shared<Transform> &world_to_light) : _light_to_world(light_to_world), _world_to_light(world_to_light) {}
     virtual Spectrum sample_Li(const Interaction &interaction, const Point2f &u, Vector3f *wi, float *pdf, VisibilityTester *tester) = 0;
+    //hero wavelength模式下只在采样的波长上求值,子类可以重写以避免构造完整的Spectrum
+    virtual SampledSpectrum sample_Li(const Interaction &interaction, const Point2f &u, const SampledWavelengths &wavelengths, Vector3f *wi, float *pdf, VisibilityTester *tester)
+    {
+        return sample(sample_Li(interaction, u, wi, pdf, tester), wavelengths);
+    }
     virtual Spectrum power() const = 0;
 };
 
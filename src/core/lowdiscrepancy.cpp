@@ -22,6 +22,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include "core/lowdiscrepancy.h"
+#include <vector>
 NARUKAMI_BEGIN
 
 constexpr uint32_t SOBOL02_GENERATOR_MATRIX[2][32]=
@@ -120,6 +121,16 @@ inline void gray_code_sample(const uint32_t *C0, const uint32_t *C1, uint32_t n,
     }
 }
 
+uint32_t sobol02_u32(uint32_t idx, uint32_t dim)
+{
+    assert(dim < 2);
+    if (dim == 0)
+    {
+        return reverse_bits_u32(idx);
+    }
+    return multiply_generator(idx, REVERSED_SOBOL02_GENERATOR_MATRIX[1]);
+}
+
 Point2f sobol02(const uint32_t idx, const uint32_t scramble[2])
 {
     auto x = sample_generator_matrix(idx, REVERSED_SOBOL02_GENERATOR_MATRIX[0], scramble[0]);
@@ -127,7 +138,7 @@ Point2f sobol02(const uint32_t idx, const uint32_t scramble[2])
     return Point2f(x, y);
 }
 
-void sobol02(int sample_per_pixel, int pixel_num,Point2f *samples, RNG& rng)
+void sobol02(int sample_per_pixel, int pixel_num,Point2f *samples, RNG4& rng)
 {
     uint32_t total_sample_num = sample_per_pixel * pixel_num;
     const uint32_t *C0 = REVERSED_SOBOL02_GENERATOR_MATRIX[0];
@@ -146,7 +157,7 @@ float van_der_corput(const uint32_t idx, uint32_t scramble)
      return sample_generator_matrix(idx, REVERSED_VAN_DER_CORPUT_GENERATOR_MATRIX,scramble);
 }
 
-void van_der_corput(int sample_per_pixel, int pixel_num, float *samples, RNG& rng)
+void van_der_corput(int sample_per_pixel, int pixel_num, float *samples, RNG4& rng)
 {
     uint32_t total_sample_num = sample_per_pixel * pixel_num;
     const uint32_t *C = REVERSED_VAN_DER_CORPUT_GENERATOR_MATRIX;
@@ -161,4 +172,162 @@ void van_der_corput(int sample_per_pixel, int pixel_num, float *samples, RNG& rn
     
 }
 
+//记录每一种形状(2^(L-a) x 2^a)的基本区间有没有被占用,坐标为x和y的最高L位
+struct PMJ02Strata
+{
+    int L;
+    std::vector<uint8_t> occupied;
+
+    void reset(const uint32_t count, const uint32_t *samples, const uint32_t sample_num)
+    {
+        L = log2(static_cast<int>(count));
+        occupied.assign(static_cast<size_t>(L + 1) << L, 0);
+        for (uint32_t i = 0; i < sample_num; ++i)
+        {
+            mark(samples[2 * i] >> (32 - L), samples[2 * i + 1] >> (32 - L));
+        }
+    }
+
+    inline size_t cell(const int a, const uint32_t xs, const uint32_t ys) const
+    {
+        return (static_cast<size_t>(a) << L) + (((ys >> (L - a)) << (L - a)) | (xs >> a));
+    }
+
+    inline void mark(const uint32_t xs, const uint32_t ys)
+    {
+        for (int a = 0; a <= L; ++a)
+        {
+            occupied[cell(a, xs, ys)] = 1;
+        }
+    }
+
+    //y已经确定了高a位,逐位确定剩下的位,每确定一位就检查一种形状
+    bool search_y(const uint32_t xs, const uint32_t y_prefix, const int a, RNG &rng, uint32_t *ys) const
+    {
+        if (a == L)
+        {
+            (*ys) = y_prefix;
+            return true;
+        }
+        const uint32_t first = rng.next_uint32() & 1;
+        for (uint32_t k = 0; k < 2; ++k)
+        {
+            const uint32_t prefix = (y_prefix << 1) | (first ^ k);
+            if (occupied[(static_cast<size_t>(a + 1) << L) + ((prefix << (L - a - 1)) | (xs >> (a + 1)))])
+            {
+                continue;
+            }
+            if (search_y(xs, prefix, a + 1, rng, ys))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+//在子象限(qx,qy)(边长为2^-log2_sub)中放置一个点
+static bool pmj02_place(PMJ02Strata &strata, const uint32_t qx, const uint32_t qy, const int log2_sub, RNG &rng, uint32_t *sample)
+{
+    const int L = strata.L;
+    const int free_bits = L - log2_sub;
+    std::vector<uint32_t> columns;
+    for (uint32_t i = 0; i < (1u << free_bits); ++i)
+    {
+        const uint32_t xs = (qx << free_bits) | i;
+        if (!strata.occupied[strata.cell(0, xs, 0)])
+        {
+            columns.push_back(xs);
+        }
+    }
+    //随机的顺序尝试没有被占用的列
+    for (size_t i = 0; i < columns.size(); ++i)
+    {
+        std::swap(columns[i], columns[i + rng.next_uint32(static_cast<uint32_t>(columns.size() - i))]);
+        const uint32_t xs = columns[i];
+        bool free = true;
+        for (int a = 1; a <= log2_sub && free; ++a)
+        {
+            free = !strata.occupied[strata.cell(a, xs, (qy >> (log2_sub - a)) << (L - a))];
+        }
+        uint32_t ys;
+        if (free && strata.search_y(xs, qy, log2_sub, rng, &ys))
+        {
+            strata.mark(xs, ys);
+            //在最细的格子中抖动
+            sample[0] = (xs << (32 - L)) | (rng.next_uint32() >> L);
+            sample[1] = (ys << (32 - L)) | (rng.next_uint32() >> L);
+            return true;
+        }
+    }
+    return false;
+}
+
+void pmj02(uint32_t count, uint32_t *samples, RNG &rng)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    samples[0] = rng.next_uint32();
+    samples[1] = rng.next_uint32();
+    PMJ02Strata strata;
+    std::vector<uint8_t> flip_x;
+    //每一轮从N个点扩展到4N个点,n*n为前N个点所在的网格
+    for (uint32_t N = 1, log2_n = 0; N < count; N *= 4, ++log2_n)
+    {
+        const int log2_sub = log2_n + 1;
+        //N到2N:放在对角的子象限
+        strata.reset(2 * N, samples, N);
+        for (uint32_t i = 0; i < N && N + i < count; ++i)
+        {
+            const uint32_t qx = (samples[2 * i] >> (31 - log2_n)) ^ 1;
+            const uint32_t qy = (samples[2 * i + 1] >> (31 - log2_n)) ^ 1;
+            if (!pmj02_place(strata, qx, qy, log2_sub, rng, samples + 2 * (N + i)))
+            {
+                NARUKAMI_ERROR("pmj02: no free stratum for sample %u", N + i)
+            }
+        }
+        if (2 * N >= count)
+        {
+            break;
+        }
+        //2N到4N:剩下的两个子象限随机地分给两个新的点
+        strata.reset(4 * N, samples, 2 * N);
+        flip_x.resize(N);
+        for (uint32_t k = 2; k < 4; ++k)
+        {
+            for (uint32_t i = 0; i < N && k * N + i < count; ++i)
+            {
+                if (k == 2)
+                {
+                    flip_x[i] = rng.next_uint32() & 1;
+                }
+                const bool fx = (k == 2) == static_cast<bool>(flip_x[i]);
+                const uint32_t qx = (samples[2 * i] >> (31 - log2_n)) ^ (fx ? 1 : 0);
+                const uint32_t qy = (samples[2 * i + 1] >> (31 - log2_n)) ^ (fx ? 0 : 1);
+                if (!pmj02_place(strata, qx, qy, log2_sub, rng, samples + 2 * (k * N + i)))
+                {
+                    NARUKAMI_ERROR("pmj02: no free stratum for sample %u", k * N + i)
+                }
+            }
+        }
+    }
+}
+
+const uint32_t *pmj02_table(const uint32_t table)
+{
+    assert(table < PMJ02_TABLE_NUM);
+    static const std::vector<uint32_t> tables = []() {
+        std::vector<uint32_t> samples(2 * PMJ02_TABLE_SAMPLE_NUM * PMJ02_TABLE_NUM);
+        for (uint32_t i = 0; i < PMJ02_TABLE_NUM; ++i)
+        {
+            RNG rng(i + 1);
+            pmj02(PMJ02_TABLE_SAMPLE_NUM, &samples[2 * PMJ02_TABLE_SAMPLE_NUM * i], rng);
+        }
+        return samples;
+    }();
+    return &tables[2 * PMJ02_TABLE_SAMPLE_NUM * table];
+}
+
 NARUKAMI_END
\ No newline at end of file
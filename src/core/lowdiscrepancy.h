@@ -89,10 +89,95 @@ NARUKAMI_BEGIN
         }
     }
 
+    //每次批量生成64个随机数,再用乘法代替取模得到[0,count-i)中的索引
+    template<typename T>
+    void shuffle(T* samples,int count,int num_dim,RNG4&rng)
+    {
+        uint32_t r[64];
+        for(int start=0;start<count;start+=64)
+        {
+            const int n = min(64,count-start);
+            rng.fill_uint32(r,(n+3)&~3);
+            for(int k=0;k<n;++k)
+            {
+                const int i = start + k;
+                int other = i + static_cast<int>((static_cast<uint64_t>(r[k]) * (count-i)) >> 32);
+                for(int d=0;d<num_dim;++d)
+                {
+                    std::swap(samples[num_dim * i + d],samples[num_dim * other + d]);
+                }
+            }
+        }
+    }
+
+    /**
+     * 基于哈希的Owen scrambling,见Burley 2020,"Practical Hash-based Owen Scrambling"
+     * laine_karras_permutation中第i位只受更低位的影响,参数来自Vegdahl 2021
+     * 翻转bit后第i位只受更高位的影响,也就是对[0,1)上的32bit定点数做Owen scrambling
+    */
+    inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+    {
+        x ^= x * 0x3d20adeau;
+        x += seed;
+        x *= (seed >> 16) | 1u;
+        x ^= x * 0x05526c56u;
+        x ^= x * 0x53a22864u;
+        return x;
+    }
+
+    inline uint32_t owen_scramble_u32(uint32_t x, uint32_t seed)
+    {
+        return reverse_bits_u32(laine_karras_permutation(reverse_bits_u32(x), seed));
+    }
+
+    /**
+     * [0,count)上由seed决定的一个伪随机置换中第i个元素,count必须是2的幂
+     * 来自Kensler 2013,"Correlated Multi-Jittered Sampling",每一步在低log2(count)位上都是可逆的
+    */
+    inline uint32_t permutation_element(uint32_t i, const uint32_t count, const uint32_t seed)
+    {
+        assert(is_pow2(count));
+        const uint32_t w = count - 1;
+        i ^= seed;
+        i *= 0xe170893d;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3f;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+        return (i + seed) & w;
+    }
+
+    //Sobol序列第dim(0或1)维的第idx个点,32bit定点数;第0维就是van der Corput序列
+    uint32_t sobol02_u32(uint32_t idx, uint32_t dim);
+
     Point2f sobol02(const uint32_t idx,const uint32_t scramble[2]);
-    void sobol02(int sample_per_pixel, int pixel_num,Point2f *samples,RNG& rng);
+    void sobol02(int sample_per_pixel, int pixel_num,Point2f *samples,RNG4& rng);
 
     float van_der_corput(const uint32_t idx,uint32_t scramble);
-    void van_der_corput(int sample_per_pixel, int pixel_num,float *samples, RNG& rng);
+    void van_der_corput(int sample_per_pixel, int pixel_num,float *samples, RNG4& rng);
+
+    /**
+     * Progressive Multi-Jittered (0,2)序列(Christensen et al. 2018),samples中依次存放count个点的x和y,都是[0,1)上的32bit定点数
+     * 任意长度为2的幂的前缀都是(0,2)-net,其他长度的前缀也接近分层
+     * 新的点先放到已有点所在格子中空着的子象限,再在子象限中选一列没有被占用的x,然后逐位选择y使所有形状的基本区间都不冲突
+    */
+    void pmj02(uint32_t count, uint32_t *samples, RNG &rng);
+
+    //进程内共享的pmj02样本表,第一次使用时生成,之后只读
+    constexpr uint32_t PMJ02_TABLE_NUM = 16;
+    constexpr uint32_t PMJ02_TABLE_SAMPLE_NUM = 4096;
+    const uint32_t *pmj02_table(const uint32_t table);
    
 NARUKAMI_END
\ No newline at end of file
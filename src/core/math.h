@@ -69,6 +69,15 @@ inline int clz(uint32_t x)
 #endif
 }
 
+inline int popcount(uint32_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcount(x);
+#else
+    return static_cast<int>(__popcnt(x));
+#endif
+}
+
 //IEEE 754 float
 //[31][30 : 23][22 : 0]
 //[sign][exp][ma]
@@ -202,20 +211,13 @@ inline float rcp(const float x)
 #endif
 }
 
+/**
+ * 接近0的输入先换成MIN_RCP_INPUT再求倒数,符号和x>=0的判断一致
+ * 轴平行的射线在这个轴上得到有限的倒数,box测试中不会出现0*inf=NaN
+*/
 inline float safe_rcp(const float x)
 {
-#ifdef MATH_SSE_RCP
-    auto xxxx = _mm_set1_ps(x);
-    auto min_rcp_input = _mm_set1_ps(MIN_RCP_INPUT);
-    /**abs**/
-    auto mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
-    auto abs_xxxx = _mm_and_ps(xxxx, mask);
-    /**zero fix**/
-    float v = _mm_blendv_ps(xxxx, min_rcp_input, _mm_cmplt_ps(abs_xxxx, min_rcp_input)).m128_f32[0];
-    return rcp(v);
-#else
-    return rcp(x);
-#endif
+    return rcp(abs(x) < MIN_RCP_INPUT ? (x >= 0.0f ? MIN_RCP_INPUT : -MIN_RCP_INPUT) : x);
 }
 //速度快但是近似
 inline float rsqrt(const float x)
@@ -339,6 +341,16 @@ inline uint32_t reverse_bits_u32(uint32_t x)
     x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
     return x;
 }
+//from pbrt-v4,64bit的哈希,用来把多个整数组合成随机的种子
+inline uint64_t mix_bits(uint64_t v)
+{
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= (v >> 33);
+    return v;
+}
 //TODO 搞清楚原理
 inline uint32_t round_up_pow2(uint32_t v)
 {
@@ -355,4 +367,38 @@ inline bool is_pow2(uint32_t v)
 {
     return v != 0 && (v & (v - 1)) == 0;
 }
+
+//from pbrt
+//把低10位的每一位之间插入两个0
+inline uint32_t left_shift3(uint32_t x)
+{
+    if (x == (1 << 10))
+        --x;
+    x = (x | (x << 16)) & 0x30000ff;
+    x = (x | (x << 8)) & 0x300f00f;
+    x = (x | (x << 4)) & 0x30c30c3;
+    x = (x | (x << 2)) & 0x9249249;
+    return x;
+}
+
+inline uint32_t encode_morton3(uint32_t x, uint32_t y, uint32_t z)
+{
+    return (left_shift3(z) << 2) | (left_shift3(y) << 1) | left_shift3(x);
+}
+
+//把低16位的每一位之间插入一个0
+inline uint32_t left_shift2(uint32_t x)
+{
+    x &= 0xffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+inline uint32_t encode_morton2(uint32_t x, uint32_t y)
+{
+    return (left_shift2(y) << 1) | left_shift2(x);
+}
 NARUKAMI_END
\ No newline at end of file
@@ -320,6 +320,22 @@ inline Matrix4x4 blockwise_inverse(const Matrix4x4 &mat)
     return r;
 }
 
+//左上角3x3有非对角元素,也就是带有旋转或者切变
+inline bool has_rotation(const Matrix4x4 &mat)
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        for (int r = 0; r < 3; ++r)
+        {
+            if (c != r && mat.mn[c][r] != 0.0f)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 inline Matrix4x4 transpose(const Matrix4x4 &mat)
 {
     Matrix4x4 r(mat);
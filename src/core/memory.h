@@ -29,6 +29,7 @@ SOFTWARE.
 #include "math.h"
 #include <list>
 #include <vector>
+#include <algorithm>
 #include "stat.h"
 
 NARUKAMI_BEGIN
@@ -170,6 +171,20 @@ class MemoryArena{
 			_current_block_pos=0;
 		}
 
+		//所有block的大小之和
+		size_t allocated_size() const{
+			size_t size = _current_block ? _current_alloc_size : 0;
+			for (auto &i : _used )
+			{
+				size += i.first;
+			}
+			for (auto &i : _available )
+			{
+				size += i.first;
+			}
+			return size;
+		}
+
 		~MemoryArena(){
 			for (auto &i : _used )
 			{
@@ -245,45 +260,86 @@ class MemoryPool
 	}
 };
 
-template<typename T,int deep>
-class LocalStack
+/**
+ * 前deep个元素直接存放在对象内部,超出后转移到堆上
+ * push不会越界,适合深度无法预知的树遍历
+*/
+template<typename T,uint32_t deep>
+class InlineStack
 {
 	private:
+		T _local[deep];
+		std::vector<T> _heap;
 		T* _data;
-		int _top;
+		uint32_t _capacity;
+		uint32_t _top;
+
+		void grow(uint32_t capacity)
+		{
+			std::vector<T> heap(capacity);
+			std::copy(_data, _data + _top, heap.begin());
+			_heap.swap(heap);
+			_data = &_heap[0];
+			_capacity = capacity;
+		}
 	public:
-	LocalStack()
+	InlineStack():_data(_local),_capacity(deep),_top(0){}
+
+	InlineStack(const InlineStack&) = delete;
+	InlineStack& operator=(const InlineStack&) = delete;
+
+	//预先分配足够的空间,之后的push不再需要扩容
+	void reserve(uint32_t capacity)
 	{
-		_data = reinterpret_cast<T*>(alloca(deep * sizeof(T)));
-		_top = 0;
+		if(capacity > _capacity)
+		{
+			grow(capacity);
+		}
 	}
 
-	T top() const
+	const T& top() const
 	{
+		assert(_top > 0);
 		return _data[_top - 1];
 	}
 
 	T pop()
 	{
+		assert(_top > 0);
 		_top--;
 		return _data[_top];
 	}
 
 	void push(const T& v)
 	{
+		if(EXPECT_NOT_TAKEN(_top == _capacity))
+		{
+			grow(_capacity * 2);
+		}
 		_data[_top] = v;
 		_top++;
 	}
 
+	void clear()
+	{
+		_top = 0;
+	}
+
 	bool empty() const
 	{
-		return _top <= 0;
+		return _top == 0;
+	}
+
+	uint32_t size() const
+	{
+		return _top;
 	}
 
-	bool full() const
+	//是否使用了堆上的空间
+	bool spilled() const
 	{
-		return _top >= deep;
-	} 
+		return _data != _local;
+	}
 };
 
 NARUKAMI_END
@@ -29,6 +29,11 @@ shared<Mesh> create_plane(const shared<Transform> &object2world, const shared<Tr
 
 }
 
+shared<Mesh> transform_mesh(const shared<Mesh> &mesh, const shared<Transform> &object2world, const shared<Transform> &world2object)
+{
+    return std::make_shared<Mesh>(object2world, world2object, mesh->positions(), mesh->normals(), mesh->texcoords(), mesh->segments());
+}
+
 // std::vector<shared<TriangleMesh>> create_disk(const shared<Transform>&object2wrold, const shared<Transform>&world2object, float radius, const uint32_t vertex_density)
 // {
 //     assert(radius > 0);
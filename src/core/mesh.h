@@ -193,6 +193,11 @@ public:
     inline size_t get_segment_count() const { return _segments.size(); }
     inline size_t get_face_count(uint32_t segment) const { return _segments[segment].faces.size(); }
 
+    inline const std::vector<Point3f> &positions() const { return _positions; }
+    inline const std::vector<Normal3f> &normals() const { return _normals; }
+    inline const std::vector<Point2f> &texcoords() const { return _texcoords; }
+    inline const std::vector<MeshSegment> &segments() const { return _segments; }
+
     inline friend std::ostream &operator<<(std::ostream &out, const Mesh &mesh)
     {
         out << "[ vertex num:" << mesh._positions.size() << " normal num:" << mesh._normals.size() << " texcoord num:" << mesh._texcoords.size() << " segment num:" << mesh._segments.size() << " ]";
@@ -201,6 +206,8 @@ public:
 };
 
 shared<Mesh> create_plane(const shared<Transform> &object2world, const shared<Transform> &world2object, const float width, const float height);
+//把已经在world空间的mesh再做一次变换,新mesh的object空间就是原mesh的world空间
+shared<Mesh> transform_mesh(const shared<Mesh> &mesh, const shared<Transform> &object2world, const shared<Transform> &world2object);
 // std::vector<shared<TriangleMesh>> create_disk(const shared<Transform> &object2worldobject2wrold, const shared<Transform> &object2worldworld2object, float radius, const uint32_t vertex_density);
 
 NARUKAMI_END
@@ -38,6 +38,7 @@ SOFTWARE.
 #define EXPECT_TAKEN(a)        __builtin_expect(!!(a), true)
 #define EXPECT_NOT_TAKEN(a)    __builtin_expect(!!(a), false)
 #define MAYBE_UNUSED           __attribute__((unused))
+#define NARUKAMI_TARGET(isa)   __attribute__((target(isa)))
 #elif defined(_MSC_VER)
 #define FINLINE                __forceinline
 #define NOINLINE               __declspec(noinline)
@@ -45,6 +46,7 @@ SOFTWARE.
 #define EXPECT_TAKEN(a)        (a)
 #define EXPECT_NOT_TAKEN(a)    (a)
 #define MAYBE_UNUSED     
+#define NARUKAMI_TARGET(isa)
 #include <intrin.h>
 #else
 #error Unsupported compiler!
@@ -61,6 +61,9 @@ public:
     Point3f get_vertex(uint32_t vertex) const { return _mesh->get_vertex(_segment, _face, vertex); }
     Point2f get_texcoord(const Point2f &u) const { return _mesh->get_texcoord(_segment, _face, u); }
     Point2f get_texcoord(uint32_t vertex) const { return _mesh->get_texcoord(_segment, _face, vertex); }
+    const shared<Mesh> &mesh() const { return _mesh; }
+    uint32_t segment() const { return _segment; }
+    uint32_t face() const { return _face; }
 
     void *operator new(size_t size);
     void operator delete(void *ptr);
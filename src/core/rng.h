@@ -25,6 +25,8 @@ SOFTWARE.
 
 #include "core/narukami.h"
 #include "core/math.h"
+#include "core/simd.h"
+#include "core/geometry.h"
 NARUKAMI_BEGIN
 
 //random number generator
@@ -36,6 +38,14 @@ static inline uint64_t rotl(const uint64_t x, int k)
     return (x << k) | (x >> (64 - k));
 }
 
+static inline uint64_t splitmix64(uint64_t seed)
+{
+    uint64_t z = (seed += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
 #define DEFAULT_STATE 0x853c49e6748fea9bULL
 
 class RNG
@@ -43,14 +53,6 @@ class RNG
 private:
     uint64_t _s[2]; //state
 
-    inline uint64_t splitmix64(uint64_t seed) const
-    {
-        uint64_t z = (seed += UINT64_C(0x9E3779B97F4A7C15));
-        z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
-        z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
-        return z ^ (z >> 31);
-    }
-
     inline uint64_t next()
     {
         const uint64_t s0 = _s[0];
@@ -104,4 +106,136 @@ public:
     }
 };
 
+//4条独立的xoshiro128+,每条lane的状态是4个32bit,一次调用得到4个随机数
+//http://xoshiro.di.unimi.it/xoshiro128plus.c
+class RNG4
+{
+private:
+    __m128i _s[4]; //state
+    //逐个取用时的缓存
+    alignas(16) uint32_t _buffer[4];
+    uint32_t _buffer_idx;
+
+    template <int k>
+    static inline __m128i rotl(const __m128i x)
+    {
+        return _mm_or_si128(_mm_slli_epi32(x, k), _mm_srli_epi32(x, 32 - k));
+    }
+
+    //只用高24位,低位的线性相关性较强
+    static inline float4 to_float4(const __m128i x)
+    {
+        return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(x, 8)), _mm_set1_ps(0x1p-24f));
+    }
+
+    static inline __m128i next(__m128i &s0, __m128i &s1, __m128i &s2, __m128i &s3)
+    {
+        const __m128i result = _mm_add_epi32(s0, s3);
+        const __m128i t = _mm_slli_epi32(s1, 9);
+        s2 = _mm_xor_si128(s2, s0);
+        s3 = _mm_xor_si128(s3, s1);
+        s1 = _mm_xor_si128(s1, s2);
+        s0 = _mm_xor_si128(s0, s3);
+        s2 = _mm_xor_si128(s2, t);
+        s3 = rotl<11>(s3);
+        return result;
+    }
+
+    //批量生成时状态放在局部变量中,避免每次写出结果后重新读取状态
+    template <typename Store>
+    inline void fill(const uint32_t count, Store store)
+    {
+        __m128i s0 = _s[0], s1 = _s[1], s2 = _s[2], s3 = _s[3];
+        for (uint32_t i = 0; i < count; i += 4)
+        {
+            store(i, next(s0, s1, s2, s3));
+        }
+        _s[0] = s0, _s[1] = s1, _s[2] = s2, _s[3] = s3;
+    }
+
+public:
+    inline RNG4(const uint64_t seed = DEFAULT_STATE)
+    {
+        set_seed(seed);
+    }
+
+    //splitmix64的连续8个输出作为4条lane的状态
+    inline void set_seed(const uint64_t seed)
+    {
+        alignas(16) uint32_t s[4][4];
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            const uint64_t a = splitmix64(seed + (2 * lane) * UINT64_C(0x9E3779B97F4A7C15));
+            const uint64_t b = splitmix64(seed + (2 * lane + 1) * UINT64_C(0x9E3779B97F4A7C15));
+            s[0][lane] = static_cast<uint32_t>(a);
+            s[1][lane] = static_cast<uint32_t>(a >> 32);
+            s[2][lane] = static_cast<uint32_t>(b);
+            s[3][lane] = static_cast<uint32_t>(b >> 32) | 1; //状态不能全为0
+        }
+        for (int i = 0; i < 4; ++i)
+        {
+            _s[i] = _mm_load_si128(reinterpret_cast<const __m128i *>(s[i]));
+        }
+        _buffer_idx = 4;
+    }
+
+    inline __m128i next_uint32x4()
+    {
+        return next(_s[0], _s[1], _s[2], _s[3]);
+    }
+
+    //[0,1)
+    inline float4 next_float4()
+    {
+        return to_float4(next_uint32x4());
+    }
+
+    inline uint32_t next_uint32()
+    {
+        if (_buffer_idx == 4)
+        {
+            _mm_store_si128(reinterpret_cast<__m128i *>(_buffer), next_uint32x4());
+            _buffer_idx = 0;
+        }
+        return _buffer[_buffer_idx++];
+    }
+
+    //[0,upper_bound),用乘法代替取模
+    inline uint32_t next_uint32(const uint32_t upper_bound)
+    {
+        return static_cast<uint32_t>((static_cast<uint64_t>(next_uint32()) * upper_bound) >> 32);
+    }
+
+    inline float next_float()
+    {
+        return (next_uint32() >> 8) * 0x1p-24f;
+    }
+
+    inline void fill_uint32(uint32_t *samples, const uint32_t count)
+    {
+        const uint32_t vector_count = count & ~3u;
+        fill(vector_count, [samples](const uint32_t i, const __m128i r) { _mm_storeu_si128(reinterpret_cast<__m128i *>(samples + i), r); });
+        for (uint32_t i = vector_count; i < count; ++i)
+        {
+            samples[i] = next_uint32();
+        }
+    }
+
+    inline void fill_1D(float *samples, const uint32_t count)
+    {
+        const uint32_t vector_count = count & ~3u;
+        fill(vector_count, [samples](const uint32_t i, const __m128i r) { _mm_storeu_ps(samples + i, to_float4(r)); });
+        for (uint32_t i = vector_count; i < count; ++i)
+        {
+            samples[i] = next_float();
+        }
+    }
+
+    inline void fill_2D(Point2f *samples, const uint32_t count)
+    {
+        static_assert(sizeof(Point2f) == 2 * sizeof(float), "Point2f must be two packed floats");
+        fill_1D(&samples[0].x, 2 * count);
+    }
+};
+
 NARUKAMI_END
\ No newline at end of file
@@ -25,42 +25,55 @@ SOFTWARE.
 #include "core/sampler.h"
 
 NARUKAMI_BEGIN
-Sampler::Sampler(const uint32_t spp, const uint32_t max_dim):_dim_1d(0),_dim_2d(0),_sample_idx(0),_spp(round_up_pow2(spp)),_max_dim(max_dim)
+LowDiscrepancySampler::LowDiscrepancySampler(const uint32_t spp, const uint32_t max_dim):Sampler(round_up_pow2(spp)),_dim_1d(0),_dim_2d(0),_seed(0),_dimensions(2 * max_dim),_rng_ready(false),_max_dim(max_dim)
 {
-    _samples_1d.resize(_max_dim);
-    for(int i=0;i<_samples_1d.size();++i)
+    if(!is_pow2(spp))
     {
-        _samples_1d[i].resize(_spp);
+        NARUKAMI_WARNING("LowDiscrepancySampler: spp %u is rounded up to %u, use PMJ02Sampler for arbitrary spp", spp, _spp)
     }
+}
+
+static inline float to_float(const uint32_t v)
+{
+    return min(v * 0x1p-32f, ONE_MINUS_EPSILON);
+}
+
+uint64_t LowDiscrepancySampler::hash(const uint64_t v) const
+{
+    const uint64_t pixel = (static_cast<uint64_t>(static_cast<uint32_t>(_pixel.x)) << 32) | static_cast<uint32_t>(_pixel.y);
+    return mix_bits(pixel ^ mix_bits(v ^ mix_bits(_seed)));
+}
 
-    _samples_2d.resize(_max_dim);
-     for(int i=0;i<_samples_2d.size();++i)
+RNG4 &LowDiscrepancySampler::rng()
+{
+    if (EXPECT_NOT_TAKEN(!_rng_ready))
     {
-        _samples_2d[i].resize(_spp);
+        _rng.set_seed(hash((static_cast<uint64_t>(_sample_idx) << 32) | 0xFFFFFFFFu));
+        _rng_ready = true;
     }
+    return _rng;
 }
 
-void Sampler::start_pixel(const Point2i &p)
+void LowDiscrepancySampler::start_pixel(const Point2i &p)
 {
+    _pixel = p;
     _dim_1d = 0;
     _dim_2d = 0;
     _sample_idx = 0;
-
-    for(int i=0;i<_samples_1d.size();++i)
-    {
-        van_der_corput(_spp,1,&_samples_1d[i][0],_rng);
-    }
-
-    for(int i=0;i<_samples_2d.size();++i)
+    _rng_ready = false;
+    for (uint32_t i = 0; i < _dimensions.size(); ++i)
     {
-        sobol02(_spp,1,&_samples_2d[i][0],_rng);
+        const uint64_t h0 = hash(i);
+        const uint64_t h1 = mix_bits(h0);
+        auto &dimension = _dimensions[i];
+        dimension.permutation = static_cast<uint32_t>(h0);
+        dimension.scramble[0] = static_cast<uint32_t>(h1);
+        dimension.scramble[1] = static_cast<uint32_t>(h1 >> 32);
     }
 }
 
 bool Sampler::start_next_sample()
 {
-    _dim_1d = 0;
-    _dim_2d = 0;
     _sample_idx += 1;
     if(_sample_idx == _spp)
     {
@@ -70,33 +83,96 @@ bool Sampler::start_next_sample()
     return true;
 }
 
+bool LowDiscrepancySampler::start_next_sample()
+{
+    _dim_1d = 0;
+    _dim_2d = 0;
+    _rng_ready = false;
+    return Sampler::start_next_sample();
+}
 
-Point2f Sampler::get_2D()
+
+Point2f LowDiscrepancySampler::get_2D()
 {
     
     if (EXPECT_TAKEN(_dim_2d < _max_dim))
     {
-        return _samples_2d[_dim_2d++][_sample_idx];
+        const auto &dimension = _dimensions[2 * _dim_2d++ + 1];
+        const uint32_t idx = permutation_element(_sample_idx, _spp, dimension.permutation);
+        return Point2f(to_float(sobol02_u32(idx, 0) ^ dimension.scramble[0]), to_float(sobol02_u32(idx, 1) ^ dimension.scramble[1]));
     }
     else
     {
-        auto sample = Point2f(_rng.next_float(), _rng.next_float());
+        auto &r = rng();
+        auto sample = Point2f(r.next_float(), r.next_float());
         _dim_2d++;
         return sample;
     }
 }
-float Sampler::get_1D()
+float LowDiscrepancySampler::get_1D()
 {
     if (EXPECT_TAKEN(_dim_1d < _max_dim))
     {
-        return _samples_1d[_dim_1d++][_sample_idx];
+        const auto &dimension = _dimensions[2 * _dim_1d++];
+        return to_float(sobol02_u32(permutation_element(_sample_idx, _spp, dimension.permutation), 0) ^ dimension.scramble[0]);
     }
     else
     {
         _dim_1d++;
-        return _rng.next_float();
+        return rng().next_float();
+    }
+}
+void LowDiscrepancySampler::fill_1D(float *samples, const uint32_t count)
+{
+    uint32_t i = 0;
+    for (; i < count && _dim_1d < _max_dim; ++i)
+    {
+        samples[i] = get_1D();
     }
+    if (i < count)
+    {
+        rng().fill_1D(samples + i, count - i);
+        _dim_1d += count - i;
+    }
+}
+
+void LowDiscrepancySampler::fill_2D(Point2f *samples, const uint32_t count)
+{
+    uint32_t i = 0;
+    for (; i < count && _dim_2d < _max_dim; ++i)
+    {
+        samples[i] = get_2D();
+    }
+    if (i < count)
+    {
+        rng().fill_2D(samples + i, count - i);
+        _dim_2d += count - i;
+    }
+}
+
+void Sampler::start_pixel_sample(const Point2i &p, const uint32_t sample_idx)
+{
+    assert(sample_idx < _spp);
+    start_pixel(p);
+    _sample_idx = sample_idx;
 }
+
+void Sampler::fill_1D(float *samples, const uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        samples[i] = get_1D();
+    }
+}
+
+void Sampler::fill_2D(Point2f *samples, const uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        samples[i] = get_2D();
+    }
+}
+
 CameraSample Sampler::get_camera_sample(const Point2i &raster)
 {
     CameraSample cs;
@@ -105,10 +181,11 @@ CameraSample Sampler::get_camera_sample(const Point2i &raster)
     cs.time = get_1D();
     return cs;
 }
-std::unique_ptr<Sampler> Sampler::clone(const uint64_t seed) const
+std::unique_ptr<Sampler> LowDiscrepancySampler::clone(const uint64_t seed) const
 {
-    auto sampler = narukami::make_unique<Sampler>(*this);
-    sampler->_rng.set_seed(seed);
+    auto sampler = narukami::make_unique<LowDiscrepancySampler>(*this);
+    sampler->_seed = seed;
+    sampler->_rng_ready = false;
     return sampler;
 }
 NARUKAMI_END
\ No newline at end of file
@@ -37,26 +37,71 @@ struct CameraSample
     float time;
 };
 
+/**
+ * 采样器的接口,每个线程(tile)通过clone得到自己的采样器
+ * 一个像素内依次调用start_pixel,然后每个样本调用get_1D/get_2D,再用start_next_sample切换到下一个样本
+*/
 class Sampler
 {
+protected:
+    uint32_t _sample_idx;
+    const uint32_t _spp;
+
+public:
+    Sampler(const uint32_t spp) : _sample_idx(0), _spp(spp) {}
+    virtual ~Sampler() {}
+    virtual void start_pixel(const Point2i &p) = 0;
+    //从像素的第sample_idx个样本开始,用于分多遍渲染
+    //样本只能由(像素,样本,维度)决定,和之前取过哪些像素,每个样本取了多少维无关,分多遍渲染才和一次渲染相同
+    void start_pixel_sample(const Point2i &p, const uint32_t sample_idx);
+    virtual bool start_next_sample();
+    virtual Point2f get_2D() = 0;
+    virtual float get_1D() = 0;
+    //一次取当前样本接下来的count个维度,消耗的维度和连续调用count次get_1D/get_2D相同
+    virtual void fill_1D(float *samples, const uint32_t count);
+    virtual void fill_2D(Point2f *samples, const uint32_t count);
+    CameraSample get_camera_sample(const Point2i &raster);
+    inline uint32_t get_spp() const { return _spp; }
+    virtual std::unique_ptr<Sampler> clone(const uint64_t seed) const = 0;
+};
+
+/**
+ * 前max_dim维使用van der Corput和Sobol(0,2)样本,超出的维度使用RNG4
+ * 每个维度的样本顺序和scramble都由(像素,维度,seed)的hash决定,不需要在像素开始时生成样本表
+ * 超出max_dim的维度在每个样本开始时用(像素,样本,seed)的hash重新设置RNG4,所以任意样本都可以直接开始
+ * spp会被向上取整到2的幂
+*/
+class LowDiscrepancySampler : public Sampler
+{
 private:
-    
+    Point2i _pixel;
     uint32_t _dim_1d;
     uint32_t _dim_2d;
-    uint32_t _sample_idx;
-    std::vector<std::vector<float>> _samples_1d;
-    std::vector<std::vector<Point2f>> _samples_2d;
-    RNG _rng;
-    const uint32_t _spp;
+    uint64_t _seed;
+    //一个维度的样本顺序和scramble
+    struct Dimension
+    {
+        uint32_t permutation;
+        uint32_t scramble[2];
+    };
+    //当前像素前max_dim维的参数,1D和2D交替存放,每个像素开始时计算一次
+    std::vector<Dimension> _dimensions;
+    RNG4 _rng;
+    //_rng是否已经按照当前样本设置了种子,只有用到超出max_dim的维度时才设置
+    bool _rng_ready;
     const uint32_t _max_dim;
+
+    uint64_t hash(const uint64_t v) const;
+    RNG4 &rng();
+
 public:
-    Sampler(const uint32_t spp, const uint32_t max_dim = 5);
-    void start_pixel(const Point2i &p);
-    bool start_next_sample();
-    Point2f get_2D();
-    float get_1D();
-    CameraSample get_camera_sample(const Point2i &raster);
-    inline uint32_t get_spp() const{return _spp;}
-    std::unique_ptr<Sampler> clone(const uint64_t seed) const;
+    LowDiscrepancySampler(const uint32_t spp, const uint32_t max_dim = 5);
+    void start_pixel(const Point2i &p) override;
+    bool start_next_sample() override;
+    Point2f get_2D() override;
+    float get_1D() override;
+    void fill_1D(float *samples, const uint32_t count) override;
+    void fill_2D(Point2f *samples, const uint32_t count) override;
+    std::unique_ptr<Sampler> clone(const uint64_t seed) const override;
 };
 NARUKAMI_END
\ No newline at end of file
@@ -45,5 +45,21 @@ class Scene{
         inline bool intersect(const Ray& ray) const{
              return _accelerator->intersect(ray);
         }
+
+        inline void intersect_packet(const Ray* rays,uint32_t lane_mask,SurfaceInteraction* interactions,bool* hits) const{
+            _accelerator->intersect_packet(rays,lane_mask,interactions,hits);
+        }
+
+        inline void occluded_packet(const Ray* rays,uint32_t lane_mask,bool* occluded) const{
+            _accelerator->occluded_packet(rays,lane_mask,occluded);
+        }
+
+        inline void intersect_stream(const RayStream& rays,HitRecord* hits) const{
+            _accelerator->intersect_stream(rays,hits);
+        }
+
+        inline void occluded_stream(const RayStream& rays,bool* occluded) const{
+            _accelerator->occluded_stream(rays,occluded);
+        }
 };
 NARUKAMI_END
\ No newline at end of file
@@ -137,7 +137,8 @@ float average_spd_sample(const float *lambda, const float *sample, int n, float
     return sum / (lambda1 - lambda0);
 }
 
-Spectrum from_sample_data(const float *lambda, float *sample, int n)
+template <typename SpectrumType>
+SpectrumType from_sample_data(const float *lambda, float *sample, int n)
 {
     if (!is_sorted_spd_by_wavelength(lambda, n))
     {
@@ -148,44 +149,37 @@ Spectrum from_sample_data(const float *lambda, float *sample, int n)
         lambda = &sorted_lambda[0];
         sample = &sorted_sample[0];
     }
-    Spectrum spd;
-    for (int i = 0; i < SPD_SAMPLE_COUNT; ++i)
+    SpectrumType spd;
+    for (int i = 0; i < SpectrumType::SAMPLE_COUNT; ++i)
     {
-        float lambda0 = lerp(WAVELENGTH_MIN, WAVELENGTH_MAX, float(i) / SPD_SAMPLE_COUNT);
-        float lambda1 = lerp(WAVELENGTH_MIN, WAVELENGTH_MAX, float(i + 1) / SPD_SAMPLE_COUNT);
+        float lambda0 = lerp(SpectrumType::WAVELENGTH_MIN, SpectrumType::WAVELENGTH_MAX, float(i) / SpectrumType::SAMPLE_COUNT);
+        float lambda1 = lerp(SpectrumType::WAVELENGTH_MIN, SpectrumType::WAVELENGTH_MAX, float(i + 1) / SpectrumType::SAMPLE_COUNT);
         spd[i] = average_spd_sample(lambda, sample, n, lambda0, lambda1);
     }
     return spd;
 }
 
-Spectrum Spectrum::X;
-Spectrum Spectrum::Y;
-Spectrum Spectrum::Z;
-void Spectrum::init()
+//直接使用cie.h中编译期计算好的表
+template <int SampleCount, int LambdaMin, int LambdaMax>
+const BasicSpectrum<SampleCount, LambdaMin, LambdaMax> BasicSpectrum<SampleCount, LambdaMin, LambdaMax>::X(cie_matching_functions<SampleCount, LambdaMin, LambdaMax>.x);
+template <int SampleCount, int LambdaMin, int LambdaMax>
+const BasicSpectrum<SampleCount, LambdaMin, LambdaMax> BasicSpectrum<SampleCount, LambdaMin, LambdaMax>::Y(cie_matching_functions<SampleCount, LambdaMin, LambdaMax>.y);
+template <int SampleCount, int LambdaMin, int LambdaMax>
+const BasicSpectrum<SampleCount, LambdaMin, LambdaMax> BasicSpectrum<SampleCount, LambdaMin, LambdaMax>::Z(cie_matching_functions<SampleCount, LambdaMin, LambdaMax>.z);
+
+bool load_srgb_coeff()
 {
-    for (int i = 0; i < SPD_SAMPLE_COUNT; ++i)
-    {
-#if 0
-        float lambda0 = lerp(WAVELENGTH_MIN, WAVELENGTH_MAX, float(i) / float(SPD_SAMPLE_COUNT));
-        float lambda1 = lerp(WAVELENGTH_MIN, WAVELENGTH_MAX, float(i + 1) / float(SPD_SAMPLE_COUNT));
-        //这段代码使用的是插值的方式来算X,Y,Z的频谱样本,使用的是PBRT的方式
-        X[i] = average_spd_sample(CIE_lambda, CIE_X, WAVELENGTH_COUNT, lambda0, lambda1);
-        Y[i] = average_spd_sample(CIE_lambda, CIE_Y, WAVELENGTH_COUNT, lambda0, lambda1);
-        Z[i] = average_spd_sample(CIE_lambda, CIE_Z, WAVELENGTH_COUNT, lambda0, lambda1);
-#else
-        //这里直接采样了cie1931中已经算好的样本
-        X[i] = static_cast<float>(cie_x[i]);
-        Y[i] = static_cast<float>(cie_y[i]);
-        Z[i] = static_cast<float>(cie_z[i]);
-#endif
-    }
+    srgb_coeff = nullptr;
+    srgb_coeff = rgb2spec_load("./srgb.coeff");
+    if (srgb_coeff == nullptr)
     {
-        srgb_coeff = nullptr;
-        srgb_coeff = rgb2spec_load("./srgb.coeff");
+        NARUKAMI_WARNING("can't load ./srgb.coeff, from_srgb_to_spd is unavailable")
+        return false;
     }
+    return true;
 }
 
-void Spectrum::free()
+void free_srgb_coeff()
 {
     if(srgb_coeff)
     {
@@ -193,24 +187,34 @@ void Spectrum::free()
     }
 }
 
-void from_spd_to_xyz(const Spectrum &spd, float xyz[3])
+template <typename SpectrumType>
+void from_spd_to_xyz(const SpectrumType &spd, float xyz[3])
 {
-    float4 xxxx, yyyy, zzzz;
-    for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
-    {
-        xxxx += spd.samples[i] * Spectrum::X.samples[i];
-        yyyy += spd.samples[i] * Spectrum::Y.samples[i];
-        zzzz += spd.samples[i] * Spectrum::Z.samples[i];
-    }
+    spectrum_kernels().dot_xyz(spd.data(), SpectrumType::X.data(), SpectrumType::Y.data(), SpectrumType::Z.data(), SpectrumType::FLOAT_COUNT, xyz);
+
+    float scale = (SpectrumType::WAVELENGTH_MAX - SpectrumType::WAVELENGTH_MIN) / (CIE_Y_integral * SpectrumType::SAMPLE_COUNT);
+    xyz[0] *= scale;
+    xyz[1] *= scale;
+    xyz[2] *= scale;
+}
 
-    float x = vreduce_add(xxxx)[0];
-    float y = vreduce_add(yyyy)[0];
-    float z = vreduce_add(zzzz)[0];
+void from_sampled_spectrum_to_xyz(const SampledSpectrum &s, const SampledWavelengths &wavelengths, float xyz[3])
+{
+    const float4 l = s.values / wavelengths.pdf;
+    const float scale = 1.0f / (CIE_Y_integral * SAMPLED_WAVELENGTH_COUNT);
+    xyz[0] = reduce_add(l * sample(Spectrum::X, wavelengths).values) * scale;
+    xyz[1] = reduce_add(l * sample(Spectrum::Y, wavelengths).values) * scale;
+    xyz[2] = reduce_add(l * sample(Spectrum::Z, wavelengths).values) * scale;
+}
 
-    float scale = (WAVELENGTH_MAX - WAVELENGTH_MIN) / (CIE_Y_integral * SPD_SAMPLE_COUNT);
-    xyz[0] = x * scale;
-    xyz[1] = y * scale;
-    xyz[2] = z * scale;
+void from_sampled_spectrum_to_spd(const SampledSpectrum &s, const SampledWavelengths &wavelengths, Spectrum &spd)
+{
+    const float4 l = s.values / wavelengths.pdf;
+    const float scale = SPD_SAMPLE_COUNT / (static_cast<float>(WAVELENGTH_MAX - WAVELENGTH_MIN) * SAMPLED_WAVELENGTH_COUNT);
+    for (int i = 0; i < SAMPLED_WAVELENGTH_COUNT; ++i)
+    {
+        spd[spd_sample_index(wavelengths.lambda[i])] += l[i] * scale;
+    }
 }
 
 void from_xyz_to_srgb(const float xyz[3], float rgb[3])
@@ -220,18 +224,49 @@ void from_xyz_to_srgb(const float xyz[3], float rgb[3])
     rgb[2] = 0.055648f * xyz[0] - 0.204043f * xyz[1] + 1.057311f * xyz[2];
 }
 
-void from_srgb_to_spd(float rgb[3],Spectrum &spd)
+template <typename SpectrumType>
+void from_srgb_to_spd(float rgb[3], SpectrumType &spd)
+{
+    from_sigmoid_polynomial_to_spd(from_srgb_to_sigmoid_polynomial(rgb), spd);
+}
+
+void from_srgb_to_sigmoid_polynomial(const float *rgb, SigmoidPolynomial *polys, int n)
+{
+    static_assert(RGB2SPEC_N_COEFFS == 3, "SigmoidPolynomial expects 3 coefficients");
+    assert(srgb_coeff != nullptr);
+    for (int i = 0; i < n; ++i)
+    {
+        float coeff[RGB2SPEC_N_COEFFS];
+        rgb2spec_fetch(srgb_coeff, &rgb[i * 3], coeff);
+        polys[i].c0 = coeff[0];
+        polys[i].c1 = coeff[1];
+        polys[i].c2 = coeff[2];
+    }
+}
+
+SigmoidPolynomialCache::SigmoidPolynomialCache() : _entries(1 << ENTRY_COUNT_LOG2)
 {
-    float coeff[RGB2SPEC_N_COEFFS];
-    rgb2spec_fetch(srgb_coeff,rgb,coeff);
-   
-    for(int i=0;i<SPD_SAMPLE_COUNT;++i)
+    for (auto &&entry : _entries)
     {
-        float lambda = WAVELENGTH_MIN + i * (WAVELENGTH_MAX - WAVELENGTH_MIN)/(SPD_SAMPLE_COUNT - 1);
-        spd[i] = rgb2spec_eval_precise(coeff, lambda);
+        entry.key = INVALID_KEY;
     }
 }
 
+void SigmoidPolynomialCache::fill(Entry &entry, uint32_t key)
+{
+    constexpr uint32_t mask = (1u << QUANTIZE_BITS) - 1;
+    constexpr float inv_scale = 1.0f / mask;
+    const float rgb[3] = {(key & mask) * inv_scale, ((key >> QUANTIZE_BITS) & mask) * inv_scale, ((key >> (2 * QUANTIZE_BITS)) & mask) * inv_scale};
+    entry.key = key;
+    entry.poly = from_srgb_to_sigmoid_polynomial(rgb);
+}
+
+SigmoidPolynomial from_srgb_to_sigmoid_polynomial_cached(const float rgb[3])
+{
+    thread_local SigmoidPolynomialCache cache;
+    return cache.lookup(rgb);
+}
+
 void blackbody(const float *lambda, int n, float T, float *Le)
 {
     constexpr float c = 299792458.f;
@@ -257,18 +292,35 @@ void blackbody_normalized(const float *lambda, int n, float T, float *Le)
     }
 }
 
-Spectrum tungsten_lamp_2700k(float intensity)
+template <typename SpectrumType>
+SpectrumType tungsten_lamp_2700k(float intensity)
 {
     float Le[CIE_SAMPLES];
     blackbody_normalized(cie_lambda, CIE_SAMPLES, 2700, Le);
-    return from_sample_data(cie_lambda, Le, CIE_SAMPLES) * intensity;
+    return from_sample_data<SpectrumType>(cie_lambda, Le, CIE_SAMPLES) * intensity;
 }
 
-Spectrum tungsten_lamp_3000k(float intensity)
+template <typename SpectrumType>
+SpectrumType tungsten_lamp_3000k(float intensity)
 {
     float Le[CIE_SAMPLES];
     blackbody_normalized(cie_lambda, CIE_SAMPLES, 3000, Le);
-    return from_sample_data(cie_lambda, Le, CIE_SAMPLES) * intensity;
+    return from_sample_data<SpectrumType>(cie_lambda, Le, CIE_SAMPLES) * intensity;
 }
 
+#define NARUKAMI_INSTANTIATE_SPECTRUM(SpectrumType)                                    \
+    template struct SpectrumType;                                                      \
+    template SpectrumType from_sample_data<SpectrumType>(const float *, float *, int); \
+    template void from_spd_to_xyz<SpectrumType>(const SpectrumType &, float[3]);       \
+    template void from_srgb_to_spd<SpectrumType>(float[3], SpectrumType &);            \
+    template SpectrumType tungsten_lamp_2700k<SpectrumType>(float);                    \
+    template SpectrumType tungsten_lamp_3000k<SpectrumType>(float);
+
+NARUKAMI_INSTANTIATE_SPECTRUM(BasicSpectrum<95>)
+NARUKAMI_INSTANTIATE_SPECTRUM(BasicSpectrum<32>)
+#if NARUKAMI_SPECTRUM_SAMPLE_COUNT != 95 && NARUKAMI_SPECTRUM_SAMPLE_COUNT != 32
+NARUKAMI_INSTANTIATE_SPECTRUM(BasicSpectrum<NARUKAMI_SPECTRUM_SAMPLE_COUNT>)
+#endif
+#undef NARUKAMI_INSTANTIATE_SPECTRUM
+
 NARUKAMI_END
\ No newline at end of file
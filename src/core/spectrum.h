@@ -27,65 +27,203 @@ SOFTWARE.
 #include "core/narukami.h"
 #include "core/math.h"
 #include "simd.h"
+#include <vector>
 NARUKAMI_BEGIN
 
-constexpr int WAVELENGTH_MIN = 360;
-constexpr int WAVELENGTH_MAX = 830;
-constexpr int SPD_SAMPLE_COUNT = 95;
-constexpr int SPD_SSE_SAMPLE_COUNT = SPD_SAMPLE_COUNT / SSE_WIDTH + 1;
-struct Spectrum
+//默认Spectrum的样本数量,可以在编译时修改,比如-DNARUKAMI_SPECTRUM_SAMPLE_COUNT=32
+#ifndef NARUKAMI_SPECTRUM_SAMPLE_COUNT
+#define NARUKAMI_SPECTRUM_SAMPLE_COUNT 95
+#endif
+
+/**
+ * 光谱批量运算的SIMD实现,在spectrum_kernels.cpp中分别用SSE/AVX2/AVX-512实现
+ * 启动时根据CPUID选择一次,CPU不支持AVX时使用SSE
+ * n为float的个数,必须是SSE_WIDTH的倍数;所有kernel都不使用FMA,逐元素运算在各指令集下结果一致
+*/
+enum class SIMDLevel
+{
+    SSE,
+    AVX2,
+    AVX512
+};
+
+struct SpectrumKernels
+{
+    void (*add)(float *dst, const float *a, const float *b, int n);
+    void (*sub)(float *dst, const float *a, const float *b, int n);
+    void (*mul)(float *dst, const float *a, const float *b, int n);
+    void (*div)(float *dst, const float *a, const float *b, int n);
+    void (*scale)(float *dst, const float *a, float s, int n);
+    //dst += a * s,用于film的累加
+    void (*madd)(float *dst, const float *a, float s, int n);
+    bool (*is_black)(const float *a, int n);
+    float (*sum)(const float *a, int n);
+    void (*dot_xyz)(const float *a, const float *x, const float *y, const float *z, int n, float xyz[3]);
+};
+
+extern const SpectrumKernels *active_spectrum_kernels;
+inline const SpectrumKernels &spectrum_kernels() { return *active_spectrum_kernels; }
+//指定指令集的实现,CPU不支持时返回nullptr
+const SpectrumKernels *spectrum_kernels(SIMDLevel level);
+SIMDLevel spectrum_simd_level();
+//CPU不支持时返回false并保持原来的实现,用于测试和benchmark
+bool set_spectrum_simd_level(SIMDLevel level);
+
+//加载/释放rgb2spec的系数表,from_srgb_to_spd需要,文件不存在时返回false
+bool load_srgb_coeff();
+void free_srgb_coeff();
+
+/**
+ * 在[LambdaMin,LambdaMax)内等宽分段的光谱,每段一个样本
+ * 样本按SSE_WIDTH打包,最后一个float4中多出来的样本都是无效样本,始终为0.0f
+*/
+template <int SampleCount, int LambdaMin = 360, int LambdaMax = 830>
+struct BasicSpectrum
 {
+    static constexpr int SAMPLE_COUNT = SampleCount;
+    static constexpr int SSE_SAMPLE_COUNT = (SampleCount + SSE_WIDTH - 1) / SSE_WIDTH;
+    //包含补齐的无效样本
+    static constexpr int FLOAT_COUNT = SSE_SAMPLE_COUNT * SSE_WIDTH;
+    static constexpr int WAVELENGTH_MIN = LambdaMin;
+    static constexpr int WAVELENGTH_MAX = LambdaMax;
 
-    float4 samples[SPD_SSE_SAMPLE_COUNT];
+    float4 samples[SSE_SAMPLE_COUNT];
 
-    Spectrum()
+    BasicSpectrum()
     {
-        for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
+        for (int i = 0; i < SSE_SAMPLE_COUNT; ++i)
         {
             samples[i] = float4();
         }
     }
 
-    Spectrum(float v)
+    BasicSpectrum(float v)
     {
-        for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
+        for (int i = 0; i < SSE_SAMPLE_COUNT; ++i)
         {
             samples[i] = float4(v);
         }
-        //最后一个空间是无效样本,因此设置成0.0f
-        samples[SPD_SSE_SAMPLE_COUNT - 1][3] = 0.0f;
+        clear_invalid_samples();
     }
 
-    Spectrum(float *input)
+    BasicSpectrum(const float *input)
     {
-        memcpy(samples, input, SPD_SAMPLE_COUNT * sizeof(float));
-        //最后一个空间是无效样本,因此设置成0.0f
-        samples[SPD_SSE_SAMPLE_COUNT - 1][3] = 0.0f;
+        memcpy(samples, input, SAMPLE_COUNT * sizeof(float));
+        clear_invalid_samples();
     }
 
     float operator[](int idx) const
     {
-        assert(idx >= 0 && idx < SPD_SAMPLE_COUNT);
+        assert(idx >= 0 && idx < SAMPLE_COUNT);
         return samples[idx >> 2][idx & 0x3];
     }
     float &operator[](int idx)
     {
-        assert(idx >= 0 && idx < SPD_SAMPLE_COUNT);
+        assert(idx >= 0 && idx < SAMPLE_COUNT);
         return samples[idx >> 2][idx & 0x3];
     }
 
-    //static number value
-    static Spectrum X;
-    static Spectrum Y;
-    static Spectrum Z;
+    //CIE匹配函数,由cie.h中编译期计算的表初始化
+    static const BasicSpectrum X;
+    static const BasicSpectrum Y;
+    static const BasicSpectrum Z;
+
+    static void init() { load_srgb_coeff(); }
+    static void free() { free_srgb_coeff(); }
+
+    float *data() { return reinterpret_cast<float *>(samples); }
+    const float *data() const { return reinterpret_cast<const float *>(samples); }
+
+    //运算符定义成friend,这样float可以隐式转换成光谱参与运算(比如float * spd)
+    //逐元素的运算都交给启动时选择的SIMD kernel
+    friend inline BasicSpectrum operator+(const BasicSpectrum &lhs, const BasicSpectrum &rhs)
+    {
+        BasicSpectrum spd;
+        spectrum_kernels().add(spd.data(), lhs.data(), rhs.data(), FLOAT_COUNT);
+        return spd;
+    }
+
+    friend inline BasicSpectrum operator+=(BasicSpectrum &lhs, const BasicSpectrum &rhs)
+    {
+        spectrum_kernels().add(lhs.data(), lhs.data(), rhs.data(), FLOAT_COUNT);
+        return lhs;
+    }
+
+    friend inline BasicSpectrum operator-(const BasicSpectrum &lhs, const BasicSpectrum &rhs)
+    {
+        BasicSpectrum spd;
+        spectrum_kernels().sub(spd.data(), lhs.data(), rhs.data(), FLOAT_COUNT);
+        return spd;
+    }
+
+    friend inline BasicSpectrum operator-=(BasicSpectrum &lhs, const BasicSpectrum &rhs)
+    {
+        spectrum_kernels().sub(lhs.data(), lhs.data(), rhs.data(), FLOAT_COUNT);
+        return lhs;
+    }
+
+    friend inline BasicSpectrum operator*(const BasicSpectrum &lhs, const BasicSpectrum &rhs)
+    {
+        BasicSpectrum spd;
+        spectrum_kernels().mul(spd.data(), lhs.data(), rhs.data(), FLOAT_COUNT);
+        return spd;
+    }
+
+    friend inline BasicSpectrum operator*=(BasicSpectrum &lhs, const BasicSpectrum &rhs)
+    {
+        spectrum_kernels().mul(lhs.data(), lhs.data(), rhs.data(), FLOAT_COUNT);
+        return lhs;
+    }
+
+    friend inline BasicSpectrum operator*(const BasicSpectrum &lhs, float rhs)
+    {
+        BasicSpectrum spd;
+        spectrum_kernels().scale(spd.data(), lhs.data(), rhs, FLOAT_COUNT);
+        return spd;
+    }
+
+    friend inline BasicSpectrum operator/(const BasicSpectrum &lhs, const BasicSpectrum &rhs)
+    {
+        BasicSpectrum spd;
+        spectrum_kernels().div(spd.data(), lhs.data(), rhs.data(), FLOAT_COUNT);
+        return spd;
+    }
 
-    static void init();
-    static void free();
+    //保持真正的除法而不是乘以倒数,结果和之前一致
+    friend inline BasicSpectrum operator/(const BasicSpectrum &lhs, float rhs)
+    {
+        assert(rhs != 0);
+        BasicSpectrum spd;
+        for (int i = 0; i < SSE_SAMPLE_COUNT; ++i)
+        {
+            spd.samples[i] = lhs.samples[i] / rhs;
+        }
+        return spd;
+    }
+
+private:
+    void clear_invalid_samples()
+    {
+        for (int i = SAMPLE_COUNT; i < SSE_SAMPLE_COUNT * SSE_WIDTH; ++i)
+        {
+            samples[i >> 2][i & 0x3] = 0.0f;
+        }
+    }
 };
 
-inline bool isnan(const Spectrum &spd)
+typedef BasicSpectrum<NARUKAMI_SPECTRUM_SAMPLE_COUNT> Spectrum;
+//10~20nm的分辨率在大部分场景下和5nm的结果看不出差别
+typedef BasicSpectrum<32> CoarseSpectrum;
+
+constexpr int WAVELENGTH_MIN = Spectrum::WAVELENGTH_MIN;
+constexpr int WAVELENGTH_MAX = Spectrum::WAVELENGTH_MAX;
+constexpr int SPD_SAMPLE_COUNT = Spectrum::SAMPLE_COUNT;
+constexpr int SPD_SSE_SAMPLE_COUNT = Spectrum::SSE_SAMPLE_COUNT;
+
+template <int SampleCount, int LambdaMin, int LambdaMax>
+inline bool isnan(const BasicSpectrum<SampleCount, LambdaMin, LambdaMax> &spd)
 {
-    for (int i = 0; i < SPD_SAMPLE_COUNT; ++i)
+    for (int i = 0; i < SampleCount; ++i)
     {
         if (isnan(spd[i]))
         {
@@ -95,10 +233,11 @@ inline bool isnan(const Spectrum &spd)
     return false;
 }
 
-inline std::ostream &operator<<(std::ostream &out, const Spectrum &spd)
+template <int SampleCount, int LambdaMin, int LambdaMax>
+inline std::ostream &operator<<(std::ostream &out, const BasicSpectrum<SampleCount, LambdaMin, LambdaMax> &spd)
 {
     out << '( ';
-    for (int i = 0; i < SPD_SAMPLE_COUNT; ++i)
+    for (int i = 0; i < SampleCount; ++i)
     {
         out << spd[i] << " ";
     }
@@ -106,118 +245,242 @@ inline std::ostream &operator<<(std::ostream &out, const Spectrum &spd)
     return out;
 }
 
-inline bool is_black(const Spectrum &spd)
+template <int SampleCount, int LambdaMin, int LambdaMax>
+inline bool is_black(const BasicSpectrum<SampleCount, LambdaMin, LambdaMax> &spd)
 {
-    for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
+    //大部分光谱都不是黑的,先检查第一组样本,这样常见情况不需要扫描整个光谱
+    if (EXPECT_TAKEN(any(spd.samples[0] != float4::zero)))
     {
-        if (EXPECT_TAKEN(any(spd.samples[i] != float4::zero)))
-        {
-            return false;
-        }
+        return false;
     }
-    return true;
+    return spectrum_kernels().is_black(spd.data(), BasicSpectrum<SampleCount, LambdaMin, LambdaMax>::FLOAT_COUNT);
 }
 
-inline Spectrum operator+(const Spectrum &lhs, const Spectrum &rhs)
+template <int SampleCount, int LambdaMin, int LambdaMax>
+inline float average(const BasicSpectrum<SampleCount, LambdaMin, LambdaMax> &spd)
 {
-    Spectrum spd;
-    for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
-    {
-        spd.samples[i] = lhs.samples[i] + rhs.samples[i];
-    }
-    return spd;
+    return spectrum_kernels().sum(spd.data(), BasicSpectrum<SampleCount, LambdaMin, LambdaMax>::FLOAT_COUNT) / SampleCount;
 }
 
-inline Spectrum operator+=(Spectrum &lhs, const Spectrum &rhs)
+//dst += spd * s,film累加样本时使用
+template <int SampleCount, int LambdaMin, int LambdaMax>
+inline void madd(BasicSpectrum<SampleCount, LambdaMin, LambdaMax> &dst, const BasicSpectrum<SampleCount, LambdaMin, LambdaMax> &spd, float s)
 {
-    lhs = lhs + rhs;
-    return lhs;
+    spectrum_kernels().madd(dst.data(), spd.data(), s, BasicSpectrum<SampleCount, LambdaMin, LambdaMax>::FLOAT_COUNT);
 }
 
-inline Spectrum operator-(const Spectrum &lhs, const Spectrum &rhs)
+/**
+ * hero wavelength采样
+ * 每个相机样本只追踪SAMPLED_WAVELENGTH_COUNT个波长
+ * 可见光范围被分成SAMPLED_WAVELENGTH_COUNT个等宽的区间,每个区间一个波长
+*/
+constexpr int SAMPLED_WAVELENGTH_COUNT = SSE_WIDTH;
+struct SampledWavelengths
+{
+    float4 lambda;
+    float4 pdf;
+};
+
+struct SampledSpectrum
 {
-    Spectrum spd;
-    for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
+    float4 values;
+
+    SampledSpectrum() {}
+    explicit SampledSpectrum(float v) : values(v) {}
+    SampledSpectrum(const float4 &v) : values(v) {}
+
+    float operator[](int idx) const
+    {
+        assert(idx >= 0 && idx < SAMPLED_WAVELENGTH_COUNT);
+        return values[idx];
+    }
+    float &operator[](int idx)
     {
-        spd.samples[i] = lhs.samples[i] - rhs.samples[i];
+        assert(idx >= 0 && idx < SAMPLED_WAVELENGTH_COUNT);
+        return values[idx];
     }
-    return spd;
+};
+
+inline bool isnan(const SampledSpectrum &s)
+{
+    return any(s.values != s.values);
 }
 
-inline Spectrum operator-=(Spectrum &lhs, const Spectrum &rhs)
+inline bool is_black(const SampledSpectrum &s)
 {
-    lhs = lhs - rhs;
+    return all(s.values == float4::zero);
+}
+
+inline SampledSpectrum operator+(const SampledSpectrum &lhs, const SampledSpectrum &rhs) { return lhs.values + rhs.values; }
+inline SampledSpectrum operator+=(SampledSpectrum &lhs, const SampledSpectrum &rhs)
+{
+    lhs.values += rhs.values;
     return lhs;
 }
+inline SampledSpectrum operator*(const SampledSpectrum &lhs, const SampledSpectrum &rhs) { return lhs.values * rhs.values; }
+inline SampledSpectrum operator*(const SampledSpectrum &lhs, float rhs) { return lhs.values * rhs; }
+inline SampledSpectrum operator*(float lhs, const SampledSpectrum &rhs) { return rhs.values * lhs; }
+inline SampledSpectrum operator/(const SampledSpectrum &lhs, float rhs)
+{
+    assert(rhs != 0);
+    return lhs.values / rhs;
+}
 
-inline Spectrum operator*(const Spectrum &lhs, const Spectrum &rhs)
+inline SampledWavelengths sample_wavelengths(float u)
 {
-    Spectrum spd;
-    for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
-    {
-        spd.samples[i] = lhs.samples[i] * rhs.samples[i];
-    }
-    return spd;
+    constexpr float range = static_cast<float>(WAVELENGTH_MAX - WAVELENGTH_MIN);
+    //u只决定波长在各自区间内的位置,这样u的分层可以直接传递到每个区间内
+    //如果用u决定第一个波长再旋转,分层的u(比如0,0.25,0.5,0.75)会得到完全相同的波长组合
+    const float4 t = (float4(u) + float4(0.0f, 1.0f, 2.0f, 3.0f)) * (1.0f / SAMPLED_WAVELENGTH_COUNT);
+    SampledWavelengths wavelengths;
+    wavelengths.lambda = float4(static_cast<float>(WAVELENGTH_MIN)) + t * range;
+    wavelengths.pdf = float4(1.0f / range);
+    return wavelengths;
 }
 
-inline Spectrum operator*=(Spectrum &lhs, const Spectrum &rhs)
+//波长对应的Spectrum样本下标,和from_sample_data的分段方式一致
+template <typename SpectrumType = Spectrum>
+inline int spd_sample_index(float lambda)
 {
-    lhs = lhs * rhs;
-    return lhs;
+    constexpr float scale = SpectrumType::SAMPLE_COUNT / static_cast<float>(SpectrumType::WAVELENGTH_MAX - SpectrumType::WAVELENGTH_MIN);
+    return min(max(static_cast<int>((lambda - SpectrumType::WAVELENGTH_MIN) * scale), 0), SpectrumType::SAMPLE_COUNT - 1);
 }
 
-inline Spectrum operator*(const Spectrum &lhs, float rhs)
+//在采样的波长上对分段常数的Spectrum求值
+template <int SampleCount, int LambdaMin, int LambdaMax>
+inline SampledSpectrum sample(const BasicSpectrum<SampleCount, LambdaMin, LambdaMax> &spd, const SampledWavelengths &wavelengths)
 {
-    Spectrum spd;
-    for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
+    SampledSpectrum s;
+    for (int i = 0; i < SAMPLED_WAVELENGTH_COUNT; ++i)
     {
-        spd.samples[i] = lhs.samples[i] * rhs;
+        s[i] = spd[spd_sample_index<BasicSpectrum<SampleCount, LambdaMin, LambdaMax>>(wavelengths.lambda[i])];
     }
-    return spd;
+    return s;
 }
 
-inline Spectrum operator/(const Spectrum &lhs, const Spectrum &rhs)
+/**
+ * 下面的模板函数在spectrum.cpp中为BasicSpectrum<95>和BasicSpectrum<32>
+ * (以及NARUKAMI_SPECTRUM_SAMPLE_COUNT指定的Spectrum)显式实例化
+*/
+template <typename SpectrumType>
+void from_spd_to_xyz(const SpectrumType &spd, float xyz[3]);
+//from_spd_to_xyz的蒙特卡洛估计
+void from_sampled_spectrum_to_xyz(const SampledSpectrum &s, const SampledWavelengths &wavelengths, float xyz[3]);
+//把样本放回对应的Spectrum样本中,from_spd_to_xyz的结果和from_sampled_spectrum_to_xyz相同
+void from_sampled_spectrum_to_spd(const SampledSpectrum &s, const SampledWavelengths &wavelengths, Spectrum &spd);
+void from_xyz_to_srgb(const float xyz[3], float rgb[3]);
+
+template <typename SpectrumType>
+void from_srgb_to_spd(float rgb[3], SpectrumType &spd);
+
+/**
+ * rgb2spec的sigmoid多项式,对应的光谱为s(λ)=sigmoid(c0*λ²+c1*λ+c2),sigmoid(x)=0.5+x/(2*sqrt(1+x²))
+ * 每个rgb只需要查一次表,之后可以在float4上同时对4个波长求值
+*/
+struct SigmoidPolynomial
 {
-    Spectrum spd;
-    for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
-    {
-        spd.samples[i] = lhs.samples[i] / rhs.samples[i];
-    }
-    return spd;
+    float c0, c1, c2;
+};
+
+inline float4 eval(const SigmoidPolynomial &poly, const float4 &lambda)
+{
+    const float4 x = (float4(poly.c0) * lambda + float4(poly.c1)) * lambda + float4(poly.c2);
+    return float4(0.5f) + float4(0.5f) * x * rsqrt(float4(1.0f) + x * x);
 }
 
-inline Spectrum operator/(const Spectrum &lhs, float rhs)
+inline SampledSpectrum sample(const SigmoidPolynomial &poly, const SampledWavelengths &wavelengths)
 {
-    assert(rhs != 0);
-    Spectrum spd;
-    for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
+    return eval(poly, wavelengths.lambda);
+}
+
+//批量查表,rgb中连续存放n个rgb
+void from_srgb_to_sigmoid_polynomial(const float *rgb, SigmoidPolynomial *polys, int n);
+inline SigmoidPolynomial from_srgb_to_sigmoid_polynomial(const float rgb[3])
+{
+    SigmoidPolynomial poly;
+    from_srgb_to_sigmoid_polynomial(rgb, &poly, 1);
+    return poly;
+}
+
+//波长的取法和from_srgb_to_spd一致
+template <int SampleCount, int LambdaMin, int LambdaMax>
+inline void from_sigmoid_polynomial_to_spd(const SigmoidPolynomial &poly, BasicSpectrum<SampleCount, LambdaMin, LambdaMax> &spd)
+{
+    typedef BasicSpectrum<SampleCount, LambdaMin, LambdaMax> SpectrumType;
+    const float step = static_cast<float>(LambdaMax - LambdaMin) / (SampleCount - 1);
+    const float4 offset = float4(0.0f, 1.0f, 2.0f, 3.0f) * step;
+    for (int i = 0; i < SpectrumType::SSE_SAMPLE_COUNT; ++i)
+    {
+        spd.samples[i] = eval(poly, float4(LambdaMin + i * SSE_WIDTH * step) + offset);
+    }
+    for (int i = SampleCount; i < SpectrumType::FLOAT_COUNT; ++i)
     {
-        spd.samples[i] = lhs.samples[i] / rhs;
+        spd.data()[i] = 0.0f;
     }
-    return spd;
 }
 
-inline float average(const Spectrum &spd)
+/**
+ * 以量化后的rgb为key的SigmoidPolynomial缓存,用于常量颜色和纹理颜色
+ * 每个通道量化到10bit,直接映射,冲突时覆盖旧的项
+ * 系数总是由量化后的rgb计算,所以结果只和rgb有关,和缓存的状态无关
+ * 不是线程安全的,每个线程使用自己的缓存(见from_srgb_to_sigmoid_polynomial_cached)
+*/
+class SigmoidPolynomialCache
 {
-    float4 sum4;
-    for (int i = 0; i < SPD_SSE_SAMPLE_COUNT; ++i)
+public:
+    static constexpr int QUANTIZE_BITS = 10;
+    static constexpr int ENTRY_COUNT_LOG2 = 12;
+
+    SigmoidPolynomialCache();
+
+    inline SigmoidPolynomial lookup(const float rgb[3])
     {
-        sum4 += spd.samples[i];
+        const uint32_t key = quantize(rgb);
+        Entry &entry = _entries[(key * 2654435761u) >> (32 - ENTRY_COUNT_LOG2)];
+        if (EXPECT_NOT_TAKEN(entry.key != key))
+        {
+            fill(entry, key);
+        }
+        return entry.poly;
     }
-    return vreduce_add(sum4).x / SPD_SAMPLE_COUNT;
-}
 
-void from_spd_to_xyz(const Spectrum &spd, float xyz[3]);
-void from_xyz_to_srgb(const float xyz[3], float rgb[3]);
+    static inline uint32_t quantize(const float rgb[3])
+    {
+        constexpr float scale = static_cast<float>((1 << QUANTIZE_BITS) - 1);
+        uint32_t key = 0;
+        for (int i = 0; i < 3; ++i)
+        {
+            key |= static_cast<uint32_t>(clamp(rgb[i], 0.0f, 1.0f) * scale + 0.5f) << (i * QUANTIZE_BITS);
+        }
+        return key;
+    }
+
+private:
+    struct Entry
+    {
+        uint32_t key;
+        SigmoidPolynomial poly;
+    };
+    //key只用了低30位,所以这个值不会和任何rgb冲突
+    static constexpr uint32_t INVALID_KEY = 0xFFFFFFFFu;
+
+    void fill(Entry &entry, uint32_t key);
+
+    std::vector<Entry> _entries;
+};
 
-void from_srgb_to_spd(float rgb[3],Spectrum &spd);
+//使用当前线程的SigmoidPolynomialCache
+SigmoidPolynomial from_srgb_to_sigmoid_polynomial_cached(const float rgb[3]);
 
-Spectrum from_sample_data(const float *lambda, float *sample, int n);
+template <typename SpectrumType = Spectrum>
+SpectrumType from_sample_data(const float *lambda, float *sample, int n);
 
 void blackbody(const float *lambda, int n, float T, float *Le);
 void blackbody_normalized(const float *lambda, int n, float T, float *Le);
 
-Spectrum tungsten_lamp_2700k(float intensity);
-Spectrum tungsten_lamp_3000k(float intensity);
+template <typename SpectrumType = Spectrum>
+SpectrumType tungsten_lamp_2700k(float intensity);
+template <typename SpectrumType = Spectrum>
+SpectrumType tungsten_lamp_3000k(float intensity);
 
 NARUKAMI_END
\ No newline at end of file
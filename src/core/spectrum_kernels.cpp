@@ -0,0 +1,464 @@
+/*
+MIT License
+
+Copyright (c) 2019 ZhuQian
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "core/spectrum.h"
+#include <immintrin.h>
+
+//avx512f隐含了FMA,GCC默认会把mul+add合并成FMA,这样结果就和SSE路径不一致了
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+NARUKAMI_BEGIN
+
+/**
+ * 整个文件只用-msse4.1编译,AVX2/AVX-512的kernel通过NARUKAMI_TARGET单独打开指令集
+ * 这些函数只能在spectrum_kernels(level)返回非空之后调用
+*/
+
+/************************************SSE************************************/
+static void sse_add(float *dst, const float *a, const float *b, int n)
+{
+    for (int i = 0; i < n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+}
+
+static void sse_sub(float *dst, const float *a, const float *b, int n)
+{
+    for (int i = 0; i < n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+}
+
+static void sse_mul(float *dst, const float *a, const float *b, int n)
+{
+    for (int i = 0; i < n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+}
+
+static void sse_div(float *dst, const float *a, const float *b, int n)
+{
+    for (int i = 0; i < n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_div_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+}
+
+static void sse_scale(float *dst, const float *a, float s, int n)
+{
+    const __m128 s4 = _mm_set1_ps(s);
+    for (int i = 0; i < n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), s4));
+    }
+}
+
+static void sse_madd(float *dst, const float *a, float s, int n)
+{
+    const __m128 s4 = _mm_set1_ps(s);
+    for (int i = 0; i < n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(a + i), s4)));
+    }
+}
+
+static bool sse_is_black(const float *a, int n)
+{
+    __m128 m = _mm_setzero_ps();
+    for (int i = 0; i < n; i += 4)
+    {
+        m = _mm_or_ps(m, _mm_cmpneq_ps(_mm_loadu_ps(a + i), _mm_setzero_ps()));
+    }
+    return _mm_movemask_ps(m) == 0;
+}
+
+static inline float sse_hsum(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+static float sse_sum(const float *a, int n)
+{
+    __m128 s = _mm_setzero_ps();
+    for (int i = 0; i < n; i += 4)
+    {
+        s = _mm_add_ps(s, _mm_loadu_ps(a + i));
+    }
+    return sse_hsum(s);
+}
+
+static void sse_dot_xyz(const float *a, const float *x, const float *y, const float *z, int n, float xyz[3])
+{
+    __m128 sx = _mm_setzero_ps(), sy = _mm_setzero_ps(), sz = _mm_setzero_ps();
+    for (int i = 0; i < n; i += 4)
+    {
+        const __m128 v = _mm_loadu_ps(a + i);
+        sx = _mm_add_ps(sx, _mm_mul_ps(v, _mm_loadu_ps(x + i)));
+        sy = _mm_add_ps(sy, _mm_mul_ps(v, _mm_loadu_ps(y + i)));
+        sz = _mm_add_ps(sz, _mm_mul_ps(v, _mm_loadu_ps(z + i)));
+    }
+    xyz[0] = sse_hsum(sx);
+    xyz[1] = sse_hsum(sy);
+    xyz[2] = sse_hsum(sz);
+}
+
+static const SpectrumKernels sse_kernels = {sse_add, sse_sub, sse_mul, sse_div, sse_scale, sse_madd, sse_is_black, sse_sum, sse_dot_xyz};
+
+/************************************AVX2************************************/
+//n不是8的倍数时,剩下的4个float用SSE处理
+//_mm256_castps128_ps256的高128位未定义,扩展到256位时必须用_mm256_zextps128_ps256
+#define NARUKAMI_AVX2_BINARY(name, op, sse_op)                                                          \
+    NARUKAMI_TARGET("avx2") static void avx2_##name(float *dst, const float *a, const float *b, int n) \
+    {                                                                                                   \
+        int i = 0;                                                                                      \
+        for (; i + 8 <= n; i += 8)                                                                      \
+        {                                                                                               \
+            _mm256_storeu_ps(dst + i, op(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));              \
+        }                                                                                               \
+        if (i < n)                                                                                      \
+        {                                                                                               \
+            _mm_storeu_ps(dst + i, sse_op(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));                   \
+        }                                                                                               \
+    }
+
+NARUKAMI_AVX2_BINARY(add, _mm256_add_ps, _mm_add_ps)
+NARUKAMI_AVX2_BINARY(sub, _mm256_sub_ps, _mm_sub_ps)
+NARUKAMI_AVX2_BINARY(mul, _mm256_mul_ps, _mm_mul_ps)
+NARUKAMI_AVX2_BINARY(div, _mm256_div_ps, _mm_div_ps)
+#undef NARUKAMI_AVX2_BINARY
+
+NARUKAMI_TARGET("avx2")
+static void avx2_scale(float *dst, const float *a, float s, int n)
+{
+    const __m256 s8 = _mm256_set1_ps(s);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), s8));
+    }
+    if (i < n)
+    {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm256_castps256_ps128(s8)));
+    }
+}
+
+NARUKAMI_TARGET("avx2")
+static void avx2_madd(float *dst, const float *a, float s, int n)
+{
+    const __m256 s8 = _mm256_set1_ps(s);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(_mm256_loadu_ps(a + i), s8)));
+    }
+    if (i < n)
+    {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(a + i), _mm256_castps256_ps128(s8))));
+    }
+}
+
+NARUKAMI_TARGET("avx2")
+static bool avx2_is_black(const float *a, int n)
+{
+    __m256 m = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        m = _mm256_or_ps(m, _mm256_cmp_ps(_mm256_loadu_ps(a + i), _mm256_setzero_ps(), _CMP_NEQ_UQ));
+    }
+    if (i < n)
+    {
+        m = _mm256_or_ps(m, _mm256_zextps128_ps256(_mm_cmpneq_ps(_mm_loadu_ps(a + i), _mm_setzero_ps())));
+    }
+    return _mm256_movemask_ps(m) == 0;
+}
+
+NARUKAMI_TARGET("avx2")
+static inline float avx2_hsum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+NARUKAMI_TARGET("avx2")
+static float avx2_sum(const float *a, int n)
+{
+    __m256 s = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        s = _mm256_add_ps(s, _mm256_loadu_ps(a + i));
+    }
+    if (i < n)
+    {
+        s = _mm256_add_ps(s, _mm256_zextps128_ps256(_mm_loadu_ps(a + i)));
+    }
+    return avx2_hsum(s);
+}
+
+NARUKAMI_TARGET("avx2")
+static void avx2_dot_xyz(const float *a, const float *x, const float *y, const float *z, int n, float xyz[3])
+{
+    __m256 sx = _mm256_setzero_ps(), sy = _mm256_setzero_ps(), sz = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256 v = _mm256_loadu_ps(a + i);
+        sx = _mm256_add_ps(sx, _mm256_mul_ps(v, _mm256_loadu_ps(x + i)));
+        sy = _mm256_add_ps(sy, _mm256_mul_ps(v, _mm256_loadu_ps(y + i)));
+        sz = _mm256_add_ps(sz, _mm256_mul_ps(v, _mm256_loadu_ps(z + i)));
+    }
+    if (i < n)
+    {
+        const __m256 v = _mm256_zextps128_ps256(_mm_loadu_ps(a + i));
+        sx = _mm256_add_ps(sx, _mm256_mul_ps(v, _mm256_zextps128_ps256(_mm_loadu_ps(x + i))));
+        sy = _mm256_add_ps(sy, _mm256_mul_ps(v, _mm256_zextps128_ps256(_mm_loadu_ps(y + i))));
+        sz = _mm256_add_ps(sz, _mm256_mul_ps(v, _mm256_zextps128_ps256(_mm_loadu_ps(z + i))));
+    }
+    xyz[0] = avx2_hsum(sx);
+    xyz[1] = avx2_hsum(sy);
+    xyz[2] = avx2_hsum(sz);
+}
+
+static const SpectrumKernels avx2_kernels = {avx2_add, avx2_sub, avx2_mul, avx2_div, avx2_scale, avx2_madd, avx2_is_black, avx2_sum, avx2_dot_xyz};
+
+/************************************AVX-512************************************/
+//n不是16的倍数时,用mask处理剩下的4/8/12个float
+NARUKAMI_TARGET("avx512f")
+static inline __mmask16 avx512_tail_mask(int remain)
+{
+    return static_cast<__mmask16>((1u << remain) - 1u);
+}
+
+#define NARUKAMI_AVX512_BINARY(name, op)                                                                   \
+    NARUKAMI_TARGET("avx512f") static void avx512_##name(float *dst, const float *a, const float *b, int n) \
+    {                                                                                                      \
+        int i = 0;                                                                                         \
+        for (; i + 16 <= n; i += 16)                                                                       \
+        {                                                                                                  \
+            _mm512_storeu_ps(dst + i, op(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));                 \
+        }                                                                                                  \
+        if (i < n)                                                                                         \
+        {                                                                                                  \
+            const __mmask16 m = avx512_tail_mask(n - i);                                                   \
+            const __m512 va = _mm512_maskz_loadu_ps(m, a + i);                                             \
+            const __m512 vb = _mm512_mask_loadu_ps(_mm512_set1_ps(1.0f), m, b + i);                        \
+            _mm512_mask_storeu_ps(dst + i, m, op(va, vb));                                                 \
+        }                                                                                                  \
+    }
+
+NARUKAMI_AVX512_BINARY(add, _mm512_add_ps)
+NARUKAMI_AVX512_BINARY(sub, _mm512_sub_ps)
+NARUKAMI_AVX512_BINARY(mul, _mm512_mul_ps)
+NARUKAMI_AVX512_BINARY(div, _mm512_div_ps)
+#undef NARUKAMI_AVX512_BINARY
+
+NARUKAMI_TARGET("avx512f")
+static void avx512_scale(float *dst, const float *a, float s, int n)
+{
+    const __m512 s16 = _mm512_set1_ps(s);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_loadu_ps(a + i), s16));
+    }
+    if (i < n)
+    {
+        const __mmask16 m = avx512_tail_mask(n - i);
+        _mm512_mask_storeu_ps(dst + i, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, a + i), s16));
+    }
+}
+
+NARUKAMI_TARGET("avx512f")
+static void avx512_madd(float *dst, const float *a, float s, int n)
+{
+    const __m512 s16 = _mm512_set1_ps(s);
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(dst + i), _mm512_mul_ps(_mm512_loadu_ps(a + i), s16)));
+    }
+    if (i < n)
+    {
+        const __mmask16 m = avx512_tail_mask(n - i);
+        const __m512 d = _mm512_maskz_loadu_ps(m, dst + i);
+        _mm512_mask_storeu_ps(dst + i, m, _mm512_add_ps(d, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, a + i), s16)));
+    }
+}
+
+NARUKAMI_TARGET("avx512f")
+static bool avx512_is_black(const float *a, int n)
+{
+    __mmask16 nonzero = 0;
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        nonzero |= _mm512_cmp_ps_mask(_mm512_loadu_ps(a + i), _mm512_setzero_ps(), _CMP_NEQ_UQ);
+    }
+    if (i < n)
+    {
+        const __mmask16 m = avx512_tail_mask(n - i);
+        nonzero |= _mm512_mask_cmp_ps_mask(m, _mm512_maskz_loadu_ps(m, a + i), _mm512_setzero_ps(), _CMP_NEQ_UQ);
+    }
+    return nonzero == 0;
+}
+
+NARUKAMI_TARGET("avx512f")
+static float avx512_sum(const float *a, int n)
+{
+    __m512 s = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        s = _mm512_add_ps(s, _mm512_loadu_ps(a + i));
+    }
+    if (i < n)
+    {
+        s = _mm512_add_ps(s, _mm512_maskz_loadu_ps(avx512_tail_mask(n - i), a + i));
+    }
+    return _mm512_reduce_add_ps(s);
+}
+
+NARUKAMI_TARGET("avx512f")
+static void avx512_dot_xyz(const float *a, const float *x, const float *y, const float *z, int n, float xyz[3])
+{
+    __m512 sx = _mm512_setzero_ps(), sy = _mm512_setzero_ps(), sz = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m512 v = _mm512_loadu_ps(a + i);
+        sx = _mm512_add_ps(sx, _mm512_mul_ps(v, _mm512_loadu_ps(x + i)));
+        sy = _mm512_add_ps(sy, _mm512_mul_ps(v, _mm512_loadu_ps(y + i)));
+        sz = _mm512_add_ps(sz, _mm512_mul_ps(v, _mm512_loadu_ps(z + i)));
+    }
+    if (i < n)
+    {
+        const __mmask16 m = avx512_tail_mask(n - i);
+        const __m512 v = _mm512_maskz_loadu_ps(m, a + i);
+        sx = _mm512_add_ps(sx, _mm512_mul_ps(v, _mm512_maskz_loadu_ps(m, x + i)));
+        sy = _mm512_add_ps(sy, _mm512_mul_ps(v, _mm512_maskz_loadu_ps(m, y + i)));
+        sz = _mm512_add_ps(sz, _mm512_mul_ps(v, _mm512_maskz_loadu_ps(m, z + i)));
+    }
+    xyz[0] = _mm512_reduce_add_ps(sx);
+    xyz[1] = _mm512_reduce_add_ps(sy);
+    xyz[2] = _mm512_reduce_add_ps(sz);
+}
+
+static const SpectrumKernels avx512_kernels = {avx512_add, avx512_sub, avx512_mul, avx512_div, avx512_scale, avx512_madd, avx512_is_black, avx512_sum, avx512_dot_xyz};
+
+/************************************dispatch************************************/
+static bool cpu_supports(SIMDLevel level)
+{
+    if (level == SIMDLevel::SSE)
+    {
+        return true;
+    }
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    //操作系统必须通过XSAVE保存AVX的寄存器
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave)
+    {
+        return false;
+    }
+    const unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    if (level == SIMDLevel::AVX2)
+    {
+        return (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+    }
+    return (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16)) != 0;
+#else
+    __builtin_cpu_init();
+    if (level == SIMDLevel::AVX2)
+    {
+        return __builtin_cpu_supports("avx2");
+    }
+    return __builtin_cpu_supports("avx512f");
+#endif
+}
+
+const SpectrumKernels *spectrum_kernels(SIMDLevel level)
+{
+    if (!cpu_supports(level))
+    {
+        return nullptr;
+    }
+    switch (level)
+    {
+    case SIMDLevel::AVX512:
+        return &avx512_kernels;
+    case SIMDLevel::AVX2:
+        return &avx2_kernels;
+    default:
+        return &sse_kernels;
+    }
+}
+
+static SIMDLevel select_simd_level()
+{
+    if (cpu_supports(SIMDLevel::AVX512))
+    {
+        return SIMDLevel::AVX512;
+    }
+    if (cpu_supports(SIMDLevel::AVX2))
+    {
+        return SIMDLevel::AVX2;
+    }
+    return SIMDLevel::SSE;
+}
+
+//静态初始化之前(其他编译单元的全局对象构造时)使用的是SSE
+SIMDLevel active_simd_level = SIMDLevel::SSE;
+const SpectrumKernels *active_spectrum_kernels = &sse_kernels;
+
+static MAYBE_UNUSED const bool simd_level_selected = set_spectrum_simd_level(select_simd_level());
+
+bool set_spectrum_simd_level(SIMDLevel level)
+{
+    const SpectrumKernels *kernels = spectrum_kernels(level);
+    if (kernels == nullptr)
+    {
+        return false;
+    }
+    active_simd_level = level;
+    active_spectrum_kernels = kernels;
+    return true;
+}
+
+SIMDLevel spectrum_simd_level()
+{
+    return active_simd_level;
+}
+
+NARUKAMI_END
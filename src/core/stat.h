@@ -176,6 +176,9 @@ public:
 #define STAT_INCREASE_MEMORY_COUNTER(var, count) \
     var += count;
 
+#define STAT_MAX_MEMORY_COUNTER(var, count) \
+    var = max(var, static_cast<uint64_t>(count));
+
 #else
 #define STAT_COUNTER(name, var)
 #define STAT_MEMORY_COUNTER(name, var)
@@ -184,6 +187,7 @@ public:
 #define STAT_DECREASE_COUNTER(var, count)
 #define STAT_INCREASE_COUNTER_CONDITION(var, count, condition)
 #define STAT_INCREASE_MEMORY_COUNTER(var, count)
+#define STAT_MAX_MEMORY_COUNTER(var, count)
 #endif
 
 //print statistics infos into ostream
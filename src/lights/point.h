@@ -30,9 +30,8 @@ class PointLight : public Light
 {
 private:
     Spectrum _I; //radiant intensity
-public:
-    PointLight(const shared<Transform>& light_to_world,const shared<Transform>& world_to_light, const Spectrum &L) : Light(light_to_world,world_to_light), _I(L) {}
-    Spectrum sample_Li(const Interaction &interaction, const Point2f &u, Vector3f *wi, float *pdf, VisibilityTester *tester) override
+    //返回到光源距离的平方
+    float sample_position(const Interaction &interaction, Vector3f *wi, float *pdf, VisibilityTester *tester) const
     {
         auto light_position = (*_light_to_world)(Point3f(0.0f, 0.0f, 0.0f));
         (*wi) = normalize(light_position - interaction.p);
@@ -45,7 +44,19 @@ public:
             (*tester) = VisibilityTester(interaction, Interaction(light_position));
         }
 
-        return _I / sqrlen(interaction.p - light_position);
+        return sqrlen(interaction.p - light_position);
+    }
+
+public:
+    PointLight(const shared<Transform>& light_to_world,const shared<Transform>& world_to_light, const Spectrum &L) : Light(light_to_world,world_to_light), _I(L) {}
+    Spectrum sample_Li(const Interaction &interaction, const Point2f &u, Vector3f *wi, float *pdf, VisibilityTester *tester) override
+    {
+        return _I / sample_position(interaction, wi, pdf, tester);
+    }
+
+    SampledSpectrum sample_Li(const Interaction &interaction, const Point2f &u, const SampledWavelengths &wavelengths, Vector3f *wi, float *pdf, VisibilityTester *tester) override
+    {
+        return sample(_I, wavelengths) / sample_position(interaction, wi, pdf, tester);
     }
 
     Spectrum power() const override
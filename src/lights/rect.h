@@ -39,13 +39,9 @@ private:
     bool _two_side;
     float _width, _height;
 
-public:
-    RectLight(const shared<Transform>& light_to_world,const shared<Transform>& world_to_light,const Spectrum &L, bool two_side, const float w, const float h) : AreaLight(light_to_world,world_to_light,w*h), _radiance(L), _two_side(two_side), _width(w), _height(h){
-    }
-
-    Spectrum sample_Li(const Interaction &interaction, const Point2f &u, Vector3f *wi, float *pdf, VisibilityTester *tester) override
+    //返回false表示采样点在光源的背面
+    bool sample_position(const Interaction &interaction, const Point2f &u, Vector3f *wi, float *pdf, VisibilityTester *tester) const
     {
-
         Point3f local_light_position((u.x - 0.5f) * _width, (u.y - 0.5f) * _height, 0);
         auto light_position = (*_light_to_world)(local_light_position);
         auto unnormalized_wi = light_position - interaction.p;
@@ -55,7 +51,7 @@ public:
         auto costheta = (*_world_to_light)(-(*wi)).z;
         if (!_two_side && costheta <= 0.0f)
         {
-            return Spectrum(0.0f);
+            return false;
         }
 
         if (pdf)
@@ -66,10 +62,31 @@ public:
         {
             (*tester) = VisibilityTester(interaction, Interaction(light_position));
         }
+        return true;
+    }
+
+public:
+    RectLight(const shared<Transform>& light_to_world,const shared<Transform>& world_to_light,const Spectrum &L, bool two_side, const float w, const float h) : AreaLight(light_to_world,world_to_light,w*h), _radiance(L), _two_side(two_side), _width(w), _height(h){
+    }
 
+    Spectrum sample_Li(const Interaction &interaction, const Point2f &u, Vector3f *wi, float *pdf, VisibilityTester *tester) override
+    {
+        if (!sample_position(interaction, u, wi, pdf, tester))
+        {
+            return Spectrum(0.0f);
+        }
         return _radiance;
     }
 
+    SampledSpectrum sample_Li(const Interaction &interaction, const Point2f &u, const SampledWavelengths &wavelengths, Vector3f *wi, float *pdf, VisibilityTester *tester) override
+    {
+        if (!sample_position(interaction, u, wi, pdf, tester))
+        {
+            return SampledSpectrum(0.0f);
+        }
+        return sample(_radiance, wavelengths);
+    }
+
     Spectrum L(const Interaction &interaction, const Vector3f &wi) const override
     {
         if (!_two_side && (*_world_to_light)(wi).z >= 0)
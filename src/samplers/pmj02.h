@@ -0,0 +1,99 @@
+/*
+MIT License
+
+Copyright (c) 2019 ZhuQian
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "core/sampler.h"
+#include "core/lowdiscrepancy.h"
+
+NARUKAMI_BEGIN
+/**
+ * 使用预先生成的pmj02样本表的采样器,spp不需要是2的幂
+ * 每个像素的样本按顺序取表中的前spp个点,所以渲染可以在任意样本数停止,前2^k个样本总是分层的
+ * 每个维度根据(像素,维度,seed)的hash选择一张表,再做Owen scrambling,维度没有上限
+ * 超过表长的样本换到另一张表继续
+*/
+class PMJ02Sampler : public Sampler
+{
+private:
+    Point2i _pixel;
+    uint32_t _dim;
+    const uint32_t _seed;
+
+    inline uint64_t hash(const uint32_t dim) const
+    {
+        const uint64_t pixel = (static_cast<uint64_t>(static_cast<uint32_t>(_pixel.x)) << 32) | static_cast<uint32_t>(_pixel.y);
+        const uint64_t block = _sample_idx / PMJ02_TABLE_SAMPLE_NUM;
+        return mix_bits(pixel ^ mix_bits((static_cast<uint64_t>(dim) << 32) | _seed) ^ (block << 48));
+    }
+
+    inline const uint32_t *get_sample(const uint64_t h) const
+    {
+        return pmj02_table(static_cast<uint32_t>(h % PMJ02_TABLE_NUM)) + 2 * (_sample_idx % PMJ02_TABLE_SAMPLE_NUM);
+    }
+
+    static inline float to_float(const uint32_t v)
+    {
+        return min(v * 0x1p-32f, ONE_MINUS_EPSILON);
+    }
+
+public:
+    PMJ02Sampler(const uint32_t spp, const uint32_t seed = 0) : Sampler(spp), _dim(0), _seed(seed)
+    {
+        //第一次使用时生成样本表,避免在渲染线程中等待
+        pmj02_table(0);
+    }
+
+    void start_pixel(const Point2i &p) override
+    {
+        _pixel = p;
+        _dim = 0;
+        _sample_idx = 0;
+    }
+
+    bool start_next_sample() override
+    {
+        _dim = 0;
+        return Sampler::start_next_sample();
+    }
+
+    float get_1D() override
+    {
+        const uint64_t h = hash(_dim++);
+        return to_float(owen_scramble_u32(get_sample(h)[0], static_cast<uint32_t>(h >> 32)));
+    }
+
+    Point2f get_2D() override
+    {
+        const uint64_t h = hash(_dim++);
+        const uint32_t *sample = get_sample(h);
+        return Point2f(to_float(owen_scramble_u32(sample[0], static_cast<uint32_t>(h >> 32))),
+                       to_float(owen_scramble_u32(sample[1], static_cast<uint32_t>(mix_bits(h)))));
+    }
+
+    std::unique_ptr<Sampler> clone(const uint64_t seed) const override
+    {
+        return narukami::make_unique<PMJ02Sampler>(*this);
+    }
+};
+NARUKAMI_END
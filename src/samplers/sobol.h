@@ -0,0 +1,98 @@
+/*
+MIT License
+
+Copyright (c) 2019 ZhuQian
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "core/sampler.h"
+#include "core/lowdiscrepancy.h"
+
+NARUKAMI_BEGIN
+/**
+ * 不需要为像素预先生成样本的Sobol采样器,任意(像素,样本,维度)的值都可以直接算出来
+ * 每次get_1D/get_2D占用一个维度,每个维度用各自的种子打乱样本的顺序(nested uniform scramble),
+ * 再对Sobol序列的前两维做Owen scrambling,所以维度没有上限,而且每一维(对)都是分层的
+ * 样本的值只和像素、样本、维度以及构造时的seed有关,clone的seed不会改变结果,渲染的结果和tile的划分无关
+*/
+class SobolSampler : public Sampler
+{
+private:
+    Point2i _pixel;
+    uint32_t _dim;
+    const uint32_t _seed;
+    const uint32_t _index_mask;
+
+    inline uint64_t hash(const uint32_t dim) const
+    {
+        const uint64_t pixel = (static_cast<uint64_t>(static_cast<uint32_t>(_pixel.x)) << 32) | static_cast<uint32_t>(_pixel.y);
+        return mix_bits(pixel ^ mix_bits((static_cast<uint64_t>(dim) << 32) | _seed));
+    }
+
+    //Owen scrambling中输出的第k位只和输入的低k位有关,所以只保留低log2(spp)位仍然是[0,spp)上的一个置换
+    inline uint32_t shuffle_index(const uint32_t seed) const
+    {
+        return owen_scramble_u32(_sample_idx, seed) & _index_mask;
+    }
+
+    static inline float to_float(const uint32_t v)
+    {
+        return min(v * 0x1p-32f, ONE_MINUS_EPSILON);
+    }
+
+public:
+    SobolSampler(const uint32_t spp, const uint32_t seed = 0) : Sampler(spp), _dim(0), _seed(seed), _index_mask(round_up_pow2(spp) - 1) {}
+
+    void start_pixel(const Point2i &p) override
+    {
+        _pixel = p;
+        _dim = 0;
+        _sample_idx = 0;
+    }
+
+    bool start_next_sample() override
+    {
+        _dim = 0;
+        return Sampler::start_next_sample();
+    }
+
+    float get_1D() override
+    {
+        const uint64_t h = hash(_dim++);
+        const uint32_t idx = shuffle_index(static_cast<uint32_t>(h));
+        return to_float(owen_scramble_u32(sobol02_u32(idx, 0), static_cast<uint32_t>(h >> 32)));
+    }
+
+    Point2f get_2D() override
+    {
+        const uint64_t h = hash(_dim++);
+        const uint32_t idx = shuffle_index(static_cast<uint32_t>(h));
+        const uint32_t seed_y = static_cast<uint32_t>(mix_bits(h));
+        return Point2f(to_float(owen_scramble_u32(sobol02_u32(idx, 0), static_cast<uint32_t>(h >> 32))),
+                       to_float(owen_scramble_u32(sobol02_u32(idx, 1), seed_y)));
+    }
+
+    std::unique_ptr<Sampler> clone(const uint64_t seed) const override
+    {
+        return narukami::make_unique<SobolSampler>(*this);
+    }
+};
+NARUKAMI_END
@@ -0,0 +1,128 @@
+/*
+MIT License
+
+Copyright (c) 2019 ZhuQian
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#pragma once
+
+#include "core/sampler.h"
+#include "core/lowdiscrepancy.h"
+
+NARUKAMI_BEGIN
+/**
+ * ZSampler(Ahmed and Wonka 2020):整张图共用一个Sobol序列,像素按Morton顺序排列,第i个像素的样本是序列中的第[i*spp,(i+1)*spp)个点
+ * 然后按维度随机地置换Morton索引中的每个4进制位,相邻像素拿到的是同一个(0,2)-net中的不同子集,像素之间的误差成为蓝噪声
+ * 置换只发生在位与位之间,每个像素的样本仍然是一个对齐的Sobol块,像素内的分层和SobolSampler相同
+ * spp会被向上取整到2的幂;Morton索引和样本一起只有32bit,所以要求 2*log2(分辨率)+log2(spp)<=32
+*/
+class ZSobolSampler : public Sampler
+{
+private:
+    uint32_t _morton_idx;
+    uint32_t _dim;
+    const uint32_t _seed;
+    const int _log2_spp;
+    const int _base4_digit_num;
+
+    static int log2_resolution(const Point2i &resolution)
+    {
+        return log2(static_cast<int>(round_up_pow2(static_cast<uint32_t>(max(resolution.x, resolution.y)))));
+    }
+
+    //当前维度下当前样本在整个Sobol序列中的索引
+    uint32_t get_sample_index() const
+    {
+        static const uint8_t permutations[24][4] = {
+            {0, 1, 2, 3}, {0, 1, 3, 2}, {0, 2, 1, 3}, {0, 2, 3, 1}, {0, 3, 2, 1}, {0, 3, 1, 2},
+            {1, 0, 2, 3}, {1, 0, 3, 2}, {1, 2, 0, 3}, {1, 2, 3, 0}, {1, 3, 2, 0}, {1, 3, 0, 2},
+            {2, 1, 0, 3}, {2, 1, 3, 0}, {2, 0, 1, 3}, {2, 0, 3, 1}, {2, 3, 0, 1}, {2, 3, 1, 0},
+            {3, 1, 2, 0}, {3, 1, 0, 2}, {3, 2, 1, 0}, {3, 2, 0, 1}, {3, 0, 2, 1}, {3, 0, 1, 2}};
+
+        const uint32_t morton_idx = _morton_idx | _sample_idx;
+        const uint64_t dim_hash = 0x55555555ull * _dim;
+        //spp是4的幂时最低一位也是完整的4进制位,否则最低一位单独处理
+        const bool odd_bits = _log2_spp & 1;
+        uint32_t sample_idx = 0;
+        for (int i = _base4_digit_num - 1; i >= static_cast<int>(odd_bits); --i)
+        {
+            const int shift = 2 * i - static_cast<int>(odd_bits);
+            const uint32_t digit = (morton_idx >> shift) & 3;
+            //高位决定当前位使用的置换,所以索引到索引的映射是一个双射
+            const uint64_t higher_digits = static_cast<uint64_t>(morton_idx) >> (shift + 2);
+            const uint32_t p = (mix_bits(higher_digits ^ dim_hash) >> 24) % 24;
+            sample_idx |= static_cast<uint32_t>(permutations[p][digit]) << shift;
+        }
+        if (odd_bits)
+        {
+            const uint32_t bit = morton_idx & 1;
+            sample_idx |= bit ^ static_cast<uint32_t>(mix_bits((morton_idx >> 1) ^ dim_hash) & 1);
+        }
+        return sample_idx;
+    }
+
+    static inline float to_float(const uint32_t v)
+    {
+        return min(v * 0x1p-32f, ONE_MINUS_EPSILON);
+    }
+
+public:
+    ZSobolSampler(const uint32_t spp, const Point2i &resolution, const uint32_t seed = 0) : Sampler(round_up_pow2(spp)), _morton_idx(0), _dim(0), _seed(seed), _log2_spp(log2(static_cast<int>(round_up_pow2(spp)))), _base4_digit_num(log2_resolution(resolution) + (_log2_spp + 1) / 2)
+    {
+        if (2 * log2_resolution(resolution) + _log2_spp > 32)
+        {
+            NARUKAMI_WARNING("ZSobolSampler: resolution (%d,%d) with %d spp exceeds 32bit sample index", resolution.x, resolution.y, _spp)
+        }
+    }
+
+    void start_pixel(const Point2i &p) override
+    {
+        _morton_idx = encode_morton2(static_cast<uint32_t>(p.x), static_cast<uint32_t>(p.y)) << _log2_spp;
+        _dim = 0;
+        _sample_idx = 0;
+    }
+
+    bool start_next_sample() override
+    {
+        _dim = 0;
+        return Sampler::start_next_sample();
+    }
+
+    float get_1D() override
+    {
+        const uint32_t idx = get_sample_index();
+        const uint64_t h = mix_bits((static_cast<uint64_t>(_dim++) << 32) | _seed);
+        return to_float(owen_scramble_u32(sobol02_u32(idx, 0), static_cast<uint32_t>(h)));
+    }
+
+    Point2f get_2D() override
+    {
+        const uint32_t idx = get_sample_index();
+        const uint64_t h = mix_bits((static_cast<uint64_t>(_dim++) << 32) | _seed);
+        return Point2f(to_float(owen_scramble_u32(sobol02_u32(idx, 0), static_cast<uint32_t>(h))),
+                       to_float(owen_scramble_u32(sobol02_u32(idx, 1), static_cast<uint32_t>(h >> 32))));
+    }
+
+    std::unique_ptr<Sampler> clone(const uint64_t seed) const override
+    {
+        return narukami::make_unique<ZSobolSampler>(*this);
+    }
+};
+NARUKAMI_END
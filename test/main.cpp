@@ -168,11 +168,11 @@ TEST(rcp, values)
 
 TEST(safe_rcp, zero)
 {
-#ifdef MATH_SSE_RCP
     EXPECT_FLOAT_EQ(safe_rcp(0.0f), 1.0f / MIN_RCP_INPUT);
-#else
-    EXPECT_FLOAT_EQ(safe_rcp(0.0f), INFINITE);
-#endif
+    EXPECT_FLOAT_EQ(safe_rcp(-0.0f), 1.0f / MIN_RCP_INPUT);
+    EXPECT_FLOAT_EQ(safe_rcp(-1E-30f), -1.0f / MIN_RCP_INPUT);
+    EXPECT_FLOAT_EQ(safe_rcp(float4(0.0f))[0], 1.0f / MIN_RCP_INPUT);
+    EXPECT_FLOAT_EQ(safe_rcp(float4(-1E-30f))[0], -1.0f / MIN_RCP_INPUT);
 }
 
 TEST(safe_rcp, values)
@@ -261,6 +261,16 @@ TEST(clz, values)
     EXPECT_EQ(clz(8), 28);
 }
 
+TEST(popcount, values)
+{
+    EXPECT_EQ(popcount(0), 0);
+    EXPECT_EQ(popcount(1), 1);
+    EXPECT_EQ(popcount(3), 2);
+    EXPECT_EQ(popcount(0xF), 4);
+    EXPECT_EQ(popcount(0x80000001), 2);
+    EXPECT_EQ(popcount(0xFFFFFFFF), 32);
+}
+
 TEST(is_pow2,values)
 {
     EXPECT_TRUE(is_pow2(1));
@@ -303,6 +313,124 @@ TEST(Spectrum, average)
     EXPECT_FLOAT_EQ(average(a3), 100000000.0f);
 }
 
+TEST(Spectrum, coarse)
+{
+    //32个采样的CoarseSpectrum,末尾补齐的通道必须为0
+    CoarseSpectrum a(1.0f);
+    EXPECT_EQ(CoarseSpectrum::SAMPLE_COUNT, 32);
+    EXPECT_FLOAT_EQ(average(a), 1.0f);
+    EXPECT_FALSE(is_black(a));
+
+    float reference[3], xyz[3];
+    from_spd_to_xyz(tungsten_lamp_3000k<Spectrum>(1.0f), reference);
+    from_spd_to_xyz(tungsten_lamp_3000k<CoarseSpectrum>(1.0f), xyz);
+    for (int i = 0; i < 3; ++i)
+    {
+        EXPECT_NEAR(xyz[i], reference[i], reference[i] * 0.02f);
+    }
+}
+
+TEST(SigmoidPolynomial, eval)
+{
+    const SigmoidPolynomial poly = {1e-5f, -1e-2f, 0.3f};
+    auto reference = [&](float lambda) {
+        const float x = (poly.c0 * lambda + poly.c1) * lambda + poly.c2;
+        return 0.5f + 0.5f * x / std::sqrt(1.0f + x * x);
+    };
+
+    BasicSpectrum<30> spd;
+    from_sigmoid_polynomial_to_spd(poly, spd);
+    const float step = (830.0f - 360.0f) / 29;
+    for (int i = 0; i < 30; ++i)
+    {
+        EXPECT_NEAR(spd[i], reference(360.0f + i * step), 1e-5f);
+    }
+    //补齐的两个样本必须为0
+    EXPECT_EQ(spd.data()[30], 0.0f);
+    EXPECT_EQ(spd.data()[31], 0.0f);
+
+    const SampledWavelengths wavelengths = sample_wavelengths(0.3f);
+    const SampledSpectrum s = sample(poly, wavelengths);
+    for (int i = 0; i < SAMPLED_WAVELENGTH_COUNT; ++i)
+    {
+        EXPECT_NEAR(s[i], reference(wavelengths.lambda[i]), 1e-5f);
+    }
+}
+
+TEST(SigmoidPolynomialCache, quantize)
+{
+    const float black[3] = {0.0f, 0.0f, 0.0f};
+    const float white[3] = {1.0f, 1.0f, 1.0f};
+    const float hdr[3] = {4.0f, 1.5f, -1.0f};
+    const float red[3] = {1.0f, 0.0f, 0.0f};
+    const float blue[3] = {0.0f, 0.0f, 1.0f};
+    EXPECT_EQ(SigmoidPolynomialCache::quantize(black), 0u);
+    EXPECT_EQ(SigmoidPolynomialCache::quantize(white), (1u << 30) - 1);
+    //超出[0,1]的颜色被截断
+    EXPECT_EQ(SigmoidPolynomialCache::quantize(hdr), SigmoidPolynomialCache::quantize(white) & ~(1023u << 20));
+    EXPECT_NE(SigmoidPolynomialCache::quantize(red), SigmoidPolynomialCache::quantize(blue));
+    //8bit纹理的颜色量化后互不相同
+    const float c0[3] = {100 / 255.0f, 0.0f, 0.0f};
+    const float c1[3] = {101 / 255.0f, 0.0f, 0.0f};
+    EXPECT_NE(SigmoidPolynomialCache::quantize(c0), SigmoidPolynomialCache::quantize(c1));
+}
+
+TEST(SpectrumKernels, consistent)
+{
+    //所有CPU支持的指令集都要和SSE的结果一致,n覆盖了AVX2/AVX-512需要处理剩余部分的情况
+    const SpectrumKernels *sse = spectrum_kernels(SIMDLevel::SSE);
+    ASSERT_NE(sse, nullptr);
+    const int max_n = 100;
+    float a[max_n], b[max_n], x[max_n], y[max_n], z[max_n];
+    for (int i = 0; i < max_n; ++i)
+    {
+        a[i] = 0.25f + i * 0.5f;
+        b[i] = 1.0f + (i % 7);
+        x[i] = 0.01f * i;
+        y[i] = 1.0f - 0.005f * i;
+        z[i] = 0.5f;
+    }
+    for (const SIMDLevel level : {SIMDLevel::AVX2, SIMDLevel::AVX512})
+    {
+        const SpectrumKernels *k = spectrum_kernels(level);
+        if (k == nullptr)
+        {
+            continue;
+        }
+        for (const int n : {4, 8, 12, 16, 28, 32, 96, 100})
+        {
+            float expected[max_n], actual[max_n];
+            sse->mul(expected, a, b, n);
+            k->mul(actual, a, b, n);
+            EXPECT_EQ(memcmp(expected, actual, n * sizeof(float)), 0);
+
+            sse->div(expected, a, b, n);
+            k->div(actual, a, b, n);
+            EXPECT_EQ(memcmp(expected, actual, n * sizeof(float)), 0);
+
+            memcpy(expected, b, sizeof(b));
+            memcpy(actual, b, sizeof(b));
+            sse->madd(expected, a, 0.3f, n);
+            k->madd(actual, a, 0.3f, n);
+            EXPECT_EQ(memcmp(expected, actual, max_n * sizeof(float)), 0);
+
+            EXPECT_NEAR(k->sum(a, n), sse->sum(a, n), sse->sum(a, n) * 1e-6f);
+            float xyz_expected[3], xyz_actual[3];
+            sse->dot_xyz(a, x, y, z, n, xyz_expected);
+            k->dot_xyz(a, x, y, z, n, xyz_actual);
+            for (int i = 0; i < 3; ++i)
+            {
+                EXPECT_NEAR(xyz_actual[i], xyz_expected[i], std::abs(xyz_expected[i]) * 1e-6f);
+            }
+
+            float black[max_n] = {};
+            EXPECT_TRUE(k->is_black(black, n));
+            black[n - 1] = 1.0f;
+            EXPECT_FALSE(k->is_black(black, n));
+        }
+    }
+}
+
 /********************************************************/
 /************************texture************************/
 
@@ -1624,6 +1752,1598 @@ TEST(Image,set_texel)
 //     EXPECT_EQ(leaf_offset(a),10);
 // }
 
+#include "core/accelerator.h"
+//超过MAX_LOCAL_STACK_DEEP以后转移到堆上,顺序不变
+TEST(InlineStack, spill)
+{
+    InlineStack<uint32_t, MAX_LOCAL_STACK_DEEP> stack;
+    EXPECT_TRUE(stack.empty());
+    EXPECT_FALSE(stack.spilled());
+
+    const uint32_t n = MAX_LOCAL_STACK_DEEP * 3 + 1;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        stack.push(i);
+        EXPECT_EQ(i, stack.top());
+        EXPECT_EQ(i >= MAX_LOCAL_STACK_DEEP, stack.spilled());
+    }
+    EXPECT_EQ(n, stack.size());
+
+    //先弹出一部分再压入,转移之前的元素也要保持原来的顺序
+    for (uint32_t i = n; i > MAX_LOCAL_STACK_DEEP / 2; --i)
+    {
+        EXPECT_EQ(i - 1, stack.pop());
+    }
+    for (uint32_t i = MAX_LOCAL_STACK_DEEP / 2; i < n; ++i)
+    {
+        stack.push(i);
+    }
+    for (uint32_t i = n; i > 0; --i)
+    {
+        EXPECT_EQ(i - 1, stack.pop());
+    }
+    EXPECT_TRUE(stack.empty());
+    EXPECT_TRUE(stack.spilled());
+
+    InlineStack<uint32_t, MAX_LOCAL_STACK_DEEP> reserved;
+    reserved.push(7);
+    reserved.reserve(MAX_LOCAL_STACK_DEEP * 4);
+    EXPECT_TRUE(reserved.spilled());
+    EXPECT_EQ(7u, reserved.pop());
+}
+
+TEST(QBVHNode, wide_reference)
+{
+    auto a = wide_leaf(0x12345678, 4);
+    EXPECT_TRUE(is_leaf(a));
+    EXPECT_TRUE(!leaf_is_empty(a));
+    EXPECT_EQ(leaf_offset(a), 0x12345678u);
+    EXPECT_EQ(leaf_num(a), 4u);
+    EXPECT_TRUE(leaf_is_empty(wide_empty_leaf()));
+    EXPECT_TRUE(!is_leaf(static_cast<uint64_t>(7)));
+    EXPECT_EQ(interior(static_cast<uint64_t>(7)), 7u);
+
+    EXPECT_TRUE(fits_node_reference<NarrowNodeReference>(1 << 27, 1 << 20));
+    EXPECT_TRUE(!fits_node_reference<NarrowNodeReference>((1 << 27) + 1, 1 << 20));
+    EXPECT_TRUE(fits_node_reference<WideNodeReference>((1 << 27) + 1, 1 << 20));
+}
+
+TEST(QBVHNode, reference_overflow)
+{
+    std::vector<QBVHNode> nodes(8);
+    EXPECT_TRUE(check_node_reference("test", 1 << 27, 1 << 20, nodes));
+    EXPECT_EQ(nodes.size(), 8u);
+
+    //溢出时只留下一个空的根节点
+    EXPECT_TRUE(!check_node_reference("test", (1 << 27) + 1, 1 << 20, nodes));
+    ASSERT_EQ(nodes.size(), 1u);
+    for (uint32_t i = 0; i < 4; ++i)
+    {
+        EXPECT_TRUE(leaf_is_empty(nodes[0].childrens[i]));
+    }
+    Ray ray(Point3f(0, 0, -1), normalize(Vector3f(0.1f, 0.2f, 1)));
+    bool visited = false;
+    traverse_closest(&nodes[0], nullptr, 1, TraversalRay(ray), ray, [&](uint32_t, uint32_t) { visited = true; });
+    EXPECT_TRUE(!visited);
+
+    std::vector<WideQBVHNode> wide_nodes(8);
+    EXPECT_TRUE(check_node_reference("test", (1ull << 27) + 1, 1 << 20, wide_nodes));
+    EXPECT_EQ(wide_nodes.size(), 8u);
+}
+
+#include <thread>
+TEST(LazyBLAS, build_once)
+{
+    std::atomic<int> build_num(0);
+    auto identity = std::make_shared<Transform>();
+    LazyBLAS blas(Bounds3f(Point3f(-1, -1, -1), Point3f(1, 1, 1)), [&]() {
+        build_num++;
+        return shared<BLAS>(new MeshBLAS(create_mesh_triangle_primitives(create_plane(identity, identity, 1, 1))));
+    });
+    EXPECT_TRUE(!blas.is_built());
+
+    std::atomic<int> hit_num(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([&]() {
+            Ray ray(Point3f(0.1f, 0.1f, -1), Vector3f(0, 0, 1));
+            SurfaceInteraction interaction;
+            if (blas.intersect(ray, &interaction))
+            {
+                hit_num++;
+            }
+        });
+    }
+    for (auto &&t : threads)
+    {
+        t.join();
+    }
+    EXPECT_TRUE(blas.is_built());
+    EXPECT_EQ(build_num, 1);
+    EXPECT_EQ(hit_num, 4);
+}
+
+//构建出来的BLAS超出声明的包围盒时报错
+TEST(LazyBLAS, bounds_check)
+{
+    EXPECT_TRUE(inside(Bounds3f(Point3f(0, 0, 0), Point3f(1, 1, 1)), Bounds3f(Point3f(0, 0, 0), Point3f(1, 1, 1))));
+    EXPECT_TRUE(inside(Bounds3f(), Bounds3f(Point3f(0, 0, 0), Point3f(1, 1, 1))));
+    EXPECT_FALSE(inside(Bounds3f(Point3f(0, 0, 0), Point3f(1, 1, 1.5f)), Bounds3f(Point3f(0, 0, 0), Point3f(1, 1, 1))));
+
+    auto identity = std::make_shared<Transform>();
+    auto create = [identity]() { return shared<BLAS>(new MeshBLAS(create_mesh_triangle_primitives(create_plane(identity, identity, 1, 1)))); };
+    Ray ray(Point3f(0.1f, 0.1f, -1), Vector3f(0, 0, 1));
+
+    LazyBLAS fit(Bounds3f(Point3f(-1, -1, -1), Point3f(1, 1, 1)), create);
+    testing::internal::CaptureStderr();
+    EXPECT_TRUE(fit.intersect(ray));
+    EXPECT_TRUE(testing::internal::GetCapturedStderr().empty());
+
+    LazyBLAS too_small(Bounds3f(Point3f(0, 0, 0), Point3f(0.1f, 0.1f, 0.1f)), create);
+    testing::internal::CaptureStderr();
+    EXPECT_TRUE(too_small.intersect(ray));
+    EXPECT_NE(std::string::npos, testing::internal::GetCapturedStderr().find("LazyBLAS"));
+}
+
+//方向和起点都有为0的分量,o*inv_d不能是NaN
+TEST(TraversalRay, axis_parallel)
+{
+    auto transform = std::make_shared<Transform>(translate(0.5f, 0, 2.5f));
+    auto inv_transform = std::make_shared<Transform>(inverse(*transform));
+    auto blas = std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(create_plane(transform, inv_transform, 5, 5)));
+    std::vector<shared<BLASInstance>> instances = {std::make_shared<BLASInstance>(std::make_shared<AnimatedTransform>(std::make_shared<Transform>()), blas)};
+    TLAS tlas(instances);
+
+    for (auto &&d : {Vector3f(0, 0, 1), Vector3f(-0.0f, 0, 1), Vector3f(0, -0.0f, 1)})
+    {
+        Ray ray(Point3f(0, 0, -1), d);
+        SurfaceInteraction interaction;
+        EXPECT_TRUE(blas->intersect(ray, &interaction));
+        EXPECT_FLOAT_EQ(ray.t_max, 3.5f);
+
+        ray = Ray(Point3f(0, 0, -1), d);
+        EXPECT_TRUE(tlas.intersect(ray, &interaction));
+        EXPECT_FLOAT_EQ(ray.t_max, 3.5f);
+        EXPECT_TRUE(tlas.intersect(Ray(Point3f(0, 0, -1), d)));
+    }
+    //不在平面范围内的轴平行射线
+    EXPECT_TRUE(!tlas.intersect(Ray(Point3f(-3, 0, -1), Vector3f(0, 0, 1))));
+}
+
+#include "core/rng.h"
+//随机三角形组成的mesh,位于[0,1]^3
+static shared<MeshBLAS> create_random_triangle_blas(RNG &rng, uint32_t triangle_num, float triangle_size = 0.1f)
+{
+    std::vector<Point3f> positions;
+    std::vector<MeshFace> faces;
+    for (uint32_t i = 0; i < triangle_num; ++i)
+    {
+        Point3f center(rng.next_float(), rng.next_float(), rng.next_float());
+        for (int v = 0; v < 3; ++v)
+        {
+            positions.push_back(center + Vector3f(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f) * triangle_size);
+        }
+        uint32_t vi[3] = {i * 3, i * 3 + 1, i * 3 + 2};
+        faces.push_back(MeshFace(vi));
+    }
+    auto transform = std::make_shared<Transform>();
+    auto mesh = std::make_shared<Mesh>(transform, transform, positions, std::vector<Normal3f>(), std::vector<Point2f>(), std::vector<MeshSegment>{MeshSegment(faces)});
+    return std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(mesh));
+}
+
+static shared<BLASInstance> create_test_instance(const Transform &blas_to_world, const shared<BLAS> &blas, uint32_t mask = RAY_MASK_ALL)
+{
+    return std::make_shared<BLASInstance>(std::make_shared<AnimatedTransform>(std::make_shared<Transform>(blas_to_world)), blas, mask);
+}
+
+//几个共用同一个blas的随机三角形instance加上一个平面,rotated为true时instance带旋转
+static std::vector<shared<BLASInstance>> create_test_instances(bool rotated)
+{
+    RNG rng(7);
+    auto blas = create_random_triangle_blas(rng, 256);
+    std::vector<shared<BLASInstance>> instances;
+    for (int i = 0; i < 8; ++i)
+    {
+        auto transform = translate(rng.next_float() * 4.0f - 2.0f, rng.next_float() * 4.0f - 2.0f, rng.next_float() * 2.0f);
+        if (rotated)
+        {
+            transform = transform * rotate(rng.next_float() * 360.0f, normalize(Vector3f(rng.next_float() + 0.1f, rng.next_float(), rng.next_float())));
+        }
+        instances.push_back(create_test_instance(transform, blas));
+    }
+    auto plane_transform = std::make_shared<Transform>(translate(0.5f, 0, 2.5f));
+    auto inv_plane_transform = std::make_shared<Transform>(inverse(*plane_transform));
+    instances.push_back(create_test_instance(Transform(), std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(create_plane(plane_transform, inv_plane_transform, 5, 5)))));
+    //y=3处的水平面,z的范围是[-2.5,2.5]
+    auto ceiling_transform = std::make_shared<Transform>(translate(0, 3, 0) * rotate(90, 1, 0, 0));
+    auto inv_ceiling_transform = std::make_shared<Transform>(inverse(*ceiling_transform));
+    instances.push_back(create_test_instance(Transform(), std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(create_plane(ceiling_transform, inv_ceiling_transform, 5, 5)))));
+    return instances;
+}
+
+static Ray create_random_ray(RNG &rng)
+{
+    Point3f o(rng.next_float() * 6.0f - 3.0f, rng.next_float() * 6.0f - 3.0f, rng.next_float() * 4.0f - 2.0f);
+    Vector3f d(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f);
+    return Ray(o, normalize(d));
+}
+
+//从(0,0,-4)出发看向+z的射线,相邻的射线方向接近
+static Ray create_camera_ray(uint32_t x, uint32_t y, uint32_t width)
+{
+    float u = static_cast<float>(x) / width - 0.5f;
+    float v = static_cast<float>(y) / width - 0.5f;
+    return Ray(Point3f(0, 0, -4), normalize(Vector3f(u, v, 1.0f)));
+}
+
+static void expect_same_hit(bool expected_hit, const Ray &expected_ray, const SurfaceInteraction &expected, bool hit, const Ray &ray, const SurfaceInteraction &interaction)
+{
+    ASSERT_EQ(expected_hit, hit);
+    if (hit)
+    {
+        EXPECT_NEAR(expected_ray.t_max, ray.t_max, 1e-4f);
+        EXPECT_NEAR(expected.n.x, interaction.n.x, 1e-4f);
+        EXPECT_NEAR(expected.n.y, interaction.n.y, 1e-4f);
+        EXPECT_NEAR(expected.n.z, interaction.n.z, 1e-4f);
+        EXPECT_NEAR(expected.uv.x, interaction.uv.x, 1e-4f);
+        EXPECT_NEAR(expected.uv.y, interaction.uv.y, 1e-4f);
+    }
+}
+
+//packet的结果和逐条射线的结果比较,不活跃的通道不能被改动
+static void expect_packet_matches_single(const TLAS &tlas, const Ray *packet_rays, uint32_t lane_mask)
+{
+    Ray rays[SSE_WIDTH];
+    SurfaceInteraction interactions[SSE_WIDTH];
+    bool hits[SSE_WIDTH] = {false, false, false, false};
+    bool occluded[SSE_WIDTH] = {false, false, false, false};
+    for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+    {
+        rays[lane] = packet_rays[lane];
+    }
+    tlas.intersect_packet(rays, lane_mask, interactions, hits);
+    tlas.occluded_packet(packet_rays, lane_mask, occluded);
+
+    for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+    {
+        if (!is_active_lane(lane_mask, lane))
+        {
+            EXPECT_EQ(rays[lane].t_max, packet_rays[lane].t_max);
+            continue;
+        }
+        Ray ray = packet_rays[lane];
+        SurfaceInteraction interaction;
+        bool hit = tlas.intersect(ray, &interaction);
+        expect_same_hit(hit, ray, interaction, hits[lane], rays[lane], interactions[lane]);
+        EXPECT_EQ(tlas.intersect(packet_rays[lane]), occluded[lane]);
+    }
+}
+
+TEST(TLAS, packet)
+{
+    auto instances = create_test_instances(false);
+    TLAS tlas(instances);
+    const uint32_t lane_masks[] = {0xF, 0x7, 0xA, 0x9, 0x4};
+
+    //2x2像素块组成的相干packet
+    const uint32_t width = 32;
+    for (uint32_t y = 0; y < width; y += 2)
+    {
+        for (uint32_t x = 0; x < width; x += 2)
+        {
+            Ray rays[SSE_WIDTH];
+            for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+            {
+                rays[lane] = create_camera_ray(x + (lane & 1), y + (lane >> 1), width);
+            }
+            for (auto &&lane_mask : lane_masks)
+            {
+                expect_packet_matches_single(tlas, rays, lane_mask);
+            }
+        }
+    }
+
+    //方向不在同一个卦限的随机射线
+    RNG rng(3);
+    for (int i = 0; i < 256; ++i)
+    {
+        Ray rays[SSE_WIDTH];
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            rays[lane] = create_random_ray(rng);
+        }
+        for (auto &&lane_mask : lane_masks)
+        {
+            expect_packet_matches_single(tlas, rays, lane_mask);
+        }
+    }
+
+    //射向水平面的轴平行射线,第一条射线的起点在box的z边界上,区间射线的z轴会出现0*inf
+    float min_z = instances.back()->bounds().min_point.z;
+    Ray rays[SSE_WIDTH] = {Ray(Point3f(0.3f, 0, min_z), Vector3f(0, 1, 0)), Ray(Point3f(0.3f, 0, -1.3f), Vector3f(0, 1, 0)), Ray(Point3f(0.3f, 0, 0.1f), Vector3f(0, 1, 0)), Ray(Point3f(0.3f, 0, 1.7f), Vector3f(0, 1, 0))};
+    for (auto &&lane_mask : lane_masks)
+    {
+        expect_packet_matches_single(tlas, rays, lane_mask);
+    }
+    SurfaceInteraction interactions[SSE_WIDTH];
+    bool hits[SSE_WIDTH] = {false, false, false, false};
+    tlas.intersect_packet(rays, 0xF, interactions, hits);
+    EXPECT_TRUE(hits[1] && hits[2] && hits[3]);
+}
+
+//64 bits节点引用的BLAS和32 bits的遍历结果必须完全一样
+TEST(WideMeshBLAS, matches_narrow)
+{
+    RNG rng(37);
+    auto blas = create_random_triangle_blas(rng, 4096, 0.05f);
+    WideMeshBLAS wide(blas->get_primitives());
+    ASSERT_EQ(blas->bounds().min_point.x, wide.bounds().min_point.x);
+    ASSERT_EQ(blas->bounds().max_point.z, wide.bounds().max_point.z);
+
+    //起点在[-0.5,1.5]^3内的随机射线
+    auto create_ray = [&rng]() {
+        Point3f o(rng.next_float() * 2.0f - 0.5f, rng.next_float() * 2.0f - 0.5f, rng.next_float() * 2.0f - 0.5f);
+        Vector3f d(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f);
+        return Ray(o, normalize(d));
+    };
+    auto expect_same_occlusion = [&](const Ray &test_ray) {
+        uint32_t occluder = INVALID_OCCLUDER;
+        uint32_t wide_occluder = INVALID_OCCLUDER;
+        bool occluded = blas->occluded(test_ray, &occluder);
+        ASSERT_EQ(occluded, wide.occluded(test_ray, &wide_occluder));
+        EXPECT_EQ(occluded, blas->intersect(test_ray));
+        EXPECT_EQ(occluded, wide.intersect(test_ray));
+        if (occluded)
+        {
+            EXPECT_TRUE(wide.occluded_by(test_ray, wide_occluder));
+            EXPECT_TRUE(blas->occluded_by(test_ray, occluder));
+        }
+    };
+
+    int hit_num = 0;
+    for (int i = 0; i < 1024; ++i)
+    {
+        auto test_ray = create_ray();
+        Ray expected_ray = test_ray;
+        SurfaceInteraction expected;
+        bool expected_hit = blas->intersect(expected_ray, &expected);
+        Ray ray = test_ray;
+        SurfaceInteraction interaction;
+        bool hit = wide.intersect(ray, &interaction);
+        expect_same_hit(expected_hit, expected_ray, expected, hit, ray, interaction);
+        expect_same_occlusion(test_ray);
+        hit_num += expected_hit ? 1 : 0;
+    }
+    EXPECT_GT(hit_num, 0);
+
+    //同一个起点附近的相干packet和方向随机的packet,包括部分通道活跃的情况
+    const uint32_t lane_masks[] = {0xF, 0x7, 0xA, 0x9, 0x4};
+    for (int i = 0; i < 256; ++i)
+    {
+        Ray rays[SSE_WIDTH];
+        auto base_ray = create_ray();
+        for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+        {
+            if (i % 2 == 0)
+            {
+                Vector3f jitter(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f);
+                rays[lane] = Ray(base_ray.o, normalize(base_ray.d + jitter * 0.05f));
+            }
+            else
+            {
+                rays[lane] = create_ray();
+            }
+        }
+        for (auto &&lane_mask : lane_masks)
+        {
+            Ray expected_rays[SSE_WIDTH];
+            Ray wide_rays[SSE_WIDTH];
+            SurfaceInteraction expected[SSE_WIDTH];
+            SurfaceInteraction interactions[SSE_WIDTH];
+            bool expected_hits[SSE_WIDTH] = {false, false, false, false};
+            bool hits[SSE_WIDTH] = {false, false, false, false};
+            bool expected_occluded[SSE_WIDTH] = {false, false, false, false};
+            bool occluded[SSE_WIDTH] = {false, false, false, false};
+            for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+            {
+                expected_rays[lane] = rays[lane];
+                wide_rays[lane] = rays[lane];
+            }
+            blas->intersect_packet(expected_rays, lane_mask, expected, expected_hits);
+            wide.intersect_packet(wide_rays, lane_mask, interactions, hits);
+            blas->occluded_packet(rays, lane_mask, expected_occluded);
+            wide.occluded_packet(rays, lane_mask, occluded);
+            for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+            {
+                if (!is_active_lane(lane_mask, lane))
+                {
+                    EXPECT_EQ(rays[lane].t_max, wide_rays[lane].t_max);
+                    continue;
+                }
+                expect_same_hit(expected_hits[lane], expected_rays[lane], expected[lane], hits[lane], wide_rays[lane], interactions[lane]);
+                EXPECT_EQ(expected_occluded[lane], occluded[lane]);
+                EXPECT_EQ(blas->intersect(rays[lane]), occluded[lane]);
+            }
+        }
+    }
+}
+
+struct TestRayStream
+{
+    std::vector<float> ox, oy, oz, dx, dy, dz, t_max;
+
+    RayStream stream() const
+    {
+        return RayStream{&ox[0], &oy[0], &oz[0], &dx[0], &dy[0], &dz[0], &t_max[0], ox.size()};
+    }
+
+    void push_back(const Ray &ray)
+    {
+        ox.push_back(ray.o.x);
+        oy.push_back(ray.o.y);
+        oz.push_back(ray.o.z);
+        dx.push_back(ray.d.x);
+        dy.push_back(ray.d.y);
+        dz.push_back(ray.d.z);
+        t_max.push_back(ray.t_max);
+    }
+};
+
+static void expect_stream_matches_single(const TLAS &tlas, const TestRayStream &rays)
+{
+    auto stream = rays.stream();
+    std::vector<HitRecord> hits(stream.count);
+    std::unique_ptr<bool[]> occluded(new bool[stream.count]);
+    tlas.intersect_stream(stream, &hits[0]);
+    tlas.occluded_stream(stream, occluded.get());
+
+    uint32_t hit_num = 0;
+    for (size_t i = 0; i < stream.count; ++i)
+    {
+        auto ray = stream[i];
+        SurfaceInteraction interaction;
+        bool hit = tlas.intersect(ray, &interaction);
+        ASSERT_EQ(hit, hits[i].t != INFINITE);
+        if (hit)
+        {
+            hit_num++;
+            EXPECT_NEAR(ray.t_max, hits[i].t, 1e-4f);
+            EXPECT_NEAR(interaction.n.x, hits[i].n.x, 1e-4f);
+            EXPECT_NEAR(interaction.n.y, hits[i].n.y, 1e-4f);
+            EXPECT_NEAR(interaction.n.z, hits[i].n.z, 1e-4f);
+            EXPECT_NEAR(interaction.uv.x, hits[i].uv.x, 1e-4f);
+            EXPECT_NEAR(interaction.uv.y, hits[i].uv.y, 1e-4f);
+        }
+        EXPECT_EQ(tlas.intersect(stream[i]), occluded[i]);
+    }
+    EXPECT_GT(hit_num, 0u);
+}
+
+TEST(TLAS, stream)
+{
+    auto instances = create_test_instances(false);
+    TLAS tlas(instances);
+
+    //射线数量超过一个bin,并且不是4的倍数,部分射线的t_max有限
+    RNG rng(5);
+    TestRayStream random_rays;
+    for (uint32_t i = 0; i < RAY_STREAM_BIN_SIZE + 1001; ++i)
+    {
+        auto ray = create_random_ray(rng);
+        if (i % 3 == 0)
+        {
+            ray.t_max = rng.next_float() * 4.0f;
+        }
+        random_rays.push_back(ray);
+    }
+    expect_stream_matches_single(tlas, random_rays);
+
+    const uint32_t width = 67;
+    TestRayStream coherent_rays;
+    for (uint32_t y = 0; y < width; ++y)
+    {
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            coherent_rays.push_back(create_camera_ray(x, y, width));
+        }
+    }
+    expect_stream_matches_single(tlas, coherent_rays);
+}
+
+//逐个instance求交的最近交点,不经过TLAS的任何剔除
+static bool intersect_brute_force(const std::vector<shared<BLASInstance>> &instances, const Ray &ray, SurfaceInteraction *interaction)
+{
+    bool has_hit = false;
+    for (auto &&instance : instances)
+    {
+        if ((instance->mask() & ray.mask) != 0 && instance->intersect(ray, interaction))
+        {
+            has_hit = true;
+        }
+    }
+    return has_hit;
+}
+
+static bool occluded_brute_force(const std::vector<shared<BLASInstance>> &instances, const Ray &ray)
+{
+    for (auto &&instance : instances)
+    {
+        if ((instance->mask() & ray.mask) != 0 && instance->intersect(ray))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void expect_tlas_matches_brute_force(const TLAS &tlas, const std::vector<shared<BLASInstance>> &instances, const Ray &test_ray)
+{
+    Ray expected_ray = test_ray;
+    SurfaceInteraction expected;
+    bool expected_hit = intersect_brute_force(instances, expected_ray, &expected);
+    Ray ray = test_ray;
+    SurfaceInteraction interaction;
+    bool hit = tlas.intersect(ray, &interaction);
+    expect_same_hit(expected_hit, expected_ray, expected, hit, ray, interaction);
+    EXPECT_EQ(occluded_brute_force(instances, test_ray), tlas.intersect(test_ray));
+}
+
+TEST(TLAS, oriented_bounds)
+{
+    //方向的分量是-0.0时,is_positive和inv_d的符号必须一致
+    InstanceOBB obb;
+    obb.world_to_blas = Matrix4x4();
+    obb.bounds = Bounds3f(Point3f(0, 0, 0), Point3f(1, 1, 1));
+    obb.enabled = true;
+    EXPECT_TRUE(intersect(Ray(Point3f(0.5f, 0.5f, -1), Vector3f(-0.0f, 0, 1)), obb));
+    EXPECT_TRUE(intersect(Ray(Point3f(0.5f, 0.5f, -1), Vector3f(0, -0.0f, 1)), obb));
+    EXPECT_TRUE(!intersect(Ray(Point3f(1.5f, 0.5f, -1), Vector3f(-0.0f, 0, 1)), obb));
+
+    auto instances = create_test_instances(true);
+    for (uint32_t i = 0; i < 8; ++i)
+    {
+        EXPECT_TRUE(instances[i]->has_oriented_bounds());
+    }
+    TLAS tlas(instances);
+
+    RNG rng(11);
+    for (int i = 0; i < 4096; ++i)
+    {
+        expect_tlas_matches_brute_force(tlas, instances, create_random_ray(rng));
+    }
+    //射向每个instance的中心,包括blas空间中轴平行的方向
+    for (auto &&instance : instances)
+    {
+        auto center = instance->static_blas_to_world()(Point3f(0.5f, 0.5f, 0.5f));
+        for (auto &&d : {Vector3f(0, 0, 1), Vector3f(-0.0f, 0, 1), Vector3f(0, 1, 0), Vector3f(1, 0, -0.0f)})
+        {
+            auto world_d = normalize(instance->static_blas_to_world()(d));
+            expect_tlas_matches_brute_force(tlas, instances, Ray(center - world_d * 4.0f, world_d));
+            expect_tlas_matches_brute_force(tlas, instances, Ray(center - d * 4.0f, d));
+        }
+    }
+}
+
+static shared<BLASInstance> create_test_plane_instance(const Transform &plane_to_world, uint32_t mask)
+{
+    auto transform = std::make_shared<Transform>(plane_to_world);
+    auto inv_transform = std::make_shared<Transform>(inverse(*transform));
+    return create_test_instance(Transform(), std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(create_plane(transform, inv_transform, 5, 5))), mask);
+}
+
+TEST(TLAS, mask)
+{
+    //前面的平面只对相机射线可见,后面的平面只对阴影射线可见
+    std::vector<shared<BLASInstance>> planes = {create_test_plane_instance(translate(0, 0, 1), RAY_MASK_CAMERA), create_test_plane_instance(translate(0, 0, 2), RAY_MASK_SHADOW)};
+    TLAS plane_tlas(planes);
+    auto create_masked_ray = [](uint32_t mask) {
+        Ray ray(Point3f(0.1f, 0.2f, 0), Vector3f(0, 0, 1));
+        ray.mask = mask;
+        return ray;
+    };
+    SurfaceInteraction interaction;
+    auto ray = create_masked_ray(RAY_MASK_CAMERA);
+    EXPECT_TRUE(plane_tlas.intersect(ray, &interaction));
+    EXPECT_FLOAT_EQ(ray.t_max, 1.0f);
+    ray = create_masked_ray(RAY_MASK_SHADOW);
+    EXPECT_TRUE(plane_tlas.intersect(ray, &interaction));
+    EXPECT_FLOAT_EQ(ray.t_max, 2.0f);
+    ray = create_masked_ray(RAY_MASK_INDIRECT);
+    EXPECT_TRUE(!plane_tlas.intersect(ray, &interaction));
+    EXPECT_TRUE(!plane_tlas.intersect(create_masked_ray(RAY_MASK_INDIRECT)));
+    EXPECT_TRUE(plane_tlas.intersect(create_masked_ray(RAY_MASK_SHADOW)));
+
+    //足够多的instance让TLAS有多层内部节点,内部节点的mask是子树的并集,错误的并集会剔除可见的instance
+    RNG rng(13);
+    auto blas = create_random_triangle_blas(rng, 64);
+    std::vector<shared<BLASInstance>> instances;
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        auto transform = translate(rng.next_float() * 6.0f - 3.0f, rng.next_float() * 6.0f - 3.0f, rng.next_float() * 4.0f - 2.0f);
+        instances.push_back(create_test_instance(transform, blas, 1u << (i % 4)));
+    }
+    TLAS tlas(instances);
+    const uint32_t ray_masks[] = {1, 2, 4, 8, 5, 10, 16, RAY_MASK_ALL};
+    for (int i = 0; i < 2048; ++i)
+    {
+        auto test_ray = create_random_ray(rng);
+        test_ray.mask = ray_masks[i % 8];
+        expect_tlas_matches_brute_force(tlas, instances, test_ray);
+    }
+
+    //packet中每条射线的mask不同
+    const uint32_t width = 16;
+    for (uint32_t y = 0; y < width; y += 2)
+    {
+        for (uint32_t x = 0; x < width; x += 2)
+        {
+            Ray rays[SSE_WIDTH];
+            for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+            {
+                rays[lane] = create_camera_ray(x + (lane & 1), y + (lane >> 1), width);
+                rays[lane].mask = ray_masks[(x + y + lane) % 8];
+            }
+            Ray packet_rays[SSE_WIDTH] = {rays[0], rays[1], rays[2], rays[3]};
+            SurfaceInteraction interactions[SSE_WIDTH];
+            bool hits[SSE_WIDTH];
+            bool occluded[SSE_WIDTH];
+            tlas.intersect_packet(packet_rays, 0xF, interactions, hits);
+            tlas.occluded_packet(rays, 0xF, occluded);
+            for (uint32_t lane = 0; lane < SSE_WIDTH; ++lane)
+            {
+                Ray expected_ray = rays[lane];
+                SurfaceInteraction expected;
+                bool expected_hit = intersect_brute_force(instances, expected_ray, &expected);
+                expect_same_hit(expected_hit, expected_ray, expected, hits[lane], packet_rays[lane], interactions[lane]);
+                EXPECT_EQ(occluded_brute_force(instances, rays[lane]), occluded[lane]);
+            }
+        }
+    }
+}
+
+TEST(TLAS, flatten_instances)
+{
+    RNG rng(17);
+    auto reused_blas = create_random_triangle_blas(rng, 256);
+    auto small_blas = create_random_triangle_blas(rng, 16);
+    auto unique_blas = create_random_triangle_blas(rng, 200);
+    auto random_transform = [&rng]() {
+        return translate(rng.next_float() * 4.0f - 2.0f, rng.next_float() * 4.0f - 2.0f, rng.next_float() * 2.0f) * rotate(rng.next_float() * 360.0f, normalize(Vector3f(rng.next_float() + 0.1f, rng.next_float(), rng.next_float())));
+    };
+
+    std::vector<shared<BLASInstance>> instances;
+    //被复用并且不小的blas不展开
+    for (int i = 0; i < 3; ++i)
+    {
+        instances.push_back(create_test_instance(random_transform(), reused_blas));
+    }
+    //小的blas即使被复用也展开,mask不同的展开到不同的blas
+    for (int i = 0; i < 4; ++i)
+    {
+        instances.push_back(create_test_instance(random_transform(), small_blas, i == 3 ? RAY_MASK_SHADOW : RAY_MASK_ALL));
+    }
+    //只被引用一次的blas展开
+    instances.push_back(create_test_instance(random_transform(), unique_blas));
+
+    auto flattened = flatten_instances(instances);
+    ASSERT_EQ(flattened.size(), 5u);
+    for (int i = 0; i < 3; ++i)
+    {
+        EXPECT_EQ(flattened[i], instances[i]);
+    }
+    uint32_t merged_primitive_num = 0;
+    for (size_t i = 3; i < flattened.size(); ++i)
+    {
+        EXPECT_TRUE(!flattened[i]->has_oriented_bounds());
+        merged_primitive_num += std::dynamic_pointer_cast<MeshBLAS>(flattened[i]->blas())->get_primitive_num();
+    }
+    EXPECT_EQ(merged_primitive_num, small_blas->get_primitive_num() * 4 + unique_blas->get_primitive_num());
+
+    //展开前后的交点相同
+    TLAS tlas(flattened);
+    const uint32_t ray_masks[] = {RAY_MASK_ALL, RAY_MASK_CAMERA, RAY_MASK_SHADOW};
+    for (int i = 0; i < 4096; ++i)
+    {
+        auto test_ray = create_random_ray(rng);
+        test_ray.mask = ray_masks[i % 3];
+        expect_tlas_matches_brute_force(tlas, instances, test_ray);
+    }
+    //射向每个展开的instance
+    for (size_t i = 3; i < instances.size(); ++i)
+    {
+        auto center = instances[i]->static_blas_to_world()(Point3f(0.5f, 0.5f, 0.5f));
+        for (int j = 0; j < 64; ++j)
+        {
+            Vector3f d = normalize(Vector3f(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f));
+            expect_tlas_matches_brute_force(tlas, instances, Ray(center - d * 4.0f, d));
+        }
+    }
+}
+
+//线程的遮挡缓存只能用在记录它的TLAS上,缓存的遮挡物不遮挡当前射线时要重新遍历
+TEST(TLAS, occluder_cache)
+{
+    //两个TLAS的结构相同,平面的位置不同:a在z=1,b在射线旁边
+    std::vector<shared<BLASInstance>> a_instances = {create_test_plane_instance(translate(0, 0, 1), RAY_MASK_ALL)};
+    std::vector<shared<BLASInstance>> b_instances = {create_test_plane_instance(translate(10, 0, 1), RAY_MASK_ALL)};
+    TLAS a(a_instances);
+    TLAS b(b_instances);
+
+    Ray ray(Point3f(0.1f, 0.2f, 0), Vector3f(0, 0, 1));
+    for (int i = 0; i < 4; ++i)
+    {
+        EXPECT_TRUE(a.intersect(ray));
+        EXPECT_TRUE(!b.intersect(ray));
+    }
+
+    //缓存的遮挡物在t_max之外
+    EXPECT_TRUE(a.intersect(ray));
+    EXPECT_TRUE(!a.intersect(Ray(Point3f(0.1f, 0.2f, 0), Vector3f(0, 0, 1), 0.5f)));
+    //缓存的遮挡物不在射线的路径上
+    EXPECT_TRUE(a.intersect(ray));
+    EXPECT_TRUE(!a.intersect(Ray(Point3f(0.1f, 0.2f, 0), Vector3f(0, 0, -1))));
+    //射线的mask看不到缓存的instance
+    std::vector<shared<BLASInstance>> masked_instances = {create_test_plane_instance(translate(0, 0, 1), RAY_MASK_CAMERA), create_test_plane_instance(translate(0, 0, 2), RAY_MASK_SHADOW)};
+    TLAS masked(masked_instances);
+    Ray camera_ray = ray;
+    camera_ray.mask = RAY_MASK_CAMERA;
+    Ray indirect_ray = ray;
+    indirect_ray.mask = RAY_MASK_INDIRECT;
+    EXPECT_TRUE(masked.intersect(camera_ray));
+    EXPECT_TRUE(!masked.intersect(indirect_ray));
+
+    //交替查询两个随机场景,结果和没有缓存的暴力求交相同
+    auto scene_a = create_test_instances(false);
+    auto scene_b = create_test_instances(true);
+    TLAS tlas_a(scene_a);
+    TLAS tlas_b(scene_b);
+    RNG rng(19);
+    for (int i = 0; i < 2048; ++i)
+    {
+        auto test_ray = create_random_ray(rng);
+        EXPECT_EQ(occluded_brute_force(scene_a, test_ray), tlas_a.intersect(test_ray));
+        EXPECT_EQ(occluded_brute_force(scene_b, test_ray), tlas_b.intersect(test_ray));
+        //同一条射线缩短以后
+        test_ray.t_max = rng.next_float() * 2.0f;
+        EXPECT_EQ(occluded_brute_force(scene_a, test_ray), tlas_a.intersect(test_ray));
+    }
+}
+
+struct TestPermutationState
+{
+    uint32_t prim_index;
+};
+
+//原地重排和复制一份有序数组的结果相同,包括不动点和很长的环
+TEST(CompactBLAS, permute_in_place)
+{
+    RNG rng(38);
+    for (uint32_t n : {0u, 1u, 2u, 7u, 64u, 1000u})
+    {
+        std::vector<TestPermutationState> states(n);
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            states[i].prim_index = i;
+        }
+        for (uint32_t i = n; i > 1; --i)
+        {
+            std::swap(states[i - 1], states[rng.next_uint32() % i]);
+        }
+        std::vector<shared<uint32_t>> values;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            values.push_back(std::make_shared<uint32_t>(i));
+        }
+
+        std::vector<shared<uint32_t>> ordered;
+        for (auto &&state : states)
+        {
+            ordered.push_back(values[state.prim_index]);
+        }
+        permute_in_place(values, states);
+        ASSERT_EQ(ordered.size(), values.size());
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            EXPECT_EQ(ordered[i], values[i]);
+        }
+    }
+}
+
+TEST(BuildMemoryTracker, peak)
+{
+    BuildMemoryTracker tracker;
+    tracker.alloc(100);
+    tracker.alloc(50);
+    tracker.release(100);
+    EXPECT_EQ(50u, tracker.current);
+    EXPECT_EQ(150u, tracker.peak);
+    tracker.alloc(80);
+    EXPECT_EQ(150u, tracker.peak);
+    tracker.alloc(40);
+    EXPECT_EQ(170u, tracker.peak);
+}
+
+//原地构建的BLAS和每个三角形单独构建的BLAS逐个求交的结果相同
+TEST(CompactBLAS, in_place_build)
+{
+    RNG rng(27);
+    std::vector<Point3f> positions;
+    std::vector<MeshFace> faces;
+    const uint32_t triangle_num = 2048;
+    for (uint32_t i = 0; i < triangle_num; ++i)
+    {
+        Point3f center(rng.next_float() * 4.0f - 2.0f, rng.next_float() * 4.0f - 2.0f, rng.next_float() * 2.0f);
+        for (int v = 0; v < 3; ++v)
+        {
+            positions.push_back(center + Vector3f(rng.next_float() - 0.5f, rng.next_float() - 0.5f, rng.next_float() - 0.5f) * 0.2f);
+        }
+        uint32_t vi[3] = {i * 3, i * 3 + 1, i * 3 + 2};
+        faces.push_back(MeshFace(vi));
+    }
+    auto transform = std::make_shared<Transform>();
+    auto mesh = std::make_shared<Mesh>(transform, transform, positions, std::vector<Normal3f>(), std::vector<Point2f>(), std::vector<MeshSegment>{MeshSegment(faces)});
+    auto primitives = create_mesh_triangle_primitives(mesh);
+    MeshBLAS blas(primitives);
+
+    //重排以后每个图元只出现一次
+    auto ordered = blas.get_primitives();
+    ASSERT_EQ(primitives.size(), ordered.size());
+    std::vector<uint32_t> face_count(triangle_num, 0);
+    for (auto &&primitive : ordered)
+    {
+        face_count[primitive->face()]++;
+    }
+    for (uint32_t i = 0; i < triangle_num; ++i)
+    {
+        EXPECT_EQ(1u, face_count[i]);
+    }
+
+    std::vector<shared<MeshBLAS>> single_blases;
+    for (auto &&primitive : primitives)
+    {
+        single_blases.push_back(std::make_shared<MeshBLAS>(std::vector<shared<MeshTrianglePrimitive>>{primitive}));
+    }
+    for (int i = 0; i < 1024; ++i)
+    {
+        auto test_ray = create_random_ray(rng);
+        Ray expected_ray = test_ray;
+        SurfaceInteraction expected;
+        bool expected_hit = false;
+        for (auto &&single : single_blases)
+        {
+            if (single->intersect(expected_ray, &expected))
+            {
+                expected_hit = true;
+            }
+        }
+        Ray ray = test_ray;
+        SurfaceInteraction interaction;
+        bool hit = blas.intersect(ray, &interaction);
+        expect_same_hit(expected_hit, expected_ray, expected, hit, ray, interaction);
+        EXPECT_EQ(expected_hit, blas.intersect(test_ray));
+    }
+
+    //状态数组和图元的引用同时存在,峰值至少是两者之和,也不小于最终的节点和图元
+    size_t handle_bytes = sizeof(shared<MeshTrianglePrimitive>) * triangle_num;
+    size_t state_bytes = sizeof(BVHPrimitiveState<MeshTrianglePrimitive>) * triangle_num;
+    size_t compact_bytes = (sizeof(CompactMeshTrianglePrimitive) + sizeof(uint32_t)) * ((triangle_num - 1) / SSE_WIDTH + 1);
+    size_t node_num = 0;
+    for (uint32_t depth = 0; !blas.get_nodes(depth).empty(); ++depth)
+    {
+        node_num += blas.get_nodes(depth).size();
+    }
+    EXPECT_GE(blas.get_build_peak_memory(), handle_bytes + state_bytes);
+    EXPECT_GE(blas.get_build_peak_memory(), handle_bytes + compact_bytes + sizeof(BasicQBVHNode<NarrowNodeReference>) * node_num);
+}
+
+#include "core/film.h"
+TEST(Film, xyz_mode)
+{
+    Spectrum::init();
+    Film spectrum_film(Point2i(16, 16), Bounds2f(Point2f(0, 0), Point2f(1, 1)), 1.5f);
+    Film xyz_film(Point2i(16, 16), Bounds2f(Point2f(0, 0), Point2f(1, 1)), 1.5f, 1.0f, FilmMode::XYZ);
+    auto spectrum_tile = spectrum_film.get_film_tile(spectrum_film.get_sample_bounds());
+    auto xyz_tile = xyz_film.get_film_tile(xyz_film.get_sample_bounds());
+
+    RNG rng(7);
+    for (int i = 0; i < 1024; ++i)
+    {
+        Point2f pos(rng.next_float() * 16.0f, rng.next_float() * 16.0f);
+        Spectrum l;
+        for (int j = 0; j < SPD_SAMPLE_COUNT; ++j)
+        {
+            l[j] = rng.next_float();
+        }
+        float weight = rng.next_float();
+        spectrum_tile->add_sample(pos, l, weight);
+        xyz_tile->add_sample(pos, l, weight);
+    }
+    spectrum_film.merge_film_tile(std::move(spectrum_tile));
+    xyz_film.merge_film_tile(std::move(xyz_tile));
+
+    auto spectrum_image = spectrum_film.get_image();
+    auto xyz_image = xyz_film.get_image();
+    for (int y = 0; y < 16; ++y)
+    {
+        for (int x = 0; x < 16; ++x)
+        {
+            auto a = spectrum_image->get_texel(Point2i(x, y));
+            auto b = xyz_image->get_texel(Point2i(x, y));
+            for (int c = 0; c < 3; ++c)
+            {
+                EXPECT_NEAR(a[c], b[c], 1e-4f * max(1.0f, std::abs(a[c])));
+            }
+        }
+    }
+}
+
+TEST(SampledSpectrum, xyz)
+{
+    Spectrum::init();
+    Spectrum spd = tungsten_lamp_3000k(1.0f);
+    float reference[3];
+    from_spd_to_xyz(spd, reference);
+
+    const int n = 4096;
+    float mean[3] = {0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < n; ++i)
+    {
+        auto wavelengths = sample_wavelengths((i + 0.5f) / n);
+        auto s = sample(spd, wavelengths);
+        float xyz[3];
+        from_sampled_spectrum_to_xyz(s, wavelengths, xyz);
+
+        //放回Spectrum之后投影到XYZ得到相同的结果
+        Spectrum binned;
+        from_sampled_spectrum_to_spd(s, wavelengths, binned);
+        float binned_xyz[3];
+        from_spd_to_xyz(binned, binned_xyz);
+        for (int c = 0; c < 3; ++c)
+        {
+            EXPECT_NEAR(xyz[c], binned_xyz[c], 1e-4f * reference[c]);
+            mean[c] += xyz[c] / n;
+        }
+    }
+    for (int c = 0; c < 3; ++c)
+    {
+        EXPECT_NEAR(mean[c], reference[c], 1e-3f * reference[c]);
+    }
+}
+
+TEST(Film, parallel_merge_film_tile)
+{
+    Spectrum::init();
+    for (auto mode : {FilmMode::Spectrum, FilmMode::XYZ})
+    {
+        Film reference_film(Point2i(20, 15), Bounds2f(Point2f(0, 0), Point2f(1, 1)), 1.5f, 1.0f, mode);
+        Film film(Point2i(20, 15), Bounds2f(Point2f(0, 0), Point2f(1, 1)), 1.5f, 1.0f, mode);
+        auto sample_bounds = film.get_sample_bounds();
+
+        //不重叠的5x5 tile,每个tile在自己的线程中累加并merge
+        std::vector<Bounds2i> tile_bounds;
+        for (int y = sample_bounds.min_point.y; y < sample_bounds.max_point.y; y += 5)
+        {
+            for (int x = sample_bounds.min_point.x; x < sample_bounds.max_point.x; x += 5)
+            {
+                tile_bounds.push_back(Bounds2i(Point2i(x, y), min(Point2i(x + 5, y + 5), sample_bounds.max_point)));
+            }
+        }
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < tile_bounds.size(); ++i)
+        {
+            RNG rng(static_cast<uint64_t>(i));
+            auto tile = film.get_film_tile(tile_bounds[i]);
+            for (auto p : tile_bounds[i])
+            {
+                Point2f pos = Point2f(p) + Vector2f(rng.next_float(), rng.next_float());
+                Spectrum l(rng.next_float());
+                tile->add_sample(pos, l, 1.0f);
+                reference_film.add_sample(pos, l, 1.0f);
+            }
+            threads.emplace_back([&film](std::unique_ptr<FilmTile> tile) { film.merge_film_tile(std::move(tile)); }, std::move(tile));
+        }
+        for (auto &&t : threads)
+        {
+            t.join();
+        }
+
+        auto reference_image = reference_film.get_image();
+        auto image = film.get_image();
+        for (auto p : film.get_cropped_pixel_bounds())
+        {
+            auto a = reference_image->get_texel(p);
+            auto b = image->get_texel(p);
+            for (int c = 0; c < 3; ++c)
+            {
+                EXPECT_NEAR(a[c], b[c], 1e-4f * max(1.0f, std::abs(a[c])));
+            }
+        }
+    }
+}
+
+#include "samplers/sobol.h"
+TEST(SobolSampler, stratified)
+{
+    //每个维度的16个样本都是分层的:二维时任意面积为1/16的基本区间内恰好有一个样本,超过300维也一样
+    const uint32_t spp = 16;
+    const int dim_num = 300;
+    SobolSampler sampler(spp, 7);
+    std::vector<std::vector<Point2f>> samples_2d(dim_num);
+    std::vector<std::vector<float>> samples_1d(dim_num);
+    sampler.start_pixel(Point2i(3, 5));
+    do
+    {
+        for (int d = 0; d < dim_num; ++d)
+        {
+            samples_2d[d].push_back(sampler.get_2D());
+            samples_1d[d].push_back(sampler.get_1D());
+        }
+    } while (sampler.start_next_sample());
+
+    for (int d = 0; d < dim_num; ++d)
+    {
+        ASSERT_EQ(samples_2d[d].size(), spp);
+        for (int log2_nx = 0; log2_nx <= 4; ++log2_nx)
+        {
+            const int nx = 1 << log2_nx;
+            const int ny = spp / nx;
+            std::vector<int> count(spp, 0);
+            for (auto &&p : samples_2d[d])
+            {
+                ASSERT_TRUE(p.x >= 0.0f && p.x < 1.0f && p.y >= 0.0f && p.y < 1.0f);
+                count[static_cast<int>(p.x * nx) * ny + static_cast<int>(p.y * ny)]++;
+            }
+            for (int c : count)
+            {
+                EXPECT_EQ(c, 1);
+            }
+        }
+
+        std::vector<int> count(spp, 0);
+        for (float u : samples_1d[d])
+        {
+            ASSERT_TRUE(u >= 0.0f && u < 1.0f);
+            count[static_cast<int>(u * spp)]++;
+        }
+        for (int c : count)
+        {
+            EXPECT_EQ(c, 1);
+        }
+    }
+}
+
+TEST(SobolSampler, deterministic)
+{
+    //结果和clone的seed无关,只和像素、样本、维度有关
+    SobolSampler sampler(8);
+    auto a = sampler.clone(1);
+    auto b = sampler.clone(2);
+    a->start_pixel(Point2i(10, 20));
+    b->start_pixel(Point2i(10, 20));
+    a->start_next_sample();
+    b->start_next_sample();
+    EXPECT_EQ(a->get_2D(), b->get_2D());
+    EXPECT_EQ(a->get_1D(), b->get_1D());
+
+    //不同的像素和不同的维度得到不同的样本
+    b->start_pixel(Point2i(11, 20));
+    a->start_pixel(Point2i(10, 20));
+    const Point2f p0 = a->get_2D();
+    EXPECT_NE(p0, b->get_2D());
+    EXPECT_NE(p0, a->get_2D());
+}
+
+#include "samplers/zsobol.h"
+//points中每个面积为1/n的二维基本区间(n为2的幂)内恰好有一个点
+static void expect_elementary_net(const std::vector<Point2f> &points)
+{
+    const int n = static_cast<int>(points.size());
+    for (int nx = 1; nx <= n; nx *= 2)
+    {
+        const int ny = n / nx;
+        std::vector<int> count(n, 0);
+        for (auto &&p : points)
+        {
+            ASSERT_TRUE(p.x >= 0.0f && p.x < 1.0f && p.y >= 0.0f && p.y < 1.0f);
+            count[static_cast<int>(p.x * nx) * ny + static_cast<int>(p.y * ny)]++;
+        }
+        for (int c : count)
+        {
+            EXPECT_EQ(c, 1);
+        }
+    }
+}
+
+TEST(ZSobolSampler, stratified)
+{
+    //每个像素内的样本分层,spp为奇数次幂时也一样
+    for (uint32_t spp : {8u, 16u})
+    {
+        ZSobolSampler sampler(spp, Point2i(32, 32), 3);
+        for (auto &&pixel : {Point2i(0, 0), Point2i(5, 17), Point2i(31, 31)})
+        {
+            const int dim_num = 32;
+            std::vector<std::vector<Point2f>> samples(dim_num);
+            sampler.start_pixel(pixel);
+            do
+            {
+                for (int d = 0; d < dim_num; ++d)
+                {
+                    samples[d].push_back(sampler.get_2D());
+                }
+            } while (sampler.start_next_sample());
+            for (auto &&s : samples)
+            {
+                expect_elementary_net(s);
+            }
+        }
+    }
+}
+
+TEST(ZSobolSampler, blue_noise)
+{
+    //1spp时任意对齐的4x4像素块中16个像素的样本也是分层的,所以相邻像素的误差是负相关的
+    ZSobolSampler sampler(1, Point2i(32, 32));
+    for (int by = 0; by < 32; by += 4)
+    {
+        for (int bx = 0; bx < 32; bx += 4)
+        {
+            const int dim_num = 8;
+            std::vector<std::vector<Point2f>> samples(dim_num);
+            for (int y = by; y < by + 4; ++y)
+            {
+                for (int x = bx; x < bx + 4; ++x)
+                {
+                    sampler.start_pixel(Point2i(x, y));
+                    for (int d = 0; d < dim_num; ++d)
+                    {
+                        samples[d].push_back(sampler.get_2D());
+                    }
+                }
+            }
+            for (auto &&s : samples)
+            {
+                expect_elementary_net(s);
+            }
+        }
+    }
+}
+
+TEST(lowdiscrepancy, pmj02)
+{
+    //任意长度为2的幂的前缀都是(0,2)-net
+    const uint32_t count = 1024;
+    std::vector<uint32_t> samples(2 * count);
+    RNG rng(7);
+    pmj02(count, &samples[0], rng);
+    for (uint32_t n = 1; n <= count; n *= 2)
+    {
+        std::vector<Point2f> points;
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            points.push_back(Point2f(samples[2 * i] * 0x1p-32f, samples[2 * i + 1] * 0x1p-32f));
+        }
+        expect_elementary_net(points);
+    }
+}
+
+#include "samplers/pmj02.h"
+TEST(PMJ02Sampler, arbitrary_spp)
+{
+    //spp不会被取整,前32个样本在每个维度上都是分层的
+    PMJ02Sampler sampler(48, 5);
+    EXPECT_EQ(sampler.get_spp(), 48u);
+    const int dim_num = 64;
+    std::vector<std::vector<Point2f>> samples(dim_num);
+    sampler.start_pixel(Point2i(9, 4));
+    uint32_t sample_num = 0;
+    do
+    {
+        for (int d = 0; d < dim_num; ++d)
+        {
+            const Point2f u = sampler.get_2D();
+            ASSERT_TRUE(u.x >= 0.0f && u.x < 1.0f && u.y >= 0.0f && u.y < 1.0f);
+            if (sample_num < 32)
+            {
+                samples[d].push_back(u);
+            }
+        }
+        ++sample_num;
+    } while (sampler.start_next_sample());
+    EXPECT_EQ(sample_num, 48u);
+    for (auto &&s : samples)
+    {
+        expect_elementary_net(s);
+    }
+}
+
+TEST(RNG4, uniform)
+{
+    //每条lane分别做64个桶的卡方检验,自由度63,99.9%分位数约为103.4
+    RNG4 rng(11);
+    const int bin_num = 64;
+    const int sample_num = 1 << 16;
+    std::vector<int> bins[4];
+    for (int lane = 0; lane < 4; ++lane)
+    {
+        bins[lane].assign(bin_num, 0);
+    }
+    for (int i = 0; i < sample_num; ++i)
+    {
+        const float4 u = rng.next_float4();
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            ASSERT_TRUE(u[lane] >= 0.0f && u[lane] < 1.0f);
+            bins[lane][static_cast<int>(u[lane] * bin_num)]++;
+        }
+    }
+    const double expected = static_cast<double>(sample_num) / bin_num;
+    for (int lane = 0; lane < 4; ++lane)
+    {
+        double chi2 = 0.0;
+        for (int c : bins[lane])
+        {
+            chi2 += (c - expected) * (c - expected) / expected;
+        }
+        EXPECT_LT(chi2, 103.4);
+    }
+}
+
+TEST(RNG4, independent)
+{
+    //lane之间以及同一lane前后两个数的相关系数都应接近0,标准差约为1/256
+    RNG4 rng(12);
+    const int sample_num = 1 << 16;
+    std::vector<float4> samples(sample_num);
+    for (auto &&u : samples)
+    {
+        u = rng.next_float4();
+    }
+    auto correlation = [&](int lane0, int lane1, int offset) {
+        double sum0 = 0, sum1 = 0, sum00 = 0, sum11 = 0, sum01 = 0;
+        const int n = sample_num - offset;
+        for (int i = 0; i < n; ++i)
+        {
+            const double a = samples[i][lane0];
+            const double b = samples[i + offset][lane1];
+            sum0 += a, sum1 += b, sum00 += a * a, sum11 += b * b, sum01 += a * b;
+        }
+        const double cov = sum01 / n - sum0 / n * sum1 / n;
+        return cov / std::sqrt((sum00 / n - sum0 / n * sum0 / n) * (sum11 / n - sum1 / n * sum1 / n));
+    };
+    for (int lane0 = 0; lane0 < 4; ++lane0)
+    {
+        EXPECT_LT(std::abs(correlation(lane0, lane0, 1)), 0.02);
+        for (int lane1 = lane0 + 1; lane1 < 4; ++lane1)
+        {
+            EXPECT_LT(std::abs(correlation(lane0, lane1, 0)), 0.02);
+        }
+    }
+}
+
+TEST(RNG4, fill)
+{
+    RNG4 a(3), b(3), c(3);
+    float f[8];
+    a.fill_1D(f, 8);
+    const float4 u0 = b.next_float4();
+    const float4 u1 = b.next_float4();
+    for (int i = 0; i < 4; ++i)
+    {
+        EXPECT_EQ(f[i], u0[i]);
+        EXPECT_EQ(f[i + 4], u1[i]);
+    }
+    Point2f p[4];
+    c.fill_2D(p, 4);
+    for (int i = 0; i < 4; ++i)
+    {
+        EXPECT_EQ(p[i], Point2f(f[2 * i], f[2 * i + 1]));
+    }
+}
+
+TEST(lowdiscrepancy, shuffle)
+{
+    //4个元素的24种排列应该等概率出现,卡方检验自由度23,99.9%分位数约为49.7
+    RNG4 rng(5);
+    const int trial_num = 24000;
+    std::map<std::vector<int>, int> count;
+    for (int t = 0; t < trial_num; ++t)
+    {
+        std::vector<int> v = {0, 1, 2, 3};
+        shuffle(&v[0], 4, 1, rng);
+        count[v]++;
+    }
+    EXPECT_EQ(count.size(), 24u);
+    double chi2 = 0.0;
+    for (auto &&kv : count)
+    {
+        chi2 += (kv.second - 1000.0) * (kv.second - 1000.0) / 1000.0;
+    }
+    EXPECT_LT(chi2, 49.7);
+}
+
+TEST(Sampler, fill)
+{
+    //批量取样本和逐个取样本得到相同的结果
+    SobolSampler sobol(16);
+    LowDiscrepancySampler low_discrepancy(16, 8);
+    for (Sampler *sampler : {static_cast<Sampler *>(&sobol), static_cast<Sampler *>(&low_discrepancy)})
+    {
+        auto a = sampler->clone(1);
+        auto b = sampler->clone(1);
+        a->start_pixel(Point2i(2, 3));
+        b->start_pixel(Point2i(2, 3));
+        a->start_next_sample();
+        b->start_next_sample();
+        Point2f p[4];
+        a->fill_2D(p, 4);
+        float f[4];
+        a->fill_1D(f, 4);
+        for (int i = 0; i < 4; ++i)
+        {
+            EXPECT_EQ(p[i], b->get_2D());
+        }
+        for (int i = 0; i < 4; ++i)
+        {
+            EXPECT_EQ(f[i], b->get_1D());
+        }
+    }
+}
+
+TEST(LowDiscrepancySampler, stratified)
+{
+    //前max_dim维的样本是分层的,并且不同维度之间的样本顺序不同
+    const uint32_t spp = 16;
+    const int dim_num = 4;
+    auto sampler = LowDiscrepancySampler(spp, dim_num).clone(3);
+    std::vector<std::vector<Point2f>> samples_2d(dim_num);
+    std::vector<std::vector<float>> samples_1d(dim_num);
+    sampler->start_pixel(Point2i(3, 5));
+    do
+    {
+        for (int d = 0; d < dim_num; ++d)
+        {
+            samples_2d[d].push_back(sampler->get_2D());
+            samples_1d[d].push_back(sampler->get_1D());
+        }
+    } while (sampler->start_next_sample());
+
+    for (int d = 0; d < dim_num; ++d)
+    {
+        ASSERT_EQ(samples_2d[d].size(), spp);
+        for (int log2_nx = 0; log2_nx <= 4; ++log2_nx)
+        {
+            const int nx = 1 << log2_nx;
+            const int ny = spp / nx;
+            std::vector<int> count(spp, 0);
+            for (auto &&p : samples_2d[d])
+            {
+                ASSERT_TRUE(p.x >= 0.0f && p.x < 1.0f && p.y >= 0.0f && p.y < 1.0f);
+                count[static_cast<int>(p.x * nx) * ny + static_cast<int>(p.y * ny)]++;
+            }
+            for (int c : count)
+            {
+                EXPECT_EQ(c, 1);
+            }
+        }
+
+        std::vector<int> count(spp, 0);
+        for (float u : samples_1d[d])
+        {
+            ASSERT_TRUE(u >= 0.0f && u < 1.0f);
+            count[static_cast<int>(u * spp)]++;
+        }
+        for (int c : count)
+        {
+            EXPECT_EQ(c, 1);
+        }
+    }
+    EXPECT_NE(samples_1d[0], samples_1d[1]);
+}
+
+//从任意样本开始取到的值,和之前取过哪些像素,每个样本取了多少维无关,包括超过max_dim的维度
+TEST(Sampler, resume)
+{
+    const uint32_t spp = 8;
+    const uint32_t dim_num = 12;
+    LowDiscrepancySampler low_discrepancy(spp, 3);
+    SobolSampler sobol(spp);
+    ZSobolSampler zsobol(spp, Point2i(8, 8));
+    PMJ02Sampler pmj02(spp);
+    for (Sampler *sampler : {static_cast<Sampler *>(&low_discrepancy), static_cast<Sampler *>(&sobol), static_cast<Sampler *>(&zsobol), static_cast<Sampler *>(&pmj02)})
+    {
+        //每个样本消耗的维度数量不同
+        auto a = sampler->clone(5);
+        std::vector<std::vector<float>> expected(spp);
+        for (int x = 0; x < 4; ++x)
+        {
+            a->start_pixel(Point2i(x, 1));
+            uint32_t sample_idx = 0;
+            do
+            {
+                const uint32_t n = x == 2 ? dim_num : (sample_idx * 5 + x) % dim_num;
+                for (uint32_t d = 0; d < n; ++d)
+                {
+                    auto u = a->get_2D();
+                    auto v = a->get_1D();
+                    if (x == 2)
+                    {
+                        expected[sample_idx].insert(expected[sample_idx].end(), {u.x, u.y, v});
+                    }
+                }
+                sample_idx++;
+            } while (a->start_next_sample());
+        }
+
+        auto b = sampler->clone(5);
+        for (uint32_t i = spp; i > 0; --i)
+        {
+            const uint32_t sample_idx = i - 1;
+            b->start_pixel_sample(Point2i(2, 1), sample_idx);
+            std::vector<float> values;
+            for (uint32_t d = 0; d < dim_num; ++d)
+            {
+                auto u = b->get_2D();
+                auto v = b->get_1D();
+                values.insert(values.end(), {u.x, u.y, v});
+            }
+            EXPECT_EQ(expected[sample_idx], values);
+            //下一个像素,检查像素之间没有残留的状态
+            b->start_pixel_sample(Point2i(3, 1), sample_idx);
+            b->get_2D();
+        }
+    }
+}
+
+#include "core/integrator.h"
+#include "core/mesh.h"
+#include "cameras/perspective.h"
+#include "lights/rect.h"
+//一个被面光源照亮的平面
+static Scene create_progressive_test_scene()
+{
+    Spectrum::init();
+    auto transform = std::make_shared<Transform>(translate(0, 0, 2.5f));
+    auto inv_transform = std::make_shared<Transform>(inverse(*transform));
+    auto blas = std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(create_plane(transform, inv_transform, 5, 5)));
+    std::vector<shared<BLASInstance>> instances = {std::make_shared<BLASInstance>(std::make_shared<AnimatedTransform>(std::make_shared<Transform>()), blas)};
+    auto light_transform = std::make_shared<Transform>(translate(Vector3f(0.0f, 0.0f, 1.0f)));
+    auto inv_light_transform = std::make_shared<Transform>(inverse(*light_transform));
+    std::vector<Light *> lights = {new RectLight(light_transform, inv_light_transform, Spectrum(1.0f), false, 1, 1)};
+    auto tlas = std::make_shared<TLAS>(instances);
+    return Scene(tlas, lights);
+}
+
+static shared<PerspectiveCamera> create_progressive_test_camera()
+{
+    auto film = std::make_shared<Film>(Point2i(32, 32), Bounds2f(Point2f(0, 0), Point2f(1, 1)), 1.0f, 1.0f, FilmMode::XYZ);
+    return std::make_shared<PerspectiveCamera>(std::make_shared<AnimatedTransform>(std::make_shared<Transform>(translate(0, 0, -4))), 0, 1, Bounds2f{{-1, -1}, {1, 1}}, 45, film);
+}
+
+static void expect_same_image(const Film &a, const Film &b)
+{
+    auto image_a = a.get_image();
+    auto image_b = b.get_image();
+    for (int y = 0; y < 32; ++y)
+    {
+        for (int x = 0; x < 32; ++x)
+        {
+            auto ca = image_a->get_texel(Point2i(x, y));
+            auto cb = image_b->get_texel(Point2i(x, y));
+            for (int c = 0; c < 3; ++c)
+            {
+                EXPECT_NEAR(ca[c], cb[c], 1e-4f * max(1.0f, std::abs(ca[c])));
+            }
+        }
+    }
+}
+
+TEST(Integrator, progressive)
+{
+    //每遍2个样本,4遍之后和一次渲染8个样本的图像相同(只差浮点累加顺序),并且在spp处停止
+    auto scene = create_progressive_test_scene();
+    auto reference_camera = create_progressive_test_camera();
+    LowDiscrepancySampler sampler(8);
+    Integrator(reference_camera.get(), &sampler).render(scene);
+
+    auto camera = create_progressive_test_camera();
+    Integrator integrator(camera.get(), &sampler);
+    ProgressiveSettings settings;
+    settings.samples_per_pass = 2;
+    settings.max_passes = 3;
+    auto result = integrator.render_progressive(scene, settings);
+    EXPECT_EQ(result.pass_count, 3u);
+    EXPECT_EQ(result.sample_count, 6u);
+    EXPECT_LT(result.noise, INFINITE);
+
+    //继续渲染,到达spp后停止
+    settings.max_passes = 0;
+    result = integrator.render_progressive(scene, settings);
+    EXPECT_EQ(result.pass_count, 4u);
+    EXPECT_EQ(result.sample_count, 8u);
+    expect_same_image(*reference_camera->get_film(), *camera->get_film());
+}
+
+TEST(Integrator, progressive_past_max_dim)
+{
+    //max_dim为1时相机和光源的样本大部分来自RNG4,分遍渲染仍然和一次渲染相同
+    auto scene = create_progressive_test_scene();
+    auto reference_camera = create_progressive_test_camera();
+    LowDiscrepancySampler sampler(8, 1);
+    Integrator(reference_camera.get(), &sampler).render(scene);
+
+    auto camera = create_progressive_test_camera();
+    Integrator integrator(camera.get(), &sampler);
+    ProgressiveSettings settings;
+    settings.samples_per_pass = 3;
+    auto result = integrator.render_progressive(scene, settings);
+    EXPECT_EQ(result.pass_count, 3u);
+    EXPECT_EQ(result.sample_count, 8u);
+    expect_same_image(*reference_camera->get_film(), *camera->get_film());
+}
+
+TEST(Integrator, progressive_noise_target)
+{
+    //噪声估计随样本数下降,达到目标后停止
+    auto scene = create_progressive_test_scene();
+    auto camera = create_progressive_test_camera();
+    PMJ02Sampler sampler(1024);
+    Integrator integrator(camera.get(), &sampler);
+    ProgressiveSettings settings;
+    settings.max_passes = 2;
+    const float noise_2 = integrator.render_progressive(scene, settings).noise;
+    settings.max_passes = 14;
+    const float noise_16 = integrator.render_progressive(scene, settings).noise;
+    EXPECT_LT(noise_16, noise_2);
+
+    settings.max_passes = 0;
+    settings.noise_target = noise_16 * 0.5f;
+    auto result = integrator.render_progressive(scene, settings);
+    EXPECT_LE(result.noise, settings.noise_target);
+    EXPECT_LT(result.sample_count, 1024u);
+}
+
+TEST(WavefrontIntegrator, same_image)
+{
+    //维度的消耗顺序相同,wavefront的图像和Integrator相同(只差浮点误差)
+    //在光源和平面之间放一个小平面,让一部分阴影射线被遮挡
+    Spectrum::init();
+    auto transform = std::make_shared<Transform>(translate(0, 0, 2.5f));
+    auto inv_transform = std::make_shared<Transform>(inverse(*transform));
+    auto blocker_transform = std::make_shared<Transform>(translate(0.6f, 0.6f, 1.8f));
+    auto inv_blocker_transform = std::make_shared<Transform>(inverse(*blocker_transform));
+    std::vector<shared<BLASInstance>> instances = {
+        create_test_instance(Transform(), std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(create_plane(transform, inv_transform, 5, 5)))),
+        create_test_instance(Transform(), std::make_shared<MeshBLAS>(create_mesh_triangle_primitives(create_plane(blocker_transform, inv_blocker_transform, 1, 1))))};
+    auto light_transform = std::make_shared<Transform>(translate(Vector3f(0.0f, 0.0f, 1.0f)));
+    auto inv_light_transform = std::make_shared<Transform>(inverse(*light_transform));
+    std::vector<Light *> lights = {new RectLight(light_transform, inv_light_transform, Spectrum(1.0f), false, 1, 1)};
+    auto tlas = std::make_shared<TLAS>(instances);
+    Scene scene(tlas, lights);
+    LowDiscrepancySampler sampler(4);
+    auto reference_camera = create_progressive_test_camera();
+    Integrator(reference_camera.get(), &sampler).render(scene);
+    auto camera = create_progressive_test_camera();
+    WavefrontIntegrator(camera.get(), &sampler).render(scene);
+    expect_same_image(*reference_camera->get_film(), *camera->get_film());
+
+    //图像中既有被照亮的像素,也有光源挡住的像素
+    auto image = camera->get_film()->get_image();
+    float max_luminance = 0.0f;
+    float min_luminance = INFINITE;
+    for (int y = 0; y < 32; ++y)
+    {
+        for (int x = 0; x < 32; ++x)
+        {
+            max_luminance = max(max_luminance, image->get_texel(Point2i(x, y))[1]);
+            min_luminance = min(min_luminance, image->get_texel(Point2i(x, y))[1]);
+        }
+    }
+    EXPECT_GT(max_luminance, 0.0f);
+    EXPECT_EQ(min_luminance, 0.0f);
+}
+
 // TEST(math,max_nan){
 //     float zero=0.0f;
 //     float x=0.0f/zero;